@@ -76,10 +76,18 @@ public:
     {
         return true;
     }
+    bool load(const QStringList &)
+    {
+        return true;
+    }
     bool load(const QDate &, const QDate &)
     {
         return true;
     }
+    bool loadHeaders(const QDate &, const QDate &, mKCal::IncidenceHeader::List *)
+    {
+        return true;
+    }
     bool purgeDeletedIncidences(const KCalendarCore::Incidence::List &, const QString &)
     {
         return true;
@@ -100,6 +108,10 @@ public:
     {
         return true;
     }
+    bool forEachIncidence(IncidenceFilter, const QDateTime &, const IncidenceVisitor &)
+    {
+        return true;
+    }
     bool search(const QString &, QStringList *, int)
     {
         return true;
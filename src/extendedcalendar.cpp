@@ -221,6 +221,14 @@ ExtendedStorage::Ptr ExtendedCalendar::defaultStorage(const ExtendedCalendar::Pt
     return ss.staticCast<ExtendedStorage>();
 }
 
+ExtendedStorage::Ptr ExtendedCalendar::defaultStorage(const ExtendedCalendar::Ptr &calendar,
+                                                      const SqliteStorageOptions &options)
+{
+    SqliteStorage::Ptr ss = SqliteStorage::Ptr(new SqliteStorage(calendar, options));
+
+    return ss.staticCast<ExtendedStorage>();
+}
+
 Journal::List ExtendedCalendar::journals(const QDate &start, const QDate &end)
 {
     Journal::List journalList;
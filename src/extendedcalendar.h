@@ -199,6 +199,7 @@
 namespace mKCal {
 
 class ExtendedStorage;
+struct SqliteStorageOptions;
 /**
   @brief
   This class provides a calendar cached into memory.
@@ -319,6 +320,18 @@ public:
     static QSharedPointer<ExtendedStorage> defaultStorage(const ExtendedCalendar::Ptr
                                                           &calendar);   //No typedef to avoid cyclic includes
 
+    /**
+      Creates the default Storage Object, with a tuned connection
+      to its database.
+
+      @param The parent calendar that you want to use with the storage
+      @param options is the tuning of the database connection
+      @return Object used as storage.
+      @warning A new storage is created with each call.
+    */
+    static QSharedPointer<ExtendedStorage> defaultStorage(const ExtendedCalendar::Ptr &calendar,
+                                                          const SqliteStorageOptions &options);
+
 private:
     //@cond PRIVATE
     Q_DISABLE_COPY(ExtendedCalendar)
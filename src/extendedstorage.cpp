@@ -37,35 +37,127 @@
 
 #include <KCalendarCore/Exceptions>
 #include <KCalendarCore/Calendar>
+
+#include <QMap>
+
+#include <limits>
+
 using namespace KCalendarCore;
 
 using namespace mKCal;
 
-struct Range
+// Set of disjoint day intervals, indexed by their first day. Days are
+// Julian days and an interval ends before its end day. The extreme
+// values stand for unbounded intervals.
+class RangeSet
 {
-    Range(const QDate &start, const QDate &end)
-        : mStart(start), mEnd(end) { }
+public:
+    struct Range
+    {
+        qint64 mEnd;
+        // Value of the use counter when the range was last loaded or requested.
+        quint64 mLastUse;
+    };
+    typedef QPair<qint64, qint64> Bounds;
 
-    bool contains(const QDate &at) const
+    static qint64 startDay(const QDate &date)
+    {
+        return date.isValid() ? date.toJulianDay() : std::numeric_limits<qint64>::min();
+    }
+    static qint64 endDay(const QDate &date)
     {
-        return at.isValid()
-            && (mStart.isNull() || at >= mStart)
-            && (mEnd.isNull() || at <= mEnd);
+        return date.isValid() ? date.toJulianDay() : std::numeric_limits<qint64>::max();
+    }
+    static QDate toDate(qint64 day)
+    {
+        return day == std::numeric_limits<qint64>::min()
+            || day == std::numeric_limits<qint64>::max() ? QDate() : QDate::fromJulianDay(day);
     }
 
-    QDate mStart, mEnd;
-};
+    void clear()
+    {
+        mRanges.clear();
+    }
 
-// Range a is strictly before range b.
-bool operator<(const Range &a, const Range &b)
-{
-    return a.mEnd.isValid() && b.mStart.isValid() && a.mEnd < b.mStart;
-}
-// Date a is strictly before range b.
-bool operator<(const QDate &at, const Range &range)
-{
-    return at.isNull() || (range.mStart.isValid() && at < range.mStart);
-}
+    int count() const
+    {
+        return mRanges.count();
+    }
+
+    // The sub-intervals of [start, end) not covered by the set, in order.
+    // The ranges overlapping them are marked as used at use.
+    QList<Bounds> missing(qint64 start, qint64 end, quint64 use)
+    {
+        QList<Bounds> gaps;
+        qint64 cursor = start;
+        for (QMap<qint64, Range>::Iterator it = firstOverlapping(start);
+             it != mRanges.end() && it.key() < end; ++it) {
+            it->mLastUse = use;
+            if (it.key() > cursor) {
+                gaps.append(Bounds(cursor, it.key()));
+            }
+            cursor = qMax(cursor, it->mEnd);
+        }
+        if (cursor < end) {
+            gaps.append(Bounds(cursor, end));
+        }
+        return gaps;
+    }
+
+    // Add the parts of [start, end) not covered yet, each as its own
+    // range, and mark the overlapping ranges as used. Ranges are not
+    // merged, so that each load can be evicted on its own.
+    void insert(qint64 start, qint64 end, quint64 use)
+    {
+        const QList<Bounds> gaps = missing(start, end, use);
+        for (const Bounds &gap : gaps) {
+            mRanges.insert(gap.first, Range{gap.second, use});
+        }
+    }
+
+    // Tell if some part of [start, end) is covered by the set.
+    bool overlaps(qint64 start, qint64 end) const
+    {
+        QMap<qint64, Range>::ConstIterator it = mRanges.upperBound(start);
+        if (it != mRanges.constBegin() && std::prev(it)->mEnd > start) {
+            return true;
+        }
+        return it != mRanges.constEnd() && it.key() < end;
+    }
+
+    // Remove the range used the longest time ago.
+    bool takeLeastRecentlyUsed(Bounds *bounds)
+    {
+        if (mRanges.isEmpty()) {
+            return false;
+        }
+        QMap<qint64, Range>::Iterator lru = mRanges.begin();
+        for (QMap<qint64, Range>::Iterator it = mRanges.begin(); it != mRanges.end(); ++it) {
+            if (it->mLastUse < lru->mLastUse) {
+                lru = it;
+            }
+        }
+        *bounds = Bounds(lru.key(), lru->mEnd);
+        mRanges.erase(lru);
+        return true;
+    }
+
+private:
+    // The first range ending after day.
+    QMap<qint64, Range>::Iterator firstOverlapping(qint64 day)
+    {
+        QMap<qint64, Range>::Iterator it = mRanges.upperBound(day);
+        if (it != mRanges.begin()) {
+            QMap<qint64, Range>::Iterator previous = std::prev(it);
+            if (previous->mEnd > day) {
+                return previous;
+            }
+        }
+        return it;
+    }
+
+    QMap<qint64, Range> mRanges;
+};
 
 /**
   Private class that helps to provide binary compatibility between releases.
@@ -78,15 +170,19 @@ public:
     Private(ExtendedStorage *storage)
         : mStorage(storage)
         , mIsRecurrenceLoaded(false)
+        , mDeferredParts(ExtendedStorage::NoPart)
     {}
 
     ~Private()
     {}
 
     ExtendedStorage *mStorage;
-    QList<Range> mRanges;
+    RangeSet mRanges;
     bool mIsRecurrenceLoaded;
     QList<ExtendedStorageObserver *> mObservers;
+    ExtendedStorage::DeferredParts mDeferredParts;
+    int mMemoryBudget = 0;
+    quint64 mRangeUse = 0;
     bool clear();
 
     Incidence::List incidencesWithAlarms(const QString &uid);
@@ -156,67 +252,99 @@ bool ExtendedStorage::close()
     return d->clear();
 }
 
+void ExtendedStorage::setDeferredParts(DeferredParts parts)
+{
+    d->mDeferredParts = parts;
+}
+
+ExtendedStorage::DeferredParts ExtendedStorage::deferredParts() const
+{
+    return d->mDeferredParts;
+}
+
+bool ExtendedStorage::hydrate(const Incidence::Ptr &incidence, DeferredParts parts)
+{
+    return !(pendingParts(incidence) & parts);
+}
+
+ExtendedStorage::DeferredParts ExtendedStorage::pendingParts(const Incidence::Ptr &incidence) const
+{
+    Q_UNUSED(incidence);
+    return NoPart;
+}
+
+void ExtendedStorage::setMemoryBudget(int incidences)
+{
+    d->mMemoryBudget = qMax(0, incidences);
+}
+
+int ExtendedStorage::memoryBudget() const
+{
+    return d->mMemoryBudget;
+}
+
 bool ExtendedStorage::getLoadDates(const QDate &start, const QDate &end,
                                    QDateTime *loadStart, QDateTime *loadEnd) const
 {
-    loadStart->setDate(start);   // may be null if start is not valid
-    loadEnd->setDate(end);   // may be null if end is not valid
-
-    // Check the need to load from db.
-    for (const Range &loadedRange : d->mRanges) {
-        bool startIsIn = loadedRange.contains(loadStart->date())
-            || (loadedRange.mStart.isNull() && loadStart->date().isNull());
-        bool endIsIn = loadedRange.contains(loadEnd->date().addDays(-1))
-            || (loadedRange.mEnd.isNull() && loadEnd->date().isNull());
-        if (startIsIn && endIsIn) {
-            return false;
-        } else if (startIsIn) {
-            loadStart->setDate(loadedRange.mEnd.addDays(1));
-        } else if (endIsIn) {
-            loadEnd->setDate(loadedRange.mStart);
-        }
-    }
-    if (loadStart->isValid() && loadEnd->isValid() && *loadStart >= *loadEnd) {
+    const QList<QPair<QDateTime, QDateTime>> ranges = getLoadRanges(start, end);
+    if (ranges.isEmpty()) {
         return false;
     }
 
-    if (loadStart->isValid()) {
-        loadStart->setTimeZone(calendar()->timeZone());
-    }
-    if (loadEnd->isValid()) {
-        loadEnd->setTimeZone(calendar()->timeZone());
+    *loadStart = ranges.first().first;
+    *loadEnd = ranges.last().second;
+
+    return true;
+}
+
+QList<QPair<QDateTime, QDateTime>> ExtendedStorage::getLoadRanges(const QDate &start,
+                                                                  const QDate &end) const
+{
+    QList<QPair<QDateTime, QDateTime>> ranges;
+
+    // Check the need to load from db.
+    const QList<RangeSet::Bounds> gaps =
+        d->mRanges.missing(RangeSet::startDay(start), RangeSet::endDay(end), ++d->mRangeUse);
+    for (const RangeSet::Bounds &gap : gaps) {
+        QDateTime loadStart, loadEnd;
+        loadStart.setDate(RangeSet::toDate(gap.first));   // null if unbounded
+        loadEnd.setDate(RangeSet::toDate(gap.second));   // null if unbounded
+        if (loadStart.isValid()) {
+            loadStart.setTimeZone(calendar()->timeZone());
+        }
+        if (loadEnd.isValid()) {
+            loadEnd.setTimeZone(calendar()->timeZone());
+        }
+        ranges.append(qMakePair(loadStart, loadEnd));
     }
 
-    qCDebug(lcMkcal) << "get load dates" << start << end << *loadStart << *loadEnd;
+    qCDebug(lcMkcal) << "get load ranges" << start << end << ranges;
 
-    return true;
+    return ranges;
 }
 
 void ExtendedStorage::addLoadedRange(const QDate &start, const QDate &end) const
 {
     qCDebug(lcMkcal) << "set load dates" << start << end;
 
-    Range range(start, end.addDays(-1));
-    QList<Range>::Iterator it = d->mRanges.begin();
-    while (it != d->mRanges.end()) {
-        if (range < *it) {
-            d->mRanges.insert(it, range);
-            return;
-        } else if (it->contains(end)) {
-            if (start < *it) {
-                it->mStart = start;
-            }
-            return;
-        } else if (start < *it) {
-            it = d->mRanges.erase(it);
-        } else if (it->contains(start)) {
-            range.mStart = it->mStart;
-            it = d->mRanges.erase(it);
-        } else {
-            it++;
-        }
+    d->mRanges.insert(RangeSet::startDay(start), RangeSet::endDay(end), ++d->mRangeUse);
+}
+
+bool ExtendedStorage::takeLeastRecentlyUsedRange(QDate *start, QDate *end)
+{
+    RangeSet::Bounds bounds;
+    if (d->mRanges.count() < 2 || !d->mRanges.takeLeastRecentlyUsed(&bounds)) {
+        return false;
     }
-    d->mRanges.append(range);
+    *start = RangeSet::toDate(bounds.first);
+    *end = RangeSet::toDate(bounds.second);
+
+    return true;
+}
+
+bool ExtendedStorage::isLoadedRangeOverlapping(const QDate &start, const QDate &end) const
+{
+    return d->mRanges.overlaps(RangeSet::startDay(start), RangeSet::endDay(end));
 }
 
 bool ExtendedStorage::isRecurrenceLoaded() const
@@ -273,6 +401,64 @@ bool ExtendedStorage::load(const QDate &date)
     return date.isValid() && load(date, date.addDays(1));
 }
 
+bool ExtendedStorage::load(const QStringList &uids)
+{
+    for (const QString &uid : uids) {
+        if (!load(uid)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ExtendedStorage::loadAsync(const QDate &start, const QDate &end)
+{
+    Q_UNUSED(start);
+    Q_UNUSED(end);
+    return false;
+}
+
+bool ExtendedStorage::loadAsync(const QString &uid)
+{
+    Q_UNUSED(uid);
+    return false;
+}
+
+bool ExtendedStorage::loadHeaders(const QDate &start, const QDate &end,
+                                  IncidenceHeader::List *list)
+{
+    Q_UNUSED(start);
+    Q_UNUSED(end);
+    Q_UNUSED(list);
+    return false;
+}
+
+Incidence::Ptr ExtendedStorage::loadIncidence(const IncidenceHeader &header)
+{
+    if (header.uid.isEmpty() || !load(header.uid)) {
+        return Incidence::Ptr();
+    }
+    return calendar()->incidence(header.uid, header.recurrenceId);
+}
+
+bool ExtendedStorage::forEachIncidence(IncidenceFilter filter, const QDateTime &after,
+                                       const IncidenceVisitor &visitor)
+{
+    Q_UNUSED(filter);
+    Q_UNUSED(after);
+    Q_UNUSED(visitor);
+    return false;
+}
+
+bool ExtendedStorage::searchAsync(const QString &key, int limit,
+                                  const SearchResultHandler &handler)
+{
+    Q_UNUSED(key);
+    Q_UNUSED(limit);
+    Q_UNUSED(handler);
+    return false;
+}
+
 void ExtendedStorageObserver::storageModified(ExtendedStorage *storage,
                                               const QString &info)
 {
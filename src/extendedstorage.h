@@ -38,6 +38,8 @@
 #include <KCalendarCore/CalStorage>
 #include <KCalendarCore/Calendar>
 
+#include <functional>
+
 namespace KCalendarCore {
 class Incidence;
 }
@@ -47,12 +49,42 @@ class tst_load;
 
 namespace mKCal {
 
+/**
+  @brief
+  A lightweight description of an incidence, as read from the storage
+  without decoding the attendees, attachments, alarms, recurrence
+  rules or custom properties.
+
+  It is intended for views that only display a summary of the
+  incidences, like a month grid or an agenda list. The full incidence
+  can be obtained with ExtendedStorage::loadIncidence().
+*/
+struct IncidenceHeader
+{
+    typedef QList<IncidenceHeader> List;
+
+    KCalendarCore::IncidenceBase::IncidenceType type = KCalendarCore::IncidenceBase::TypeUnknown;
+    QString uid;
+    QDateTime recurrenceId;
+    QString summary;
+    QDateTime dtStart;
+    /**
+      The end date time for events, the due date time for todos.
+    */
+    QDateTime dtEnd;
+    bool allDay = false;
+    QString color;
+    bool hasAlarms = false;
+    bool recurs = false;
+};
+
 /**
   @brief
   This class provides a calendar storage interface.
   Every action on the storage can be synchronous or asynchronous,
   depending on the storage implementation. SqliteStorage is a
-  synchronous implementation. 
+  synchronous implementation, with asynchronous variants for
+  loading and searching, see loadAsync() and searchAsync().
 
   In any case, caller can use ExtendedStorageObserver to get
   notified about the action done.
@@ -77,6 +109,40 @@ public:
     */
     typedef QSharedPointer<ExtendedStorage> Ptr;
 
+    /**
+      Parts of an incidence that can be read from the storage
+      only when needed, see setDeferredParts().
+    */
+    enum DeferredPart {
+        NoPart = 0x0,
+        AttendeesPart = 0x1,
+        AttachmentsPart = 0x2,
+        AllParts = AttendeesPart | AttachmentsPart
+    };
+    Q_DECLARE_FLAGS(DeferredParts, DeferredPart)
+
+    /**
+      Selection of incidences to enumerate with forEachIncidence().
+    */
+    enum IncidenceFilter {
+        AllIncidences,
+        InsertedIncidences,
+        ModifiedIncidences,
+        DeletedIncidences
+    };
+
+    /**
+      Function called for each enumerated incidence by forEachIncidence().
+      Returning false stops the enumeration.
+    */
+    typedef std::function<bool (const KCalendarCore::Incidence::Ptr &)> IncidenceVisitor;
+
+    /**
+      Function called with the instance identifiers of the incidences
+      matching a searchAsync() request.
+    */
+    typedef std::function<void (const QStringList &)> SearchResultHandler;
+
     /**
       Constructs a new ExtendedStorage object.
 
@@ -117,6 +183,19 @@ public:
     */
     virtual bool load(const QString &uid) = 0;
 
+    /**
+      Load all incidences of several series into the memory, at once.
+      Series already in the calendar are not reloaded, like with
+      load(const QString &uid).
+
+      The default implementation calls load(const QString &uid)
+      for each uid.
+
+      @param uids are the uids of the series
+      @return true if the load was successful; false otherwise.
+    */
+    virtual bool load(const QStringList &uids);
+
     /**
       Load all incidences sharing the same uid into the memory.
 
@@ -169,6 +248,124 @@ public:
     */
     virtual bool load(const QDate &start, const QDate &end) = 0;
 
+    /**
+      Asynchronous variant of load(const QDate &, const QDate &).
+      The incidences are read from the storage in another thread and
+      are added to the calendar by batches, in the thread of the
+      storage, when its event loop is running. The end of the load
+      is notified by ExtendedStorageObserver::storageFinished(), once
+      per call. The pending loads are canceled, and notified as
+      failed, when the storage is closed.
+
+      The default implementation schedules nothing and returns false.
+
+      @param start is the starting date
+      @param end is the ending date, exclusive
+      @return true if the load has been scheduled; false otherwise.
+    */
+    virtual bool loadAsync(const QDate &start, const QDate &end);
+
+    /**
+      Asynchronous variant of load(const QString &uid), see
+      loadAsync(const QDate &, const QDate &).
+
+      @param uid is uid of the series
+      @return true if the load has been scheduled; false otherwise.
+    */
+    virtual bool loadAsync(const QString &uid);
+
+    /**
+      Read the headers of the incidences between given dates, without
+      loading them into the memory. start is inclusive, while end is
+      exclusive. Like load(const QDate &, const QDate &), the recurring
+      incidences are always listed, since there is no way to know in
+      advance if they will have occurrences within the range.
+
+      Use loadIncidence() to get the full incidence of a header.
+      The default implementation reads nothing and returns false.
+
+      @param start is the starting date, unbounded if invalid
+      @param end is the ending date, exclusive, unbounded if invalid
+      @param list the read headers are appended to this list
+      @return true if the read was successful; false otherwise.
+    */
+    virtual bool loadHeaders(const QDate &start, const QDate &end,
+                             IncidenceHeader::List *list);
+
+    /**
+      Load the series of the incidence described by @param header into
+      the memory, see load(const QString &uid), and returns the incidence
+      corresponding to the header.
+
+      @param header a header as read by loadHeaders()
+      @return the incidence matching header, or a null pointer if
+              it is not in the storage anymore.
+    */
+    KCalendarCore::Incidence::Ptr loadIncidence(const IncidenceHeader &header);
+
+    /**
+      Set the parts that are not read when loading incidences into
+      the memory. By default, incidences are loaded complete.
+
+      Deferred attendees (the organizer is always loaded) and attachments
+      are read from the storage by hydrate(). Incidences that are modified
+      are hydrated before being saved, so the deferred parts are never
+      lost, but hydrate() should be called before modifying the
+      attendee or attachment lists to work on the stored values.
+
+      @param parts the parts to defer, NoPart to load complete incidences.
+    */
+    void setDeferredParts(DeferredParts parts);
+
+    /**
+      The parts deferred on load, see setDeferredParts().
+    */
+    DeferredParts deferredParts() const;
+
+    /**
+      Set the maximum number of incidences to keep in the calendar.
+      When a range load brings the calendar over this budget, the
+      least recently loaded or requested date ranges are forgotten,
+      and their non recurring incidences are removed from the calendar,
+      unless they have unsaved modifications. The most recently used
+      range is always kept. Recurring incidences and their exceptions,
+      and incidences loaded outside of a date range, are not removed.
+      The removed incidences are read again if their range is loaded
+      again.
+
+      @param incidences the budget, 0 for no limit, the default.
+    */
+    void setMemoryBudget(int incidences);
+
+    /**
+      The maximum number of incidences to keep in the calendar,
+      see setMemoryBudget().
+    */
+    int memoryBudget() const;
+
+    /**
+      Read the deferred parts of an incidence loaded into the memory.
+      Nothing is done for incidences already hydrated for these parts.
+      The incidence is not marked as modified by this operation.
+      The default implementation reads nothing, relying on pendingParts().
+
+      @param incidence an incidence of the calendar
+      @param parts the parts to hydrate
+      @return true if the incidence is complete for @param parts.
+    */
+    virtual bool hydrate(const KCalendarCore::Incidence::Ptr &incidence,
+                         DeferredParts parts = AllParts);
+
+    /**
+      The parts of an incidence that have been deferred on load and
+      not yet hydrated. The default implementation, for storages
+      that do not defer any part, returns NoPart.
+
+      @param incidence an incidence of the calendar
+      @return the parts still to be read from the storage.
+    */
+    virtual DeferredParts pendingParts(const KCalendarCore::Incidence::Ptr &incidence) const;
+
     /**
       Load the incidence matching the given identifier. This method may be
       more fragile than load(uid, recid) though since the instanceIdentifier
@@ -290,6 +487,27 @@ public:
     */
     virtual bool allIncidences(KCalendarCore::Incidence::List *list) = 0;
 
+    /**
+      Enumerate incidences from storage, without loading them into the
+      calendar. Contrary to insertedIncidences(), modifiedIncidences(),
+      deletedIncidences() or allIncidences(), the incidences are not
+      gathered in a list but read by chunks and given one at a time to
+      @param visitor, and the storage is not locked while visiting them.
+      Thus, the memory used does not depend on the number of incidences,
+      but modifications of the storage during the enumeration
+      may be partially seen.
+
+      @param filter the incidences to enumerate
+      @param after for inserted, modified or deleted incidences, list only
+             incidences changed after or at given datetime. It is mandatory
+             for InsertedIncidences and ModifiedIncidences.
+      @param visitor called for each incidence, in storage order
+      @return true if the enumeration completed or was stopped by visitor,
+              false on error. The default implementation returns false.
+    */
+    virtual bool forEachIncidence(IncidenceFilter filter, const QDateTime &after,
+                                  const IncidenceVisitor &visitor);
+
     /**
       Get all incidences from storage that match key. Incidences are
       loaded into the associated ExtendedCalendar. More incidences than
@@ -298,14 +516,18 @@ public:
       recurring incidences.
 
       Matching is done on summary, description and location fields.
-
-      The matching incidences are sorted by start dates before applying
-      the @param limit. Since recurring incidences have occurrences later
-      than their start date, they are not taken into account when
-      counting the limit and all matching recurring events are always
-      loaded.
-
-      @param key can be any substring from the summary, the description or the location.
+      Storages with a full-text index match the words of key in
+      sequence, the last word being matched as a prefix, ignoring
+      punctuation, case and diacritics.
+
+      The matching incidences are sorted by relevance, when available,
+      then by start dates before applying the @param limit. Since
+      recurring incidences have occurrences later than their start
+      date, they are not taken into account when counting the limit
+      and all matching recurring events are always loaded.
+
+      @param key can be any substring from the summary, the description or the location,
+             or the beginning of a sequence of words with a full-text index.
       @param identifiers optional, stores the instance identifiers of
              matching incidences.
       @param limit the maximum number of non-recurring incidences, unlimited by default
@@ -313,6 +535,21 @@ public:
      */
     virtual bool search(const QString &key, QStringList *identifiers, int limit = 0) = 0;
 
+    /**
+      Asynchronous variant of search(), see loadAsync(const QDate &, const QDate &).
+      The limit applies to the incidences read from the storage,
+      whether they were already in the calendar or not.
+      The default implementation schedules nothing and returns false.
+
+      @param key can be any substring from the summary, the description or the location.
+      @param limit the maximum number of non-recurring incidences, unlimited by default
+      @param handler optional, called with the instance identifiers of
+             matching incidences, before the end is notified to observers.
+      @return true if the search has been scheduled; false otherwise.
+    */
+    virtual bool searchAsync(const QString &key, int limit = 0,
+                             const SearchResultHandler &handler = SearchResultHandler());
+
     /**
       Get deletion time of incidence
 
@@ -353,8 +590,12 @@ public:
 protected:
     bool getLoadDates(const QDate &start, const QDate &end,
                       QDateTime *loadStart, QDateTime *loadEnd) const;
+    QList<QPair<QDateTime, QDateTime>> getLoadRanges(const QDate &start,
+                                                     const QDate &end) const;
 
     void addLoadedRange(const QDate &start, const QDate &end) const;
+    bool takeLeastRecentlyUsedRange(QDate *start, QDate *end);
+    bool isLoadedRangeOverlapping(const QDate &start, const QDate &end) const;
     bool isRecurrenceLoaded() const;
     void setIsRecurrenceLoaded(bool loaded);
 
@@ -377,4 +618,6 @@ private:
 
 }
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(mKCal::ExtendedStorage::DeferredParts)
+
 #endif
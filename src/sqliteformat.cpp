@@ -35,6 +35,12 @@
 #include "logging_p.h"
 
 #include <QTimeZone>
+#include <QHash>
+#include <QMutex>
+#include <QDataStream>
+
+#include <algorithm>
+#include <limits>
 
 #include <KCalendarCore/Alarm>
 #include <KCalendarCore/Attendee>
@@ -43,14 +49,21 @@
 
 using namespace KCalendarCore;
 
-#define FLOATING_DATE "FloatingDate"
+// Bounds on the expansion of recurring incidences in the Occurrences table,
+// around the current date when saving them.
+static const int gOccurrenceHistoryDays = 365;
+static const int gOccurrenceHorizonDays = 730;
+static const int gMaxOccurrences = 5000;
+
+// Components read per batch by updateRecurrenceEnds().
+static const int gRecurrenceEndBatchSize = 500;
 
 using namespace mKCal;
 class mKCal::SqliteFormat::Private
 {
 public:
     Private(SqliteFormat *format, sqlite3 *database)
-        : mFormat(format), mDatabase(database)
+        : mFormat(format), mDatabase(database), mStatements(database)
     {
     }
     ~Private()
@@ -65,26 +78,34 @@ public:
         sqlite3_finalize(mSelectIncRecursives);
         sqlite3_finalize(mSelectIncRDates);
         sqlite3_finalize(mSelectIncAttachments);
+        sqlite3_finalize(mInsertSelection);
+        sqlite3_finalize(mDeleteSelection);
+        sqlite3_finalize(mSelectSelProperties);
+        sqlite3_finalize(mSelectSelAttendees);
+        sqlite3_finalize(mSelectSelOrganizers);
+        sqlite3_finalize(mSelectSelAlarms);
+        sqlite3_finalize(mSelectSelAttachments);
         sqlite3_finalize(mSelectDeletedIncidences);
         sqlite3_finalize(mDeleteIncComponents);
         sqlite3_finalize(mDeleteIncProperties);
         sqlite3_finalize(mDeleteIncAttendees);
         sqlite3_finalize(mDeleteIncAlarms);
-        sqlite3_finalize(mDeleteIncRecursives);
-        sqlite3_finalize(mDeleteIncRDates);
         sqlite3_finalize(mDeleteIncAttachments);
         sqlite3_finalize(mInsertIncComponents);
         sqlite3_finalize(mInsertIncProperties);
         sqlite3_finalize(mInsertIncAttendees);
         sqlite3_finalize(mInsertIncAlarms);
-        sqlite3_finalize(mInsertIncRecursives);
-        sqlite3_finalize(mInsertIncRDates);
         sqlite3_finalize(mInsertIncAttachments);
         sqlite3_finalize(mUpdateIncComponents);
         sqlite3_finalize(mMarkDeletedIncidences);
+        sqlite3_finalize(mInsertIncRange);
+        sqlite3_finalize(mDeleteIncRange);
+        sqlite3_finalize(mInsertIncText);
+        sqlite3_finalize(mDeleteIncText);
     }
     SqliteFormat *mFormat;
     sqlite3 *mDatabase;
+    StatementCache mStatements;
 
     // Cache for various queries.
     sqlite3_stmt *mSelectMetadata = nullptr;
@@ -100,37 +121,66 @@ public:
     sqlite3_stmt *mSelectIncRDates = nullptr;
     sqlite3_stmt *mSelectIncAttachments = nullptr;
 
+    // Batch loading of the child tables, see selectComponents(stmt, list, max).
+    sqlite3_stmt *mInsertSelection = nullptr;
+    sqlite3_stmt *mDeleteSelection = nullptr;
+    sqlite3_stmt *mSelectSelProperties = nullptr;
+    sqlite3_stmt *mSelectSelAttendees = nullptr;
+    sqlite3_stmt *mSelectSelOrganizers = nullptr;
+    sqlite3_stmt *mSelectSelAlarms = nullptr;
+    sqlite3_stmt *mSelectSelAttachments = nullptr;
+
     sqlite3_stmt *mSelectDeletedIncidences = nullptr;
 
     sqlite3_stmt *mDeleteIncComponents = nullptr;
     sqlite3_stmt *mDeleteIncProperties = nullptr;
     sqlite3_stmt *mDeleteIncAttendees = nullptr;
     sqlite3_stmt *mDeleteIncAlarms = nullptr;
-    sqlite3_stmt *mDeleteIncRecursives = nullptr;
-    sqlite3_stmt *mDeleteIncRDates = nullptr;
     sqlite3_stmt *mDeleteIncAttachments = nullptr;
 
     sqlite3_stmt *mInsertIncComponents = nullptr;
     sqlite3_stmt *mInsertIncProperties = nullptr;
     sqlite3_stmt *mInsertIncAttendees = nullptr;
     sqlite3_stmt *mInsertIncAlarms = nullptr;
-    sqlite3_stmt *mInsertIncRecursives = nullptr;
-    sqlite3_stmt *mInsertIncRDates = nullptr;
     sqlite3_stmt *mInsertIncAttachments = nullptr;
 
     sqlite3_stmt *mUpdateIncComponents = nullptr;
 
     sqlite3_stmt *mMarkDeletedIncidences = nullptr;
+    sqlite3_stmt *mInsertIncRange = nullptr;
+    sqlite3_stmt *mDeleteIncRange = nullptr;
+    sqlite3_stmt *mInsertIncText = nullptr;
+    sqlite3_stmt *mDeleteIncText = nullptr;
+
+    bool mFullText = false;
+
+    // Both ways mapping of the TimeZones table, filled on demand.
+    QHash<QByteArray, int> mTimeZoneIds;
+    QHash<int, QByteArray> mTimeZoneNames;
 
     bool updateMetadata(int transactionId);
     bool selectCustomproperties(Incidence::Ptr &incidence, int rowid);
     int selectRowId(const QString &uid,
-                    const QDateTime &recId);
+                    const QDateTime &recId,
+                    QString *attachments = nullptr);
     bool selectRecursives(Incidence::Ptr &incidence, int rowid);
     bool selectAlarms(Incidence::Ptr &incidence, int rowid);
     bool selectAttendees(Incidence::Ptr &incidence, int rowid);
     bool selectRdates(Incidence::Ptr &incidence, int rowid);
     bool selectAttachments(Incidence::Ptr &incidence, int rowid);
+    Incidence::Ptr selectComponent(sqlite3_stmt *stmt, int *rowid, QString *attachments);
+    void readCustomproperty(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    void readRecursive(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    void readAlarm(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    void readAttendee(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    void readRdate(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    void readAttachment(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    typedef void (Private::*RowReader)(Incidence::Ptr &incidence, sqlite3_stmt *stmt);
+    bool clearSelection();
+    bool addToSelection(int rowid);
+    int purgeSelection();
+    bool selectBySelection(sqlite3_stmt **stmt, const char *query, int qsize,
+                           RowReader reader, QHash<int, Incidence::Ptr> &incidences);
     bool insertCustomproperties(const Incidence &incidence, int rowid);
     bool insertCustomproperty(int rowid, const QByteArray &key, const QString &value, const QString &parameters);
     bool insertAttendees(const Incidence &incidence, int rowid);
@@ -138,11 +188,25 @@ public:
     bool insertAttachments(const Incidence &incidence, int rowid);
     bool insertAlarms(const Incidence &incidence, int rowid);
     bool insertAlarm(int rowid, const Alarm &alarm);
-    bool insertRecursives(const Incidence &incidence, int rowid);
-    bool insertRecursive(int rowid, RecurrenceRule *rule, int type);
-    bool insertRdates(const Incidence &incidence, int rowid);
-    bool insertRdate(int rowid, int type, const QDateTime &rdate, bool allDay);
-    bool deleteListsForIncidence(int rowid);
+    bool deleteListsForIncidence(int rowid, SqliteFormat::IncidenceParts parts = SqliteFormat::AllParts);
+    bool modifyComponentsRange(int rowid, DBOperation dbop);
+    bool insertComponentsText(int rowid);
+    bool deleteComponentsText(int rowid);
+    bool modifyOccurrences(const Incidence &incidence, int rowid, DBOperation dbop);
+    bool insertOccurrences(const Incidence &incidence, int rowid,
+                           sqlite3_int64 from, sqlite3_int64 until);
+    bool extendOccurrences(const Incidence &incidence, int rowid,
+                           sqlite3_int64 start, sqlite3_int64 end,
+                           bool fromStart, sqlite3_int64 origin, sqlite3_int64 horizon);
+    bool appendOccurrences(const Incidence &incidence, int rowid, QDateTime dt,
+                           sqlite3_int64 until, sqlite3_int64 *horizon);
+    bool prependOccurrences(const Incidence &incidence, int rowid, sqlite3_int64 start,
+                            bool *fromStart, sqlite3_int64 *origin);
+    bool insertOccurrence(sqlite3_stmt *occurrences, sqlite3_stmt *ranges,
+                          int rowid, sqlite3_int64 secs, qint64 duration);
+    bool updateHorizon(int rowid, bool fromStart, sqlite3_int64 origin, sqlite3_int64 horizon);
+    sqlite3_int64 occurrenceTime(const Incidence &incidence, const QDateTime &dt) const;
+    bool deleteById(const char *query, int qsize, int rowid);
     bool modifyCalendarProperties(DBOperation dbop);
     bool deleteCalendarProperties(const QByteArray &id);
     bool insertCalendarProperty(const QByteArray &id, const QByteArray &key,
@@ -160,6 +224,271 @@ SqliteFormat::~SqliteFormat()
     delete d;
 }
 
+sqlite3_stmt *SqliteFormat::acquireStatement(const char *query, int qsize)
+{
+    return d->mStatements.acquire(query, qsize);
+}
+
+void SqliteFormat::releaseStatement(sqlite3_stmt *stmt)
+{
+    d->mStatements.release(stmt);
+}
+
+StatementCache::Statistics SqliteFormat::statementStatistics() const
+{
+    return d->mStatements.statistics();
+}
+
+void SqliteFormat::applyOptions(sqlite3 *database, const SqliteStorageOptions &options)
+{
+    int rv = 0;
+    char *errmsg = nullptr;
+    const char *query = nullptr;
+    QList<QByteArray> pragmas;
+
+    sqlite3_busy_timeout(database, options.busyTimeout);
+
+    if (options.cacheSize) {
+        pragmas << "PRAGMA cache_size=" + QByteArray::number(options.cacheSize);
+    }
+    if (options.mmapSize >= 0) {
+        pragmas << "PRAGMA mmap_size=" + QByteArray::number(options.mmapSize);
+    }
+    if (options.synchronous != SqliteStorageOptions::SynchronousDefault) {
+        pragmas << "PRAGMA synchronous=" + QByteArray::number(options.synchronous);
+    }
+    if (options.tempStore != SqliteStorageOptions::TempStoreDefault) {
+        pragmas << "PRAGMA temp_store=" + QByteArray::number(options.tempStore);
+    }
+    for (const QByteArray &pragma : const_cast<const QList<QByteArray>&>(pragmas)) {
+        query = pragma.constData();
+        SL3_try_exec(database); // Keep the default value on error.
+    }
+}
+
+bool SqliteFormat::timeZoneId(const QByteArray &name, int *id)
+{
+    int rv = 0;
+    int index = 1;
+    bool success = false;
+    sqlite3_stmt *stmt = nullptr;
+
+    QHash<QByteArray, int>::ConstIterator it = d->mTimeZoneIds.constFind(name);
+    if (it != d->mTimeZoneIds.constEnd()) {
+        *id = it.value();
+        return true;
+    }
+
+    SL3_acquire(this, INSERT_TIMEZONES, sizeof(INSERT_TIMEZONES), stmt);
+    SL3_bind_text(stmt, index, name.constData(), name.length(), SQLITE_STATIC);
+    SL3_step(stmt);
+    releaseStatement(stmt);
+
+    index = 1;
+    SL3_acquire(this, SELECT_TIMEZONES_BY_NAME, sizeof(SELECT_TIMEZONES_BY_NAME), stmt);
+    SL3_bind_text(stmt, index, name.constData(), name.length(), SQLITE_STATIC);
+    SL3_step(stmt);
+    if (rv == SQLITE_ROW) {
+        *id = sqlite3_column_int(stmt, 0);
+        d->mTimeZoneIds.insert(name, *id);
+        d->mTimeZoneNames.insert(*id, name);
+        success = true;
+    }
+
+error:
+    releaseStatement(stmt);
+
+    return success;
+}
+
+QByteArray SqliteFormat::timeZoneName(int id)
+{
+    int rv = 0;
+    sqlite3_stmt *stmt = nullptr;
+
+    QHash<int, QByteArray>::ConstIterator it = d->mTimeZoneNames.constFind(id);
+    if (it != d->mTimeZoneNames.constEnd()) {
+        return it.value();
+    }
+
+    // Unknown identifier, the zone may have been added by another
+    // connection: read the whole table again.
+    SL3_acquire(this, SELECT_TIMEZONES, sizeof(SELECT_TIMEZONES), stmt);
+    SL3_step(stmt);
+    while (rv == SQLITE_ROW) {
+        const int zoneId = sqlite3_column_int(stmt, 0);
+        const QByteArray name((const char *)sqlite3_column_text(stmt, 1));
+        d->mTimeZoneIds.insert(name, zoneId);
+        d->mTimeZoneNames.insert(zoneId, name);
+        SL3_step(stmt);
+    }
+
+error:
+    releaseStatement(stmt);
+
+    return d->mTimeZoneNames.value(id);
+}
+
+void SqliteFormat::resetTimeZones()
+{
+    d->mTimeZoneIds.clear();
+    d->mTimeZoneNames.clear();
+}
+
+bool SqliteFormat::updateRecurrenceEnds()
+{
+    int rv = 0;
+    int index;
+    int nRows;
+    int lastRowId = 0;
+    bool success = false;
+    sqlite3_stmt *select = nullptr;
+    sqlite3_stmt *update = nullptr;
+    QList<QPair<int, sqlite3_int64>> ends;
+
+    SL3_acquire(this, SELECT_COMPONENTS_BY_RECURSIVE, sizeof(SELECT_COMPONENTS_BY_RECURSIVE), select);
+    SL3_acquire(this, UPDATE_COMPONENTS_RECURRENCE_END, sizeof(UPDATE_COMPONENTS_RECURRENCE_END), update);
+    // Not updated while selecting from the same table, only the rows
+    // of a batch are kept in memory. The child tables are not needed.
+    do {
+        nRows = 0;
+        ends.clear();
+        index = 1;
+        SL3_reset(select);
+        SL3_bind_int(select, index, lastRowId);
+        SL3_bind_int(select, index, gRecurrenceEndBatchSize);
+        SL3_step(select);
+        while (rv == SQLITE_ROW) {
+            int rowid;
+            QString attachments;
+            nRows += 1;
+            lastRowId = sqlite3_column_int(select, 0);
+            const Incidence::Ptr incidence = d->selectComponent(select, &rowid, &attachments);
+            if (incidence) {
+                ends.append(qMakePair(rowid, recurrenceEnd(this, *incidence)));
+            }
+            SL3_step(select);
+        }
+        SL3_reset(select);
+
+        for (const QPair<int, sqlite3_int64> &end : const_cast<const QList<QPair<int, sqlite3_int64>>&>(ends)) {
+            index = 1;
+            SL3_reset(update);
+            SL3_bind_int64(update, index, end.second);
+            SL3_bind_int(update, index, end.first);
+            SL3_step(update);
+        }
+    } while (nRows == gRecurrenceEndBatchSize);
+    success = true;
+
+error:
+    releaseStatement(select);
+    releaseStatement(update);
+
+    return success;
+}
+
+bool SqliteFormat::selectFullTextIndex()
+{
+    int rv = 0;
+    sqlite3_stmt *stmt = nullptr;
+
+    d->mFullText = false;
+    SL3_acquire(this, SELECT_COMPONENTS_TEXT_EXISTS, sizeof(SELECT_COMPONENTS_TEXT_EXISTS), stmt);
+    SL3_step(stmt);
+    d->mFullText = (rv == SQLITE_ROW);
+
+error:
+    releaseStatement(stmt);
+    return d->mFullText;
+}
+
+bool SqliteFormat::createFullTextIndex()
+{
+    int rv = 0;
+    char *errmsg = nullptr;
+    const char *query = nullptr;
+    bool inTransaction = false;
+
+    if (selectFullTextIndex()) {
+        return true;
+    }
+
+    query = BEGIN_TRANSACTION;
+    SL3_exec(d->mDatabase);
+    inTransaction = true;
+    query = CREATE_COMPONENTS_TEXT;
+    SL3_try_exec(d->mDatabase);
+    if (rv) {
+        // Most likely, SQLite is built without FTS5.
+        query = "ROLLBACK";
+        SL3_try_exec(d->mDatabase);
+        return false;
+    }
+    query = INSERT_COMPONENTS_TEXT_ALL;
+    SL3_exec(d->mDatabase);
+    query = COMMIT_TRANSACTION;
+    SL3_exec(d->mDatabase);
+    d->mFullText = true;
+
+    return true;
+
+error:
+    if (inTransaction) {
+        query = "ROLLBACK";
+        SL3_try_exec(d->mDatabase);
+    }
+    return false;
+}
+
+bool SqliteFormat::hasFullTextIndex() const
+{
+    return d->mFullText;
+}
+
+bool SqliteFormat::indexOccurrences(const Incidence &incidence,
+                                    sqlite3_int64 start, sqlite3_int64 end)
+{
+    int rv = 0;
+    int index = 1;
+    sqlite3_stmt *stmt = nullptr;
+    const int rowid = d->selectRowId(incidence.uid(), incidence.recurrenceId());
+    bool indexed = false;
+    bool fromStart = false;
+    sqlite3_int64 origin = 0;
+    sqlite3_int64 horizon = 0;
+
+    if (!rowid) {
+        return false;
+    }
+
+    SL3_acquire(this, SELECT_OCCURRENCEHORIZONS_BY_ID, sizeof(SELECT_OCCURRENCEHORIZONS_BY_ID), stmt);
+    SL3_bind_int(stmt, index, rowid);
+    SL3_step(stmt);
+    if (rv == SQLITE_ROW) {
+        indexed = true;
+        fromStart = (sqlite3_column_type(stmt, 0) == SQLITE_NULL);
+        origin = sqlite3_column_int64(stmt, 0);
+        horizon = sqlite3_column_int64(stmt, 1);
+    }
+    releaseStatement(stmt);
+
+    if (indexed) {
+        // Only the occurrences missing on either side are added.
+        return d->extendOccurrences(incidence, rowid, start, end, fromStart, origin, horizon);
+    } else {
+        // The dates around today, like at save time, and the range.
+        const QDateTime now = QDateTime::currentDateTimeUtc();
+        return d->insertOccurrences(incidence, rowid,
+                                    qMin(start, toOriginTime(now.addDays(-gOccurrenceHistoryDays))),
+                                    qMax(end, toOriginTime(now.addDays(gOccurrenceHorizonDays))));
+    }
+
+error:
+    releaseStatement(stmt);
+    return false;
+}
+
 bool SqliteFormat::selectMetadata(int *id)
 {
     int rv = 0;
@@ -224,6 +553,7 @@ bool SqliteFormat::modifyCalendars(DBOperation dbop, sqlite3_stmt *stmt, bool is
 {
     int rv = 0;
     int index = 1;
+    sqlite3_stmt *unset = nullptr;
 
     sqlite3_int64  secs;
 
@@ -236,12 +566,12 @@ bool SqliteFormat::modifyCalendars(DBOperation dbop, sqlite3_stmt *stmt, bool is
         if (isDefault) {
             const char *query = UNSET_FLAG_FROM_CALENDAR;
             int qsize = sizeof(UNSET_FLAG_FROM_CALENDAR);
-            sqlite3_stmt *unset;
             int idx = 1;
-            SL3_prepare_v2(d->mDatabase, query, qsize, &unset, nullptr);
+            SL3_acquire(this, query, qsize, unset);
             SL3_bind_int(unset, idx, SqliteFormat::Default);
             SL3_step(unset);
-            sqlite3_finalize(unset);
+            releaseStatement(unset);
+            unset = nullptr;
             flags |= SqliteFormat::Default;
         }
 
@@ -259,9 +589,15 @@ bool SqliteFormat::modifyCalendars(DBOperation dbop, sqlite3_stmt *stmt, bool is
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(d->mDatabase);
+    releaseStatement(unset);
     return false;
 }
 
+bool SqliteFormat::hasComponent(const Incidence &incidence)
+{
+    return d->selectRowId(incidence.uid(), incidence.recurrenceId()) != 0;
+}
+
 bool SqliteFormat::purgeDeletedComponents(const KCalendarCore::Incidence &incidence)
 {
     int rv;
@@ -304,6 +640,7 @@ bool SqliteFormat::purgeDeletedComponents(const KCalendarCore::Incidence &incide
 
         if (!d->deleteListsForIncidence(rowid)) {
             qCWarning(lcMkcal) << "failed to delete lists for incidence" << uid;
+            goto error;
         }
 
         SL3_step(stmt);
@@ -313,14 +650,115 @@ bool SqliteFormat::purgeDeletedComponents(const KCalendarCore::Incidence &incide
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(d->mDatabase);
+    // Clear the failure, so the statements can be used again.
+    sqlite3_reset(d->mSelectDeletedIncidences);
+    sqlite3_reset(d->mDeleteIncComponents);
     return false;
 }
 
+int SqliteFormat::purgeDeletedComponents(const KCalendarCore::Incidence::List &list)
+{
+    int rv = 0;
+    int count = -1;
+    sqlite3_stmt *stmt = nullptr;
+
+    if (!d->clearSelection()) {
+        return -1;
+    }
+
+    SL3_acquire(this, INSERT_TEMP_SELECTION_BY_UID_RECID_AND_DELETED,
+                sizeof(INSERT_TEMP_SELECTION_BY_UID_RECID_AND_DELETED), stmt);
+    for (const KCalendarCore::Incidence::Ptr &incidence : list) {
+        int index = 1;
+        const QByteArray uid(incidence->uid().toUtf8());
+        qint64 secsRecurId = 0;
+        if (incidence->hasRecurrenceId() && incidence->recurrenceId().timeSpec() == Qt::LocalTime) {
+            secsRecurId = toLocalOriginTime(incidence->recurrenceId());
+        } else if (incidence->hasRecurrenceId()) {
+            secsRecurId = toOriginTime(incidence->recurrenceId());
+        }
+        SL3_reset(stmt);
+        SL3_bind_text(stmt, index, uid.constData(), uid.length(), SQLITE_STATIC);
+        SL3_bind_int64(stmt, index, secsRecurId);
+        SL3_step(stmt);
+    }
+
+    count = d->purgeSelection();
+
+error:
+    releaseStatement(stmt);
+    if (count < 0) {
+        qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(d->mDatabase);
+    }
+    return count;
+}
+
+int SqliteFormat::purgeDeletedComponents(const QDateTime &before)
+{
+    int rv = 0;
+    int index = 1;
+    int count = -1;
+    sqlite3_stmt *stmt = nullptr;
+
+    if (!d->clearSelection()) {
+        return -1;
+    }
+
+    SL3_acquire(this, INSERT_TEMP_SELECTION_BY_DELETED_BEFORE,
+                sizeof(INSERT_TEMP_SELECTION_BY_DELETED_BEFORE), stmt);
+    SL3_bind_int64(stmt, index, toOriginTime(before));
+    SL3_step(stmt);
+
+    count = d->purgeSelection();
+
+error:
+    releaseStatement(stmt);
+    if (count < 0) {
+        qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(d->mDatabase);
+    }
+    return count;
+}
+
+static qint64 occurrenceDuration(const Incidence &incidence)
+{
+    if (incidence.type() == Incidence::TypeEvent) {
+        const Event *event = static_cast<const Event*>(&incidence);
+        if (event->hasEndDate()) {
+            // Same one day addition as for the DateEndDue column.
+            return event->dtStart().secsTo(incidence.allDay()
+                                           ? event->dtEnd().addDays(1) : event->dtEnd());
+        }
+    } else if (incidence.type() == Incidence::TypeTodo) {
+        const Todo *todo = static_cast<const Todo*>(&incidence);
+        if (todo->hasStartDate() && todo->hasDueDate()) {
+            return todo->dtStart(true).secsTo(todo->dtDue(true));
+        }
+    }
+    return 0;
+}
+
+// Date of the end of the last occurrence of a recurring incidence,
+// with the same time convention as the DateStart column.
+static sqlite3_int64 recurrenceEnd(SqliteFormat *format, const Incidence &incidence)
+{
+    if (!incidence.recurs()) {
+        return 0;
+    }
+
+    const QDateTime end = incidence.recurrence()->endDateTime();
+    if (!end.isValid()) {
+        return std::numeric_limits<sqlite3_int64>::max();
+    }
+    const sqlite3_int64 secs = (end.timeSpec() == Qt::LocalTime || incidence.allDay())
+        ? format->toLocalOriginTime(end) : format->toOriginTime(end);
+    return secs + qMax(qint64(0), occurrenceDuration(incidence));
+}
+
 static bool setDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int &index, const QDateTime &dateTime, bool allDay)
 {
     int rv = 0;
     sqlite3_int64 secs;
-    QByteArray tz;
+    int tz = SqliteFormat::ClockTime;
 
     if (dateTime.isValid()) {
         secs = (dateTime.timeSpec() == Qt::LocalTime || allDay)
@@ -329,15 +767,17 @@ static bool setDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int &index, co
         secs = format->toLocalOriginTime(dateTime);
         SL3_bind_int64(stmt, index, secs);
         if (allDay) {
-            tz = FLOATING_DATE;
-        } else if (dateTime.timeSpec() != Qt::LocalTime) {
-            tz = dateTime.timeZone().id();
+            tz = SqliteFormat::FloatingDate;
+        } else if (dateTime.timeSpec() != Qt::LocalTime
+                   && !format->timeZoneId(dateTime.timeZone().id(), &tz)) {
+            qCWarning(lcMkcal) << "cannot store time zone" << dateTime.timeZone().id();
+            goto error;
         }
-        SL3_bind_text(stmt, index, tz.constData(), tz.length(), SQLITE_TRANSIENT);
+        SL3_bind_int(stmt, index, tz);
     } else {
         SL3_bind_int(stmt, index, 0);
         SL3_bind_int(stmt, index, 0);
-        SL3_bind_text(stmt, index, "", 0, SQLITE_STATIC);
+        SL3_bind_int(stmt, index, SqliteFormat::ClockTime);
     }
     return true;
  error:
@@ -350,112 +790,483 @@ static bool setDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int &index, co
             goto error;                                                \
     }
 
-bool SqliteFormat::modifyComponents(const Incidence &incidence,
-                                    DBOperation dbop)
-{
-    int rv = 0;
-    int index = 1;
-    QByteArray uid;
-    QByteArray type;
-    QByteArray summary;
-    QByteArray category;
-    QByteArray location;
-    QByteArray description;
-    QByteArray url;
-    QByteArray contact;
-    QByteArray relatedtouid;
-    QByteArray colorstr;
-    QByteArray comments;
-    QByteArray resources;
-    QDateTime dt;
-    sqlite3_int64 secs;
-    int rowid = 0;
-    sqlite3_stmt *stmt1;
+// Version of the encoding of the Components.Recurrence column.
+static const quint8 gRecurrenceVersion = 1;
 
-    // Don't leave deleted events with the same UID/recID in the
-    // notebook to add a new incidence to. It may otherwise
-    // confuse sync processes, getting both added and deleted events.
-    if (dbop == DBInsert && !purgeDeletedComponents(incidence)) {
-        qCWarning(lcMkcal) << "cannot purge deleted components on insertion.";
-    }
+// Same conventions as setDateTime(), but only the seconds relevant
+// for the time zone are kept: the time in UTC when the time zone is
+// known and the clock time otherwise.
+static bool writeDateTime(SqliteFormat *format, QDataStream &out, const QDateTime &dateTime, bool allDay)
+{
+    int tz = SqliteFormat::ClockTime;
+    sqlite3_int64 secs = 0;
 
-    if (dbop == DBDelete || dbop == DBMarkDeleted || dbop == DBUpdate) {
-        rowid = d->selectRowId(incidence.uid(), incidence.recurrenceId());
-        if (!rowid && dbop == DBDelete) {
-            // Already deleted.
-            return true;
-        } else if (!rowid) {
-            qCWarning(lcMkcal) << "failed to select rowid of incidence" << incidence.uid() << incidence.recurrenceId();
-            goto error;
+    if (dateTime.isValid()) {
+        if (allDay) {
+            tz = SqliteFormat::FloatingDate;
+        } else if (dateTime.timeSpec() != Qt::LocalTime
+                   && !format->timeZoneId(dateTime.timeZone().id(), &tz)) {
+            qCWarning(lcMkcal) << "cannot store time zone" << dateTime.timeZone().id();
+            return false;
         }
+        secs = (tz == SqliteFormat::ClockTime || tz == SqliteFormat::FloatingDate)
+            ? format->toLocalOriginTime(dateTime) : format->toOriginTime(dateTime);
     }
+    out << qint32(tz) << qint64(secs);
 
-    switch (dbop) {
-    case DBDelete:
-        if (!d->mDeleteIncComponents) {
-            const char *query = DELETE_COMPONENTS;
-            int qsize = sizeof(DELETE_COMPONENTS);
-            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mDeleteIncComponents, nullptr);
-        }
-        SL3_reset(d->mDeleteIncComponents);
-        SL3_bind_int(d->mDeleteIncComponents, index, rowid);
-        stmt1 = d->mDeleteIncComponents;
-        break;
-    case DBMarkDeleted:
-        if (!d->mMarkDeletedIncidences) {
-            const char *query = UPDATE_COMPONENTS_AS_DELETED;
-            int qsize = sizeof(UPDATE_COMPONENTS_AS_DELETED);
-            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mMarkDeletedIncidences, nullptr);
+    return true;
+}
+
+static QDateTime readDateTime(SqliteFormat *format, QDataStream &in, bool *isDate = nullptr)
+{
+    qint32 tz;
+    qint64 secs;
+    QDateTime dateTime;
+
+    in >> tz >> secs;
+    if (isDate) {
+        *isDate = false;
+    }
+    if (tz == SqliteFormat::ClockTime) {
+        if (secs) {
+            dateTime = format->fromOriginTime(secs);
+            dateTime.setTimeSpec(Qt::LocalTime);
         }
-        SL3_reset(d->mMarkDeletedIncidences);
-        secs = toOriginTime(QDateTime::currentDateTimeUtc());
-        SL3_bind_int64(d->mMarkDeletedIncidences, index, secs);
-        SL3_bind_int(d->mMarkDeletedIncidences, index, rowid);
-        stmt1 = d->mMarkDeletedIncidences;
-        break;
-    case DBInsert:
-        if (!d->mInsertIncComponents) {
-            const char *query = INSERT_COMPONENTS;
-            int qsize = sizeof(INSERT_COMPONENTS);
-            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mInsertIncComponents, nullptr);
+    } else if (tz == SqliteFormat::FloatingDate) {
+        dateTime = format->fromOriginTime(secs);
+        dateTime.setTimeSpec(Qt::LocalTime);
+        dateTime.setTime(QTime(0, 0, 0));
+        if (isDate) {
+            *isDate = dateTime.isValid();
         }
-        SL3_reset(d->mInsertIncComponents);
-        stmt1 = d->mInsertIncComponents;
-        break;
-    case DBUpdate:
-        if (!d->mUpdateIncComponents) {
-            const char *query = UPDATE_COMPONENTS;
-            int qsize = sizeof(UPDATE_COMPONENTS);
-            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mUpdateIncComponents, nullptr);
+    } else {
+        dateTime = format->fromOriginTime(secs, format->timeZoneName(tz));
+        if (!dateTime.isValid()) {
+            // Unknown time zone, keep the time in UTC.
+            dateTime = format->fromOriginTime(secs);
         }
-        SL3_reset(d->mUpdateIncComponents);
-        stmt1 = d->mUpdateIncComponents;
-        break;
-    default:
-        qCWarning(lcMkcal) << "unknown DB operation" << dbop;
-        goto error;
+    }
+
+    return dateTime;
+}
+
+static bool writeRules(SqliteFormat *format, QDataStream &out, const RecurrenceRule::List &rules)
+{
+    out << qint32(rules.count());
+    for (const RecurrenceRule *rule : rules) {
+        out << qint8(rule->recurrenceType()) << qint32(rule->frequency()) << qint32(rule->duration());
+        // The end of a rule with a count is computed on read.
+        if (!writeDateTime(format, out, rule->duration() ? QDateTime() : rule->endDt(), rule->allDay())) {
+            return false;
+        }
+        out << rule->bySeconds() << rule->byMinutes() << rule->byHours();
+        const QList<RecurrenceRule::WDayPos> byDays = rule->byDays();
+        out << qint32(byDays.count());
+        for (const RecurrenceRule::WDayPos &day : byDays) {
+            out << qint16(day.day()) << qint32(day.pos());
+        }
+        out << rule->byMonthDays() << rule->byYearDays() << rule->byWeekNumbers()
+            << rule->byMonths() << rule->bySetPos();
+        out << qint16(rule->weekStart());
+    }
+
+    return true;
+}
+
+static bool readRules(SqliteFormat *format, QDataStream &in, const Incidence::Ptr &incidence, bool exclusion)
+{
+    qint32 count;
+
+    in >> count;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        qint8 type;
+        qint32 frequency;
+        qint32 duration;
+        bool isAllDay;
+        QList<int> bySeconds, byMinutes, byHours;
+        QList<int> byMonthDays, byYearDays, byWeekNumbers, byMonths, bySetPos;
+        QList<RecurrenceRule::WDayPos> byDays;
+        qint32 nDays;
+        qint16 weekStart;
+
+        in >> type >> frequency >> duration;
+        const QDateTime until = readDateTime(format, in, &isAllDay);
+        in >> bySeconds >> byMinutes >> byHours;
+        in >> nDays;
+        for (int j = 0; j < nDays && in.status() == QDataStream::Ok; j++) {
+            qint16 day;
+            qint32 pos;
+            in >> day >> pos;
+            byDays.append(RecurrenceRule::WDayPos(pos, day));
+        }
+        in >> byMonthDays >> byYearDays >> byWeekNumbers >> byMonths >> bySetPos;
+        in >> weekStart;
+        if (in.status() != QDataStream::Ok) {
+            return false;
+        }
+
+        RecurrenceRule *rule = new RecurrenceRule();
+        if (incidence->dtStart().isValid()) {
+            rule->setStartDt(incidence->dtStart());
+        } else if (incidence->type() == Incidence::TypeTodo) {
+            rule->setStartDt(incidence.staticCast<Todo>()->dtDue(true));
+        }
+        rule->setRRule(exclusion ? QStringLiteral("EXRULE") : QStringLiteral("RRULE"));
+        if (type >= RecurrenceRule::rSecondly && type <= RecurrenceRule::rYearly) {
+            rule->setRecurrenceType(RecurrenceRule::PeriodType(type));
+        } else {
+            rule->setRecurrenceType(RecurrenceRule::rNone);
+        }
+        rule->setEndDt(until);
+        incidence->recurrence()->setAllDay(until.isValid() ? isAllDay : incidence->allDay());
+        if (duration == 0 && !until.isValid()) {
+            duration = -1; // recurring infinitely, like in readRecursive()
+        }
+        rule->setDuration(duration);
+        rule->setFrequency(frequency);
+        rule->setBySeconds(bySeconds);
+        rule->setByMinutes(byMinutes);
+        rule->setByHours(byHours);
+        rule->setByDays(byDays);
+        rule->setByMonthDays(byMonthDays);
+        rule->setByYearDays(byYearDays);
+        rule->setByWeekNumbers(byWeekNumbers);
+        rule->setByMonths(byMonths);
+        rule->setBySetPos(bySetPos);
+        rule->setWeekStart(weekStart);
+        if (exclusion) {
+            incidence->recurrence()->addExRule(rule);
+        } else {
+            incidence->recurrence()->addRRule(rule);
+        }
+    }
+
+    return in.status() == QDataStream::Ok;
+}
+
+static bool writeDateTimes(SqliteFormat *format, QDataStream &out, const Incidence &incidence,
+                           const QList<QDateTime> &dateTimes)
+{
+    out << qint32(dateTimes.count());
+    for (const QDateTime &dateTime : dateTimes) {
+        // See the all day case in getDateTime().
+        const bool allDay = incidence.allDay() && dateTime.timeSpec() == Qt::LocalTime
+            && dateTime.time() == QTime(0, 0);
+        if (!writeDateTime(format, out, dateTime, allDay)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static QList<QDateTime> readDateTimes(SqliteFormat *format, QDataStream &in)
+{
+    qint32 count;
+    QList<QDateTime> dateTimes;
+
+    in >> count;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        const QDateTime dateTime = readDateTime(format, in);
+        if (dateTime.isValid()) {
+            dateTimes.append(dateTime);
+        }
+    }
+
+    return dateTimes;
+}
+
+/*
+  Encode the rules, the dates and the exception dates of the recurrence
+  of an incidence, to be stored in the Recurrence column.
+
+  @param data set to an empty array if the incidence does not recur
+  @return false if the encoding failed.
+*/
+static bool encodeRecurrence(SqliteFormat *format, const Incidence &incidence, QByteArray *data)
+{
+    const Recurrence *recurrence = incidence.recurrence();
+
+    data->clear();
+    if (recurrence->rRules().isEmpty() && recurrence->exRules().isEmpty()
+        && recurrence->rDates().isEmpty() && recurrence->exDates().isEmpty()
+        && recurrence->rDateTimes().isEmpty() && recurrence->exDateTimes().isEmpty()) {
+        return true;
+    }
+
+    QDataStream out(data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_6_0);
+    out << gRecurrenceVersion;
+    if (!writeRules(format, out, recurrence->rRules())
+        || !writeRules(format, out, recurrence->exRules())) {
+        return false;
+    }
+    out << recurrence->rDates() << recurrence->exDates();
+    if (!writeDateTimes(format, out, incidence, recurrence->rDateTimes())
+        || !writeDateTimes(format, out, incidence, recurrence->exDateTimes())) {
+        return false;
+    }
+
+    return out.status() == QDataStream::Ok;
+}
+
+static bool decodeRecurrence(SqliteFormat *format, const QByteArray &data, const Incidence::Ptr &incidence)
+{
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_6_0);
+    quint8 version;
+    QList<QDate> rDates;
+    QList<QDate> exDates;
+
+    in >> version;
+    if (version != gRecurrenceVersion) {
+        qCWarning(lcMkcal) << "unknown recurrence encoding" << version;
+        return false;
+    }
+    if (!readRules(format, in, incidence, false) || !readRules(format, in, incidence, true)) {
+        return false;
+    }
+    in >> rDates >> exDates;
+    if (!rDates.isEmpty()) {
+        incidence->recurrence()->setRDates(rDates);
+    }
+    if (!exDates.isEmpty()) {
+        incidence->recurrence()->setExDates(exDates);
+    }
+    const QList<QDateTime> rDateTimes = readDateTimes(format, in);
+    if (!rDateTimes.isEmpty()) {
+        incidence->recurrence()->setRDateTimes(rDateTimes);
+    }
+    const QList<QDateTime> exDateTimes = readDateTimes(format, in);
+    if (!exDateTimes.isEmpty()) {
+        incidence->recurrence()->setExDateTimes(exDateTimes);
+    }
+
+    return in.status() == QDataStream::Ok;
+}
+
+bool SqliteFormat::convertRecurrences()
+{
+    int rv = 0;
+    char *errmsg = nullptr;
+    const char *query = nullptr;
+    bool success = false;
+    sqlite3_stmt *select = nullptr;
+    sqlite3_stmt *update = nullptr;
+    QList<QPair<int, QByteArray>> recurrences;
+
+    SL3_acquire(this, SELECT_COMPONENTS_BY_LEGACY_RECURRENCE,
+                sizeof(SELECT_COMPONENTS_BY_LEGACY_RECURRENCE), select);
+    SL3_step(select);
+    while (rv == SQLITE_ROW) {
+        int rowid;
+        QString attachments;
+        Incidence::Ptr incidence = d->selectComponent(select, &rowid, &attachments);
+        if (incidence) {
+            QByteArray data;
+            if (!d->selectRecursives(incidence, rowid) || !d->selectRdates(incidence, rowid)
+                || !encodeRecurrence(this, *incidence, &data)) {
+                qCWarning(lcMkcal) << "cannot convert recurrence of incidence" << incidence->uid();
+                goto error;
+            }
+            recurrences.append(qMakePair(rowid, data));
+        }
+        SL3_step(select);
+    }
+
+    // Not updated while selecting from the same table.
+    SL3_acquire(this, UPDATE_COMPONENTS_RECURRENCE, sizeof(UPDATE_COMPONENTS_RECURRENCE), update);
+    for (const QPair<int, QByteArray> &recurrence : const_cast<const QList<QPair<int, QByteArray>>&>(recurrences)) {
+        int index = 1;
+        SL3_reset(update);
+        SL3_bind_blob(update, index, recurrence.second.isEmpty() ? nullptr : recurrence.second.constData(),
+                      recurrence.second.size(), SQLITE_STATIC);
+        SL3_bind_int(update, index, recurrence.first);
+        SL3_step(update);
+    }
+
+    query = "DELETE FROM Recursive";
+    SL3_exec(d->mDatabase);
+    query = "DELETE FROM Rdates";
+    SL3_exec(d->mDatabase);
+    success = true;
+
+error:
+    releaseStatement(select);
+    releaseStatement(update);
+
+    return success;
+}
+
+// A hash of the alarms of an incidence, 0 if it has none.
+static size_t alarmsFingerprint(const Incidence &incidence)
+{
+    const Alarm::List alarms = incidence.alarms();
+    QByteArray data;
+
+    if (alarms.isEmpty()) {
+        return 0;
+    }
+    QDataStream out(&data, QIODevice::WriteOnly);
+    for (const Alarm::Ptr &alarm : alarms) {
+        out << alarm;
+    }
+    return qHash(data);
+}
+
+SqliteFormat::Snapshot SqliteFormat::snapshot(const Incidence &incidence)
+{
+    Snapshot snapshot;
+
+    snapshot.customProperties = incidence;
+    snapshot.organizer = incidence.organizer();
+    snapshot.attendees = incidence.attendees();
+    snapshot.attachments = incidence.attachments();
+    snapshot.dtStart = incidence.dtStart();
+    snapshot.dtEnd = incidence.dateTime(Incidence::RoleEnd);
+    snapshot.allDay = incidence.allDay();
+    if (!encodeRecurrence(this, incidence, &snapshot.recurrence)) {
+        // Never equal to an encoded recurrence, see changedParts().
+        snapshot.recurrence = QByteArray(1, '\0');
+    }
+    snapshot.alarms = alarmsFingerprint(incidence);
+
+    return snapshot;
+}
+
+SqliteFormat::IncidenceParts SqliteFormat::changedParts(const Snapshot &snapshot,
+                                                        const Incidence &incidence,
+                                                        IncidenceParts parts)
+{
+    IncidenceParts changed = NoPart;
+    QByteArray recurrence;
+
+    if ((parts & CustomPropertiesPart) && !(snapshot.customProperties == incidence)) {
+        changed |= CustomPropertiesPart;
+    }
+    if ((parts & AttendeesPart)
+        && (!(snapshot.organizer == incidence.organizer())
+            || snapshot.attendees != incidence.attendees())) {
+        changed |= AttendeesPart;
+    }
+    if ((parts & AlarmsPart) && snapshot.alarms != alarmsFingerprint(incidence)) {
+        changed |= AlarmsPart;
+    }
+    if ((parts & AttachmentsPart) && snapshot.attachments != incidence.attachments()) {
+        changed |= AttachmentsPart;
+    }
+    if ((parts & RecurrencePart)
+        && (snapshot.dtStart != incidence.dtStart()
+            || snapshot.dtEnd != incidence.dateTime(Incidence::RoleEnd)
+            || snapshot.allDay != incidence.allDay()
+            || !encodeRecurrence(this, incidence, &recurrence)
+            || snapshot.recurrence != recurrence)) {
+        changed |= RecurrencePart;
+    }
+
+    return changed;
+}
+
+bool SqliteFormat::modifyComponents(const Incidence &incidence,
+                                    DBOperation dbop, IncidenceParts parts)
+{
+    int rv = 0;
+    int index = 1;
+    QByteArray uid;
+    QByteArray summary;
+    QByteArray category;
+    QByteArray location;
+    QByteArray description;
+    QByteArray url;
+    QByteArray contact;
+    QByteArray relatedtouid;
+    QByteArray colorstr;
+    QByteArray comments;
+    QByteArray resources;
+    QByteArray recurrence;
+    QDateTime dt;
+    sqlite3_int64 secs;
+    int rowid = 0;
+    sqlite3_stmt *stmt1 = nullptr;
+
+    // Don't leave deleted events with the same UID/recID in the
+    // notebook to add a new incidence to. It may otherwise
+    // confuse sync processes, getting both added and deleted events.
+    if (dbop == DBInsert && !purgeDeletedComponents(incidence)) {
+        qCWarning(lcMkcal) << "cannot purge deleted components on insertion.";
+        goto error;
+    }
+
+    if (dbop == DBDelete || dbop == DBMarkDeleted || dbop == DBUpdate) {
+        rowid = d->selectRowId(incidence.uid(), incidence.recurrenceId());
+        if (!rowid && dbop == DBDelete) {
+            // Already deleted.
+            return true;
+        } else if (!rowid) {
+            qCWarning(lcMkcal) << "failed to select rowid of incidence" << incidence.uid() << incidence.recurrenceId();
+            goto error;
+        }
+    }
+
+    // The indexed text of the row is needed to remove it from the index.
+    if (dbop != DBInsert && d->mFullText && !d->deleteComponentsText(rowid)) {
+        qCWarning(lcMkcal) << "failed to remove text of incidence" << incidence.uid();
+        goto error;
+    }
+
+    switch (dbop) {
+    case DBDelete:
+        if (!d->mDeleteIncComponents) {
+            const char *query = DELETE_COMPONENTS;
+            int qsize = sizeof(DELETE_COMPONENTS);
+            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mDeleteIncComponents, nullptr);
+        }
+        SL3_reset(d->mDeleteIncComponents);
+        SL3_bind_int(d->mDeleteIncComponents, index, rowid);
+        stmt1 = d->mDeleteIncComponents;
+        break;
+    case DBMarkDeleted:
+        if (!d->mMarkDeletedIncidences) {
+            const char *query = UPDATE_COMPONENTS_AS_DELETED;
+            int qsize = sizeof(UPDATE_COMPONENTS_AS_DELETED);
+            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mMarkDeletedIncidences, nullptr);
+        }
+        SL3_reset(d->mMarkDeletedIncidences);
+        secs = toOriginTime(QDateTime::currentDateTimeUtc());
+        SL3_bind_int64(d->mMarkDeletedIncidences, index, secs);
+        SL3_bind_int(d->mMarkDeletedIncidences, index, rowid);
+        stmt1 = d->mMarkDeletedIncidences;
+        break;
+    case DBInsert:
+        if (!d->mInsertIncComponents) {
+            const char *query = INSERT_COMPONENTS;
+            int qsize = sizeof(INSERT_COMPONENTS);
+            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mInsertIncComponents, nullptr);
+        }
+        SL3_reset(d->mInsertIncComponents);
+        stmt1 = d->mInsertIncComponents;
+        break;
+    case DBUpdate:
+        if (!d->mUpdateIncComponents) {
+            const char *query = UPDATE_COMPONENTS;
+            int qsize = sizeof(UPDATE_COMPONENTS);
+            SL3_prepare_v2(d->mDatabase, query, qsize, &d->mUpdateIncComponents, nullptr);
+        }
+        SL3_reset(d->mUpdateIncComponents);
+        stmt1 = d->mUpdateIncComponents;
+        break;
+    default:
+        qCWarning(lcMkcal) << "unknown DB operation" << dbop;
+        goto error;
     }
 
     if (dbop == DBInsert || dbop == DBUpdate) {
         SL3_bind_text(stmt1, index, "", 0, SQLITE_STATIC);
 
-        switch (incidence.type()) {
-        case Incidence::TypeEvent:
-            type = "Event";
-            break;
-        case Incidence::TypeTodo:
-            type = "Todo";
-            break;
-        case Incidence::TypeJournal:
-            type = "Journal";
-            break;
-        case Incidence::TypeFreeBusy:
-            type = "FreeBusy";
-            break;
-        case Incidence::TypeUnknown:
+        if (incidence.type() == Incidence::TypeUnknown) {
             goto error;
         }
-        SL3_bind_text(stmt1, index, type.constData(), type.length(), SQLITE_STATIC);   // NOTE
+        SL3_bind_int(stmt1, index, incidence.type());
 
         summary = incidence.summary().toUtf8();
         SL3_bind_text(stmt1, index, summary.constData(), summary.length(), SQLITE_STATIC);
@@ -567,7 +1378,7 @@ bool SqliteFormat::modifyComponents(const Incidence &incidence,
         contact = incidence.contacts().join(" ").toUtf8();
         SL3_bind_text(stmt1, index, contact.constData(), contact.length(), SQLITE_STATIC);
 
-        // Never save recurrenceId as FLOATING_DATE, because the time of a
+        // Never save recurrenceId as a floating date, because the time of a
         // floating date is not guaranteed on read and recurrenceId is used
         // for date-time comparisons.
         SL3_bind_date_time(this, stmt1, index, incidence.recurrenceId(), false);
@@ -605,36 +1416,371 @@ bool SqliteFormat::modifyComponents(const Incidence &incidence,
 
         SL3_bind_int(stmt1, index, incidence.thisAndFuture());
 
+        SL3_bind_int64(stmt1, index, recurrenceEnd(this, incidence));
+
+        if (!encodeRecurrence(this, incidence, &recurrence)) {
+            qCWarning(lcMkcal) << "cannot encode recurrence of incidence" << incidence.uid();
+            goto error;
+        }
+        SL3_bind_blob(stmt1, index, recurrence.isEmpty() ? nullptr : recurrence.constData(),
+                      recurrence.size(), SQLITE_STATIC);
+
         if (dbop == DBUpdate)
             SL3_bind_int(stmt1, index, rowid);
     }
 
     SL3_step(stmt1);
 
-    if ((dbop == DBDelete || dbop == DBUpdate) && !d->deleteListsForIncidence(rowid)) {
-        qCWarning(lcMkcal) << "failed to delete lists for incidence" << incidence.uid();
-    } else if (dbop == DBInsert || dbop == DBUpdate) {
-        if (dbop == DBInsert)
-            rowid = sqlite3_last_insert_rowid(d->mDatabase);
+    if (dbop == DBInsert)
+        rowid = sqlite3_last_insert_rowid(d->mDatabase);
 
-        if (!d->insertCustomproperties(incidence, rowid))
+    // Any failure below leaves the incidence partially written,
+    // the caller has to roll it back.
+    if (!d->modifyComponentsRange(rowid, dbop)) {
+        qCWarning(lcMkcal) << "failed to modify range for incidence" << incidence.uid();
+        goto error;
+    }
+
+    if ((dbop == DBInsert || dbop == DBUpdate) && d->mFullText
+        && !d->insertComponentsText(rowid)) {
+        qCWarning(lcMkcal) << "failed to index text of incidence" << incidence.uid();
+        goto error;
+    }
+
+    // Only an update may leave some parts untouched.
+    if (dbop != DBUpdate) {
+        parts = AllParts;
+    }
+
+    if ((parts & RecurrencePart) && !d->modifyOccurrences(incidence, rowid, dbop)) {
+        qCWarning(lcMkcal) << "failed to modify occurrences for incidence" << incidence.uid();
+        goto error;
+    }
+
+    if ((dbop == DBDelete || dbop == DBUpdate) && !d->deleteListsForIncidence(rowid, parts)) {
+        qCWarning(lcMkcal) << "failed to delete lists for incidence" << incidence.uid();
+        goto error;
+    }
+    if (dbop == DBInsert || dbop == DBUpdate) {
+        if ((parts & CustomPropertiesPart) && !d->insertCustomproperties(incidence, rowid)) {
             qCWarning(lcMkcal) << "failed to modify customproperties for incidence" << incidence.uid();
+            goto error;
+        }
+
+        if ((parts & AttendeesPart) && !d->insertAttendees(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to modify attendees for incidence" << incidence.uid();
+            goto error;
+        }
+
+        if ((parts & AlarmsPart) && !d->insertAlarms(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to modify alarms for incidence" << incidence.uid();
+            goto error;
+        }
+
+        if ((parts & AttachmentsPart) && !d->insertAttachments(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to modify attachments for incidence" << incidence.uid();
+            goto error;
+        }
+    }
+
+    return true;
+
+error:
+    // Clear the failure, so the statement can be used again
+    // for the next incidence.
+    if (stmt1) {
+        sqlite3_reset(stmt1);
+    }
+    return false;
+}
+
+//@cond PRIVATE
+bool SqliteFormat::Private::modifyComponentsRange(int rowid, DBOperation dbop)
+{
+    int rv = 0;
+    int index = 1;
+    sqlite3_stmt *stmt = nullptr;
+
+    if (dbop == DBInsert || dbop == DBUpdate) {
+        if (!mInsertIncRange) {
+            const char *query = INSERT_COMPONENTS_RANGE;
+            int qsize = sizeof(INSERT_COMPONENTS_RANGE);
+            SL3_prepare_v2(mDatabase, query, qsize, &mInsertIncRange, nullptr);
+        }
+        stmt = mInsertIncRange;
+    } else {
+        if (!mDeleteIncRange) {
+            const char *query = DELETE_COMPONENTS_RANGE;
+            int qsize = sizeof(DELETE_COMPONENTS_RANGE);
+            SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncRange, nullptr);
+        }
+        stmt = mDeleteIncRange;
+    }
+    SL3_reset(stmt);
+    SL3_bind_int(stmt, index, rowid);
+    SL3_step(stmt);
+
+    return true;
+
+error:
+    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(stmt);
+    return false;
+}
+
+bool SqliteFormat::Private::insertComponentsText(int rowid)
+{
+    int rv = 0;
+    int index = 1;
+
+    if (!mInsertIncText) {
+        const char *query = INSERT_COMPONENTS_TEXT;
+        int qsize = sizeof(INSERT_COMPONENTS_TEXT);
+        SL3_prepare_v2(mDatabase, query, qsize, &mInsertIncText, nullptr);
+    }
+    SL3_reset(mInsertIncText);
+    SL3_bind_int(mInsertIncText, index, rowid);
+    SL3_step(mInsertIncText);
+
+    return true;
+
+error:
+    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mInsertIncText);
+    return false;
+}
+
+bool SqliteFormat::Private::deleteComponentsText(int rowid)
+{
+    int rv = 0;
+    int index = 1;
+
+    if (!mDeleteIncText) {
+        const char *query = DELETE_COMPONENTS_TEXT;
+        int qsize = sizeof(DELETE_COMPONENTS_TEXT);
+        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncText, nullptr);
+    }
+    SL3_reset(mDeleteIncText);
+    SL3_bind_int(mDeleteIncText, index, rowid);
+    SL3_step(mDeleteIncText);
+
+    return true;
+
+error:
+    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mDeleteIncText);
+    return false;
+}
+
+bool SqliteFormat::Private::deleteById(const char *query, int qsize, int rowid)
+{
+    int rv = 0;
+    int index = 1;
+    bool success = false;
+    sqlite3_stmt *stmt = nullptr;
+
+    SL3_acquire(mFormat, query, qsize, stmt);
+    SL3_bind_int(stmt, index, rowid);
+    SL3_step(stmt);
+    success = true;
+
+error:
+    mStatements.release(stmt);
+
+    return success;
+}
+
+bool SqliteFormat::Private::modifyOccurrences(const Incidence &incidence, int rowid,
+                                              DBOperation dbop)
+{
+    if (dbop != DBInsert
+        && (!deleteById(DELETE_OCCURRENCES_RANGE, sizeof(DELETE_OCCURRENCES_RANGE), rowid)
+            || !deleteById(DELETE_OCCURRENCES, sizeof(DELETE_OCCURRENCES), rowid)
+            || !deleteById(DELETE_OCCURRENCEHORIZONS, sizeof(DELETE_OCCURRENCEHORIZONS), rowid))) {
+        return false;
+    }
+
+    if ((dbop == DBInsert || dbop == DBUpdate) && incidence.recurs()) {
+        const QDateTime now = QDateTime::currentDateTimeUtc();
+        return insertOccurrences(incidence, rowid,
+                                 SqliteFormat::toOriginTime(now.addDays(-gOccurrenceHistoryDays)),
+                                 SqliteFormat::toOriginTime(now.addDays(gOccurrenceHorizonDays)));
+    }
+
+    return true;
+}
+
+// Same time convention as the DateStart column.
+sqlite3_int64 SqliteFormat::Private::occurrenceTime(const Incidence &incidence,
+                                                    const QDateTime &dt) const
+{
+    return (dt.timeSpec() == Qt::LocalTime || incidence.allDay())
+        ? SqliteFormat::toLocalOriginTime(dt) : SqliteFormat::toOriginTime(dt);
+}
+
+// The occurrences ending after from start after this date and time,
+// a day earlier whatever the time convention of the occurrences.
+static QDateTime lowerBound(sqlite3_int64 from, qint64 duration)
+{
+    return SqliteFormat::fromOriginTime(from - duration).addDays(-1);
+}
+
+// Expand the occurrences ending after from, up to the ones starting
+// at until, or to the maximum number of occurrences.
+bool SqliteFormat::Private::insertOccurrences(const Incidence &incidence, int rowid,
+                                              sqlite3_int64 from, sqlite3_int64 until)
+{
+    const Recurrence *recurrence = incidence.recurrence();
+    const qint64 duration = qMax(qint64(0), occurrenceDuration(incidence));
+    const bool fromStart = (from <= occurrenceTime(incidence, recurrence->startDateTime()));
+    const QDateTime dt = fromStart
+        ? recurrence->getNextDateTime(recurrence->startDateTime().addSecs(-1))
+        : recurrence->getNextDateTime(lowerBound(from, duration));
+    sqlite3_int64 horizon;
+
+    return appendOccurrences(incidence, rowid, dt, until, &horizon)
+        && updateHorizon(rowid, fromStart, from, horizon);
+}
+
+// Expand the occurrences of an indexed series over [start, end),
+// keeping the ones already indexed from origin up to horizon.
+bool SqliteFormat::Private::extendOccurrences(const Incidence &incidence, int rowid,
+                                              sqlite3_int64 start, sqlite3_int64 end,
+                                              bool fromStart, sqlite3_int64 origin,
+                                              sqlite3_int64 horizon)
+{
+    const bool before = !fromStart && start < origin;
+    const bool after = horizon < end;
+
+    if (!before && !after) {
+        return true;
+    }
+    if (before && !prependOccurrences(incidence, rowid, start, &fromStart, &origin)) {
+        return false;
+    }
+    if (after) {
+        // The first occurrence not indexed starts at the horizon.
+        const Recurrence *recurrence = incidence.recurrence();
+        QDateTime dt = recurrence->getNextDateTime(SqliteFormat::fromOriginTime(horizon).addDays(-1));
+        while (dt.isValid() && occurrenceTime(incidence, dt) < horizon) {
+            dt = recurrence->getNextDateTime(dt);
+        }
+        if (!appendOccurrences(incidence, rowid, dt, end, &horizon)) {
+            return false;
+        }
+    }
+
+    return updateHorizon(rowid, fromStart, origin, horizon);
+}
+
+// Index the occurrences from dt on, up to the ones starting at until,
+// or to the maximum number of occurrences. The horizon is set to the
+// start of the first occurrence not indexed.
+bool SqliteFormat::Private::appendOccurrences(const Incidence &incidence, int rowid, QDateTime dt,
+                                              sqlite3_int64 until, sqlite3_int64 *horizon)
+{
+    bool success = false;
+    sqlite3_stmt *occurrences = nullptr;
+    sqlite3_stmt *ranges = nullptr;
+    const Recurrence *recurrence = incidence.recurrence();
+    const qint64 duration = qMax(qint64(0), occurrenceDuration(incidence));
+    int count = 0;
+
+    // Fully expanded, unless a bound is reached.
+    *horizon = std::numeric_limits<sqlite3_int64>::max();
+    SL3_acquire(mFormat, INSERT_OCCURRENCES, sizeof(INSERT_OCCURRENCES), occurrences);
+    SL3_acquire(mFormat, INSERT_OCCURRENCES_RANGE, sizeof(INSERT_OCCURRENCES_RANGE), ranges);
+
+    while (dt.isValid()) {
+        const sqlite3_int64 secs = occurrenceTime(incidence, dt);
+        if (secs > until || count >= gMaxOccurrences) {
+            // Occurrences starting before the horizon are all indexed.
+            *horizon = secs;
+            break;
+        }
+        if (!insertOccurrence(occurrences, ranges, rowid, secs, duration)) {
+            goto error;
+        }
+        count += 1;
+        dt = recurrence->getNextDateTime(dt);
+    }
+    success = true;
+
+error:
+    mStatements.release(occurrences);
+    mStatements.release(ranges);
+
+    return success;
+}
+
+// Index the occurrences before the ones indexed from origin, down to
+// the ones ending after start, or to the maximum number of occurrences.
+// The origin is moved accordingly, or the series is marked as indexed
+// from its start.
+bool SqliteFormat::Private::prependOccurrences(const Incidence &incidence, int rowid,
+                                               sqlite3_int64 start, bool *fromStart,
+                                               sqlite3_int64 *origin)
+{
+    bool success = false;
+    sqlite3_stmt *occurrences = nullptr;
+    sqlite3_stmt *ranges = nullptr;
+    const Recurrence *recurrence = incidence.recurrence();
+    const qint64 duration = qMax(qint64(0), occurrenceDuration(incidence));
+    const QDateTime bound = lowerBound(start, duration);
+    int count = 0;
+    QDateTime last;
+    // The last occurrence not indexed, the ones after lowerBound(origin) are.
+    QDateTime dt = recurrence->getPreviousDateTime(lowerBound(*origin, duration).addSecs(1));
+
+    SL3_acquire(mFormat, INSERT_OCCURRENCES, sizeof(INSERT_OCCURRENCES), occurrences);
+    SL3_acquire(mFormat, INSERT_OCCURRENCES_RANGE, sizeof(INSERT_OCCURRENCES_RANGE), ranges);
+
+    while (dt.isValid() && dt > bound && count < gMaxOccurrences) {
+        if (!insertOccurrence(occurrences, ranges, rowid,
+                                    occurrenceTime(incidence, dt), duration)) {
+            goto error;
+        }
+        count += 1;
+        last = dt;
+        dt = recurrence->getPreviousDateTime(dt);
+    }
+    if (!dt.isValid()) {
+        *fromStart = true;
+    } else if (dt <= bound) {
+        *origin = start;
+    } else {
+        // The lower bound of the new origin is just before the last
+        // occurrence indexed, see lowerBound().
+        *origin = SqliteFormat::toOriginTime(last) - 1 + 86400 + duration;
+    }
+    success = true;
 
-        if (!d->insertAttendees(incidence, rowid))
-            qCWarning(lcMkcal) << "failed to modify attendees for incidence" << incidence.uid();
+error:
+    mStatements.release(occurrences);
+    mStatements.release(ranges);
 
-        if (!d->insertAlarms(incidence, rowid))
-            qCWarning(lcMkcal) << "failed to modify alarms for incidence" << incidence.uid();
+    return success;
+}
 
-        if (!d->insertRecursives(incidence, rowid))
-            qCWarning(lcMkcal) << "failed to modify recursives for incidence" << incidence.uid();
+bool SqliteFormat::Private::insertOccurrence(sqlite3_stmt *occurrences, sqlite3_stmt *ranges,
+                                             int rowid, sqlite3_int64 secs, qint64 duration)
+{
+    int rv = 0;
+    int index = 1;
 
-        if (!d->insertRdates(incidence, rowid))
-            qCWarning(lcMkcal) << "failed to modify rdates for incidence" << incidence.uid();
+    SL3_reset(occurrences);
+    SL3_bind_int(occurrences, index, rowid);
+    SL3_step(occurrences);
 
-        if (!d->insertAttachments(incidence, rowid))
-            qCWarning(lcMkcal) << "failed to modify attachments for incidence" << incidence.uid();
-    }
+    index = 1;
+    SL3_reset(ranges);
+    SL3_bind_int64(ranges, index, sqlite3_last_insert_rowid(mDatabase));
+    SL3_bind_int64(ranges, index, qMin(secs, secs + duration));
+    SL3_bind_int64(ranges, index, qMax(secs, secs + duration));
+    SL3_step(ranges);
 
     return true;
 
@@ -642,76 +1788,93 @@ error:
     return false;
 }
 
-//@cond PRIVATE
-bool SqliteFormat::Private::deleteListsForIncidence(int rowid)
+bool SqliteFormat::Private::updateHorizon(int rowid, bool fromStart,
+                                          sqlite3_int64 origin, sqlite3_int64 horizon)
 {
     int rv = 0;
     int index = 1;
+    bool success = false;
+    sqlite3_stmt *insertHorizon = nullptr;
 
-    if (!mDeleteIncProperties) {
-        const char *query = DELETE_CUSTOMPROPERTIES;
-        int qsize = sizeof(DELETE_CUSTOMPROPERTIES);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncProperties, nullptr);
+    SL3_acquire(mFormat, INSERT_OCCURRENCEHORIZONS, sizeof(INSERT_OCCURRENCEHORIZONS), insertHorizon);
+    SL3_bind_int(insertHorizon, index, rowid);
+    SL3_bind_int64(insertHorizon, index, horizon);
+    if (fromStart) {
+        SL3_bind_blob(insertHorizon, index, static_cast<const char *>(nullptr), 0, SQLITE_STATIC);
+    } else {
+        SL3_bind_int64(insertHorizon, index, origin);
     }
-    SL3_reset(mDeleteIncProperties);
-    index = 1;
-    SL3_bind_int(mDeleteIncProperties, index, rowid);
-    SL3_step(mDeleteIncProperties);
+    SL3_step(insertHorizon);
+    success = true;
 
-    if (!mDeleteIncAlarms) {
-        const char *query = DELETE_ALARM;
-        int qsize = sizeof(DELETE_ALARM);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAlarms, nullptr);
-    }
-    SL3_reset(mDeleteIncAlarms);
-    index = 1;
-    SL3_bind_int(mDeleteIncAlarms, index, rowid);
-    SL3_step(mDeleteIncAlarms);
+error:
+    mStatements.release(insertHorizon);
+
+    return success;
+}
+
+bool SqliteFormat::Private::deleteListsForIncidence(int rowid, SqliteFormat::IncidenceParts parts)
+{
+    int rv = 0;
+    int index = 1;
 
-    if (!mDeleteIncAttendees) {
-        const char *query = DELETE_ATTENDEE;
-        int qsize = sizeof(DELETE_ATTENDEE);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAttendees, nullptr);
+    if (parts & SqliteFormat::CustomPropertiesPart) {
+        if (!mDeleteIncProperties) {
+            const char *query = DELETE_CUSTOMPROPERTIES;
+            int qsize = sizeof(DELETE_CUSTOMPROPERTIES);
+            SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncProperties, nullptr);
+        }
+        SL3_reset(mDeleteIncProperties);
+        index = 1;
+        SL3_bind_int(mDeleteIncProperties, index, rowid);
+        SL3_step(mDeleteIncProperties);
     }
-    SL3_reset(mDeleteIncAttendees);
-    index = 1;
-    SL3_bind_int(mDeleteIncAttendees, index, rowid);
-    SL3_step(mDeleteIncAttendees);
 
-    if (!mDeleteIncRecursives) {
-        const char *query = DELETE_RECURSIVE;
-        int qsize = sizeof(DELETE_RECURSIVE);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncRecursives, nullptr);
+    if (parts & SqliteFormat::AlarmsPart) {
+        if (!mDeleteIncAlarms) {
+            const char *query = DELETE_ALARM;
+            int qsize = sizeof(DELETE_ALARM);
+            SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAlarms, nullptr);
+        }
+        SL3_reset(mDeleteIncAlarms);
+        index = 1;
+        SL3_bind_int(mDeleteIncAlarms, index, rowid);
+        SL3_step(mDeleteIncAlarms);
     }
-    SL3_reset(mDeleteIncRecursives);
-    index = 1;
-    SL3_bind_int(mDeleteIncRecursives, index, rowid);
-    SL3_step(mDeleteIncRecursives);
 
-    if (!mDeleteIncRDates) {
-        const char *query = DELETE_RDATES;
-        int qsize = sizeof(DELETE_RDATES);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncRDates, nullptr);
+    if (parts & SqliteFormat::AttendeesPart) {
+        if (!mDeleteIncAttendees) {
+            const char *query = DELETE_ATTENDEE;
+            int qsize = sizeof(DELETE_ATTENDEE);
+            SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAttendees, nullptr);
+        }
+        SL3_reset(mDeleteIncAttendees);
+        index = 1;
+        SL3_bind_int(mDeleteIncAttendees, index, rowid);
+        SL3_step(mDeleteIncAttendees);
     }
-    SL3_reset(mDeleteIncRDates);
-    index = 1;
-    SL3_bind_int(mDeleteIncRDates, index, rowid);
-    SL3_step(mDeleteIncRDates);
 
-    if (!mDeleteIncAttachments) {
-        const char *query = DELETE_ATTACHMENTS;
-        int qsize = sizeof(DELETE_ATTACHMENTS);
-        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAttachments, nullptr);
+    if (parts & SqliteFormat::AttachmentsPart) {
+        if (!mDeleteIncAttachments) {
+            const char *query = DELETE_ATTACHMENTS;
+            int qsize = sizeof(DELETE_ATTACHMENTS);
+            SL3_prepare_v2(mDatabase, query, qsize, &mDeleteIncAttachments, nullptr);
+        }
+        SL3_reset(mDeleteIncAttachments);
+        index = 1;
+        SL3_bind_int(mDeleteIncAttachments, index, rowid);
+        SL3_step(mDeleteIncAttachments);
     }
-    SL3_reset(mDeleteIncAttachments);
-    index = 1;
-    SL3_bind_int(mDeleteIncAttachments, index, rowid);
-    SL3_step(mDeleteIncAttachments);
 
     return true;
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mDeleteIncProperties);
+    sqlite3_reset(mDeleteIncAlarms);
+    sqlite3_reset(mDeleteIncAttendees);
+    sqlite3_reset(mDeleteIncAttachments);
     return false;
 }
 
@@ -757,85 +1920,8 @@ bool SqliteFormat::Private::insertCustomproperty(int rowid, const QByteArray &ke
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
-    return false;
-}
-
-bool SqliteFormat::Private::insertRdates(const Incidence &incidence, int rowid)
-{
-    bool success = true;
-
-    int type = SqliteFormat::RDate;
-    DateList dateList = incidence.recurrence()->rDates();
-    DateList::ConstIterator dt;
-    for (dt = dateList.constBegin(); dt != dateList.constEnd(); ++dt) {
-        QDate date = *dt;
-        if (!insertRdate(rowid, type, date.startOfDay(), true)) {
-            qCWarning(lcMkcal) << "failed to modify rdates for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-
-    type = SqliteFormat::XDate;
-    dateList = incidence.recurrence()->exDates();
-    for (dt = dateList.constBegin(); dt != dateList.constEnd(); ++dt) {
-        QDate date = *dt;
-        if (!insertRdate(rowid, type,  date.startOfDay(), true)) {
-            qCWarning(lcMkcal) << "failed to modify xdates for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-
-    // Both for rDateTimes and exDateTimes, there are possible issues
-    // with all day events. KCalendarCore::Recurrence::timesInInterval()
-    // is returning repeating events in clock time for all day events,
-    // Thus being yyyy-mm-ddT00:00:00 and then "converted" to local
-    // zone, for display (meaning being after yyyy-mm-ddT00:00:00+xxxx).
-    // When saving, we don't want to store this local zone info, otherwise,
-    // the saved date-time won't match when read in another time zone.
-    type = SqliteFormat::RDateTime;
-    DateTimeList dateTimeList = incidence.recurrence()->rDateTimes();
-    DateTimeList::ConstIterator it;
-    for (it = dateTimeList.constBegin(); it != dateTimeList.constEnd(); ++it) {
-        bool allDay(incidence.allDay() && it->timeSpec() == Qt::LocalTime && it->time() == QTime(0,0));
-        if (!insertRdate(rowid, type, *it, allDay)) {
-            qCWarning(lcMkcal) << "failed to modify rdatetimes for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-
-    type = SqliteFormat::XDateTime;
-    dateTimeList = incidence.recurrence()->exDateTimes();
-    for (it = dateTimeList.constBegin(); it != dateTimeList.constEnd(); ++it) {
-        bool allDay(incidence.allDay() && it->timeSpec() == Qt::LocalTime && it->time() == QTime(0,0));
-        if (!insertRdate(rowid, type, *it, allDay)) {
-            qCWarning(lcMkcal) << "failed to modify xdatetimes for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-
-    return success;
-}
-
-bool SqliteFormat::Private::insertRdate(int rowid, int type, const QDateTime &date, bool allDay)
-{
-    int rv = 0;
-    int index = 1;
-
-    if (!mInsertIncRDates) {
-        const char *query = INSERT_RDATES;
-        int qsize = sizeof(INSERT_RDATES);
-        SL3_prepare_v2(mDatabase, query, qsize, &mInsertIncRDates, nullptr);
-    }
-    SL3_reset(mInsertIncRDates);
-    SL3_bind_int(mInsertIncRDates, index, rowid);
-    SL3_bind_int(mInsertIncRDates, index, type);
-    SL3_bind_date_time(mFormat, mInsertIncRDates, index, date, allDay);
-
-    SL3_step(mInsertIncRDates);
-    return true;
-
-error:
-    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mInsertIncProperties);
     return false;
 }
 
@@ -962,126 +2048,8 @@ bool SqliteFormat::Private::insertAlarm(int rowid, const Alarm &alarm)
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
-    return false;
-}
-
-bool SqliteFormat::Private::insertRecursives(const Incidence &incidence, int rowid)
-{
-    bool success = true;
-
-    const RecurrenceRule::List &listRR = incidence.recurrence()->rRules();
-    RecurrenceRule::List::ConstIterator it;
-    for (it = listRR.begin(); it != listRR.end(); ++it) {
-        if (!insertRecursive(rowid, *it, 1)) {
-            qCWarning(lcMkcal) << "failed to modify recursive for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-    const RecurrenceRule::List &listER = incidence.recurrence()->exRules();
-    for (it = listER.begin(); it != listER.end(); ++it) {
-        if (!insertRecursive(rowid, *it, 2)) {
-            qCWarning(lcMkcal) << "failed to modify recursive for incidence" << incidence.uid();
-            success = false;
-        }
-    }
-
-    return success;
-}
-
-bool SqliteFormat::Private::insertRecursive(int rowid, RecurrenceRule *rule, int type)
-{
-    int rv = 0;
-    int index = 1;
-
-    QByteArray bySeconds;
-    QByteArray byMinutes;
-    QByteArray byHours;
-    QByteArray byDays;
-    QByteArray byDayPoss;
-    QByteArray byMonthDays;
-    QByteArray byYearDays;
-    QByteArray byWeekNumbers;
-    QByteArray byMonths;
-    QByteArray bySetPos;
-
-    if (!mInsertIncRecursives) {
-        const char *query = INSERT_RECURSIVE;
-        int qsize = sizeof(INSERT_RECURSIVE);
-        SL3_prepare_v2(mDatabase, query, qsize, &mInsertIncRecursives, nullptr);
-    }
-    SL3_reset(mInsertIncRecursives);
-    SL3_bind_int(mInsertIncRecursives, index, rowid);
-
-    SL3_bind_int(mInsertIncRecursives, index, type);
-
-    SL3_bind_int(mInsertIncRecursives, index, (int)rule->recurrenceType()); // frequency
-
-    SL3_bind_date_time(mFormat, mInsertIncRecursives, index, rule->endDt(), rule->allDay());
-
-    SL3_bind_int(mInsertIncRecursives, index, rule->duration());  // count
-
-    SL3_bind_int(mInsertIncRecursives, index, (int)rule->frequency()); // interval
-
-#define writeSetByList( listname )                                      \
-    {                                                                   \
-        QString number;                                                 \
-        QStringList byL;                                                \
-        QList<int>::iterator i;                                         \
-        QList<int> byList;                                              \
-        byList = rule->listname();                                      \
-        byL.clear();                                                    \
-        for (i = byList.begin(); i != byList.end(); ++i) {              \
-            number.setNum(*i);                                          \
-            byL << number;                                              \
-        }                                                               \
-        listname = byL.join(" ").toUtf8();                              \
-        SL3_bind_text(mInsertIncRecursives, index, listname.constData(), listname.length(), SQLITE_STATIC); \
-    }
-
-    // BYSECOND, MINUTE and HOUR, MONTHDAY, YEARDAY, WEEKNUMBER, MONTH
-    // and SETPOS are standard int lists, so we can treat them with the
-    // same macro
-    writeSetByList(bySeconds);
-    writeSetByList(byMinutes);
-    writeSetByList(byHours);
-
-    // BYDAY is a special case, since it's not an int list
-    {
-        QString number;
-        QStringList byL;
-        QList<RecurrenceRule::WDayPos>::iterator j;
-        QList<RecurrenceRule::WDayPos> wdList = rule->byDays();
-        byL.clear();
-        for (j = wdList.begin(); j != wdList.end(); ++j) {
-            number.setNum((*j).day());
-            byL << number;
-        }
-        byDays =  byL.join(" ").toUtf8();
-        byL.clear();
-        for (j = wdList.begin(); j != wdList.end(); ++j) {
-            number.setNum((*j).pos());
-            byL << number;
-        }
-        byDayPoss =  byL.join(" ").toUtf8();
-    }
-    SL3_bind_text(mInsertIncRecursives, index, byDays.constData(), byDays.length(), SQLITE_STATIC);
-    SL3_bind_text(mInsertIncRecursives, index, byDayPoss.constData(), byDayPoss.length(), SQLITE_STATIC);
-
-    writeSetByList(byMonthDays);
-    writeSetByList(byYearDays);
-    writeSetByList(byWeekNumbers);
-    writeSetByList(byMonths);
-    writeSetByList(bySetPos);
-
-#undef writeSetByList
-
-    SL3_bind_int(mInsertIncRecursives, index, rule->weekStart());
-
-    SL3_step(mInsertIncRecursives);
-    return true;
-
-error:
-    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mInsertIncAlarms);
     return false;
 }
 
@@ -1155,6 +2123,8 @@ bool SqliteFormat::Private::insertAttendee(int rowid, const Attendee &attendee,
 
 error:
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mInsertIncAttendees);
     return false;
 }
 
@@ -1198,6 +2168,8 @@ bool SqliteFormat::Private::insertAttachments(const Incidence &incidence, int ro
 error:
     qCWarning(lcMkcal) << "cannot modify attachment for incidence" << incidence.instanceIdentifier();
     qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    // Clear the failure, so the statement can be used again.
+    sqlite3_reset(mInsertIncAttachments);
     return false;
 }
 
@@ -1221,13 +2193,13 @@ bool SqliteFormat::Private::deleteCalendarProperties(const QByteArray &id)
     int qsize = sizeof(DELETE_CALENDARPROPERTIES);
     sqlite3_stmt *stmt = NULL;
 
-    SL3_prepare_v2(mDatabase, query, qsize, &stmt, NULL);
+    SL3_acquire(mFormat, query, qsize, stmt);
     SL3_bind_text(stmt, index, id.constData(), id.length(), SQLITE_STATIC);
     SL3_step(stmt);
     success = true;
 
 error:
-    sqlite3_finalize(stmt);
+    mStatements.release(stmt);
 
     return success;
 }
@@ -1262,11 +2234,10 @@ error:
 static QDateTime getDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int index, bool *isDate = 0)
 {
     sqlite3_int64 date;
-    const QByteArray timezone((const char *)sqlite3_column_text(stmt, index + 2));
+    const int timezone = sqlite3_column_int(stmt, index + 2);
     QDateTime dateTime;
 
-    if (timezone.isEmpty()) {
-        // consider empty timezone as clock time
+    if (timezone == SqliteFormat::ClockTime) {
         date = sqlite3_column_int64(stmt, index + 1);
         if (date || sqlite3_column_int64(stmt, index)) {
             dateTime = format->fromOriginTime(date);
@@ -1275,7 +2246,7 @@ static QDateTime getDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int index
         if (isDate) {
             *isDate = false;
         }
-    } else if (timezone == QStringLiteral(FLOATING_DATE)) {
+    } else if (timezone == SqliteFormat::FloatingDate) {
         date = sqlite3_column_int64(stmt, index + 1);
         dateTime = format->fromOriginTime(date);
         dateTime.setTimeSpec(Qt::LocalTime);
@@ -1285,7 +2256,7 @@ static QDateTime getDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int index
         }
     } else {
         date = sqlite3_column_int64(stmt, index);
-        dateTime = format->fromOriginTime(date, timezone);
+        dateTime = format->fromOriginTime(date, format->timeZoneName(timezone));
         if (!dateTime.isValid()) {
             // timezone is specified but invalid?
             // fall back to local seconds from origin as clock time.
@@ -1299,245 +2270,461 @@ static QDateTime getDateTime(SqliteFormat *format, sqlite3_stmt *stmt, int index
     return dateTime;
 }
 
-Incidence::Ptr SqliteFormat::selectComponents(sqlite3_stmt *stmt1)
+//@cond PRIVATE
+Incidence::Ptr SqliteFormat::Private::selectComponent(sqlite3_stmt *stmt1, int *rowid, QString *attachments)
 {
-    int rv = 0;
     int index = 0;
     Incidence::Ptr incidence;
-    QString type;
-    QString timezone;
-    int rowid;
 
-    SL3_step(stmt1);
+    const int type = sqlite3_column_int(stmt1, 2);
+    if (type == Incidence::TypeEvent) {
+        // Set Event specific data.
+        Event::Ptr event = Event::Ptr(new Event());
+        event->setAllDay(false);
 
-    if (rv == SQLITE_ROW) {
+        bool startIsDate;
+        QDateTime start = getDateTime(mFormat, stmt1, 5, &startIsDate);
+        if (start.isValid()) {
+            event->setDtStart(start);
+        } else {
+            // start date time is mandatory in RFC5545 for VEVENTS.
+            event->setDtStart(mFormat->fromOriginTime(0));
+        }
 
-        QByteArray type((const char *)sqlite3_column_text(stmt1, 2));
-        if (type == "Event") {
-            // Set Event specific data.
-            Event::Ptr event = Event::Ptr(new Event());
-            event->setAllDay(false);
+        bool endIsDate;
+        QDateTime end = getDateTime(mFormat, stmt1, 9, &endIsDate);
+        if (startIsDate && (!end.isValid() || endIsDate)) {
+            event->setAllDay(true);
+            // Keep backward compatibility with already saved events with end + 1.
+            if (end.isValid()) {
+                end = end.addDays(-1);
+                if (end == start) {
+                    end = QDateTime();
+                }
+            }
+        }
+        if (end.isValid()) {
+            event->setDtEnd(end);
+        }
+        incidence = event;
+    } else if (type == Incidence::TypeTodo) {
+        // Set Todo specific data.
+        Todo::Ptr todo = Todo::Ptr(new Todo());
+        todo->setAllDay(false);
+
+        bool startIsDate;
+        QDateTime start = getDateTime(mFormat, stmt1, 5, &startIsDate);
+        if (start.isValid()) {
+            todo->setDtStart(start);
+        }
 
-            bool startIsDate;
-            QDateTime start = getDateTime(this, stmt1, 5, &startIsDate);
-            if (start.isValid()) {
-                event->setDtStart(start);
+        bool hasDueDate(sqlite3_column_int(stmt1, 8));
+        bool dueIsDate;
+        QDateTime due = getDateTime(mFormat, stmt1, 9, &dueIsDate);
+        if (due.isValid()) {
+            if (start.isValid() && due == start && !hasDueDate) {
+                due = QDateTime();
             } else {
-                // start date time is mandatory in RFC5545 for VEVENTS.
-                event->setDtStart(fromOriginTime(0));
+                todo->setDtDue(due, true);
             }
+        }
 
-            bool endIsDate;
-            QDateTime end = getDateTime(this, stmt1, 9, &endIsDate);
-            if (startIsDate && (!end.isValid() || endIsDate)) {
-                event->setAllDay(true);
-                // Keep backward compatibility with already saved events with end + 1.
-                if (end.isValid()) {
-                    end = end.addDays(-1);
-                    if (end == start) {
-                        end = QDateTime();
-                    }
-                }
-            }
-            if (end.isValid()) {
-                event->setDtEnd(end);
-            }
-            incidence = event;
-        } else if (type == "Todo") {
-            // Set Todo specific data.
-            Todo::Ptr todo = Todo::Ptr(new Todo());
-            todo->setAllDay(false);
+        if (startIsDate && (!due.isValid() || (dueIsDate && due > start))) {
+            todo->setAllDay(true);
+        }
+        incidence = todo;
+    } else if (type == Incidence::TypeJournal) {
+        // Set Journal specific data.
+        Journal::Ptr journal = Journal::Ptr(new Journal());
+
+        bool startIsDate;
+        QDateTime start = getDateTime(mFormat, stmt1, 5, &startIsDate);
+        journal->setDtStart(start);
+        journal->setAllDay(startIsDate);
+        incidence = journal;
+    }
 
-            bool startIsDate;
-            QDateTime start = getDateTime(this, stmt1, 5, &startIsDate);
-            if (start.isValid()) {
-                todo->setDtStart(start);
-            }
+    if (!incidence) {
+        return Incidence::Ptr();
+    }
 
-            bool hasDueDate(sqlite3_column_int(stmt1, 8));
-            bool dueIsDate;
-            QDateTime due = getDateTime(this, stmt1, 9, &dueIsDate);
-            if (due.isValid()) {
-                if (start.isValid() && due == start && !hasDueDate) {
-                    due = QDateTime();
-                } else {
-                    todo->setDtDue(due, true);
-                }
-            }
+    // Set common Incidence data.
+    *rowid = sqlite3_column_int(stmt1, index++);
 
-            if (startIsDate && (!due.isValid() || (dueIsDate && due > start))) {
-                todo->setAllDay(true);
-            }
-            incidence = todo;
-        } else if (type == "Journal") {
-            // Set Journal specific data.
-            Journal::Ptr journal = Journal::Ptr(new Journal());
+    index++;
 
-            bool startIsDate;
-            QDateTime start = getDateTime(this, stmt1, 5, &startIsDate);
-            journal->setDtStart(start);
-            journal->setAllDay(startIsDate);
-            incidence = journal;
-        }
+    incidence->setSummary(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
 
-        if (!incidence) {
-            return Incidence::Ptr();
+    incidence->setCategories(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+
+    index++;
+    index++;
+    index++;
+    index++;
+    index++;
+    index++;
+    index++;
+
+    int duration = sqlite3_column_int(stmt1, index++);
+    if (duration != 0) {
+        incidence->setDuration(Duration(duration, Duration::Seconds));
+    }
+    incidence->setSecrecy(
+        (Incidence::Secrecy)sqlite3_column_int(stmt1, index++));
+
+    incidence->setLocation(
+        QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+
+    incidence->setDescription(
+        QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+
+    incidence->setStatus(
+        (Incidence::Status)sqlite3_column_int(stmt1, index++));
+
+    incidence->setGeoLatitude(sqlite3_column_double(stmt1, index++));
+    incidence->setGeoLongitude(sqlite3_column_double(stmt1, index++));
+
+    incidence->setPriority(sqlite3_column_int(stmt1, index++));
+
+    QString Resources = QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++));
+    incidence->setResources(Resources.split(' '));
+
+    incidence->setCreated(mFormat->fromOriginTime(
+                              sqlite3_column_int64(stmt1, index++)));
+
+    QDateTime dtstamp = mFormat->fromOriginTime(sqlite3_column_int64(stmt1, index++));
+
+    incidence->setLastModified(
+        mFormat->fromOriginTime(sqlite3_column_int64(stmt1, index++)));
+
+    incidence->setRevision(sqlite3_column_int(stmt1, index++));
+
+    QString Comment = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
+    if (!Comment.isEmpty()) {
+        QStringList CommL = Comment.split(' ');
+        for (QStringList::Iterator it = CommL.begin(); it != CommL.end(); ++it) {
+            incidence->addComment(*it);
         }
+    }
+
+    // Old way to store attachment, deprecated.
+    *attachments = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
+
+    incidence->addContact(
+        QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++)));
+
+    //Invitation status (removed but still on DB)
+    ++index;
+
+    QDateTime rid = getDateTime(mFormat, stmt1, index);
+    if (rid.isValid()) {
+        incidence->setRecurrenceId(rid);
+    } else {
+        incidence->setRecurrenceId(QDateTime());
+    }
+    index += 3;
+
+    QString relatedtouid = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
+    incidence->setRelatedTo(relatedtouid);
+
+    QUrl url(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+    if (url.isValid()) {
+        incidence->setUrl(url);
+    }
+
+    // set the real uid to uid
+    incidence->setUid(QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++)));
+
+    if (incidence->type() == Incidence::TypeEvent) {
+        Event::Ptr event = incidence.staticCast<Event>();
+        int transparency = sqlite3_column_int(stmt1, index);
+        event->setTransparency((Event::Transparency) transparency);
+    }
+
+    index++;
 
-        // Set common Incidence data.
-        rowid = sqlite3_column_int(stmt1, index++);
+    incidence->setLocalOnly(sqlite3_column_int(stmt1, index++)); //LocalOnly
 
-        index++;
+    if (incidence->type() == Incidence::TypeTodo) {
+        Todo::Ptr todo = incidence.staticCast<Todo>();
+        todo->setPercentComplete(sqlite3_column_int(stmt1, index++));
+        QDateTime completed = getDateTime(mFormat, stmt1, index);
+        if (completed.isValid())
+            todo->setCompleted(completed);
+        index += 3;
+    } else {
+        index += 4;
+    }
+
+    index++; //DateDeleted
 
-        incidence->setSummary(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+    QString colorstr = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
+    if (!colorstr.isEmpty()) {
+        incidence->setColor(colorstr);
+    }
+
+    index++; // extra2
+    index++; // extra3
+    incidence->setThisAndFuture(sqlite3_column_int(stmt1, index++));
+    index++; // RecurrenceEnd
 
-        incidence->setCategories(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+    if (sqlite3_column_type(stmt1, index) == SQLITE_BLOB) {
+        const char *blob = static_cast<const char *>(sqlite3_column_blob(stmt1, index));
+        const QByteArray data(QByteArray::fromRawData(blob, sqlite3_column_bytes(stmt1, index)));
+        if (!decodeRecurrence(mFormat, data, incidence)) {
+            qCWarning(lcMkcal) << "cannot decode recurrence of incidence" << incidence->uid();
+        }
+    }
 
-        index++;
-        index++;
-        index++;
-        index++;
-        index++;
-        index++;
-        index++;
+    return incidence;
+}
 
-        int duration = sqlite3_column_int(stmt1, index++);
-        if (duration != 0) {
-            incidence->setDuration(Duration(duration, Duration::Seconds));
+static void addDeprecatedAttachments(const Incidence::Ptr &incidence, const QString &attachments)
+{
+    // Backward compatibility with the old attachment storage.
+    if (!attachments.isEmpty() && incidence->attachments().isEmpty()) {
+        QStringList AttL = attachments.split(' ');
+        for (QStringList::Iterator it = AttL.begin(); it != AttL.end(); ++it) {
+            incidence->addAttachment(Attachment(*it));
         }
-        incidence->setSecrecy(
-            (Incidence::Secrecy)sqlite3_column_int(stmt1, index++));
+    }
+}
+//@endcond
+
+Incidence::Ptr SqliteFormat::selectComponents(sqlite3_stmt *stmt1)
+{
+    int rv = 0;
+    Incidence::Ptr incidence;
+    QString attachments;
+    int rowid;
 
-        incidence->setLocation(
-            QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+    SL3_step(stmt1);
+
+    if (rv == SQLITE_ROW) {
+        incidence = d->selectComponent(stmt1, &rowid, &attachments);
+        if (!incidence) {
+            return Incidence::Ptr();
+        }
 
-        incidence->setDescription(
-            QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
+        if (!d->selectCustomproperties(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to get customproperties for incidence" << incidence->uid();
+        }
+        if (!d->selectAttendees(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to get attendees for incidence" << incidence->uid();
+        }
+        if (!d->selectAlarms(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to get alarms for incidence" << incidence->uid();
+        }
+        if (!d->selectAttachments(incidence, rowid)) {
+            qCWarning(lcMkcal) << "failed to get attachments for incidence" << incidence->uid();
+        }
 
-        incidence->setStatus(
-            (Incidence::Status)sqlite3_column_int(stmt1, index++));
+        addDeprecatedAttachments(incidence, attachments);
+    }
 
-        incidence->setGeoLatitude(sqlite3_column_double(stmt1, index++));
-        incidence->setGeoLongitude(sqlite3_column_double(stmt1, index++));
+error:
+    return incidence;
+}
 
-        incidence->setPriority(sqlite3_column_int(stmt1, index++));
+int SqliteFormat::selectComponents(sqlite3_stmt *stmt1, Incidence::List *list, int max,
+                                   ExtendedStorage::DeferredParts deferred,
+                                   int *lastRowId)
+{
+    int rv = 0;
+    int count = 0;
+    QHash<int, Incidence::Ptr> incidences;
+    QHash<int, QString> attachments;
 
-        QString Resources = QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++));
-        incidence->setResources(Resources.split(' '));
+    if (!list || !d->clearSelection()) {
+        return -1;
+    }
 
-        incidence->setCreated(fromOriginTime(
-                                  sqlite3_column_int64(stmt1, index++)));
+    while (max <= 0 || count < max) {
+        SL3_step(stmt1);
+        if (rv != SQLITE_ROW) {
+            break;
+        }
+        count += 1;
+        if (lastRowId) {
+            *lastRowId = sqlite3_column_int(stmt1, 0);
+        }
 
-        QDateTime dtstamp = fromOriginTime(sqlite3_column_int64(stmt1, index++));
+        int rowid;
+        QString deprecated;
+        Incidence::Ptr incidence = d->selectComponent(stmt1, &rowid, &deprecated);
+        if (!incidence) {
+            continue;
+        }
+        if (!d->addToSelection(rowid)) {
+            return -1;
+        }
+        incidences.insert(rowid, incidence);
+        if (!deprecated.isEmpty()) {
+            attachments.insert(rowid, deprecated);
+        }
+        list->append(incidence);
+    }
 
-        incidence->setLastModified(
-            fromOriginTime(sqlite3_column_int64(stmt1, index++)));
+    if (incidences.isEmpty()) {
+        return count;
+    }
 
-        incidence->setRevision(sqlite3_column_int(stmt1, index++));
+    if (!d->selectBySelection(&d->mSelectSelProperties, SELECT_CUSTOMPROPERTIES_BY_SELECTION,
+                              sizeof(SELECT_CUSTOMPROPERTIES_BY_SELECTION),
+                              &SqliteFormat::Private::readCustomproperty, incidences)) {
+        qCWarning(lcMkcal) << "failed to get customproperties for selection";
+    }
+    if (deferred.testFlag(ExtendedStorage::AttendeesPart)) {
+        if (!d->selectBySelection(&d->mSelectSelOrganizers, SELECT_ORGANIZER_BY_SELECTION,
+                                  sizeof(SELECT_ORGANIZER_BY_SELECTION),
+                                  &SqliteFormat::Private::readAttendee, incidences)) {
+            qCWarning(lcMkcal) << "failed to get organizers for selection";
+        }
+    } else if (!d->selectBySelection(&d->mSelectSelAttendees, SELECT_ATTENDEE_BY_SELECTION,
+                                     sizeof(SELECT_ATTENDEE_BY_SELECTION),
+                                     &SqliteFormat::Private::readAttendee, incidences)) {
+        qCWarning(lcMkcal) << "failed to get attendees for selection";
+    }
+    if (!d->selectBySelection(&d->mSelectSelAlarms, SELECT_ALARM_BY_SELECTION,
+                              sizeof(SELECT_ALARM_BY_SELECTION),
+                              &SqliteFormat::Private::readAlarm, incidences)) {
+        qCWarning(lcMkcal) << "failed to get alarms for selection";
+    }
+    if (!deferred.testFlag(ExtendedStorage::AttachmentsPart)) {
+        if (!d->selectBySelection(&d->mSelectSelAttachments, SELECT_ATTACHMENTS_BY_SELECTION,
+                                  sizeof(SELECT_ATTACHMENTS_BY_SELECTION),
+                                  &SqliteFormat::Private::readAttachment, incidences)) {
+            qCWarning(lcMkcal) << "failed to get attachments for selection";
+        }
 
-        QString Comment = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
-        if (!Comment.isEmpty()) {
-            QStringList CommL = Comment.split(' ');
-            for (QStringList::Iterator it = CommL.begin(); it != CommL.end(); ++it) {
-                incidence->addComment(*it);
-            }
+        for (QHash<int, QString>::ConstIterator it = attachments.constBegin();
+             it != attachments.constEnd(); ++it) {
+            addDeprecatedAttachments(incidences.value(it.key()), it.value());
         }
+    }
 
-        // Old way to store attachment, deprecated.
-        QString Att = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
+    return count;
 
-        incidence->addContact(
-            QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++)));
+error:
+    return -1;
+}
 
-        //Invitation status (removed but still on DB)
-        ++index;
+bool SqliteFormat::selectParts(const Incidence::Ptr &incidence,
+                               ExtendedStorage::DeferredParts parts)
+{
+    QString deprecated;
+    int rowid = d->selectRowId(incidence->uid(), incidence->recurrenceId(), &deprecated);
+    if (!rowid) {
+        qCWarning(lcMkcal) << "failed to select rowid of incidence" << incidence->uid() << incidence->recurrenceId();
+        return false;
+    }
 
-        QDateTime rid = getDateTime(this, stmt1, index);
-        if (rid.isValid()) {
-            incidence->setRecurrenceId(rid);
-        } else {
-            incidence->setRecurrenceId(QDateTime());
+    // Read the stored parts aside, to merge them with the
+    // ones that may have been added since the load.
+    Incidence::Ptr stored(new Event);
+    if (parts.testFlag(ExtendedStorage::AttendeesPart)) {
+        if (!d->selectAttendees(stored, rowid)) {
+            qCWarning(lcMkcal) << "failed to get attendees for incidence" << incidence->uid();
+            return false;
+        }
+        const Attendee::List attendees = incidence->attendees();
+        for (const Attendee &attendee : stored->attendees()) {
+            if (!attendees.contains(attendee)) {
+                incidence->addAttendee(attendee, false);
+            }
         }
-        index += 3;
-
-        QString relatedtouid = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
-        incidence->setRelatedTo(relatedtouid);
-
-        QUrl url(QString::fromUtf8((const char *)sqlite3_column_text(stmt1, index++)));
-        if (url.isValid()) {
-            incidence->setUrl(url);
+    }
+    if (parts.testFlag(ExtendedStorage::AttachmentsPart)) {
+        if (!d->selectAttachments(stored, rowid)) {
+            qCWarning(lcMkcal) << "failed to get attachments for incidence" << incidence->uid();
+            return false;
+        }
+        addDeprecatedAttachments(stored, deprecated);
+        const Attachment::List attachments = incidence->attachments();
+        for (const Attachment &attachment : stored->attachments()) {
+            if (!attachments.contains(attachment)) {
+                incidence->addAttachment(attachment);
+            }
         }
+    }
 
-        // set the real uid to uid
-        incidence->setUid(QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++)));
+    return true;
+}
 
-        if (incidence->type() == Incidence::TypeEvent) {
-            Event::Ptr event = incidence.staticCast<Event>();
-            int transparency = sqlite3_column_int(stmt1, index);
-            event->setTransparency((Event::Transparency) transparency);
-        }
+bool SqliteFormat::selectHeaders(sqlite3_stmt *stmt, IncidenceHeader::List *list)
+{
+    int rv = 0;
 
-        index++;
+    if (!list) {
+        return false;
+    }
 
-        incidence->setLocalOnly(sqlite3_column_int(stmt1, index++)); //LocalOnly
+    do {
+        SL3_step(stmt);
 
-        if (incidence->type() == Incidence::TypeTodo) {
-            Todo::Ptr todo = incidence.staticCast<Todo>();
-            todo->setPercentComplete(sqlite3_column_int(stmt1, index++));
-            QDateTime completed = getDateTime(this, stmt1, index);
-            if (completed.isValid())
-                todo->setCompleted(completed);
-            index += 3;
-        } else {
-            index += 4;
-        }
+        if (rv == SQLITE_ROW) {
+            IncidenceHeader header;
 
-        index++; //DateDeleted
+            header.type = Incidence::IncidenceType(sqlite3_column_int(stmt, 0));
+            if (header.type != Incidence::TypeEvent
+                && header.type != Incidence::TypeTodo
+                && header.type != Incidence::TypeJournal) {
+                continue;
+            }
+            header.uid = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 1));
+            header.recurrenceId = getDateTime(this, stmt, 2);
+            header.summary = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 5));
 
-        QString colorstr = QString::fromUtf8((const char *) sqlite3_column_text(stmt1, index++));
-        if (!colorstr.isEmpty()) {
-            incidence->setColor(colorstr);
-        }
+            // Same start and end conventions as in selectComponents().
+            bool startIsDate;
+            header.dtStart = getDateTime(this, stmt, 6, &startIsDate);
+            bool endIsDate;
+            QDateTime end = getDateTime(this, stmt, 10, &endIsDate);
+            if (header.type == Incidence::TypeEvent) {
+                if (!header.dtStart.isValid()) {
+                    header.dtStart = fromOriginTime(0);
+                }
+                if (startIsDate && (!end.isValid() || endIsDate)) {
+                    header.allDay = true;
+                    if (end.isValid()) {
+                        end = end.addDays(-1);
+                        if (end == header.dtStart) {
+                            end = QDateTime();
+                        }
+                    }
+                }
+                header.dtEnd = end;
+            } else if (header.type == Incidence::TypeTodo) {
+                bool hasDueDate(sqlite3_column_int(stmt, 9));
+                if (end.isValid() && header.dtStart.isValid()
+                    && end == header.dtStart && !hasDueDate) {
+                    end = QDateTime();
+                }
+                header.dtEnd = end;
+                header.allDay = startIsDate
+                    && (!end.isValid() || (endIsDate && end > header.dtStart));
+            } else {
+                header.allDay = startIsDate;
+            }
 
-        index++; // extra2
-        index++; // extra3
-        incidence->setThisAndFuture(sqlite3_column_int(stmt1, index++));
+            header.color = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 13));
+            header.hasAlarms = sqlite3_column_int(stmt, 14);
+            header.recurs = sqlite3_column_int(stmt, 15);
 
-        if (!d->selectCustomproperties(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get customproperties for incidence" << incidence->uid();
-        }
-        if (!d->selectAttendees(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get attendees for incidence" << incidence->uid();
-        }
-        if (!d->selectAlarms(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get alarms for incidence" << incidence->uid();
-        }
-        if (!d->selectRecursives(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get recursive for incidence" << incidence->uid();
-        }
-        if (!d->selectRdates(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get rdates for incidence" << incidence->uid();
-        }
-        if (!d->selectAttachments(incidence, rowid)) {
-            qCWarning(lcMkcal) << "failed to get attachments for incidence" << incidence->uid();
+            list->append(header);
         }
+    } while (rv != SQLITE_DONE);
 
-        // Backward compatibility with the old attachment storage.
-        if (!Att.isEmpty() && incidence->attachments().isEmpty()) {
-            QStringList AttL = Att.split(' ');
-            for (QStringList::Iterator it = AttL.begin(); it != AttL.end(); ++it) {
-                incidence->addAttachment(Attachment(*it));
-            }
-        }
-    }
+    return true;
 
 error:
-    return incidence;
+    return false;
 }
 
 //@cond PRIVATE
 int SqliteFormat::Private::selectRowId(const QString &uid,
-                                       const QDateTime &recId)
+                                       const QDateTime &recId,
+                                       QString *attachments)
 {
     int rv = 0;
     int index = 1;
@@ -1548,10 +2735,10 @@ int SqliteFormat::Private::selectRowId(const QString &uid,
     const QByteArray u = uid.toUtf8();
     int rowid = 0;
 
-    query = SELECT_ROWID_FROM_COMPONENTS_BY_NOTEBOOK_UID_AND_RECURID;
-    qsize = sizeof(SELECT_ROWID_FROM_COMPONENTS_BY_NOTEBOOK_UID_AND_RECURID);
+    query = SELECT_ROWID_FROM_COMPONENTS_BY_UID_AND_RECURID;
+    qsize = sizeof(SELECT_ROWID_FROM_COMPONENTS_BY_UID_AND_RECURID);
 
-    SL3_prepare_v2(mDatabase, query, qsize, &stmt, NULL);
+    SL3_acquire(mFormat, query, qsize, stmt);
     SL3_bind_text(stmt, index, u.constData(), u.length(), SQLITE_STATIC);
     if (recId.isValid()) {
         qint64 secsRecurId;
@@ -1569,15 +2756,138 @@ int SqliteFormat::Private::selectRowId(const QString &uid,
 
     if (rv == SQLITE_ROW) {
         rowid = sqlite3_column_int(stmt, 0);
+        if (attachments) {
+            *attachments = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 1));
+        }
     }
 
 error:
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    mStatements.release(stmt);
 
     return rowid;
 }
 
+bool SqliteFormat::Private::clearSelection()
+{
+    int rv = 0;
+
+    if (!mInsertSelection) {
+        char *errmsg = NULL;
+        const char *query = CREATE_TEMP_SELECTION;
+        SL3_exec(mDatabase);
+
+        query = INSERT_TEMP_SELECTION;
+        int qsize = sizeof(INSERT_TEMP_SELECTION);
+        SL3_prepare_v2(mDatabase, query, qsize, &mInsertSelection, nullptr);
+    }
+    if (!mDeleteSelection) {
+        const char *query = DELETE_TEMP_SELECTION;
+        int qsize = sizeof(DELETE_TEMP_SELECTION);
+        SL3_prepare_v2(mDatabase, query, qsize, &mDeleteSelection, nullptr);
+    }
+
+    SL3_reset(mDeleteSelection);
+    SL3_step(mDeleteSelection);
+
+    return true;
+
+error:
+    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    return false;
+}
+
+bool SqliteFormat::Private::addToSelection(int rowid)
+{
+    int rv = 0;
+    int index = 1;
+
+    SL3_reset(mInsertSelection);
+    SL3_bind_int(mInsertSelection, index, rowid);
+    SL3_step(mInsertSelection);
+
+    return true;
+
+error:
+    qCWarning(lcMkcal) << "Sqlite error:" << sqlite3_errmsg(mDatabase);
+    return false;
+}
+
+// Delete the selected components and their child rows, one
+// statement per table, returning the number of deleted components.
+int SqliteFormat::Private::purgeSelection()
+{
+    static const struct {
+        const char *query;
+        int qsize;
+    } purges[] = {
+        {DELETE_CUSTOMPROPERTIES_BY_SELECTION, sizeof(DELETE_CUSTOMPROPERTIES_BY_SELECTION)},
+        {DELETE_ALARM_BY_SELECTION, sizeof(DELETE_ALARM_BY_SELECTION)},
+        {DELETE_ATTENDEE_BY_SELECTION, sizeof(DELETE_ATTENDEE_BY_SELECTION)},
+        {DELETE_ATTACHMENTS_BY_SELECTION, sizeof(DELETE_ATTACHMENTS_BY_SELECTION)},
+        {DELETE_RDATES_BY_SELECTION, sizeof(DELETE_RDATES_BY_SELECTION)},
+        {DELETE_RECURSIVE_BY_SELECTION, sizeof(DELETE_RECURSIVE_BY_SELECTION)},
+        {DELETE_COMPONENTS_BY_SELECTION, sizeof(DELETE_COMPONENTS_BY_SELECTION)}
+    };
+    int rv = 0;
+    int count = -1;
+    sqlite3_stmt *stmt = nullptr;
+
+    for (const auto &purge : purges) {
+        SL3_acquire(mFormat, purge.query, purge.qsize, stmt);
+        SL3_step(stmt);
+        mStatements.release(stmt);
+        stmt = nullptr;
+    }
+    // The last statement purged the Components table.
+    count = sqlite3_changes(mDatabase);
+
+    if (!clearSelection()) {
+        count = -1;
+    }
+
+error:
+    mStatements.release(stmt);
+
+    return count;
+}
+
+bool SqliteFormat::Private::selectBySelection(sqlite3_stmt **stmt, const char *query, int qsize,
+                                              RowReader reader, QHash<int, Incidence::Ptr> &incidences)
+{
+    int rv = 0;
+
+    if (!*stmt) {
+        SL3_prepare_v2(mDatabase, query, qsize, stmt, nullptr);
+    }
+
+    // Rows are sorted by ComponentId, so consecutive rows usually
+    // belong to the same incidence.
+    {
+        int rowid = 0;
+        QHash<int, Incidence::Ptr>::Iterator it = incidences.end();
+        SL3_reset(*stmt);
+        do {
+            SL3_step(*stmt);
+
+            if (rv == SQLITE_ROW) {
+                int id = sqlite3_column_int(*stmt, 0);
+                if (id != rowid || it == incidences.end()) {
+                    rowid = id;
+                    it = incidences.find(rowid);
+                }
+                if (it != incidences.end()) {
+                    (this->*reader)(it.value(), *stmt);
+                }
+            }
+        } while (rv != SQLITE_DONE);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
 bool SqliteFormat::Private::selectCustomproperties(Incidence::Ptr &incidence, int rowid)
 {
     int rv = 0;
@@ -1595,11 +2905,7 @@ bool SqliteFormat::Private::selectCustomproperties(Incidence::Ptr &incidence, in
         SL3_step(mSelectIncProperties);
 
         if (rv == SQLITE_ROW) {
-            // Set Incidence data customproperties
-            const QByteArray &name = (const char *)sqlite3_column_text(mSelectIncProperties, 1);
-            const QString &value = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncProperties, 2));
-            const QString &parameters = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncProperties, 3));
-            incidence->setNonKDECustomProperty(name, value, parameters);
+            readCustomproperty(incidence, mSelectIncProperties);
         }
 
     } while (rv != SQLITE_DONE);
@@ -1610,12 +2916,19 @@ error:
     return false;
 }
 
+void SqliteFormat::Private::readCustomproperty(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    // Set Incidence data customproperties
+    const QByteArray &name = (const char *)sqlite3_column_text(stmt, 1);
+    const QString &value = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 2));
+    const QString &parameters = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 3));
+    incidence->setNonKDECustomProperty(name, value, parameters);
+}
+
 bool SqliteFormat::Private::selectRdates(Incidence::Ptr &incidence, int rowid)
 {
     int rv = 0;
     int index = 1;
-    QString   timezone;
-    QDateTime kdt;
 
     if (!mSelectIncRDates) {
         const char *query = SELECT_RDATES_BY_ID;
@@ -1629,22 +2942,7 @@ bool SqliteFormat::Private::selectRdates(Incidence::Ptr &incidence, int rowid)
         SL3_step(mSelectIncRDates);
 
         if (rv == SQLITE_ROW) {
-            // Set Incidence data rdates
-            int type = sqlite3_column_int(mSelectIncRDates, 1);
-            kdt = getDateTime(mFormat, mSelectIncRDates, 2);
-            if (kdt.isValid()) {
-                if (type == SqliteFormat::RDate || type == SqliteFormat::XDate) {
-                    if (type == SqliteFormat::RDate)
-                        incidence->recurrence()->addRDate(kdt.date());
-                    else
-                        incidence->recurrence()->addExDate(kdt.date());
-                } else {
-                    if (type == SqliteFormat::RDateTime)
-                        incidence->recurrence()->addRDateTime(kdt);
-                    else
-                        incidence->recurrence()->addExDateTime(kdt);
-                }
-            }
+            readRdate(incidence, mSelectIncRDates);
         }
 
     } while (rv != SQLITE_DONE);
@@ -1655,13 +2953,30 @@ error:
     return false;
 }
 
+void SqliteFormat::Private::readRdate(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    // Set Incidence data rdates
+    int type = sqlite3_column_int(stmt, 1);
+    QDateTime kdt = getDateTime(mFormat, stmt, 2);
+    if (kdt.isValid()) {
+        if (type == SqliteFormat::RDate || type == SqliteFormat::XDate) {
+            if (type == SqliteFormat::RDate)
+                incidence->recurrence()->addRDate(kdt.date());
+            else
+                incidence->recurrence()->addExDate(kdt.date());
+        } else {
+            if (type == SqliteFormat::RDateTime)
+                incidence->recurrence()->addRDateTime(kdt);
+            else
+                incidence->recurrence()->addExDateTime(kdt);
+        }
+    }
+}
+
 bool SqliteFormat::Private::selectRecursives(Incidence::Ptr &incidence, int rowid)
 {
     int  rv = 0;
     int  index = 1;
-    QString   timezone;
-    QDateTime kdt;
-    QDateTime dt;
 
     if (!mSelectIncRecursives) {
         const char *query = SELECT_RECURSIVE_BY_ID;
@@ -1675,80 +2990,93 @@ bool SqliteFormat::Private::selectRecursives(Incidence::Ptr &incidence, int rowi
         SL3_step(mSelectIncRecursives);
 
         if (rv == SQLITE_ROW) {
-            // Set Incidence data from recursive
-
-            // all BY*
-            QList<int> byList;
-            QList<int> byList2;
-            QStringList byL;
-            QStringList byL2;
-            QString by;
-            QString by2;
-            RecurrenceRule *recurrule = new RecurrenceRule();
-
-            if (incidence->dtStart().isValid())
-                recurrule->setStartDt(incidence->dtStart());
-            else {
-                if (incidence->type() == Incidence::TypeTodo) {
-                    Todo::Ptr todo = incidence.staticCast<Todo>();
-                    recurrule->setStartDt(todo->dtDue(true));
-                }
-            }
+            readRecursive(incidence, mSelectIncRecursives);
+        }
 
-            // Generate the RRULE string
-            if (sqlite3_column_int(mSelectIncRecursives, 1) == 1)   // ruletype
-                recurrule->setRRule(QString("RRULE"));
-            else
-                recurrule->setRRule(QString("EXRULE"));
-
-            switch (sqlite3_column_int(mSelectIncRecursives, 2)) {    // frequency
-            case 1:
-                recurrule->setRecurrenceType(RecurrenceRule::rSecondly);
-                break;
-            case 2:
-                recurrule->setRecurrenceType(RecurrenceRule::rMinutely);
-                break;
-            case 3:
-                recurrule->setRecurrenceType(RecurrenceRule::rHourly);
-                break;
-            case 4:
-                recurrule->setRecurrenceType(RecurrenceRule::rDaily);
-                break;
-            case 5:
-                recurrule->setRecurrenceType(RecurrenceRule::rWeekly);
-                break;
-            case 6:
-                recurrule->setRecurrenceType(RecurrenceRule::rMonthly);
-                break;
-            case 7:
-                recurrule->setRecurrenceType(RecurrenceRule::rYearly);
-                break;
-            default:
-                recurrule->setRecurrenceType(RecurrenceRule::rNone);
-            }
+    } while (rv != SQLITE_DONE);
 
-            // Duration & End Date
-            bool isAllDay;
-            QDateTime until = getDateTime(mFormat, mSelectIncRecursives, 3, &isAllDay);
-            recurrule->setEndDt(until);
-            incidence->recurrence()->setAllDay(until.isValid() ? isAllDay : incidence->allDay());
-
-            int duration = sqlite3_column_int(mSelectIncRecursives, 6);  // count
-            if (duration == 0 && !recurrule->endDt().isValid()) {
-                duration = -1; // work around invalid recurrence state: recurring infinitely but having invalid end date
-            } else if (duration > 0) {
-                // Ensure that no endDt is saved if duration is provided.
-                // This guarantees that the operator== returns true for
-                // rRule(withDuration) == savedRRule(withDuration)
-                recurrule->setEndDt(QDateTime());
-            }
-            recurrule->setDuration(duration);
-            // Frequency
-            recurrule->setFrequency(sqlite3_column_int(mSelectIncRecursives, 7)); // interval-field
+    return true;
+
+error:
+    return false;
+}
+
+void SqliteFormat::Private::readRecursive(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    // Set Incidence data from recursive
+
+    // all BY*
+    QList<int> byList;
+    QList<int> byList2;
+    QStringList byL;
+    QStringList byL2;
+    QString by;
+    QString by2;
+    RecurrenceRule *recurrule = new RecurrenceRule();
+
+    if (incidence->dtStart().isValid())
+        recurrule->setStartDt(incidence->dtStart());
+    else {
+        if (incidence->type() == Incidence::TypeTodo) {
+            Todo::Ptr todo = incidence.staticCast<Todo>();
+            recurrule->setStartDt(todo->dtDue(true));
+        }
+    }
+
+    // Generate the RRULE string
+    if (sqlite3_column_int(stmt, 1) == 1)   // ruletype
+        recurrule->setRRule(QString("RRULE"));
+    else
+        recurrule->setRRule(QString("EXRULE"));
+
+    switch (sqlite3_column_int(stmt, 2)) {    // frequency
+    case 1:
+        recurrule->setRecurrenceType(RecurrenceRule::rSecondly);
+        break;
+    case 2:
+        recurrule->setRecurrenceType(RecurrenceRule::rMinutely);
+        break;
+    case 3:
+        recurrule->setRecurrenceType(RecurrenceRule::rHourly);
+        break;
+    case 4:
+        recurrule->setRecurrenceType(RecurrenceRule::rDaily);
+        break;
+    case 5:
+        recurrule->setRecurrenceType(RecurrenceRule::rWeekly);
+        break;
+    case 6:
+        recurrule->setRecurrenceType(RecurrenceRule::rMonthly);
+        break;
+    case 7:
+        recurrule->setRecurrenceType(RecurrenceRule::rYearly);
+        break;
+    default:
+        recurrule->setRecurrenceType(RecurrenceRule::rNone);
+    }
+
+    // Duration & End Date
+    bool isAllDay;
+    QDateTime until = getDateTime(mFormat, stmt, 3, &isAllDay);
+    recurrule->setEndDt(until);
+    incidence->recurrence()->setAllDay(until.isValid() ? isAllDay : incidence->allDay());
+
+    int duration = sqlite3_column_int(stmt, 6);  // count
+    if (duration == 0 && !recurrule->endDt().isValid()) {
+        duration = -1; // work around invalid recurrence state: recurring infinitely but having invalid end date
+    } else if (duration > 0) {
+        // Ensure that no endDt is saved if duration is provided.
+        // This guarantees that the operator== returns true for
+        // rRule(withDuration) == savedRRule(withDuration)
+        recurrule->setEndDt(QDateTime());
+    }
+    recurrule->setDuration(duration);
+    // Frequency
+    recurrule->setFrequency(sqlite3_column_int(stmt, 7)); // interval-field
 
 
 #define readSetByList( field, setfunc )                 \
-      by = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncRecursives, field)); \
+      by = QString::fromUtf8((const char *)sqlite3_column_text(stmt, field)); \
       if (!by.isEmpty()) {                      \
         byList.clear();                         \
         byL = by.split(' ');                        \
@@ -1758,70 +3086,58 @@ bool SqliteFormat::Private::selectRecursives(Incidence::Ptr &incidence, int rowi
           recurrule->setfunc(byList);                   \
       }
 
-            // BYSECOND, MINUTE and HOUR, MONTHDAY, YEARDAY, WEEKNUMBER, MONTH
-            // and SETPOS are standard int lists, so we can treat them with the
-            // same macro
-            readSetByList(8, setBySeconds);
-            readSetByList(9, setByMinutes);
-            readSetByList(10, setByHours);
-            readSetByList(13, setByMonthDays);
-            readSetByList(14, setByYearDays);
-            readSetByList(15, setByWeekNumbers);
-            readSetByList(16, setByMonths);
-            readSetByList(17, setBySetPos);
+    // BYSECOND, MINUTE and HOUR, MONTHDAY, YEARDAY, WEEKNUMBER, MONTH
+    // and SETPOS are standard int lists, so we can treat them with the
+    // same macro
+    readSetByList(8, setBySeconds);
+    readSetByList(9, setByMinutes);
+    readSetByList(10, setByHours);
+    readSetByList(13, setByMonthDays);
+    readSetByList(14, setByYearDays);
+    readSetByList(15, setByWeekNumbers);
+    readSetByList(16, setByMonths);
+    readSetByList(17, setBySetPos);
 
 #undef readSetByList
 
-            // BYDAY is a special case, since it's not an int list
-            QList<RecurrenceRule::WDayPos> wdList;
-            RecurrenceRule::WDayPos pos;
-            wdList.clear();
-            byList.clear();
-            by = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncRecursives, 11));
-            by2 = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncRecursives, 12));
-            if (!by.isEmpty()) {
-                byL = by.split(' ');
-                if (!by2.isEmpty())
-                    byL2 = by2.split(' ');
-                for (int i = 0; i < byL.size(); ++i) {
-                    if (!by2.isEmpty()) {
-                        pos.setDay(byL.at(i).toInt());
-                        pos.setPos(byL2.at(i).toInt());
-                        wdList.append(pos);
-                    } else {
-                        pos.setDay(byL.at(i).toInt());
-                        wdList.append(pos);
-                    }
-                }
-                if (!wdList.isEmpty())
-                    recurrule->setByDays(wdList);
+    // BYDAY is a special case, since it's not an int list
+    QList<RecurrenceRule::WDayPos> wdList;
+    RecurrenceRule::WDayPos pos;
+    wdList.clear();
+    byList.clear();
+    by = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 11));
+    by2 = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 12));
+    if (!by.isEmpty()) {
+        byL = by.split(' ');
+        if (!by2.isEmpty())
+            byL2 = by2.split(' ');
+        for (int i = 0; i < byL.size(); ++i) {
+            if (!by2.isEmpty()) {
+                pos.setDay(byL.at(i).toInt());
+                pos.setPos(byL2.at(i).toInt());
+                wdList.append(pos);
+            } else {
+                pos.setDay(byL.at(i).toInt());
+                wdList.append(pos);
             }
-
-            // Week start setting
-            recurrule->setWeekStart(sqlite3_column_int(mSelectIncRecursives, 18));
-
-            if (recurrule->rrule() == "RRULE")
-                incidence->recurrence()->addRRule(recurrule);
-            else
-                incidence->recurrence()->addExRule(recurrule);
         }
+        if (!wdList.isEmpty())
+            recurrule->setByDays(wdList);
+    }
 
-    } while (rv != SQLITE_DONE);
-
-    return true;
+    // Week start setting
+    recurrule->setWeekStart(sqlite3_column_int(stmt, 18));
 
-error:
-    return false;
+    if (recurrule->rrule() == "RRULE")
+        incidence->recurrence()->addRRule(recurrule);
+    else
+        incidence->recurrence()->addExRule(recurrule);
 }
 
 bool SqliteFormat::Private::selectAlarms(Incidence::Ptr &incidence, int rowid)
 {
     int rv = 0;
     int index = 1;
-    int offset;
-    QString   timezone;
-    QDateTime kdt;
-    QDateTime dt;
 
     if (!mSelectIncAlarms) {
         const char *query = SELECT_ALARM_BY_ID;
@@ -1835,117 +3151,122 @@ bool SqliteFormat::Private::selectAlarms(Incidence::Ptr &incidence, int rowid)
         SL3_step(mSelectIncAlarms);
 
         if (rv == SQLITE_ROW) {
-            // Set Incidence data from alarm
-
-            Alarm::Ptr ialarm = incidence->newAlarm();
-
-            // Determine the alarm's action type
-            int action = sqlite3_column_int(mSelectIncAlarms, 1);
-            Alarm::Type type = Alarm::Invalid;
-
-            switch (action) {
-            case 1: //ICAL_ACTION_DISPLAY
-                type = Alarm::Display;
-                break;
-            case 2: //ICAL_ACTION_PROCEDURE
-                type = Alarm::Procedure;
-                break;
-            case 3: //ICAL_ACTION_EMAIL
-                type = Alarm::Email;
-                break;
-            case 4: //ICAL_ACTION_AUDIO
-                type = Alarm::Audio;
-                break;
-            default:
-                break;
-            }
+            readAlarm(incidence, mSelectIncAlarms);
+        }
 
-            ialarm->setType(type);
+    } while (rv != SQLITE_DONE);
 
-            if (sqlite3_column_int(mSelectIncAlarms, 2) > 0)
-                ialarm->setRepeatCount(sqlite3_column_int(mSelectIncAlarms, 2));
-            if (sqlite3_column_int(mSelectIncAlarms, 3) > 0)
-                ialarm->setSnoozeTime(Duration(sqlite3_column_int(mSelectIncAlarms, 3), Duration::Seconds));
+    return true;
 
-            offset = sqlite3_column_int(mSelectIncAlarms, 4);
-            QString relation = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 5));
+error:
+    return false;
+}
 
-            kdt = getDateTime(mFormat, mSelectIncAlarms, 6);
-            if (kdt.isValid())
-                ialarm->setTime(kdt);
+void SqliteFormat::Private::readAlarm(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    // Set Incidence data from alarm
 
-            if (!ialarm->hasTime()) {
-                if (relation.contains("startTriggerRelation")) {
-                    ialarm->setStartOffset(Duration(offset, Duration::Seconds));
-                } else if (relation.contains("endTriggerRelation")) {
-                    ialarm->setEndOffset(Duration(offset, Duration::Seconds));
-                }
-            }
+    Alarm::Ptr ialarm = incidence->newAlarm();
 
-            const QString &description =  QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 9));
-            const QString &attachments =  QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 10));
-            const QString &summary = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 11));
-            const QString &addresses = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 12));
-
-            switch (ialarm->type()) {
-            case Alarm::Display:
-                ialarm->setText(description);
-                break;
-            case Alarm::Procedure:
-                ialarm->setProgramFile(attachments);
-                ialarm->setProgramArguments(description);
-                break;
-            case Alarm::Email:
-                ialarm->setMailSubject(summary);
-                ialarm->setMailText(description);
-                if (!attachments.isEmpty())
-                    ialarm->setMailAttachments(attachments.split(','));
-                if (!addresses.isEmpty()) {
-                    Person::List persons;
-                    QStringList emails = addresses.split(',');
-                    for (int i = 0; i < emails.size(); i++) {
-                        persons.append(Person(QString(), emails.at(i)));
-                    }
-                    ialarm->setMailAddresses(persons);
-                }
-                break;
-            case Alarm::Audio:
-                ialarm->setAudioFile(attachments);
-                break;
-            default:
-                break;
-            }
+    // Determine the alarm's action type
+    int action = sqlite3_column_int(stmt, 1);
+    Alarm::Type type = Alarm::Invalid;
 
-            const QString &properties = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAlarms, 13));
-            if (!properties.isEmpty()) {
-                QMap<QByteArray, QString> customProperties;
-                QStringList list = properties.split("\r\n");
-                for (int i = 0; i < list.size(); i += 2) {
-                    QByteArray key;
-                    QString value;
-                    key = list.at(i).toUtf8();
-                    if ((i + 1) < list.size()) {
-                        value = list.at(i + 1);
-                        customProperties[key] = value;
-                    }
-                }
-                ialarm->setCustomProperties(customProperties);
-                QString locationRadius = ialarm->nonKDECustomProperty("X-LOCATION-RADIUS");
-                if (!locationRadius.isEmpty()) {
-                    ialarm->setLocationRadius(locationRadius.toInt());
-                    ialarm->setHasLocationRadius(true);
-                }
-            }
+    switch (action) {
+    case 1: //ICAL_ACTION_DISPLAY
+        type = Alarm::Display;
+        break;
+    case 2: //ICAL_ACTION_PROCEDURE
+        type = Alarm::Procedure;
+        break;
+    case 3: //ICAL_ACTION_EMAIL
+        type = Alarm::Email;
+        break;
+    case 4: //ICAL_ACTION_AUDIO
+        type = Alarm::Audio;
+        break;
+    default:
+        break;
+    }
+
+    ialarm->setType(type);
+
+    if (sqlite3_column_int(stmt, 2) > 0)
+        ialarm->setRepeatCount(sqlite3_column_int(stmt, 2));
+    if (sqlite3_column_int(stmt, 3) > 0)
+        ialarm->setSnoozeTime(Duration(sqlite3_column_int(stmt, 3), Duration::Seconds));
+
+    int offset = sqlite3_column_int(stmt, 4);
+    QString relation = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 5));
 
-            ialarm->setEnabled((bool)sqlite3_column_int(mSelectIncAlarms, 14));
+    QDateTime kdt = getDateTime(mFormat, stmt, 6);
+    if (kdt.isValid())
+        ialarm->setTime(kdt);
+
+    if (!ialarm->hasTime()) {
+        if (relation.contains("startTriggerRelation")) {
+            ialarm->setStartOffset(Duration(offset, Duration::Seconds));
+        } else if (relation.contains("endTriggerRelation")) {
+            ialarm->setEndOffset(Duration(offset, Duration::Seconds));
         }
+    }
 
-    } while (rv != SQLITE_DONE);
+    const QString &description =  QString::fromUtf8((const char *)sqlite3_column_text(stmt, 9));
+    const QString &attachments =  QString::fromUtf8((const char *)sqlite3_column_text(stmt, 10));
+    const QString &summary = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 11));
+    const QString &addresses = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 12));
 
-    return true;
+    switch (ialarm->type()) {
+    case Alarm::Display:
+        ialarm->setText(description);
+        break;
+    case Alarm::Procedure:
+        ialarm->setProgramFile(attachments);
+        ialarm->setProgramArguments(description);
+        break;
+    case Alarm::Email:
+        ialarm->setMailSubject(summary);
+        ialarm->setMailText(description);
+        if (!attachments.isEmpty())
+            ialarm->setMailAttachments(attachments.split(','));
+        if (!addresses.isEmpty()) {
+            Person::List persons;
+            QStringList emails = addresses.split(',');
+            for (int i = 0; i < emails.size(); i++) {
+                persons.append(Person(QString(), emails.at(i)));
+            }
+            ialarm->setMailAddresses(persons);
+        }
+        break;
+    case Alarm::Audio:
+        ialarm->setAudioFile(attachments);
+        break;
+    default:
+        break;
+    }
 
-error:
-    return false;
+    const QString &properties = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 13));
+    if (!properties.isEmpty()) {
+        QMap<QByteArray, QString> customProperties;
+        QStringList list = properties.split("\r\n");
+        for (int i = 0; i < list.size(); i += 2) {
+            QByteArray key;
+            QString value;
+            key = list.at(i).toUtf8();
+            if ((i + 1) < list.size()) {
+                value = list.at(i + 1);
+                customProperties[key] = value;
+            }
+        }
+        ialarm->setCustomProperties(customProperties);
+        QString locationRadius = ialarm->nonKDECustomProperty("X-LOCATION-RADIUS");
+        if (!locationRadius.isEmpty()) {
+            ialarm->setLocationRadius(locationRadius.toInt());
+            ialarm->setHasLocationRadius(true);
+        }
+    }
+
+    ialarm->setEnabled((bool)sqlite3_column_int(stmt, 14));
 }
 
 bool SqliteFormat::Private::selectAttendees(Incidence::Ptr &incidence, int rowid)
@@ -1965,22 +3286,7 @@ bool SqliteFormat::Private::selectAttendees(Incidence::Ptr &incidence, int rowid
         SL3_step(mSelectIncAttendees);
 
         if (rv == SQLITE_ROW) {
-            const QString &email = QString::fromUtf8((const char *) sqlite3_column_text(mSelectIncAttendees, 1));
-            const QString &name = QString::fromUtf8((const char *) sqlite3_column_text(mSelectIncAttendees, 2));
-            bool isOrganizer = (bool) sqlite3_column_int(mSelectIncAttendees, 3);
-
-            if (isOrganizer) {
-                incidence->setOrganizer(Person(name, email));
-            } else {
-                Attendee::Role role = (Attendee::Role) sqlite3_column_int(mSelectIncAttendees, 4);
-                Attendee::PartStat status = (Attendee::PartStat) sqlite3_column_int(mSelectIncAttendees, 5);
-                bool rsvp = (bool) sqlite3_column_int(mSelectIncAttendees, 6);
-
-                Attendee attendee(name, email, rsvp, status, role);
-                attendee.setDelegate(QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAttendees, 7)));
-                attendee.setDelegator(QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAttendees, 8)));
-                incidence->addAttendee(attendee, false);
-            }
+            readAttendee(incidence, mSelectIncAttendees);
         }
     } while (rv != SQLITE_DONE);
 
@@ -1990,6 +3296,26 @@ error:
     return false;
 }
 
+void SqliteFormat::Private::readAttendee(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    const QString &email = QString::fromUtf8((const char *) sqlite3_column_text(stmt, 1));
+    const QString &name = QString::fromUtf8((const char *) sqlite3_column_text(stmt, 2));
+    bool isOrganizer = (bool) sqlite3_column_int(stmt, 3);
+
+    if (isOrganizer) {
+        incidence->setOrganizer(Person(name, email));
+    } else {
+        Attendee::Role role = (Attendee::Role) sqlite3_column_int(stmt, 4);
+        Attendee::PartStat status = (Attendee::PartStat) sqlite3_column_int(stmt, 5);
+        bool rsvp = (bool) sqlite3_column_int(stmt, 6);
+
+        Attendee attendee(name, email, rsvp, status, role);
+        attendee.setDelegate(QString::fromUtf8((const char *)sqlite3_column_text(stmt, 7)));
+        attendee.setDelegator(QString::fromUtf8((const char *)sqlite3_column_text(stmt, 8)));
+        incidence->addAttendee(attendee, false);
+    }
+}
+
 bool SqliteFormat::Private::selectAttachments(Incidence::Ptr &incidence, int rowid)
 {
     int rv = 0;
@@ -2007,27 +3333,7 @@ bool SqliteFormat::Private::selectAttachments(Incidence::Ptr &incidence, int row
         SL3_step(mSelectIncAttachments);
 
         if (rv == SQLITE_ROW) {
-            Attachment attach;
-
-            QByteArray data = QByteArray((const char *)sqlite3_column_blob(mSelectIncAttachments, 1),
-                                         sqlite3_column_bytes(mSelectIncAttachments, 1));
-            if (!data.isEmpty()) {
-                attach.setDecodedData(data);
-            } else {
-                QString uri = QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAttachments, 2));
-                if (!uri.isEmpty()) {
-                    attach.setUri(uri);
-                }
-            }
-            if (!attach.isEmpty()) {
-                attach.setMimeType(QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAttachments, 3)));
-                attach.setShowInline(sqlite3_column_int(mSelectIncAttachments, 4) != 0);
-                attach.setLabel(QString::fromUtf8((const char *)sqlite3_column_text(mSelectIncAttachments, 5)));
-                attach.setLocal(sqlite3_column_int(mSelectIncAttachments, 6) != 0);
-                incidence->addAttachment(attach);
-            } else {
-                qCWarning(lcMkcal) << "Empty attachment for incidence" << incidence->instanceIdentifier();
-            }
+            readAttachment(incidence, mSelectIncAttachments);
         }
     } while (rv != SQLITE_DONE);
 
@@ -2037,6 +3343,32 @@ error:
     return false;
 }
 
+void SqliteFormat::Private::readAttachment(Incidence::Ptr &incidence, sqlite3_stmt *stmt)
+{
+    Attachment attach;
+
+    QByteArray data = QByteArray((const char *)sqlite3_column_blob(stmt, 1),
+                                 sqlite3_column_bytes(stmt, 1));
+    if (!data.isEmpty()) {
+        attach.setDecodedData(data);
+    } else {
+        QString uri = QString::fromUtf8((const char *)sqlite3_column_text(stmt, 2));
+        if (!uri.isEmpty()) {
+            attach.setUri(uri);
+        }
+    }
+    if (!attach.isEmpty()) {
+        attach.setMimeType(QString::fromUtf8((const char *)sqlite3_column_text(stmt, 3)));
+        attach.setShowInline(sqlite3_column_int(stmt, 4) != 0);
+        attach.setLabel(QString::fromUtf8((const char *)sqlite3_column_text(stmt, 5)));
+        attach.setLocal(sqlite3_column_int(stmt, 6) != 0);
+        incidence->addAttachment(attach);
+    } else {
+        qCWarning(lcMkcal) << "Empty attachment for incidence" << incidence->instanceIdentifier();
+    }
+}
+//@endcond
+
 sqlite3_int64 SqliteFormat::toOriginTime(const QDateTime &dt)
 {
     return dt.toMSecsSinceEpoch() / 1000;
@@ -2060,6 +3392,24 @@ QDateTime SqliteFormat::fromOriginTime(sqlite3_int64 seconds)
     return QDateTime::fromMSecsSinceEpoch(seconds * 1000, Qt::UTC);
 }
 
+// Building a QTimeZone from its id reads the system time zone
+// database, so keep the resolved time zones for the whole process.
+// Copies share their transition data with the cached object.
+static QTimeZone timeZoneFromId(const QByteArray &zonename)
+{
+    static QMutex mutex;
+    static QHash<QByteArray, QTimeZone> timezones;
+
+    QMutexLocker locker(&mutex);
+    QHash<QByteArray, QTimeZone>::ConstIterator it = timezones.constFind(zonename);
+    if (it != timezones.constEnd()) {
+        return it.value();
+    }
+    const QTimeZone timezone(zonename);
+    timezones.insert(zonename, timezone);
+    return timezone;
+}
+
 QDateTime SqliteFormat::fromOriginTime(sqlite3_int64 seconds, const QByteArray &zonename)
 {
     QDateTime dt;
@@ -2069,7 +3419,7 @@ QDateTime SqliteFormat::fromOriginTime(sqlite3_int64 seconds, const QByteArray &
     } else if (!zonename.isEmpty()) {
         // zonename should match a valid system time zone,
         // since it's the only way to create a timezone.
-        const QTimeZone timezone(zonename);
+        const QTimeZone timezone = timeZoneFromId(zonename);
         if (timezone.isValid()) {
             dt = fromOriginTime(seconds).toTimeZone(timezone);
         } else {
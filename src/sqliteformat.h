@@ -29,6 +29,8 @@
 
 #include "mkcal_export.h"
 #include "extendedstorage.h"
+#include "sqlitestorageoptions.h"
+#include "statementcache_p.h"
 
 #include <KCalendarCore/Incidence>
 
@@ -64,6 +66,15 @@ public:
         XDateTime
     };
 
+    /*
+      Reserved values of the time zone columns, the other values
+      are identifiers in the TimeZones table.
+    */
+    enum TimeZoneId {
+        FloatingDate = -1, // all-day date
+        ClockTime = 0      // local time, without time zone
+    };
+
     /*
       Values stored in the flag column of the calendars table.
      */
@@ -81,9 +92,63 @@ public:
         Shareable     = (1 << 10)
     };
 
+    /*
+      Parts of an incidence stored outside of its Components row,
+      or indexed from it, that an update rewrites only when they
+      changed, see changedParts().
+    */
+    enum IncidencePart {
+        NoPart               = 0x0,
+        CustomPropertiesPart = 0x1,
+        AttendeesPart        = 0x2,  // with the organizer
+        AlarmsPart           = 0x4,
+        AttachmentsPart      = 0x8,
+        RecurrencePart       = 0x10, // with the dates, for the Occurrences table
+        AllParts             = 0x1f
+    };
+    Q_DECLARE_FLAGS(IncidenceParts, IncidencePart)
+
+    /*
+      The parts of an incidence as they are in the database. The
+      lists are implicitly shared with the incidence, so taking a
+      snapshot is cheap, and so is comparing an unmodified part.
+      Alarms and recurrence rules are modified in place, only a
+      fingerprint of them is kept.
+    */
+    struct Snapshot {
+        KCalendarCore::CustomProperties customProperties;
+        KCalendarCore::Person organizer;
+        KCalendarCore::Attendee::List attendees;
+        KCalendarCore::Attachment::List attachments;
+        QDateTime dtStart;
+        QDateTime dtEnd;
+        bool allDay = false;
+        // The recurrence as in the Recurrence column, empty if none.
+        QByteArray recurrence;
+        // A hash of the alarms, 0 if none.
+        size_t alarms = 0;
+    };
+
     SqliteFormat(sqlite3 *database);
     virtual ~SqliteFormat();
 
+    /*
+      Take a snapshot of the parts of an incidence, just read from
+      or written to the database.
+    */
+    Snapshot snapshot(const KCalendarCore::Incidence &incidence);
+
+    /*
+      The parts of an incidence that differ from a snapshot.
+
+      @param snapshot the snapshot taken when the incidence was read or written
+      @param incidence the incidence, as in memory
+      @param parts the parts to compare
+    */
+    IncidenceParts changedParts(const Snapshot &snapshot,
+                                const KCalendarCore::Incidence &incidence,
+                                IncidenceParts parts = AllParts);
+
     /*
       Update notebook data in Calendars table.
 
@@ -101,12 +166,40 @@ public:
       @param incidence incidence to update
       @param notebook notebook of incidence
       @param dbop database operation
+      @param parts on update, the parts to rewrite besides the Components row
       @return true if the operation was successful; false otherwise.
     */
-    bool modifyComponents(const KCalendarCore::Incidence &incidence, DBOperation dbop);
+    bool modifyComponents(const KCalendarCore::Incidence &incidence, DBOperation dbop,
+                          IncidenceParts parts = AllParts);
 
     bool purgeDeletedComponents(const KCalendarCore::Incidence &incidence);
 
+    /*
+      Remove from the database the components marked as deleted with
+      the UID and recurrence id of the given incidences. The components
+      are gathered in the temporary selection table first, then each
+      table is purged with a single statement.
+
+      @param list the incidences to purge
+      @return the number of purged components, or -1 on error.
+    */
+    int purgeDeletedComponents(const KCalendarCore::Incidence::List &list);
+
+    /*
+      Remove from the database the components marked as deleted
+      before a given date, see purgeDeletedComponents(const KCalendarCore::Incidence::List &).
+
+      @param before components marked as deleted strictly before this date are purged
+      @return the number of purged components, or -1 on error.
+    */
+    int purgeDeletedComponents(const QDateTime &before);
+
+    /*
+      Tell if an incidence with the same UID and recurrence id,
+      and not marked as deleted, is stored in Components table.
+    */
+    bool hasComponent(const KCalendarCore::Incidence &incidence);
+
     /*
       Select incidences from Components table.
 
@@ -116,9 +209,168 @@ public:
     */
     KCalendarCore::Incidence::Ptr selectComponents(sqlite3_stmt *stmt1);
 
+    /*
+      Select incidences from Components table, by batch.
+
+      Contrary to selectComponents(sqlite3_stmt*), the child tables
+      (custom properties, attendees, alarms, recurrence rules, rdates
+      and attachments) are not queried row by row, but once per batch
+      for all the selected components.
+
+      @param stmt1 prepared sqlite statement for components table
+      @param list the queried incidences are appended to this list
+      @param max the maximum number of rows to read from stmt1, or all
+             remaining rows if max is not strictly positive
+      @param deferred the child tables not to read, see selectParts()
+      @param lastRowId if not null, set to the ComponentId of the last row read
+      @return the number of rows read from stmt1, or -1 on error. When
+              the returned value is lower than max, all rows have
+              been read and stmt1 should not be stepped anymore.
+    */
+    int selectComponents(sqlite3_stmt *stmt1, KCalendarCore::Incidence::List *list, int max = 0,
+                         ExtendedStorage::DeferredParts deferred = ExtendedStorage::NoPart,
+                         int *lastRowId = nullptr);
+
+    /*
+      Select incidence headers from Components table, see
+      ExtendedStorage::loadHeaders().
+
+      @param stmt prepared sqlite statement, like SELECT_HEADERS_BY_DATE
+      @param list the queried headers are appended to this list
+      @return true on success.
+    */
+    bool selectHeaders(sqlite3_stmt *stmt, IncidenceHeader::List *list);
+
+    /*
+      Read from the Attendee and Attachments tables the parts of an
+      incidence that have been deferred on load. The attendees and
+      attachments already present in the incidence are kept.
+
+      @param incidence the incidence to complete
+      @param parts the parts to read
+      @return true on success.
+    */
+    bool selectParts(const KCalendarCore::Incidence::Ptr &incidence,
+                     ExtendedStorage::DeferredParts parts);
+
     bool selectMetadata(int *id);
     bool incrementTransactionId(int *id);
 
+    /*
+      Expand the occurrences of a recurring incidence in the
+      Occurrences table over a date range, if it has not been done
+      yet, like for incidences saved before the table existed, or
+      for ranges outside of the expansion done at save time. The
+      occurrences already indexed are kept, only the missing ones
+      before or after them are added.
+
+      @param incidence a recurring incidence, as stored in the database
+      @param start the start of the range, see toOriginTime()
+      @param end the end of the range, see toOriginTime()
+      @return true if the occurrences are indexed.
+    */
+    bool indexOccurrences(const KCalendarCore::Incidence &incidence,
+                          sqlite3_int64 start, sqlite3_int64 end);
+
+    /*
+      Compute again the RecurrenceEnd column of all recurring
+      incidences, like after the column has been added.
+
+      @return true on success.
+    */
+    bool updateRecurrenceEnds();
+
+    /*
+      Encode in the Recurrence column the recurrence of the components
+      stored in the legacy Recursive and Rdates tables, then empty these
+      tables.
+
+      @return true on success.
+    */
+    bool convertRecurrences();
+
+    /*
+      Create and fill the full-text index of the components, if
+      it does not exist yet and if SQLite provides FTS5. Once
+      created, the index is maintained by modifyComponents().
+
+      @return true if the full-text index is available.
+    */
+    bool createFullTextIndex();
+
+    /*
+      Check the existence of the full-text index, without creating it.
+
+      @return true if the index exists.
+    */
+    bool selectFullTextIndex();
+
+    /*
+      @return true if the components can be searched with
+              SEARCH_COMPONENTS_TEXT, see createFullTextIndex().
+    */
+    bool hasFullTextIndex() const;
+
+    /*
+      Get the identifier of a time zone in the TimeZones table,
+      adding the time zone to the table if needed.
+
+      @param name the IANA identifier of the time zone
+      @param id the identifier, set on success
+      @return true on success.
+    */
+    bool timeZoneId(const QByteArray &name, int *id);
+
+    /*
+      Get the name of a time zone from its identifier in the
+      TimeZones table.
+
+      @param id an identifier, as returned by timeZoneId()
+      @return the IANA identifier of the time zone, or an empty
+              array if the identifier is unknown.
+    */
+    QByteArray timeZoneName(int id);
+
+    /*
+      Forget the identifiers of the TimeZones table read or added
+      so far, to be called after a rollback.
+    */
+    void resetTimeZones();
+
+    /*
+      Get a prepared statement from the statement cache of
+      the database connection, see StatementCache::acquire().
+
+      @param query the SQL text of the statement
+      @param qsize the size of query, as for sqlite3_prepare_v2()
+      @return a statement to be given back with releaseStatement(),
+              or a null pointer on error.
+    */
+    sqlite3_stmt *acquireStatement(const char *query, int qsize);
+
+    /*
+      Give back a statement obtained from acquireStatement().
+
+      @param stmt the statement, may be null
+    */
+    void releaseStatement(sqlite3_stmt *stmt);
+
+    /*
+      Usage counters of the statement cache.
+    */
+    StatementCache::Statistics statementStatistics() const;
+
+    /*
+      Apply the tuning of a connection: the busy timeout and the
+      cache, memory mapping, synchronous and temporary storage
+      pragmas. The journal mode, stored in the database file,
+      is left unchanged.
+
+      @param database the connection to tune
+      @param options the values to apply, the default ones being kept
+    */
+    static void applyOptions(sqlite3 *database, const SqliteStorageOptions &options);
+
     // Helper Functions //
 
     /*
@@ -169,6 +421,8 @@ private:
 
 }
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(mKCal::SqliteFormat::IncidenceParts)
+
 #define SL3_try_exec( db )                                    \
 {                                                             \
  /* kDebug() << "SQL query:" << query;    */                  \
@@ -202,6 +456,14 @@ private:
   }                                                                   \
 }
 
+#define SL3_acquire( format, query, qsize, stmt )                     \
+{                                                                     \
+  (stmt) = (format)->acquireStatement( (query), (qsize) );            \
+  if ( !(stmt) ) {                                                    \
+    goto error;                                                       \
+  }                                                                   \
+}
+
 #define SL3_bind_text( stmt, index, value, size, desc )               \
 {                                                                     \
   rv = sqlite3_bind_text( (stmt), (index), (value), (size), (desc) ); \
@@ -282,25 +544,50 @@ private:
 //extra1: used to store the color of a single component.
 
 #define CREATE_COMPONENTS \
-  "CREATE TABLE IF NOT EXISTS Components(ComponentId INTEGER PRIMARY KEY AUTOINCREMENT, Notebook TEXT, Type TEXT, Summary TEXT, Category TEXT, DateStart INTEGER, DateStartLocal INTEGER, StartTimeZone TEXT, HasDueDate INTEGER, DateEndDue INTEGER, DateEndDueLocal INTEGER, EndDueTimeZone TEXT, Duration INTEGER, Classification INTEGER, Location TEXT, Description TEXT, Status INTEGER, GeoLatitude REAL, GeoLongitude REAL, Priority INTEGER, Resources TEXT, DateCreated INTEGER, DateStamp INTEGER, DateLastModified INTEGER, Sequence INTEGER, Comments TEXT, Attachments TEXT, Contact TEXT, InvitationStatus INTEGER, RecurId INTEGER, RecurIdLocal INTEGER, RecurIdTimeZone TEXT, RelatedTo TEXT, URL TEXT, UID TEXT, Transparency INTEGER, LocalOnly INTEGER, Percent INTEGER, DateCompleted INTEGER, DateCompletedLocal INTEGER, CompletedTimeZone TEXT, DateDeleted INTEGER, extra1 STRING, extra2 STRING, extra3 INTEGER, thisAndFuture INTEGER)"
+  "CREATE TABLE IF NOT EXISTS Components(ComponentId INTEGER PRIMARY KEY AUTOINCREMENT, Notebook TEXT, Type INTEGER, Summary TEXT, Category TEXT, DateStart INTEGER, DateStartLocal INTEGER, StartTimeZone INTEGER, HasDueDate INTEGER, DateEndDue INTEGER, DateEndDueLocal INTEGER, EndDueTimeZone INTEGER, Duration INTEGER, Classification INTEGER, Location TEXT, Description TEXT, Status INTEGER, GeoLatitude REAL, GeoLongitude REAL, Priority INTEGER, Resources TEXT, DateCreated INTEGER, DateStamp INTEGER, DateLastModified INTEGER, Sequence INTEGER, Comments TEXT, Attachments TEXT, Contact TEXT, InvitationStatus INTEGER, RecurId INTEGER, RecurIdLocal INTEGER, RecurIdTimeZone INTEGER, RelatedTo TEXT, URL TEXT, UID TEXT, Transparency INTEGER, LocalOnly INTEGER, Percent INTEGER, DateCompleted INTEGER, DateCompletedLocal INTEGER, CompletedTimeZone INTEGER, DateDeleted INTEGER, extra1 STRING, extra2 STRING, extra3 INTEGER, thisAndFuture INTEGER, RecurrenceEnd INTEGER, Recurrence BLOB)"
 
 //Extra fields added for future use in case they are needed. They will be documented here
 //So we can add something without breaking the schema and not adding tables
 
+// Rdates and Recursive are not written anymore, the recurrence of a
+// component is encoded in Components.Recurrence. They are read once,
+// to migrate older databases.
 #define CREATE_RDATES \
-  "CREATE TABLE IF NOT EXISTS Rdates(ComponentId INTEGER, Type INTEGER, Date INTEGER, DateLocal INTEGER, TimeZone TEXT)"
+  "CREATE TABLE IF NOT EXISTS Rdates(ComponentId INTEGER, Type INTEGER, Date INTEGER, DateLocal INTEGER, TimeZone INTEGER)"
 #define CREATE_CUSTOMPROPERTIES \
   "CREATE TABLE IF NOT EXISTS Customproperties(ComponentId INTEGER, Name TEXT, Value TEXT, Parameters TEXT)"
 #define CREATE_RECURSIVE \
-  "CREATE TABLE IF NOT EXISTS Recursive(ComponentId INTEGER, RuleType INTEGER, Frequency INTEGER, Until INTEGER, UntilLocal INTEGER, untilTimeZone TEXT, Count INTEGER, Interval INTEGER, BySecond TEXT, ByMinute TEXT, ByHour TEXT, ByDay TEXT, ByDayPos Text, ByMonthDay TEXT, ByYearDay TEXT, ByWeekNum TEXT, ByMonth TEXT, BySetPos TEXT, WeekStart INTEGER)"
+  "CREATE TABLE IF NOT EXISTS Recursive(ComponentId INTEGER, RuleType INTEGER, Frequency INTEGER, Until INTEGER, UntilLocal INTEGER, untilTimeZone INTEGER, Count INTEGER, Interval INTEGER, BySecond TEXT, ByMinute TEXT, ByHour TEXT, ByDay TEXT, ByDayPos Text, ByMonthDay TEXT, ByYearDay TEXT, ByWeekNum TEXT, ByMonth TEXT, BySetPos TEXT, WeekStart INTEGER)"
 #define CREATE_ALARM \
-  "CREATE TABLE IF NOT EXISTS Alarm(ComponentId INTEGER, Action INTEGER, Repeat INTEGER, Duration INTEGER, Offset INTEGER, Relation TEXT, DateTrigger INTEGER, DateTriggerLocal INTEGER, triggerTimeZone TEXT, Description TEXT, Attachment TEXT, Summary TEXT, Address TEXT, CustomProperties TEXT, isEnabled INTEGER)"
+  "CREATE TABLE IF NOT EXISTS Alarm(ComponentId INTEGER, Action INTEGER, Repeat INTEGER, Duration INTEGER, Offset INTEGER, Relation TEXT, DateTrigger INTEGER, DateTriggerLocal INTEGER, triggerTimeZone INTEGER, Description TEXT, Attachment TEXT, Summary TEXT, Address TEXT, CustomProperties TEXT, isEnabled INTEGER)"
 #define CREATE_ATTENDEE \
 "CREATE TABLE IF NOT EXISTS Attendee(ComponentId INTEGER, Email TEXT, Name TEXT, IsOrganizer INTEGER, Role INTEGER, PartStat INTEGER, Rsvp INTEGER, DelegatedTo TEXT, DelegatedFrom TEXT)"
 #define CREATE_ATTACHMENTS \
 "CREATE TABLE IF NOT EXISTS Attachments(ComponentId INTEGER, Data BLOB, Uri TEXT, MimeType TEXT, ShowInLine INTEGER, Label TEXT, Local INTEGER)"
+// Names of the time zones used by the components, see SqliteFormat::TimeZoneId.
+#define CREATE_TIMEZONES \
+  "CREATE TABLE IF NOT EXISTS TimeZones(TimeZoneId INTEGER PRIMARY KEY, Name TEXT NOT NULL UNIQUE)"
 #define CREATE_CALENDARPROPERTIES \
   "CREATE TABLE IF NOT EXISTS Calendarproperties(CalendarId REFERENCES Calendars(CalendarId) ON DELETE CASCADE, Name TEXT NOT NULL, Value TEXT, UNIQUE (CalendarId, Name))"
+// Interval index over [DateStart, DateEndDue] of the non deleted components.
+// A component without end is indexed over [DateStart, DateStart].
+#define CREATE_COMPONENTS_RANGE \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS ComponentsRange USING rtree(ComponentId, DateMin, DateMax)"
+// Occurrences of the recurring components, expanded at save time
+// from an origin up to a horizon, see SqliteFormat::modifyComponents(),
+// and extended when a range is loaded, see SqliteFormat::indexOccurrences().
+// The origin of a series expanded from its start is NULL, the horizon
+// of a fully expanded series is the largest integer value.
+#define CREATE_OCCURRENCES \
+  "CREATE TABLE IF NOT EXISTS Occurrences(OccurrenceId INTEGER PRIMARY KEY, ComponentId INTEGER)"
+#define CREATE_OCCURRENCES_RANGE \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS OccurrencesRange USING rtree(OccurrenceId, DateMin, DateMax)"
+#define CREATE_OCCURRENCEHORIZONS \
+  "CREATE TABLE IF NOT EXISTS OccurrenceHorizons(ComponentId INTEGER PRIMARY KEY, Horizon INTEGER, Origin INTEGER)"
+// Full-text index over the searchable columns of the non deleted
+// components, when FTS5 is available, see SqliteFormat::createFullTextIndex().
+#define CREATE_COMPONENTS_TEXT \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS ComponentsText USING fts5(Summary, Description, Location, content='Components', content_rowid='ComponentId', prefix='2 3')"
 
 #define INDEX_CALENDAR \
 "CREATE INDEX IF NOT EXISTS IDX_CALENDAR on Calendars(CalendarId)"
@@ -324,19 +611,80 @@ private:
 "CREATE INDEX IF NOT EXISTS IDX_ATTACHMENTS on Attachments(ComponentId)"
 #define INDEX_CALENDARPROPERTIES \
 "CREATE INDEX IF NOT EXISTS IDX_CALENDARPROPERTIES on Calendarproperties(CalendarId)"
-
+#define INDEX_OCCURRENCES \
+"CREATE INDEX IF NOT EXISTS IDX_OCCURRENCES on Occurrences(ComponentId)"
+
+// Schema versions applied to the database, see PRAGMA user_version.
+#define CREATE_MIGRATIONS \
+  "CREATE TABLE IF NOT EXISTS Migrations(Version INTEGER PRIMARY KEY, DateApplied INTEGER)"
+#define INSERT_MIGRATION \
+"insert or replace into Migrations(Version, DateApplied) values (?, ?)"
+#define SELECT_TIMEZONES \
+"select TimeZoneId, Name from TimeZones"
+#define SELECT_TIMEZONES_BY_NAME \
+"select TimeZoneId from TimeZones where Name=?"
+#define INSERT_TIMEZONES \
+"insert or ignore into TimeZones(Name) values (?)"
+#define SELECT_COMPONENTS_TABLE_EXISTS \
+"select 1 from sqlite_master where type='table' and name='Components'"
+
+// Temporary table, private to a connection, storing the ids of
+// the components read in a batch, see SqliteFormat::selectComponents().
+#define CREATE_TEMP_SELECTION \
+"CREATE TEMP TABLE IF NOT EXISTS Selection(ComponentId INTEGER PRIMARY KEY)"
+#define INSERT_TEMP_SELECTION \
+"insert or ignore into temp.Selection values (?)"
+#define DELETE_TEMP_SELECTION \
+"delete from temp.Selection"
+// Selection of the components to purge, either given by UID and
+// recurrence id, or marked as deleted before a date.
+#define INSERT_TEMP_SELECTION_BY_UID_RECID_AND_DELETED \
+"insert or ignore into temp.Selection select ComponentId from Components where UID=? and RecurId=? and DateDeleted<>0"
+#define INSERT_TEMP_SELECTION_BY_DELETED_BEFORE \
+"insert or ignore into temp.Selection select ComponentId from Components where DateDeleted<>0 and DateDeleted<?"
+#define IN_TEMP_SELECTION \
+" where ComponentId in (select ComponentId from temp.Selection)"
+#define DELETE_COMPONENTS_BY_SELECTION \
+"delete from Components" IN_TEMP_SELECTION
+#define DELETE_CUSTOMPROPERTIES_BY_SELECTION \
+"delete from Customproperties" IN_TEMP_SELECTION
+#define DELETE_ALARM_BY_SELECTION \
+"delete from Alarm" IN_TEMP_SELECTION
+#define DELETE_ATTENDEE_BY_SELECTION \
+"delete from Attendee" IN_TEMP_SELECTION
+#define DELETE_ATTACHMENTS_BY_SELECTION \
+"delete from Attachments" IN_TEMP_SELECTION
+#define DELETE_RDATES_BY_SELECTION \
+"delete from Rdates" IN_TEMP_SELECTION
+#define DELETE_RECURSIVE_BY_SELECTION \
+"delete from Recursive" IN_TEMP_SELECTION
+
+#define INSERT_COMPONENTS_RANGE_ALL \
+"insert or replace into ComponentsRange select ComponentId, " \
+"min(DateStart, case when DateEndDue=0 then DateStart else DateEndDue end), " \
+"max(DateStart, case when DateEndDue=0 then DateStart else DateEndDue end) " \
+"from Components where DateDeleted=0"
+#define INSERT_COMPONENTS_RANGE \
+INSERT_COMPONENTS_RANGE_ALL " and ComponentId=?"
+#define INSERT_COMPONENTS_TEXT_ALL \
+"insert into ComponentsText(rowid, Summary, Description, Location) " \
+"select ComponentId, Summary, Description, Location from Components where DateDeleted=0"
+#define INSERT_COMPONENTS_TEXT \
+INSERT_COMPONENTS_TEXT_ALL " and ComponentId=?"
+#define INSERT_OCCURRENCES \
+"insert into Occurrences values (NULL, ?)"
+#define INSERT_OCCURRENCES_RANGE \
+"insert into OccurrencesRange values (?, ?, ?)"
+#define INSERT_OCCURRENCEHORIZONS \
+"insert or replace into OccurrenceHorizons values (?, ?, ?)"
 #define INSERT_CALENDARS \
 "insert into Calendars values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, '', '')"
 #define INSERT_COMPONENTS \
-"insert into Components values (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, '', 0, ?)"
+"insert into Components values (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, '', 0, ?, ?, ?)"
 #define INSERT_CUSTOMPROPERTIES \
 "insert into Customproperties values (?, ?, ?, ?)"
 #define INSERT_CALENDARPROPERTIES \
 "insert into Calendarproperties values (?, ?, ?)"
-#define INSERT_RDATES \
-"insert into Rdates values (?, ?, ?, ?, ?)"
-#define INSERT_RECURSIVE \
-"insert into Recursive values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
 #define INSERT_ALARM \
 "insert into Alarm values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
 #define INSERT_ATTENDEE \
@@ -349,7 +697,11 @@ private:
 #define UPDATE_CALENDARS \
 "update Calendars set Name=?, Description=?, Color=?, Flags=?, syncDate=?, pluginName=?, account=?, attachmentSize=?, modifiedDate=?, sharedWith=?, syncProfile=?, createdDate=? where CalendarId=?"
 #define UPDATE_COMPONENTS \
-"update Components set Notebook=?, Type=?, Summary=?, Category=?, DateStart=?, DateStartLocal=?, StartTimeZone=?, HasDueDate=?, DateEndDue=?, DateEndDueLocal=?, EndDueTimeZone=?, Duration=?, Classification=?, Location=?, Description=?, Status=?, GeoLatitude=?, GeoLongitude=?, Priority=?, Resources=?, DateCreated=?, DateStamp=?, DateLastModified=?, Sequence=?, Comments=?, Attachments=?, Contact=?, RecurId=?, RecurIdLocal=?, RecurIdTimeZone=?, RelatedTo=?, URL=?, UID=?, Transparency=?, LocalOnly=?, Percent=?, DateCompleted=?, DateCompletedLocal=?, CompletedTimeZone=?, extra1=?, thisAndFuture=? where ComponentId=?"
+"update Components set Notebook=?, Type=?, Summary=?, Category=?, DateStart=?, DateStartLocal=?, StartTimeZone=?, HasDueDate=?, DateEndDue=?, DateEndDueLocal=?, EndDueTimeZone=?, Duration=?, Classification=?, Location=?, Description=?, Status=?, GeoLatitude=?, GeoLongitude=?, Priority=?, Resources=?, DateCreated=?, DateStamp=?, DateLastModified=?, Sequence=?, Comments=?, Attachments=?, Contact=?, RecurId=?, RecurIdLocal=?, RecurIdTimeZone=?, RelatedTo=?, URL=?, UID=?, Transparency=?, LocalOnly=?, Percent=?, DateCompleted=?, DateCompletedLocal=?, CompletedTimeZone=?, extra1=?, thisAndFuture=?, RecurrenceEnd=?, Recurrence=? where ComponentId=?"
+#define UPDATE_COMPONENTS_RECURRENCE_END \
+"update Components set RecurrenceEnd=? where ComponentId=?"
+#define UPDATE_COMPONENTS_RECURRENCE \
+"update Components set Recurrence=? where ComponentId=?"
 #define UPDATE_COMPONENTS_AS_DELETED \
 "update Components set DateDeleted=? where ComponentId=?"
 //"update Components set DateDeleted=strftime('%s','now') where ComponentId=?"
@@ -358,14 +710,22 @@ private:
 "delete from Calendars where CalendarId=?"
 #define DELETE_COMPONENTS \
 "delete from Components where ComponentId=?"
-#define DELETE_RDATES \
-"delete from Rdates where ComponentId=?"
+// An external content FTS5 table is given back the indexed values to delete them.
+#define DELETE_COMPONENTS_TEXT \
+"insert into ComponentsText(ComponentsText, rowid, Summary, Description, Location) " \
+"select 'delete', ComponentId, Summary, Description, Location from Components where DateDeleted=0 and ComponentId=?"
+#define DELETE_COMPONENTS_RANGE \
+"delete from ComponentsRange where ComponentId=?"
+#define DELETE_OCCURRENCES_RANGE \
+"delete from OccurrencesRange where OccurrenceId in (select OccurrenceId from Occurrences where ComponentId=?)"
+#define DELETE_OCCURRENCES \
+"delete from Occurrences where ComponentId=?"
+#define DELETE_OCCURRENCEHORIZONS \
+"delete from OccurrenceHorizons where ComponentId=?"
 #define DELETE_CUSTOMPROPERTIES \
 "delete from Customproperties where ComponentId=?"
 #define DELETE_CALENDARPROPERTIES \
 "delete from Calendarproperties where CalendarId=?"
-#define DELETE_RECURSIVE \
-"delete from Recursive where ComponentId=?"
 #define DELETE_ALARM \
 "delete from Alarm where ComponentId=?"
 #define DELETE_ATTENDEE \
@@ -383,23 +743,66 @@ private:
 "select * from Components where DateDeleted<>0"
 #define SELECT_COMPONENTS_ALL_DELETED_BY_NOTEBOOK \
 "select * from Components where Notebook=? and DateDeleted<>0"
+// By batches of rows, after a given ComponentId.
 #define SELECT_COMPONENTS_BY_RECURSIVE \
-"select * from Components where ((ComponentId in (select DISTINCT ComponentId from Recursive)) or (ComponentId in (select DISTINCT ComponentId from Rdates)) or (RecurId!=0)) and DateDeleted=0"
+"select * from Components where ComponentId>? and (Recurrence is not null or RecurId!=0) and DateDeleted=0 order by ComponentId limit ?"
+// Used by the migration to version 7, the columns are the ones of
+// the version 6 table, the Recurrence column being still empty.
+#define SELECT_COMPONENTS_BY_LEGACY_RECURRENCE \
+"select ComponentId, Notebook, Type, Summary, Category, DateStart, DateStartLocal, StartTimeZone, HasDueDate, DateEndDue, DateEndDueLocal, EndDueTimeZone, Duration, Classification, Location, Description, Status, GeoLatitude, GeoLongitude, Priority, Resources, DateCreated, DateStamp, DateLastModified, Sequence, Comments, Attachments, Contact, InvitationStatus, RecurId, RecurIdLocal, RecurIdTimeZone, RelatedTo, URL, UID, Transparency, LocalOnly, Percent, DateCompleted, DateCompletedLocal, CompletedTimeZone, DateDeleted, extra1, extra2, extra3, thisAndFuture, RecurrenceEnd, null" \
+" from Components where ComponentId in (select ComponentId from Recursive union select ComponentId from Rdates)"
+// The ComponentsRange bounds are approximated outwards, the exact
+// date conditions are checked again on the Components rows.
+#define SELECT_COMPONENTS_BY_RANGE \
+"select Components.* from ComponentsRange cross join Components on Components.ComponentId=ComponentsRange.ComponentId where "
 #define SELECT_COMPONENTS_BY_DATE_BOTH \
-"select * from Components where DateStart<? and (DateEndDue>=? or (DateEndDue=0 and DateStart>=?)) and DateDeleted=0"
+SELECT_COMPONENTS_BY_RANGE "ComponentsRange.DateMin<? and ComponentsRange.DateMax>=? and DateStart<? and (DateEndDue>=? or (DateEndDue=0 and DateStart>=?)) and DateDeleted=0"
 #define SELECT_COMPONENTS_BY_DATE_START \
-"select * from Components where (DateEndDue>=? or (DateEndDue=0 and DateStart>=?)) and DateDeleted=0"
+SELECT_COMPONENTS_BY_RANGE "ComponentsRange.DateMax>=? and (DateEndDue>=? or (DateEndDue=0 and DateStart>=?)) and DateDeleted=0"
 #define SELECT_COMPONENTS_BY_DATE_END \
-"select * from Components where DateStart<? and DateDeleted=0"
+SELECT_COMPONENTS_BY_RANGE "ComponentsRange.DateMin<? and DateStart<? and DateDeleted=0"
+// Whole series (parent and exceptions) with an occurrence or an
+// exception in a date range.
+#define SELECT_COMPONENTS_BY_OCCURRENCE \
+"select * from Components where UID in (" \
+"select UID from Components where ComponentId in (select Occurrences.ComponentId from OccurrencesRange cross join Occurrences on Occurrences.OccurrenceId=OccurrencesRange.OccurrenceId where OccurrencesRange.DateMin<? and OccurrencesRange.DateMax>=?) " \
+"union select UID from Components where RecurId!=0 and ComponentId in (select ComponentId from ComponentsRange where DateMin<? and DateMax>=?)" \
+") and DateDeleted=0"
+// Whole series whose occurrences are not indexed over a date range,
+// up to its end and from its start, and not finished before it.
+#define SELECT_COMPONENTS_BY_HORIZON \
+"select * from Components where UID in (" \
+"select UID from Components where Recurrence is not null " \
+"and ComponentId not in (select ComponentId from OccurrenceHorizons where Horizon>=? and (Origin is null or Origin<=?)) and RecurrenceEnd>=? and DateDeleted=0" \
+") and DateDeleted=0"
+#define SELECT_OCCURRENCEHORIZONS_BY_ID \
+"select Origin, Horizon from OccurrenceHorizons where ComponentId=?"
+#define SELECT_HEADERS_BY_DATE \
+"select Type, UID, RecurId, RecurIdLocal, RecurIdTimeZone, Summary, DateStart, DateStartLocal, StartTimeZone, HasDueDate, DateEndDue, DateEndDueLocal, EndDueTimeZone, extra1, " \
+"exists (select 1 from Alarm where Alarm.ComponentId=Components.ComponentId), " \
+"(Recurrence is not null) as Recurs " \
+"from Components where ((DateStart<? and (DateEndDue>=? or (DateEndDue=0 and DateStart>=?))) or (RecurrenceEnd>=? and Recurs)) and DateDeleted=0"
 #define SELECT_COMPONENTS_BY_UID \
 "select * from Components where UID=? and DateDeleted=0"
+#define SELECT_COMPONENTS_BY_UIDS \
+"select * from Components where UID in (select value from json_each(?)) and DateDeleted=0"
 #define SELECT_COMPONENTS_BY_NOTEBOOKUID \
 "select * from Components where Notebook=? and DateDeleted=0"
-#define SELECT_ROWID_FROM_COMPONENTS_BY_NOTEBOOK_UID_AND_RECURID \
-"select ComponentId from Components where Notebook=? and UID=? and RecurId=? and DateDeleted=0"
+#define SELECT_ROWID_FROM_COMPONENTS_BY_UID_AND_RECURID \
+"select ComponentId, Attachments from Components where UID=? and RecurId=? and DateDeleted=0"
 
 #define SELECT_RDATES_BY_ID \
 "select * from Rdates where ComponentId=?"
+#define SELECT_CUSTOMPROPERTIES_BY_SELECTION \
+"select * from Customproperties where ComponentId in (select ComponentId from temp.Selection) order by ComponentId, rowid"
+#define SELECT_ALARM_BY_SELECTION \
+"select * from Alarm where ComponentId in (select ComponentId from temp.Selection) order by ComponentId, rowid"
+#define SELECT_ATTENDEE_BY_SELECTION \
+"select * from Attendee where ComponentId in (select ComponentId from temp.Selection) order by ComponentId, rowid"
+#define SELECT_ORGANIZER_BY_SELECTION \
+"select * from Attendee where IsOrganizer=1 and ComponentId in (select ComponentId from temp.Selection) order by ComponentId, rowid"
+#define SELECT_ATTACHMENTS_BY_SELECTION \
+"select * from Attachments where ComponentId in (select ComponentId from temp.Selection) order by ComponentId, rowid"
 #define SELECT_CUSTOMPROPERTIES_BY_ID \
 "select * from Customproperties where ComponentId=?"
 #define SELECT_RECURSIVE_BY_ID \
@@ -424,24 +827,68 @@ private:
 "select * from Components where DateDeleted>=? and DateCreated<?"
 #define SELECT_COMPONENTS_BY_DELETED_AND_NOTEBOOK \
 "select * from Components where DateDeleted>=? and DateCreated<? and Notebook=?"
+
+// Keyset pagination of the above queries, the last two parameters
+// being the last read ComponentId and the chunk size.
+#define SELECT_BY_CHUNK \
+" and ComponentId>? order by ComponentId limit ?"
+#define SELECT_COMPONENTS_ALL_BY_CHUNK \
+SELECT_COMPONENTS_ALL SELECT_BY_CHUNK
+#define SELECT_COMPONENTS_ALL_DELETED_BY_CHUNK \
+SELECT_COMPONENTS_ALL_DELETED SELECT_BY_CHUNK
+#define SELECT_COMPONENTS_BY_CREATED_BY_CHUNK \
+SELECT_COMPONENTS_BY_CREATED SELECT_BY_CHUNK
+#define SELECT_COMPONENTS_BY_LAST_MODIFIED_BY_CHUNK \
+SELECT_COMPONENTS_BY_LAST_MODIFIED SELECT_BY_CHUNK
+#define SELECT_COMPONENTS_BY_DELETED_BY_CHUNK \
+SELECT_COMPONENTS_BY_DELETED SELECT_BY_CHUNK
+// Components to export: deleted in an interval of dates, 0 being the
+// date of the not deleted ones, and occurring in a date range, series
+// from their start to the end of their recurrence.
+#define SELECT_COMPONENTS_FOR_EXPORT_BY_CHUNK \
+"select * from Components where DateDeleted between ? and ? and DateStart<? and (DateEndDue>=? or (DateEndDue=0 and DateStart>=?) or (RecurrenceEnd<>0 and RecurrenceEnd>=?))" SELECT_BY_CHUNK
+
 #define SELECT_COMPONENTS_BY_UID_RECID_AND_DELETED \
 "select ComponentId, DateDeleted from Components where UID=? and RecurId=? and DateDeleted<>0"
 #define SELECT_COMPONENTS_BY_NOTEBOOK_UID_RECID_AND_DELETED \
 "select ComponentId from Components where Notebook=? and UID=? and RecurId=? and DateDeleted<>0"
 
 #define SEARCH_COMPONENTS \
-"select *, (ComponentId in (select DISTINCT ComponentId from Recursive)" \
-"        or ComponentId in (select DISTINCT ComponentId from Rdates)) as doRecur" \
+"select *, (RecurrenceEnd<>0) as doRecur" \
 " from Components where DateDeleted=0 and (summary like ? escape '\\'" \
 "                                       or description like ? escape '\\'" \
 "                                       or location like ? escape '\\') order by doRecur desc, datestart desc"
+#define SEARCH_COMPONENTS_TEXT \
+"select Components.*, (RecurrenceEnd<>0) as doRecur" \
+" from ComponentsText cross join Components on Components.ComponentId=ComponentsText.rowid" \
+" where ComponentsText match ? and DateDeleted=0 order by doRecur desc, ComponentsText.rank, DateStart desc"
+#define SELECT_COMPONENTS_TEXT_EXISTS \
+"select 1 from sqlite_master where type='table' and name='ComponentsText'"
 
 #define UNSET_FLAG_FROM_CALENDAR \
 "update Calendars set Flags=(Flags & (~?))"
 
 #define BEGIN_TRANSACTION \
 "BEGIN IMMEDIATE;"
+#define BEGIN_READ_TRANSACTION \
+"BEGIN DEFERRED;"
 #define COMMIT_TRANSACTION \
 "END;"
+#define ROLLBACK_TRANSACTION \
+"ROLLBACK;"
+// Writing of a single incidence within a save transaction.
+#define SAVEPOINT_INCIDENCE \
+"SAVEPOINT Incidence;"
+#define RELEASE_INCIDENCE \
+"RELEASE Incidence;"
+#define ROLLBACK_INCIDENCE \
+"ROLLBACK TO Incidence;"
+
+// Databases are created with incremental auto-vacuum, so that the
+// pages freed by a purge can be given back to the file system.
+#define AUTO_VACUUM_INCREMENTAL \
+"PRAGMA auto_vacuum=INCREMENTAL;"
+#define INCREMENTAL_VACUUM \
+"PRAGMA incremental_vacuum;"
 
 #endif
@@ -0,0 +1,219 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "sqliteloader_p.h"
+#include "sqliteformat.h"
+#include "logging_p.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+
+using namespace KCalendarCore;
+
+using namespace mKCal;
+
+// Number of components read and handed over per batch.
+static const int gLoadBatchSize = 500;
+
+SqliteLoader::SqliteLoader(const QString &databaseName, const SqliteStorageOptions &options)
+    : mDatabaseName(databaseName),
+      mOptions(options)
+{
+}
+
+SqliteLoader::~SqliteLoader()
+{
+    delete mFormat;
+    sqlite3_close(mDatabase);
+}
+
+bool SqliteLoader::open()
+{
+    if (mDatabase) {
+        return true;
+    }
+
+    int rv = sqlite3_open_v2(mDatabaseName.toUtf8(), &mDatabase,
+                             mOptions.readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE, nullptr);
+    if (rv) {
+        qCWarning(lcMkcal) << "sqlite3_open_v2 error:" << rv << "on database" << mDatabaseName;
+        qCWarning(lcMkcal) << sqlite3_errmsg(mDatabase);
+        sqlite3_close(mDatabase);
+        mDatabase = nullptr;
+        return false;
+    }
+    SqliteFormat::applyOptions(mDatabase, mOptions);
+    mFormat = new SqliteFormat(mDatabase);
+
+    return true;
+}
+
+bool SqliteLoader::bind(sqlite3_stmt *stmt, const QVariantList &values)
+{
+    int rv = 0;
+    int index = 1;
+
+    for (const QVariant &value : values) {
+        if (value.typeId() == QMetaType::QByteArray) {
+            const QByteArray text = value.toByteArray();
+            SL3_bind_text(stmt, index, text.constData(), text.length(), SQLITE_TRANSIENT);
+        } else {
+            SL3_bind_int64(stmt, index, value.toLongLong());
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+SqliteLoader::Query SqliteLoader::seriesQuery(const QStringList &uids)
+{
+    // The uids are bound as a JSON array, read with json_each().
+    Query query(SELECT_COMPONENTS_BY_UIDS, sizeof(SELECT_COMPONENTS_BY_UIDS));
+    query.values << QJsonDocument(QJsonArray::fromStringList(uids)).toJson(QJsonDocument::Compact);
+    return query;
+}
+
+void SqliteLoader::load(int request, const QueryList &queries,
+                        ExtendedStorage::DeferredParts deferred)
+{
+    QStringList identifiers;
+    QSet<QString> series;
+    bool success = open();
+
+    for (QueryList::ConstIterator it = queries.constBegin();
+         success && it != queries.constEnd(); ++it) {
+        Incidence::List unindexed;
+        success = read(request, *it, deferred, &identifiers, &series,
+                       it->indexOccurrences ? &unindexed : nullptr);
+        if (success && !unindexed.isEmpty()
+            && !indexOccurrences(unindexed, it->indexStart, it->indexEnd)) {
+            // Indexed on a later load.
+            qCWarning(lcMkcal) << "cannot index occurrences in" << mDatabaseName;
+        }
+    }
+    if (success && !series.isEmpty()) {
+        success = readSeries(request, series, deferred);
+    }
+
+    emit finished(request, !success, identifiers);
+}
+
+bool SqliteLoader::read(int request, const Query &query, ExtendedStorage::DeferredParts deferred,
+                        QStringList *identifiers, QSet<QString> *series,
+                        Incidence::List *unindexed)
+{
+    int rv = 0;
+    int nRows = 0;
+    int count = 0;
+    int batchSize = 0;
+    bool success = false;
+    sqlite3_stmt *stmt = nullptr;
+
+    SL3_acquire(mFormat, query.query, query.qsize, stmt);
+    if (!bind(stmt, query.values)) {
+        goto error;
+    }
+
+    do {
+        Incidence::List list;
+        // Don't read more rows than the limit may need.
+        batchSize = query.limit > 0 ? qMin(gLoadBatchSize, query.limit - count) : gLoadBatchSize;
+        nRows = mFormat->selectComponents(stmt, &list, batchSize, deferred);
+        if (nRows < 0) {
+            goto error;
+        }
+        Incidence::List batch;
+        for (Incidence::List::ConstIterator it = list.constBegin();
+             it != list.constEnd() && (query.limit <= 0 || count < query.limit); ++it) {
+            if ((*it)->recurs() || (*it)->hasRecurrenceId()) {
+                if (query.loadSeries) {
+                    series->insert((*it)->uid());
+                }
+            } else {
+                // Apply limit on non recurring incidences only.
+                count += 1;
+            }
+            if (query.listIdentifiers) {
+                identifiers->append((*it)->instanceIdentifier());
+            }
+            batch.append(*it);
+        }
+        if (!batch.isEmpty()) {
+            if (unindexed) {
+                *unindexed += batch;
+            }
+            emit loaded(request, batch);
+        }
+    } while (nRows == batchSize && (query.limit <= 0 || count < query.limit));
+    success = true;
+
+error:
+    mFormat->releaseStatement(stmt);
+
+    return success;
+}
+
+bool SqliteLoader::readSeries(int request, const QSet<QString> &series,
+                              ExtendedStorage::DeferredParts deferred)
+{
+    return read(request, seriesQuery(series.values()), deferred, nullptr, nullptr);
+}
+
+// The database is not locked against the other storages, like for
+// a save: the index is not part of the saved content, and the series
+// failing to be indexed, if the database is busy, are indexed later.
+bool SqliteLoader::indexOccurrences(const Incidence::List &list,
+                                    sqlite3_int64 start, sqlite3_int64 end)
+{
+    int rv = 0;
+    char *errmsg = nullptr;
+    const char *query = nullptr;
+    bool success = false;
+    bool inTransaction = false;
+
+    if (mOptions.readOnly) {
+        return true;
+    }
+
+    query = BEGIN_TRANSACTION;
+    SL3_exec(mDatabase);
+    inTransaction = true;
+
+    for (const Incidence::Ptr &incidence : list) {
+        if (incidence->recurs() && !mFormat->indexOccurrences(*incidence, start, end)) {
+            qCWarning(lcMkcal) << "cannot index occurrences of" << incidence->uid();
+        }
+    }
+
+    query = COMMIT_TRANSACTION;
+    SL3_exec(mDatabase);
+    inTransaction = false;
+    success = true;
+
+error:
+    if (inTransaction) {
+        query = ROLLBACK_TRANSACTION;
+        SL3_try_exec(mDatabase);
+    }
+
+    return success;
+}
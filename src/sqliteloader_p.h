@@ -0,0 +1,145 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the SqliteLoader class.
+*/
+
+#ifndef MKCAL_SQLITELOADER_H
+#define MKCAL_SQLITELOADER_H
+
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+#include <QVariant>
+
+#include <KCalendarCore/Incidence>
+
+#include <sqlite3.h>
+
+#include "extendedstorage.h"
+#include "sqlitestorageoptions.h"
+
+namespace mKCal {
+
+class SqliteFormat;
+
+/**
+  @brief
+  Read incidences from a database in the thread the loader lives in,
+  with its own connection, tuned like the one of the storage.
+
+  The loaded incidences are not added to any calendar, but given
+  by batches with the loaded() signal, to be added to the calendar
+  in the thread of the storage. The connection is opened on the
+  first request and closed when the loader is destroyed.
+
+  The only writes of the loader are the occurrences of the series
+  read by queries with Query::indexOccurrences, indexed in its thread
+  rather than in the one of the storage. The connection is read-only
+  for a read-only storage, and nothing is indexed then.
+*/
+class SqliteLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+      A select query on the Components table, with its bound values.
+    */
+    struct Query {
+        Query(const char *query, int qsize)
+            : query(query), qsize(qsize) {}
+
+        const char *query;
+        int qsize;
+        /** Values bound in order, as integers or as UTF-8 text for QByteArray. */
+        QVariantList values;
+        /** The maximum number of non recurring incidences to read, 0 for all. */
+        int limit = 0;
+        /** Read also the whole series of the recurring incidences read. */
+        bool loadSeries = false;
+        /** List the instance identifiers of the incidences read. */
+        bool listIdentifiers = false;
+        /** The series read need their occurrences to be indexed, before finished() is emitted. */
+        bool indexOccurrences = false;
+        /** The range to index the occurrences over, see SqliteFormat::indexOccurrences(). */
+        sqlite3_int64 indexStart = 0;
+        sqlite3_int64 indexEnd = 0;
+    };
+    typedef QList<Query> QueryList;
+
+    /**
+      @param databaseName the database to read
+      @param options the tuning of the connection, see SqliteStorage::options()
+    */
+    SqliteLoader(const QString &databaseName, const SqliteStorageOptions &options);
+    ~SqliteLoader();
+
+    /**
+      Bind values to a statement, see Query::values.
+
+      @return true on success.
+    */
+    static bool bind(sqlite3_stmt *stmt, const QVariantList &values);
+
+    /**
+      A query reading all the incidences of several series,
+      parents and exceptions, with a single statement.
+
+      @param uids the uids of the series
+    */
+    static Query seriesQuery(const QStringList &uids);
+
+    /**
+      Run the queries of a request, to be called in the thread of the
+      loader. loaded() is emitted for every batch of read incidences,
+      then finished() is emitted once.
+
+      @param request an identifier of the request, given back in signals
+      @param queries the queries to run, in order
+      @param deferred the parts not to read, see ExtendedStorage::setDeferredParts()
+    */
+    void load(int request, const QueryList &queries,
+              ExtendedStorage::DeferredParts deferred);
+
+Q_SIGNALS:
+    void loaded(int request, const KCalendarCore::Incidence::List &list);
+    void finished(int request, bool error, const QStringList &identifiers);
+
+private:
+    bool open();
+    bool read(int request, const Query &query, ExtendedStorage::DeferredParts deferred,
+              QStringList *identifiers, QSet<QString> *series,
+              KCalendarCore::Incidence::List *unindexed = nullptr);
+    bool readSeries(int request, const QSet<QString> &series,
+                    ExtendedStorage::DeferredParts deferred);
+    bool indexOccurrences(const KCalendarCore::Incidence::List &list,
+                          sqlite3_int64 start, sqlite3_int64 end);
+
+    QString mDatabaseName;
+    SqliteStorageOptions mOptions;
+    sqlite3 *mDatabase = nullptr;
+    SqliteFormat *mFormat = nullptr;
+};
+
+}
+
+#endif
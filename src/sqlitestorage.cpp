@@ -33,6 +33,7 @@
 */
 #include "sqlitestorage.h"
 #include "sqliteformat.h"
+#include "sqliteloader_p.h"
 #include "logging_p.h"
 
 #include <KCalendarCore/MemoryCalendar>
@@ -40,13 +41,16 @@
 using namespace KCalendarCore;
 
 #include <QFileSystemWatcher>
+#include <QThread>
 
 #include <QtCore/QDir>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
 #include <QtCore/QUuid>
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 using namespace std;
 
 #ifdef Q_OS_UNIX
@@ -58,11 +62,18 @@ using namespace std;
 using namespace mKCal;
 
 static const QString gChanged(QLatin1String(".changed"));
+// Number of components read per batch when loading.
+static const int gLoadBatchSize = 500;
+// Number of components written per transaction when importing.
+static const int gImportBatchSize = 200;
+// Version of the database schema, the one of the last migration.
+static const int gDatabaseVersion = 8;
 
 static const char *createStatements[] =
 {
     CREATE_METADATA,
     CREATE_CALENDARS,
+    CREATE_TIMEZONES,
     CREATE_COMPONENTS,
     CREATE_RDATES,
     CREATE_CUSTOMPROPERTIES,
@@ -71,6 +82,10 @@ static const char *createStatements[] =
     CREATE_ATTENDEE,
     CREATE_ATTACHMENTS,
     CREATE_CALENDARPROPERTIES,
+    CREATE_COMPONENTS_RANGE,
+    CREATE_OCCURRENCES,
+    CREATE_OCCURRENCES_RANGE,
+    CREATE_OCCURRENCEHORIZONS,
     /* Create index on frequently used columns */
     INDEX_CALENDAR,
     INDEX_COMPONENT,
@@ -83,8 +98,331 @@ static const char *createStatements[] =
     INDEX_ATTENDEE,
     INDEX_ATTACHMENTS,
     INDEX_CALENDARPROPERTIES,
-    "PRAGMA foreign_keys = ON",
-    "PRAGMA user_version = 2"
+    INDEX_OCCURRENCES,
+    CREATE_MIGRATIONS
+};
+
+static bool createSchema(sqlite3 *database)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    for (unsigned int i = 0; i < (sizeof(createStatements)/sizeof(createStatements[0])); i++) {
+        query = createStatements[i];
+        SL3_exec(database);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool migrateTo1(sqlite3 *database)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    query = "DROP INDEX IF EXISTS IDX_ATTENDEE"; // recreate on new format
+    SL3_exec(database);
+    // insert normal attendee for every organizer
+    query = "INSERT INTO ATTENDEE(ComponentId, Email, Name, IsOrganizer, Role, PartStat, Rsvp, DelegatedTo, DelegatedFrom) "
+            "              SELECT ComponentId, Email, Name, 0, Role, PartStat, Rsvp, DelegatedTo, DelegatedFrom "
+            "              FROM ATTENDEE WHERE isOrganizer=1";
+    SL3_exec(database);
+
+    return true;
+
+error:
+    return false;
+}
+
+static bool migrateTo2(sqlite3 *database)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    query = "ALTER TABLE Components ADD COLUMN thisAndFuture INTEGER";
+    SL3_try_exec(database); // Ignore error if any, consider that column already exists.
+
+    return true;
+}
+
+// The statements of each migration are given as they were at its
+// version, later changes of the schema being done by later steps.
+static bool migrateTo3(sqlite3 *database)
+{
+    static const char createRange[] =
+        "CREATE VIRTUAL TABLE IF NOT EXISTS ComponentsRange USING rtree(ComponentId, DateMin, DateMax)";
+    static const char insertRanges[] =
+        "INSERT OR REPLACE INTO ComponentsRange SELECT ComponentId, "
+        "min(DateStart, CASE WHEN DateEndDue=0 THEN DateStart ELSE DateEndDue END), "
+        "max(DateStart, CASE WHEN DateEndDue=0 THEN DateStart ELSE DateEndDue END) "
+        "FROM Components WHERE DateDeleted=0";
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    query = createRange;
+    SL3_exec(database);
+    query = insertRanges;
+    SL3_exec(database);
+
+    return true;
+
+error:
+    return false;
+}
+
+// Existing series are indexed on their next range load.
+static bool migrateTo4(sqlite3 *database)
+{
+    static const char *const statements[] = {
+        "CREATE TABLE IF NOT EXISTS Occurrences(OccurrenceId INTEGER PRIMARY KEY, ComponentId INTEGER)",
+        "CREATE VIRTUAL TABLE IF NOT EXISTS OccurrencesRange USING rtree(OccurrenceId, DateMin, DateMax)",
+        "CREATE TABLE IF NOT EXISTS OccurrenceHorizons(ComponentId INTEGER PRIMARY KEY, Horizon INTEGER)",
+        "CREATE INDEX IF NOT EXISTS IDX_OCCURRENCES on Occurrences(ComponentId)"
+    };
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    for (const char *statement : statements) {
+        query = statement;
+        SL3_exec(database);
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// The RecurrenceEnd column is computed in migrateTo7(), with the
+// current encoding of the components.
+static bool migrateTo5(sqlite3 *database)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    query = "ALTER TABLE Components ADD COLUMN RecurrenceEnd INTEGER";
+    SL3_try_exec(database); // Ignore error if any, consider that column already exists.
+
+    return true;
+}
+
+// Time zone columns, converted from names to TimeZones identifiers.
+static const struct TimeZoneColumn {
+    const char *table;
+    const char *column;
+} timeZoneColumns[] =
+{
+    {"Components", "StartTimeZone"},
+    {"Components", "EndDueTimeZone"},
+    {"Components", "RecurIdTimeZone"},
+    {"Components", "CompletedTimeZone"},
+    {"Rdates", "TimeZone"},
+    {"Recursive", "untilTimeZone"},
+    {"Alarm", "triggerTimeZone"}
+};
+
+// Recreate a table with a new definition, keeping its content
+// and the identifiers of its rows, then encode its time zone columns.
+static bool rebuildTable(sqlite3 *database, const char *table, const char *create)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    sqlite3_stmt *stmt = nullptr;
+    QByteArray statement;
+    QByteArray columns;
+    QByteArray assignments;
+
+    statement = QByteArray("ALTER TABLE ") + table + " RENAME TO " + table + "V5";
+    query = statement.constData();
+    SL3_exec(database);
+    query = create;
+    SL3_exec(database);
+    // The columns of the previous definition kept by the new one.
+    statement = QByteArray("SELECT group_concat(name) FROM pragma_table_info('") + table + "V5') "
+        + "WHERE name IN (SELECT name FROM pragma_table_info('" + table + "'))";
+    SL3_prepare_v2(database, statement.constData(), statement.size(), &stmt, nullptr);
+    SL3_step(stmt);
+    columns = QByteArray((const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    stmt = nullptr;
+    statement = QByteArray("INSERT INTO ") + table + "(" + columns + ") SELECT " + columns + " FROM " + table + "V5";
+    query = statement.constData();
+    SL3_exec(database);
+    // Keep the autoincrement counter, the deleted identifiers are not reused.
+    statement = QByteArray("UPDATE sqlite_sequence SET seq=(SELECT seq FROM sqlite_sequence WHERE name='")
+        + table + "V5') WHERE name='" + table + "'";
+    query = statement.constData();
+    SL3_exec(database);
+    statement = QByteArray("DROP TABLE ") + table + "V5";
+    query = statement.constData();
+    SL3_exec(database);
+
+    if (qstrcmp(table, "Components") == 0) {
+        assignments = "Type=CASE Type WHEN 'Event' THEN 0 WHEN 'Todo' THEN 1 "
+                      "WHEN 'Journal' THEN 2 WHEN 'FreeBusy' THEN 3 ELSE 4 END";
+    }
+    for (const TimeZoneColumn &tz : timeZoneColumns) {
+        if (qstrcmp(tz.table, table) != 0) {
+            continue;
+        }
+        const QByteArray column = QByteArray(tz.table) + "." + tz.column;
+        if (!assignments.isEmpty()) {
+            assignments += ", ";
+        }
+        // See SqliteFormat::TimeZoneId for the reserved values.
+        assignments += QByteArray(tz.column) + "=CASE WHEN " + column + " IS NULL OR " + column + "='' THEN 0 "
+            + "WHEN " + column + "='FloatingDate' THEN -1 "
+            + "ELSE coalesce((SELECT TimeZoneId FROM TimeZones WHERE Name=" + column + "), 0) END";
+    }
+    statement = QByteArray("UPDATE ") + table + " SET " + assignments;
+    query = statement.constData();
+    SL3_exec(database);
+
+    return true;
+
+error:
+    sqlite3_finalize(stmt);
+    return false;
+}
+
+// Integer type codes and time zone identifiers instead of names.
+// The tables are rebuilt, an INTEGER column being needed to store
+// integers compactly. The indexes are created again by migrateTo7().
+static bool migrateTo6(sqlite3 *database)
+{
+    static const char createTimeZones[] =
+        "CREATE TABLE IF NOT EXISTS TimeZones(TimeZoneId INTEGER PRIMARY KEY, Name TEXT NOT NULL UNIQUE)";
+    static const char createComponents[] =
+        "CREATE TABLE IF NOT EXISTS Components(ComponentId INTEGER PRIMARY KEY AUTOINCREMENT, Notebook TEXT, Type INTEGER, Summary TEXT, Category TEXT, DateStart INTEGER, DateStartLocal INTEGER, StartTimeZone INTEGER, HasDueDate INTEGER, DateEndDue INTEGER, DateEndDueLocal INTEGER, EndDueTimeZone INTEGER, Duration INTEGER, Classification INTEGER, Location TEXT, Description TEXT, Status INTEGER, GeoLatitude REAL, GeoLongitude REAL, Priority INTEGER, Resources TEXT, DateCreated INTEGER, DateStamp INTEGER, DateLastModified INTEGER, Sequence INTEGER, Comments TEXT, Attachments TEXT, Contact TEXT, InvitationStatus INTEGER, RecurId INTEGER, RecurIdLocal INTEGER, RecurIdTimeZone INTEGER, RelatedTo TEXT, URL TEXT, UID TEXT, Transparency INTEGER, LocalOnly INTEGER, Percent INTEGER, DateCompleted INTEGER, DateCompletedLocal INTEGER, CompletedTimeZone INTEGER, DateDeleted INTEGER, extra1 STRING, extra2 STRING, extra3 INTEGER, thisAndFuture INTEGER, RecurrenceEnd INTEGER)";
+    static const char createRdates[] =
+        "CREATE TABLE IF NOT EXISTS Rdates(ComponentId INTEGER, Type INTEGER, Date INTEGER, DateLocal INTEGER, TimeZone INTEGER)";
+    static const char createRecursive[] =
+        "CREATE TABLE IF NOT EXISTS Recursive(ComponentId INTEGER, RuleType INTEGER, Frequency INTEGER, Until INTEGER, UntilLocal INTEGER, untilTimeZone INTEGER, Count INTEGER, Interval INTEGER, BySecond TEXT, ByMinute TEXT, ByHour TEXT, ByDay TEXT, ByDayPos Text, ByMonthDay TEXT, ByYearDay TEXT, ByWeekNum TEXT, ByMonth TEXT, BySetPos TEXT, WeekStart INTEGER)";
+    static const char createAlarm[] =
+        "CREATE TABLE IF NOT EXISTS Alarm(ComponentId INTEGER, Action INTEGER, Repeat INTEGER, Duration INTEGER, Offset INTEGER, Relation TEXT, DateTrigger INTEGER, DateTriggerLocal INTEGER, triggerTimeZone INTEGER, Description TEXT, Attachment TEXT, Summary TEXT, Address TEXT, CustomProperties TEXT, isEnabled INTEGER)";
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    QByteArray statement;
+
+    query = createTimeZones;
+    SL3_exec(database);
+    for (const TimeZoneColumn &tz : timeZoneColumns) {
+        statement = QByteArray("INSERT OR IGNORE INTO TimeZones(Name) SELECT ") + tz.column
+            + " FROM " + tz.table + " WHERE " + tz.column + " NOT IN ('', 'FloatingDate')";
+        query = statement.constData();
+        SL3_exec(database);
+    }
+
+    if (!rebuildTable(database, "Components", createComponents)
+        || !rebuildTable(database, "Rdates", createRdates)
+        || !rebuildTable(database, "Recursive", createRecursive)
+        || !rebuildTable(database, "Alarm", createAlarm)) {
+        return false;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+// Recurrence rules and dates encoded in Components.Recurrence, see
+// SqliteFormat::convertRecurrences(). The components are read with
+// their version 6 columns, and the recurrences encoded in a blob
+// carrying its version, for later encodings to keep reading it.
+static bool migrateTo7(sqlite3 *database)
+{
+    // The indexes dropped with the tables rebuilt by migrateTo6(),
+    // the components being looked up by UID while converting them.
+    static const char *const indexes[] = {
+        "CREATE INDEX IF NOT EXISTS IDX_COMPONENT on Components(ComponentId, Notebook, DateStart, DateEndDue, DateDeleted)",
+        "CREATE UNIQUE INDEX IF NOT EXISTS IDX_COMPONENT_UID on Components(UID, RecurId, DateDeleted)",
+        "CREATE INDEX IF NOT EXISTS IDX_COMPONENT_NOTEBOOK on Components(Notebook)",
+        "CREATE INDEX IF NOT EXISTS IDX_RDATES on Rdates(ComponentId)",
+        "CREATE INDEX IF NOT EXISTS IDX_RECURSIVE on Recursive(ComponentId)",
+        "CREATE INDEX IF NOT EXISTS IDX_ALARM on Alarm(ComponentId)"
+    };
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    sqlite3_stmt *stmt = nullptr;
+    bool missingEnds = false;
+
+    query = "ALTER TABLE Components ADD COLUMN Recurrence BLOB";
+    SL3_try_exec(database); // Ignore error if any, consider that column already exists.
+    for (const char *index : indexes) {
+        query = index;
+        SL3_exec(database);
+    }
+    {
+        SqliteFormat format(database);
+        if (!format.convertRecurrences()) {
+            qCWarning(lcMkcal) << "cannot convert the recurrence of incidences";
+            return false;
+        }
+    }
+
+    query = "SELECT 1 FROM Components WHERE RecurrenceEnd IS NULL LIMIT 1";
+    SL3_prepare_v2(database, query, -1, &stmt, nullptr);
+    SL3_step(stmt);
+    missingEnds = (rv == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    stmt = nullptr;
+    if (missingEnds) {
+        SqliteFormat format(database);
+        if (!format.updateRecurrenceEnds()) {
+            qCWarning(lcMkcal) << "cannot compute the end of recurring incidences";
+            return false;
+        }
+    }
+
+    return true;
+
+error:
+    sqlite3_finalize(stmt);
+    return false;
+}
+
+// Series indexed from a given date, not from their start, see
+// SqliteFormat::indexOccurrences(). Existing series have no origin,
+// they have been expanded from their start.
+static bool migrateTo8(sqlite3 *database)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+
+    query = "ALTER TABLE OccurrenceHorizons ADD COLUMN Origin INTEGER";
+    SL3_try_exec(database); // Ignore error if any, consider that column already exists.
+
+    return true;
+}
+
+// Steps from one version of the schema to the next, in order.
+static const struct Migration {
+    int version;
+    bool (*apply)(sqlite3 *database);
+} migrations[] =
+{
+    {1, migrateTo1},
+    {2, migrateTo2},
+    {3, migrateTo3},
+    {4, migrateTo4},
+    {5, migrateTo5},
+    {6, migrateTo6},
+    {7, migrateTo7},
+    {8, migrateTo8}
 };
 
 /**
@@ -96,11 +434,12 @@ class mKCal::SqliteStorage::Private
 {
 public:
     Private(const ExtendedCalendar::Ptr &calendar, SqliteStorage *storage,
-            const QString &databaseName
+            const QString &databaseName, const SqliteStorage::Options &options
            )
         : mCalendar(calendar),
           mStorage(storage),
           mDatabaseName(databaseName),
+          mOptions(options),
 #ifdef Q_OS_UNIX
           mSem(databaseName),
 #else
@@ -119,6 +458,9 @@ public:
     ExtendedCalendar::Ptr mCalendar;
     SqliteStorage *mStorage;
     QString mDatabaseName;
+    SqliteStorage::Options mOptions;
+    // The options in effect while the database is opened.
+    SqliteStorage::Options mEffectiveOptions;
 #ifdef Q_OS_UNIX
     ProcessMutex mSem;
 #else
@@ -133,22 +475,84 @@ public:
     QHash<QString, Incidence::Ptr> mIncidencesToInsert;
     QHash<QString, Incidence::Ptr> mIncidencesToUpdate;
     QHash<QString, Incidence::Ptr> mIncidencesToDelete;
+    QHash<QString, ExtendedStorage::DeferredParts> mDeferredIncidences;
+    // Parts of the loaded incidences as stored, so an update
+    // rewrites only the modified ones.
+    QHash<QString, SqliteFormat::Snapshot> mSnapshots;
     bool mIsLoading;
     bool mIsSaved;
-
-    bool addIncidence(const Incidence::Ptr &incidence);
-    bool loadRecurringIncidences();
-    int loadIncidences(sqlite3_stmt *stmt1);
+    bool mWal = false;
+    int mReadTransactions = 0;
+
+    // Pending request of the asynchronous loader.
+    struct AsyncLoad {
+        QString info;
+        // The date ranges loaded by the request, if any.
+        QList<QPair<QDate, QDate>> ranges;
+        // The parts not read by the request, see ExtendedStorage::setDeferredParts().
+        ExtendedStorage::DeferredParts deferred = ExtendedStorage::NoPart;
+        ExtendedStorage::SearchResultHandler handler;
+    };
+    QThread *mLoaderThread = nullptr;
+    SqliteLoader *mLoader = nullptr;
+    QHash<int, AsyncLoad> mAsyncLoads;
+    int mLastAsyncLoad = 0;
+
+    bool addIncidence(const Incidence::Ptr &incidence, ExtendedStorage::DeferredParts deferred);
+    bool hydrate(const Incidence::Ptr &incidence, ExtendedStorage::DeferredParts parts);
+    SqliteFormat::IncidenceParts modifiedParts(const QString &key, const Incidence &incidence,
+                                               SqliteFormat::IncidenceParts parts = SqliteFormat::AllParts) const;
+    SqliteLoader::QueryList rangeQueries(const QDateTime &loadStart, const QDateTime &loadEnd,
+                                         bool withSeries) const;
+    SqliteLoader::Query searchQuery(const QString &key, int limit) const;
+    int loadQuery(const SqliteLoader::Query &query);
+    bool loadAsync(const SqliteLoader::QueryList &queries, const AsyncLoad &load);
+    void asyncLoaded(int request, const Incidence::List &list);
+    void asyncFinished(int request, bool error, const QStringList &identifiers);
+    void stopLoader();
+    void applyMemoryBudget();
+    int unloadRange(const QDate &start, const QDate &end);
+    bool indexOccurrences(const Incidence::List &list, sqlite3_int64 start, sqlite3_int64 end);
+    bool applyOptions();
+    bool openReadOnly();
+    bool updateSchema();
+    bool recordMigration(int version);
+    bool beginRead();
+    void endRead();
+    int loadIncidences(sqlite3_stmt *stmt1, Incidence::List *loaded = nullptr);
     int loadIncidencesBySeries(sqlite3_stmt *stmt1, QStringList *identifiers = nullptr, int limit = 0);
-    bool saveIncidences(QHash<QString, Incidence::Ptr> &list, DBOperation dbop,
-                        Incidence::List *savedIncidences);
+    int purgeDeleted(const Incidence::List *list, const QDateTime &before, bool vacuum);
+    bool importBatch(const QByteArray &header, const QByteArray &timeZones,
+                     const QByteArray &components, int *count, int *failures);
+    bool saveIncidences(const QHash<QString, Incidence::Ptr> &list, DBOperation dbop,
+                        Incidence::List *savedIncidences,
+                        QHash<QString, Incidence::Ptr> *failedIncidences);
 };
 //@endcond
 
-SqliteStorage::SqliteStorage(const ExtendedCalendar::Ptr &cal, const QString &databaseName)
+SqliteStorage::SqliteStorage(const ExtendedCalendar::Ptr &cal, const QString &databaseName,
+                             const Options &options)
     : ExtendedStorage(cal),
-      d(new Private(cal, this, databaseName))
+      d(new Private(cal, this, databaseName, options))
+{
+}
+
+// Value of a pragma returning a single integer, or -1 on error.
+static qint64 pragmaValue(sqlite3 *database, const char *pragma)
 {
+    int rv = 0;
+    qint64 value = -1;
+    sqlite3_stmt *stmt = nullptr;
+
+    SL3_prepare_v2(database, pragma, -1, &stmt, nullptr);
+    SL3_step(stmt);
+    if (rv == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+
+error:
+    sqlite3_finalize(stmt);
+    return value;
 }
 
 // QDir::isReadable() doesn't support group permissions, only user permissions.
@@ -184,8 +588,8 @@ static QString defaultLocation()
     return dbFile;
 }
 
-SqliteStorage::SqliteStorage(const ExtendedCalendar::Ptr &cal)
-    : SqliteStorage(cal, defaultLocation())
+SqliteStorage::SqliteStorage(const ExtendedCalendar::Ptr &cal, const Options &options)
+    : SqliteStorage(cal, defaultLocation(), options)
 {
 }
 
@@ -200,6 +604,34 @@ QString SqliteStorage::databaseName() const
     return d->mDatabaseName;
 }
 
+SqliteStorage::StatementStatistics SqliteStorage::statementStatistics() const
+{
+    StatementStatistics statistics;
+
+    if (d->mFormat) {
+        const StatementCache::Statistics cache = d->mFormat->statementStatistics();
+        statistics.hits = cache.hits;
+        statistics.misses = cache.misses;
+        statistics.prepareNSecs = cache.prepareNSecs;
+    }
+    return statistics;
+}
+
+SqliteStorage::Options SqliteStorage::options() const
+{
+    return d->mDatabase ? d->mEffectiveOptions : d->mOptions;
+}
+
+void SqliteStorage::setWriteAheadLogging(bool enable)
+{
+    d->mOptions.journalMode = enable ? Options::JournalWal : Options::JournalDefault;
+}
+
+bool SqliteStorage::isWriteAheadLogging() const
+{
+    return d->mWal;
+}
+
 bool SqliteStorage::open()
 {
     int rv;
@@ -210,12 +642,19 @@ bool SqliteStorage::open()
         return false;
     }
 
+    if (d->mOptions.readOnly) {
+        if (!d->openReadOnly()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
     if (!d->mSem.acquire()) {
         qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
         return false;
     }
 
-    bool fileExisted = QFile::exists(d->mDatabaseName);
     rv = sqlite3_open(d->mDatabaseName.toUtf8(), &d->mDatabase);
     if (rv) {
         qCWarning(lcMkcal) << "sqlite3_open error:" << rv << "on database" << d->mDatabaseName;
@@ -224,59 +663,22 @@ bool SqliteStorage::open()
     }
     qCDebug(lcMkcal) << "database" << d->mDatabaseName << "opened";
 
-    // Set one and half second busy timeout for waiting for internal sqlite locks
-    sqlite3_busy_timeout(d->mDatabase, 1500);
-
-    {
-        sqlite3_stmt *dbVersion = nullptr;
-        SL3_prepare_v2(d->mDatabase, "PRAGMA user_version", -1, &dbVersion, nullptr);
-        SL3_step(dbVersion);
-        int version = 0;
-        if (rv == SQLITE_ROW) {
-            version = sqlite3_column_int(dbVersion, 0);
-        }
-        sqlite3_finalize(dbVersion);
-
-        if (version == 0 && fileExisted) {
-            qCWarning(lcMkcal) << "Migrating mkcal database to version 1";
-            query = BEGIN_TRANSACTION;
-            SL3_exec(d->mDatabase);
-            query = "DROP INDEX IF EXISTS IDX_ATTENDEE"; // recreate on new format
-            SL3_exec(d->mDatabase);
-            // insert normal attendee for every organizer
-            query = "INSERT INTO ATTENDEE(ComponentId, Email, Name, IsOrganizer, Role, PartStat, Rsvp, DelegatedTo, DelegatedFrom) "
-                    "              SELECT ComponentId, Email, Name, 0, Role, PartStat, Rsvp, DelegatedTo, DelegatedFrom "
-                    "              FROM ATTENDEE WHERE isOrganizer=1";
-            SL3_exec(d->mDatabase);
-            query = "PRAGMA user_version = 1";
-            SL3_exec(d->mDatabase);
-            query = COMMIT_TRANSACTION;
-            SL3_exec(d->mDatabase);
-
-            version = 1;
-        }
-        if (version == 1) {
-            qCWarning(lcMkcal) << "Migrating mkcal database to version 2";
-            query = BEGIN_TRANSACTION;
-            SL3_exec(d->mDatabase);
-            query = "ALTER TABLE Components ADD COLUMN thisAndFuture INTEGER";
-            SL3_try_exec(d->mDatabase); // Ignore error if any, consider that column already exists.
-            query = "PRAGMA user_version = 2";
-            SL3_exec(d->mDatabase);
-            query = COMMIT_TRANSACTION;
-            SL3_exec(d->mDatabase);
-
-            version = 2;
-        }
+    if (!d->applyOptions()) {
+        goto error;
     }
 
-    for (unsigned int i = 0; i < (sizeof(createStatements)/sizeof(createStatements[0])); i++) {
-         query = createStatements[i];
-         SL3_exec(d->mDatabase);
+    query = "PRAGMA foreign_keys = ON";
+    SL3_exec(d->mDatabase);
+
+    if (!d->updateSchema()) {
+        goto error;
     }
 
     d->mFormat = new SqliteFormat(d->mDatabase);
     d->mFormat->selectMetadata(&d->mSavedTransactionId);
+    if (!d->mFormat->createFullTextIndex()) {
+        qCDebug(lcMkcal) << "no full-text index on" << d->mDatabaseName << ", searching with LIKE";
+    }
 
     if (!d->mChanged.open(QIODevice::Append)) {
         qCWarning(lcMkcal) << "cannot open changed file for" << d->mDatabaseName;
@@ -320,16 +722,18 @@ bool SqliteStorage::load()
     query1 = SELECT_COMPONENTS_ALL;
     qsize1 = sizeof(SELECT_COMPONENTS_ALL);
 
-    SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
+    SL3_acquire(d->mFormat, query1, qsize1, stmt1);
 
     count = d->loadIncidences(stmt1);
 
 error:
+    d->mFormat->releaseStatement(stmt1);
     d->mIsLoading = false;
 
     setIsRecurrenceLoaded(count >= 0);
     if (count >= 0) {
         addLoadedRange(QDate(), QDate());
+        emitStorageFinished(false, "load completed");
     }
 
     return count >= 0;
@@ -364,162 +768,561 @@ bool SqliteStorage::load(const QString &uid)
         query1 = SELECT_COMPONENTS_BY_UID;
         qsize1 = sizeof(SELECT_COMPONENTS_BY_UID);
 
-        SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
+        SL3_acquire(d->mFormat, query1, qsize1, stmt1);
         u = uid.toUtf8();
         SL3_bind_text(stmt1, index, u.constData(), u.length(), SQLITE_STATIC);
 
         count = d->loadIncidences(stmt1);
     }
 error:
+    d->mFormat->releaseStatement(stmt1);
     d->mIsLoading = false;
+    if (count >= 0) {
+        emitStorageFinished(false, "load completed");
+    }
 
     return count >= 0;
 }
 
-bool SqliteStorage::load(const QDate &start, const QDate &end)
+bool SqliteStorage::load(const QStringList &uids)
 {
     if (!d->mDatabase) {
         return false;
     }
 
-    // We have no way to know if a recurring incidence
-    // is happening within [start, end[, so load them all.
-    if ((start.isValid() || end.isValid())
-        && !d->loadRecurringIncidences()) {
+    // Like load(uid), don't reload existing series.
+    QStringList missing;
+    for (const QString &uid : uids) {
+        if (!uid.isEmpty() && !calendar()->incidence(uid) && !missing.contains(uid)) {
+            missing.append(uid);
+        }
+    }
+    if (missing.isEmpty()) {
+        return true;
+    }
+
+    d->mIsLoading = true;
+    const int count = d->loadQuery(SqliteLoader::seriesQuery(missing));
+    d->mIsLoading = false;
+    if (count >= 0) {
+        emitStorageFinished(false, "load completed");
+    }
+
+    return count >= 0;
+}
+
+bool SqliteStorage::load(const QDate &start, const QDate &end)
+{
+    if (!d->mDatabase) {
         return false;
     }
 
-    int rv = 0;
-    int count = -1;
-    QDateTime loadStart;
-    QDateTime loadEnd;
+    int count = 0;
+    const QList<QPair<QDateTime, QDateTime>> ranges = getLoadRanges(start, end);
 
     d->mIsLoading = true;
 
-    if (getLoadDates(start, end, &loadStart, &loadEnd)) {
-        const char *query1 = NULL;
-        int qsize1 = 0;
-
-        sqlite3_stmt *stmt1 = NULL;
-        int index = 1;
-        qint64 secsStart;
-        qint64 secsEnd;
-
-        // Incidences to insert
-        if (loadStart.isValid() && loadEnd.isValid()) {
-            query1 = SELECT_COMPONENTS_BY_DATE_BOTH;
-            qsize1 = sizeof(SELECT_COMPONENTS_BY_DATE_BOTH);
-            SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
-            secsStart = d->mFormat->toOriginTime(loadStart);
-            secsEnd = d->mFormat->toOriginTime(loadEnd);
-            SL3_bind_int64(stmt1, index, secsEnd);
-            SL3_bind_int64(stmt1, index, secsStart);
-            SL3_bind_int64(stmt1, index, secsStart);
-        } else if (loadStart.isValid()) {
-            query1 = SELECT_COMPONENTS_BY_DATE_START;
-            qsize1 = sizeof(SELECT_COMPONENTS_BY_DATE_START);
-            SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
-            secsStart = d->mFormat->toOriginTime(loadStart);
-            SL3_bind_int64(stmt1, index, secsStart);
-            SL3_bind_int64(stmt1, index, secsStart);
-        } else if (loadEnd.isValid()) {
-            query1 = SELECT_COMPONENTS_BY_DATE_END;
-            qsize1 = sizeof(SELECT_COMPONENTS_BY_DATE_END);
-            SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
-            secsEnd = d->mFormat->toOriginTime(loadEnd);
-            SL3_bind_int64(stmt1, index, secsEnd);
-        } else {
-            query1 = SELECT_COMPONENTS_ALL;
-            qsize1 = sizeof(SELECT_COMPONENTS_ALL);
-            SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, NULL);
+    // One set of queries per range not loaded yet.
+    for (const QPair<QDateTime, QDateTime> &range : ranges) {
+        // Recurring incidences are loaded as whole series,
+        // when one of their occurrences is within the range.
+        const SqliteLoader::QueryList queries =
+            d->rangeQueries(range.first, range.second, (range.first.isValid() || range.second.isValid())
+                            && !isRecurrenceLoaded());
+        for (const SqliteLoader::Query &query : queries) {
+            const int n = d->loadQuery(query);
+            if (n < 0) {
+                count = -1;
+                break;
+            }
+            count += n;
         }
-        count = d->loadIncidences(stmt1);
-
-        if (count >= 0) {
-            addLoadedRange(loadStart.date(), loadEnd.date());
+        if (count < 0) {
+            break;
         }
-        if (loadStart.isNull() && loadEnd.isNull()) {
-            setIsRecurrenceLoaded(count >= 0);
+
+        addLoadedRange(range.first.date(), range.second.date());
+        if (range.first.isNull() && range.second.isNull()) {
+            setIsRecurrenceLoaded(true);
         }
-    } else {
-        count = 0;
     }
-error:
+    if (count >= 0 && !ranges.isEmpty()) {
+        d->applyMemoryBudget();
+    }
     d->mIsLoading = false;
+    // Once for all the queries of all the ranges.
+    if (count >= 0 && !ranges.isEmpty()) {
+        emitStorageFinished(false, "load completed");
+    }
 
     return count >= 0;
 }
 
-bool SqliteStorage::Private::loadRecurringIncidences()
+bool SqliteStorage::loadAsync(const QDate &start, const QDate &end)
 {
-    if (!mDatabase) {
+    if (!d->mDatabase) {
         return false;
     }
 
-    if (mStorage->isRecurrenceLoaded()) {
-        return true;
+    SqliteLoader::QueryList queries;
+    Private::AsyncLoad load;
+
+    load.info = QString::fromLatin1("load completed");
+    const QList<QPair<QDateTime, QDateTime>> ranges = getLoadRanges(start, end);
+    for (const QPair<QDateTime, QDateTime> &range : ranges) {
+        queries += d->rangeQueries(range.first, range.second,
+                                   (range.first.isValid() || range.second.isValid())
+                                   && !isRecurrenceLoaded());
+        load.ranges.append(qMakePair(range.first.date(), range.second.date()));
     }
 
-    int rv = 0;
-    int count = 0;
-    mIsLoading = true;
+    return d->loadAsync(queries, load);
+}
 
-    const char *query1 = NULL;
-    int qsize1 = 0;
+bool SqliteStorage::loadAsync(const QString &uid)
+{
+    if (!d->mDatabase || uid.isEmpty()) {
+        return false;
+    }
 
-    sqlite3_stmt *stmt1 = NULL;
+    SqliteLoader::QueryList queries;
+    Private::AsyncLoad load;
 
-    query1 = SELECT_COMPONENTS_BY_RECURSIVE;
-    qsize1 = sizeof(SELECT_COMPONENTS_BY_RECURSIVE);
+    load.info = QString::fromLatin1("load completed");
+    // Like load(uid), don't reload an existing incidence.
+    if (!calendar()->incidence(uid)) {
+        SqliteLoader::Query query(SELECT_COMPONENTS_BY_UID, sizeof(SELECT_COMPONENTS_BY_UID));
+        query.values << uid.toUtf8();
+        queries << query;
+    }
 
-    SL3_prepare_v2(mDatabase, query1, qsize1, &stmt1, NULL);
+    return d->loadAsync(queries, load);
+}
 
-    count = loadIncidences(stmt1);
+bool SqliteStorage::searchAsync(const QString &key, int limit,
+                                const SearchResultHandler &handler)
+{
+    if (!d->mDatabase || key.isEmpty()) {
+        return false;
+    }
 
-error:
-    mIsLoading = false;
+    SqliteLoader::Query query = d->searchQuery(key, limit);
+    Private::AsyncLoad load;
 
-    mStorage->setIsRecurrenceLoaded(count >= 0);
+    query.loadSeries = true;
+    query.listIdentifiers = true;
+    load.info = QString::fromLatin1("search completed");
+    load.handler = handler;
 
-    return count >= 0;
+    return d->loadAsync(SqliteLoader::QueryList() << query, load);
 }
 
-bool SqliteStorage::search(const QString &key, QStringList *identifiers, int limit)
+SqliteLoader::QueryList SqliteStorage::Private::rangeQueries(const QDateTime &loadStart,
+                                                             const QDateTime &loadEnd,
+                                                             bool withSeries) const
 {
-    if (!d->mDatabase || key.isEmpty())
-        return false;
-
-    d->mIsLoading = true;
-    const char *query1 = SEARCH_COMPONENTS;
-    int qsize1 = sizeof(SEARCH_COMPONENTS);
-    const QByteArray s('%' + key.toUtf8().replace("\\", "\\\\").replace("%", "\\%").replace("_", "\\_") + '%');
-    int rv = 0;
-    sqlite3_stmt *stmt1 = NULL;
-    int index = 1;
-    Incidence::Ptr incidence;
-    QString nbook;
-    int count = -1;
+    SqliteLoader::QueryList queries;
+    // Unbounded dates are given as the extreme values of the columns.
+    sqlite3_int64 secsStart = std::numeric_limits<sqlite3_int64>::min();
+    sqlite3_int64 secsEnd = std::numeric_limits<sqlite3_int64>::max();
 
-    qCDebug(lcMkcal) << "Searching DB for" << s;
-    SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, nullptr);
-    SL3_bind_text(stmt1, index, s.constData(), s.length(), SQLITE_STATIC);
-    SL3_bind_text(stmt1, index, s.constData(), s.length(), SQLITE_STATIC);
-    SL3_bind_text(stmt1, index, s.constData(), s.length(), SQLITE_STATIC);
+    if (loadStart.isValid()) {
+        secsStart = SqliteFormat::toOriginTime(loadStart);
+    }
+    if (loadEnd.isValid()) {
+        secsEnd = SqliteFormat::toOriginTime(loadEnd);
+    }
 
-    count = d->loadIncidencesBySeries(stmt1, identifiers, limit);
+    if (withSeries) {
+        // Series occurring in the range, from the occurrence index.
+        SqliteLoader::Query occurrences(SELECT_COMPONENTS_BY_OCCURRENCE,
+                                        sizeof(SELECT_COMPONENTS_BY_OCCURRENCE));
+        occurrences.values << secsEnd << secsStart << secsEnd << secsStart;
+        queries << occurrences;
+
+        // Series not indexed up to the end of the range
+        // may occur in it, load them all, unless they are finished.
+        SqliteLoader::Query unindexed(SELECT_COMPONENTS_BY_HORIZON,
+                                      sizeof(SELECT_COMPONENTS_BY_HORIZON));
+        unindexed.values << secsEnd << secsStart << secsStart;
+        unindexed.indexOccurrences = true;
+        unindexed.indexStart = secsStart;
+        unindexed.indexEnd = secsEnd;
+        queries << unindexed;
+    }
 
-error:
-    d->mIsLoading = false;
+    if (loadStart.isValid() && loadEnd.isValid()) {
+        SqliteLoader::Query query(SELECT_COMPONENTS_BY_DATE_BOTH,
+                                  sizeof(SELECT_COMPONENTS_BY_DATE_BOTH));
+        query.values << secsEnd << secsStart << secsEnd << secsStart << secsStart;
+        queries << query;
+    } else if (loadStart.isValid()) {
+        SqliteLoader::Query query(SELECT_COMPONENTS_BY_DATE_START,
+                                  sizeof(SELECT_COMPONENTS_BY_DATE_START));
+        query.values << secsStart << secsStart << secsStart;
+        queries << query;
+    } else if (loadEnd.isValid()) {
+        SqliteLoader::Query query(SELECT_COMPONENTS_BY_DATE_END,
+                                  sizeof(SELECT_COMPONENTS_BY_DATE_END));
+        query.values << secsEnd << secsEnd;
+        queries << query;
+    } else {
+        queries << SqliteLoader::Query(SELECT_COMPONENTS_ALL, sizeof(SELECT_COMPONENTS_ALL));
+    }
 
-    return count >= 0;
+    return queries;
 }
 
-//@cond PRIVATE
-bool SqliteStorage::Private::addIncidence(const Incidence::Ptr &incidence)
+int SqliteStorage::Private::loadQuery(const SqliteLoader::Query &query)
 {
-    bool added = true;
-    const QString key = incidence->instanceIdentifier();
-    if (mIncidencesToInsert.contains(key) ||
+    int count = -1;
+    Incidence::List loaded;
+    sqlite3_stmt *stmt = mFormat->acquireStatement(query.query, query.qsize);
+
+    if (stmt && SqliteLoader::bind(stmt, query.values)) {
+        count = loadIncidences(stmt, query.indexOccurrences ? &loaded : nullptr);
+    }
+    mFormat->releaseStatement(stmt);
+    if (count >= 0 && query.indexOccurrences) {
+        indexOccurrences(loaded, query.indexStart, query.indexEnd);
+    }
+
+    return count;
+}
+
+bool SqliteStorage::Private::loadAsync(const SqliteLoader::QueryList &queries,
+                                       const AsyncLoad &load)
+{
+    AsyncLoad pending = load;
+    if (!mLoader) {
+        mLoaderThread = new QThread;
+        mLoader = new SqliteLoader(mDatabaseName, mOptions);
+        mLoader->moveToThread(mLoaderThread);
+        QObject::connect(mLoader, &SqliteLoader::loaded, mStorage,
+                         [this] (int request, const Incidence::List &list) {
+                             asyncLoaded(request, list);
+                         });
+        QObject::connect(mLoader, &SqliteLoader::finished, mStorage,
+                         [this] (int request, bool error, const QStringList &identifiers) {
+                             asyncFinished(request, error, identifiers);
+                         });
+        mLoaderThread->start();
+    }
+
+    const int request = ++mLastAsyncLoad;
+    const ExtendedStorage::DeferredParts deferred = mStorage->deferredParts();
+    SqliteLoader *loader = mLoader;
+    // The deferred parts may change before the incidences are added.
+    pending.deferred = deferred;
+    mAsyncLoads.insert(request, pending);
+    if (!QMetaObject::invokeMethod(loader, [loader, request, queries, deferred] {
+                                               loader->load(request, queries, deferred);
+                                           }, Qt::QueuedConnection)) {
+        mAsyncLoads.remove(request);
+        return false;
+    }
+
+    return true;
+}
+
+void SqliteStorage::Private::asyncLoaded(int request, const Incidence::List &list)
+{
+    QHash<int, AsyncLoad>::Iterator it = mAsyncLoads.find(request);
+    if (it == mAsyncLoads.end()) {
+        // The storage has been closed since the request.
+        return;
+    }
+
+    mIsLoading = true;
+    for (const Incidence::Ptr &incidence : list) {
+        addIncidence(incidence, it->deferred);
+    }
+    mIsLoading = false;
+}
+
+void SqliteStorage::Private::asyncFinished(int request, bool error,
+                                           const QStringList &identifiers)
+{
+    QHash<int, AsyncLoad>::Iterator it = mAsyncLoads.find(request);
+    if (it == mAsyncLoads.end()) {
+        return;
+    }
+    const AsyncLoad load = *it;
+    mAsyncLoads.erase(it);
+
+    if (!error) {
+        for (const QPair<QDate, QDate> &range : load.ranges) {
+            mStorage->addLoadedRange(range.first, range.second);
+            if (range.first.isNull() && range.second.isNull()) {
+                mStorage->setIsRecurrenceLoaded(true);
+            }
+        }
+        if (!load.ranges.isEmpty()) {
+            applyMemoryBudget();
+        }
+    }
+    if (load.handler) {
+        load.handler(identifiers);
+    }
+    mStorage->emitStorageFinished(error, load.info);
+}
+
+void SqliteStorage::Private::applyMemoryBudget()
+{
+    const int budget = mStorage->memoryBudget();
+    if (budget <= 0) {
+        return;
+    }
+
+    int count = mCalendar->rawIncidences().count();
+    QDate start;
+    QDate end;
+    while (count > budget && mStorage->takeLeastRecentlyUsedRange(&start, &end)) {
+        count -= unloadRange(start, end);
+    }
+}
+
+int SqliteStorage::Private::unloadRange(const QDate &start, const QDate &end)
+{
+    const QTimeZone timeZone = mCalendar->timeZone();
+    Incidence::List unloaded;
+
+    for (const Incidence::Ptr &incidence : mCalendar->rawIncidences()) {
+        if (incidence->recurs() || incidence->hasRecurrenceId()) {
+            continue;
+        }
+        const QString key = incidence->instanceIdentifier();
+        if (mIncidencesToInsert.contains(key) || mIncidencesToUpdate.contains(key)
+            || mIncidencesToDelete.contains(key)) {
+            continue;
+        }
+        const QDateTime dtStart = incidence->dtStart();
+        QDateTime dtEnd = incidence->dateTime(Incidence::RoleEnd);
+        if (!dtEnd.isValid()) {
+            dtEnd = dtStart;
+        }
+        if (!dtEnd.isValid()) {
+            continue;
+        }
+        // The days of the incidence in the calendar time zone.
+        const QDate first = incidence->allDay() ? (dtStart.isValid() ? dtStart : dtEnd).date()
+            : (dtStart.isValid() ? dtStart : dtEnd).toTimeZone(timeZone).date();
+        const QDate last = incidence->allDay() ? dtEnd.date() : dtEnd.toTimeZone(timeZone).date();
+        // Incidences in the range, and in no other loaded range,
+        // the other ranges still needing the ones they have loaded.
+        if ((start.isValid() && last < start) || (end.isValid() && first >= end)
+            || mStorage->isLoadedRangeOverlapping(first, last.addDays(1))) {
+            continue;
+        }
+        unloaded.append(incidence);
+    }
+
+    // Removing incidences from the calendar is not a deletion.
+    const bool tracking = mCalendar->deletionTracking();
+    mCalendar->setDeletionTracking(false);
+    mIsLoading = true;
+    for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(unloaded)) {
+        mDeferredIncidences.remove(incidence->instanceIdentifier());
+        mSnapshots.remove(incidence->instanceIdentifier());
+        mCalendar->deleteIncidence(incidence);
+    }
+    mIsLoading = false;
+    mCalendar->setDeletionTracking(tracking);
+    qCDebug(lcMkcal) << "unloaded" << unloaded.count() << "incidences from" << start << end;
+
+    return unloaded.count();
+}
+
+void SqliteStorage::Private::stopLoader()
+{
+    if (mLoaderThread) {
+        // Wait for the current request, the queued ones are dropped.
+        mLoaderThread->quit();
+        mLoaderThread->wait();
+        delete mLoader;
+        mLoader = nullptr;
+        delete mLoaderThread;
+        mLoaderThread = nullptr;
+    }
+
+    const int canceled = mAsyncLoads.count();
+    mAsyncLoads.clear();
+    for (int i = 0; i < canceled; i++) {
+        mStorage->emitStorageFinished(true, QString::fromLatin1("load canceled"));
+    }
+}
+
+bool SqliteStorage::Private::indexOccurrences(const Incidence::List &list,
+                                              sqlite3_int64 start, sqlite3_int64 end)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    bool success = false;
+    bool inTransaction = false;
+    Incidence::List series;
+
+    for (const Incidence::Ptr &incidence : list) {
+        if (incidence->recurs()) {
+            series.append(incidence);
+        }
+    }
+    // Without indexing, series keep being loaded by their horizon,
+    // until a writer indexes them.
+    if (series.isEmpty() || mOptions.readOnly) {
+        return true;
+    }
+
+    if (!mSem.acquire()) {
+        qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
+        return false;
+    }
+
+    query = BEGIN_TRANSACTION;
+    SL3_exec(mDatabase);
+    inTransaction = true;
+
+    for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(series)) {
+        if (!mFormat->indexOccurrences(*incidence, start, end)) {
+            qCWarning(lcMkcal) << "cannot index occurrences of" << incidence->uid();
+        }
+    }
+
+    query = COMMIT_TRANSACTION;
+    SL3_exec(mDatabase);
+    inTransaction = false;
+    success = true;
+
+ error:
+    if (inTransaction) {
+        query = ROLLBACK_TRANSACTION;
+        SL3_try_exec(mDatabase);
+    }
+    if (!mSem.release()) {
+        qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+    }
+    return success;
+}
+
+bool SqliteStorage::loadHeaders(const QDate &start, const QDate &end,
+                                IncidenceHeader::List *list)
+{
+    if (!d->mDatabase || !list) {
+        return false;
+    }
+
+    int rv = 0;
+    int index = 1;
+    bool success = false;
+    const char *query1 = SELECT_HEADERS_BY_DATE;
+    int qsize1 = sizeof(SELECT_HEADERS_BY_DATE);
+    sqlite3_stmt *stmt1 = NULL;
+    // Unbounded dates are given as the extreme values of the columns.
+    sqlite3_int64 secsStart = std::numeric_limits<sqlite3_int64>::min();
+    sqlite3_int64 secsEnd = std::numeric_limits<sqlite3_int64>::max();
+
+    if (start.isValid()) {
+        secsStart = d->mFormat->toOriginTime(QDateTime(start, QTime(0, 0), calendar()->timeZone()));
+    }
+    if (end.isValid()) {
+        secsEnd = d->mFormat->toOriginTime(QDateTime(end, QTime(0, 0), calendar()->timeZone()));
+    }
+
+    if (!d->beginRead()) {
+        return false;
+    }
+
+    SL3_acquire(d->mFormat, query1, qsize1, stmt1);
+    SL3_bind_int64(stmt1, index, secsEnd);
+    SL3_bind_int64(stmt1, index, secsStart);
+    SL3_bind_int64(stmt1, index, secsStart);
+    SL3_bind_int64(stmt1, index, secsStart);
+
+    success = d->mFormat->selectHeaders(stmt1, list);
+
+error:
+    d->mFormat->releaseStatement(stmt1);
+    d->endRead();
+    return success;
+}
+
+bool SqliteStorage::hydrate(const Incidence::Ptr &incidence, DeferredParts parts)
+{
+    if (!d->mDatabase || !incidence) {
+        return false;
+    }
+
+    parts &= pendingParts(incidence);
+    if (parts == NoPart) {
+        return true;
+    }
+
+    if (!d->beginRead()) {
+        return false;
+    }
+
+    bool success = d->hydrate(incidence, parts);
+
+    d->endRead();
+
+    return success;
+}
+
+ExtendedStorage::DeferredParts SqliteStorage::pendingParts(const Incidence::Ptr &incidence) const
+{
+    return incidence
+        ? d->mDeferredIncidences.value(incidence->instanceIdentifier(), NoPart)
+        : NoPart;
+}
+
+bool SqliteStorage::search(const QString &key, QStringList *identifiers, int limit)
+{
+    if (!d->mDatabase || key.isEmpty())
+        return false;
+
+    d->mIsLoading = true;
+    const SqliteLoader::Query query = d->searchQuery(key, limit);
+    sqlite3_stmt *stmt1 = d->mFormat->acquireStatement(query.query, query.qsize);
+    int count = -1;
+
+    if (stmt1 && SqliteLoader::bind(stmt1, query.values)) {
+        count = d->loadIncidencesBySeries(stmt1, identifiers, limit);
+    }
+    d->mFormat->releaseStatement(stmt1);
+    d->mIsLoading = false;
+
+    return count >= 0;
+}
+
+SqliteLoader::Query SqliteStorage::Private::searchQuery(const QString &key, int limit) const
+{
+    if (mFormat->hasFullTextIndex()
+        && std::any_of(key.constBegin(), key.constEnd(),
+                       [] (const QChar &c) {return c.isLetterOrNumber();})) {
+        // The words of key, in sequence, the last one being a prefix.
+        const QByteArray s('"' + key.toUtf8().replace('"', "\"\"") + "\"*");
+        SqliteLoader::Query query(SEARCH_COMPONENTS_TEXT, sizeof(SEARCH_COMPONENTS_TEXT));
+        qCDebug(lcMkcal) << "Searching full-text index for" << s;
+        query.values << s;
+        query.limit = limit;
+        return query;
+    } else {
+        const QByteArray s('%' + key.toUtf8().replace("\\", "\\\\").replace("%", "\\%").replace("_", "\\_") + '%');
+        SqliteLoader::Query query(SEARCH_COMPONENTS, sizeof(SEARCH_COMPONENTS));
+        qCDebug(lcMkcal) << "Searching DB for" << s;
+        query.values << s << s << s;
+        query.limit = limit;
+        return query;
+    }
+}
+
+//@cond PRIVATE
+bool SqliteStorage::Private::addIncidence(const Incidence::Ptr &incidence,
+                                          ExtendedStorage::DeferredParts deferred)
+{
+    bool added = true;
+    const QString key = incidence->instanceIdentifier();
+    if (mIncidencesToInsert.contains(key) ||
         mIncidencesToUpdate.contains(key) ||
         mIncidencesToDelete.contains(key)) {
         qCWarning(lcMkcal) << "not loading" << incidence->uid();
@@ -539,96 +1342,421 @@ bool SqliteStorage::Private::addIncidence(const Incidence::Ptr &incidence)
         added = false;
         qCWarning(lcMkcal) << "cannot add incidence" << incidence->uid();
     }
+    if (added) {
+        if (deferred != ExtendedStorage::NoPart) {
+            mDeferredIncidences.insert(key, deferred);
+        } else {
+            mDeferredIncidences.remove(key);
+        }
+        mSnapshots.insert(key, mFormat->snapshot(*incidence));
+    }
 
     return added;
 }
 
-int SqliteStorage::Private::loadIncidences(sqlite3_stmt *stmt1)
+bool SqliteStorage::Private::hydrate(const Incidence::Ptr &incidence,
+                                     ExtendedStorage::DeferredParts parts)
 {
-    int count = 0;
-    Incidence::Ptr incidence;
+    const QString key = incidence->instanceIdentifier();
+    const QDateTime lastModified = incidence->lastModified();
+    const bool isLoading = mIsLoading;
+    const SqliteFormat::IncidenceParts modified =
+        modifiedParts(key, *incidence, SqliteFormat::AttendeesPart | SqliteFormat::AttachmentsPart);
 
-    if (!mSem.acquire()) {
-        qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
-        return -1;
+    // Reading the stored parts is not a modification of the incidence.
+    mIsLoading = true;
+    incidence->startUpdates();
+    bool success = mFormat->selectParts(incidence, parts);
+    incidence->endUpdates();
+    incidence->setLastModified(lastModified);
+    mIsLoading = isLoading;
+
+    if (success) {
+        const ExtendedStorage::DeferredParts pending = mDeferredIncidences.value(key) & ~parts;
+        if (pending == ExtendedStorage::NoPart) {
+            mDeferredIncidences.remove(key);
+        } else {
+            mDeferredIncidences.insert(key, pending);
+        }
+
+        // The parts just read are as stored, unless they
+        // were already modified before.
+        QHash<QString, SqliteFormat::Snapshot>::Iterator snapshot = mSnapshots.find(key);
+        if (snapshot != mSnapshots.end()) {
+            if ((parts & ExtendedStorage::AttendeesPart)
+                && !(modified & SqliteFormat::AttendeesPart)) {
+                snapshot->organizer = incidence->organizer();
+                snapshot->attendees = incidence->attendees();
+            }
+            if ((parts & ExtendedStorage::AttachmentsPart)
+                && !(modified & SqliteFormat::AttachmentsPart)) {
+                snapshot->attachments = incidence->attachments();
+            }
+        }
     }
 
-    while ((incidence = mFormat->selectComponents(stmt1))) {
-        if (addIncidence(incidence)) {
-            // qCDebug(lcMkcal) << "updating incidence" << incidence->uid()
-            //                  << incidence->dtStart() << endDateTime
-            //                  << "in calendar";
-            count += 1;
+    return success;
+}
+
+SqliteFormat::IncidenceParts SqliteStorage::Private::modifiedParts(const QString &key,
+                                                                   const Incidence &incidence,
+                                                                   SqliteFormat::IncidenceParts parts) const
+{
+    QHash<QString, SqliteFormat::Snapshot>::ConstIterator snapshot = mSnapshots.constFind(key);
+    return snapshot != mSnapshots.constEnd()
+        ? mFormat->changedParts(*snapshot, incidence, parts)
+        : parts;
+}
+
+bool SqliteStorage::Private::applyOptions()
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    sqlite3_stmt *journalMode = nullptr;
+
+    SqliteFormat::applyOptions(mDatabase, mOptions);
+
+    // The journal mode is stored in the database file, so every
+    // process opening it afterwards uses it too.
+    if (mOptions.readOnly) {
+        // Cannot be changed.
+    } else if (mOptions.journalMode == SqliteStorage::Options::JournalWal) {
+        query = "PRAGMA journal_mode=WAL";
+        SL3_try_exec(mDatabase); // Keep the current mode on error.
+    } else if (mOptions.journalMode == SqliteStorage::Options::JournalRollback) {
+        query = "PRAGMA journal_mode=DELETE";
+        SL3_try_exec(mDatabase); // Keep the current mode on error.
+    }
+
+    // Report the values in effect, whatever the requested ones.
+    mEffectiveOptions = mOptions;
+    mEffectiveOptions.cacheSize = pragmaValue(mDatabase, "PRAGMA cache_size");
+    mEffectiveOptions.mmapSize = pragmaValue(mDatabase, "PRAGMA mmap_size");
+    mEffectiveOptions.synchronous =
+        SqliteStorage::Options::Synchronous(pragmaValue(mDatabase, "PRAGMA synchronous"));
+    mEffectiveOptions.tempStore =
+        SqliteStorage::Options::TempStore(pragmaValue(mDatabase, "PRAGMA temp_store"));
+    mEffectiveOptions.busyTimeout = pragmaValue(mDatabase, "PRAGMA busy_timeout");
+
+    SL3_prepare_v2(mDatabase, "PRAGMA journal_mode", -1, &journalMode, nullptr);
+    SL3_step(journalMode);
+    mWal = (rv == SQLITE_ROW)
+        && !qstricmp(reinterpret_cast<const char*>(sqlite3_column_text(journalMode, 0)), "wal");
+    mEffectiveOptions.journalMode = mWal
+        ? SqliteStorage::Options::JournalWal : SqliteStorage::Options::JournalRollback;
+    sqlite3_finalize(journalMode);
+
+    qCDebug(lcMkcal) << "database" << mDatabaseName << "cache size" << mEffectiveOptions.cacheSize
+                     << "mmap size" << mEffectiveOptions.mmapSize
+                     << "synchronous" << mEffectiveOptions.synchronous
+                     << "temp store" << mEffectiveOptions.tempStore
+                     << "write-ahead log" << mWal;
+
+    return true;
+
+error:
+    sqlite3_finalize(journalMode);
+    return false;
+}
+
+bool SqliteStorage::Private::openReadOnly()
+{
+    // No lock, nothing is written: the database must exist
+    // with the current schema already.
+    int rv = sqlite3_open_v2(mDatabaseName.toUtf8(), &mDatabase, SQLITE_OPEN_READONLY, nullptr);
+    if (rv) {
+        qCWarning(lcMkcal) << "sqlite3_open_v2 error:" << rv << "on database" << mDatabaseName;
+        qCWarning(lcMkcal) << sqlite3_errmsg(mDatabase);
+        return false;
+    }
+    qCDebug(lcMkcal) << "database" << mDatabaseName << "opened read-only";
+
+    if (!applyOptions()) {
+        return false;
+    }
+
+    const qint64 version = pragmaValue(mDatabase, "PRAGMA user_version");
+    if (version != gDatabaseVersion) {
+        qCWarning(lcMkcal) << "cannot open database" << mDatabaseName << "read-only, version"
+                           << version << "instead of" << gDatabaseVersion;
+        return false;
+    }
+
+    mFormat = new SqliteFormat(mDatabase);
+    mFormat->selectMetadata(&mSavedTransactionId);
+    if (!mFormat->selectFullTextIndex()) {
+        qCDebug(lcMkcal) << "no full-text index on" << mDatabaseName << ", searching with LIKE";
+    }
+
+    // Watch the changes done by the writers, when there is any.
+    if (QFile::exists(mChanged.fileName())) {
+        mWatcher = new QFileSystemWatcher();
+        mWatcher->addPath(mChanged.fileName());
+        QObject::connect(mWatcher, &QFileSystemWatcher::fileChanged,
+                         mStorage, &SqliteStorage::fileChanged);
+    }
+
+    return true;
+}
+
+bool SqliteStorage::Private::updateSchema()
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    sqlite3_stmt *stmt = nullptr;
+    bool exists = false;
+    bool inTransaction = false;
+    const qint64 version = pragmaValue(mDatabase, "PRAGMA user_version");
+
+    // Nothing to compile nor to execute at each open.
+    if (version == gDatabaseVersion) {
+        return true;
+    } else if (version > gDatabaseVersion) {
+        // The rows would be written in a format unknown to newer versions.
+        qCWarning(lcMkcal) << "cannot open database" << mDatabaseName << "for writing, version"
+                           << version << "is newer than" << gDatabaseVersion;
+        return false;
+    }
+
+    SL3_prepare_v2(mDatabase, SELECT_COMPONENTS_TABLE_EXISTS, sizeof(SELECT_COMPONENTS_TABLE_EXISTS),
+                   &stmt, nullptr);
+    SL3_step(stmt);
+    exists = (rv == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    stmt = nullptr;
+
+    if (!exists) {
+        // Only possible before the first table is created.
+        query = AUTO_VACUUM_INCREMENTAL;
+        SL3_try_exec(mDatabase);
+        // A new database is created at the current version directly.
+        query = BEGIN_TRANSACTION;
+        SL3_exec(mDatabase);
+        inTransaction = true;
+        if (!createSchema(mDatabase) || !recordMigration(gDatabaseVersion)) {
+            goto error;
+        }
+        query = COMMIT_TRANSACTION;
+        SL3_exec(mDatabase);
+        return true;
+    }
+
+    for (const Migration &migration : migrations) {
+        if (migration.version <= version) {
+            continue;
+        }
+        qCWarning(lcMkcal) << "Migrating mkcal database to version" << migration.version;
+        query = BEGIN_TRANSACTION;
+        SL3_exec(mDatabase);
+        inTransaction = true;
+        if (!migration.apply(mDatabase)) {
+            goto error;
+        }
+        // Indexes dropped by the migrations, created again within
+        // the last one, not to leave a migrated database without them.
+        if (migration.version == gDatabaseVersion && !createSchema(mDatabase)) {
+            goto error;
         }
+        if (!recordMigration(migration.version)) {
+            goto error;
+        }
+        query = COMMIT_TRANSACTION;
+        SL3_exec(mDatabase);
+        inTransaction = false;
     }
 
-    sqlite3_finalize(stmt1);
+    return true;
 
-    if (!mSem.release()) {
-        qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+error:
+    sqlite3_finalize(stmt);
+    if (inTransaction) {
+        query = "ROLLBACK";
+        SL3_try_exec(mDatabase);
     }
-    mStorage->emitStorageFinished(false, "load completed");
+    return false;
+}
 
-    return count;
+bool SqliteStorage::Private::recordMigration(int version)
+{
+    int rv = 0;
+    int index = 1;
+    char *errmsg = NULL;
+    bool success = false;
+    sqlite3_stmt *stmt = nullptr;
+    const QByteArray userVersion = "PRAGMA user_version = " + QByteArray::number(version);
+    const char *query = CREATE_MIGRATIONS;
+
+    SL3_exec(mDatabase);
+    SL3_prepare_v2(mDatabase, INSERT_MIGRATION, sizeof(INSERT_MIGRATION), &stmt, nullptr);
+    SL3_bind_int(stmt, index, version);
+    SL3_bind_int64(stmt, index, SqliteFormat::toOriginTime(QDateTime::currentDateTimeUtc()));
+    SL3_step(stmt);
+    query = userVersion.constData();
+    SL3_exec(mDatabase);
+    success = true;
+
+error:
+    sqlite3_finalize(stmt);
+    return success;
 }
 
-int SqliteStorage::Private::loadIncidencesBySeries(sqlite3_stmt *stmt1, QStringList *identifiers, int limit)
+bool SqliteStorage::Private::beginRead()
+{
+    if (!mWal) {
+        if (!mSem.acquire()) {
+            qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    // With a write-ahead log, writers of other processes don't
+    // disturb a deferred transaction, no need for the lock.
+    if (mReadTransactions > 0) {
+        mReadTransactions += 1;
+        return true;
+    }
+
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = BEGIN_READ_TRANSACTION;
+    SL3_exec(mDatabase);
+    mReadTransactions = 1;
+
+    return true;
+
+error:
+    return false;
+}
+
+void SqliteStorage::Private::endRead()
+{
+    if (!mWal) {
+        if (!mSem.release()) {
+            qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+        }
+        return;
+    }
+
+    mReadTransactions -= 1;
+    if (mReadTransactions == 0) {
+        int rv = 0;
+        char *errmsg = NULL;
+        const char *query = COMMIT_TRANSACTION;
+        SL3_try_exec(mDatabase);
+    }
+}
+
+int SqliteStorage::Private::loadIncidences(sqlite3_stmt *stmt1, Incidence::List *loaded)
 {
     int count = 0;
-    Incidence::Ptr incidence;
-    QSet<QString> recurringUids;
+    int nRows;
+    const ExtendedStorage::DeferredParts deferred = mStorage->deferredParts();
 
-    if (!mSem.acquire()) {
-        qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
+    if (!beginRead()) {
+        mStorage->emitStorageFinished(true, "errors loading incidences");
         return -1;
     }
 
-    while ((incidence = mFormat->selectComponents(stmt1))
-           && (limit <= 0 || count < limit)) {
-        if (addIncidence(incidence)) {
-            if (incidence->recurs() || incidence->hasRecurrenceId()) {
-                recurringUids.insert(incidence->uid());
-            } else {
-                // Apply limit on load on non recurring events only.
+    do {
+        Incidence::List list;
+        nRows = mFormat->selectComponents(stmt1, &list, gLoadBatchSize, deferred);
+        if (nRows < 0) {
+            count = -1;
+            break;
+        }
+        for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(list)) {
+            if (addIncidence(incidence, deferred)) {
+                // qCDebug(lcMkcal) << "updating incidence" << incidence->uid()
+                //                  << incidence->dtStart() << endDateTime
+                //                  << "in calendar";
                 count += 1;
             }
         }
-        if (identifiers) {
-            identifiers->append(incidence->instanceIdentifier());
+        if (loaded) {
+            *loaded += list;
         }
+    } while (nRows == gLoadBatchSize);
+
+    endRead();
+    if (count < 0) {
+        mStorage->emitStorageFinished(true, "errors loading incidences");
     }
 
-    sqlite3_finalize(stmt1);
+    return count;
+}
 
-    if (recurringUids.count() > 0) {
-        // Additionally load any exception or parent to ensure calendar
-        // consistency.
-        int rv = 0;
-        sqlite3_stmt *loadByUid = NULL;
-        const char *query1 = NULL;
-        int qsize1 = 0;
-        query1 = SELECT_COMPONENTS_BY_UID;
-        qsize1 = sizeof(SELECT_COMPONENTS_BY_UID);
-        SL3_prepare_v2(mDatabase, query1, qsize1, &loadByUid, NULL);
-
-        for (const QString &uid : const_cast<const QSet<QString>&>(recurringUids)) {
-            int index = 1;
-            QByteArray u = uid.toUtf8();
-            SL3_reset(loadByUid);
-            SL3_bind_text(loadByUid, index, u.constData(), u.length(), SQLITE_STATIC);
-            while ((incidence = mFormat->selectComponents(stmt1))) {
-                addIncidence(incidence);
+int SqliteStorage::Private::loadIncidencesBySeries(sqlite3_stmt *stmt1, QStringList *identifiers, int limit)
+{
+    int count = 0;
+    int nRows;
+    int batchSize;
+    Incidence::Ptr incidence;
+    QSet<QString> recurringUids;
+    const ExtendedStorage::DeferredParts deferred = mStorage->deferredParts();
+
+    if (!beginRead()) {
+        mStorage->emitStorageFinished(true, "errors loading incidences");
+        return -1;
+    }
+
+    do {
+        Incidence::List list;
+        // Don't read more rows than the limit may need.
+        batchSize = limit > 0 ? qMin(gLoadBatchSize, limit - count) : gLoadBatchSize;
+        nRows = mFormat->selectComponents(stmt1, &list, batchSize, deferred);
+        if (nRows < 0) {
+            count = -1;
+            break;
+        }
+        for (Incidence::List::ConstIterator it = list.constBegin();
+             it != list.constEnd() && (limit <= 0 || count < limit); ++it) {
+            incidence = *it;
+            if (addIncidence(incidence, deferred)) {
+                if (incidence->recurs() || incidence->hasRecurrenceId()) {
+                    recurringUids.insert(incidence->uid());
+                } else {
+                    // Apply limit on load on non recurring events only.
+                    count += 1;
+                }
+            }
+            if (identifiers) {
+                identifiers->append(incidence->instanceIdentifier());
             }
         }
+    } while (nRows == batchSize && (limit <= 0 || count < limit));
 
-    error:
-        sqlite3_finalize(loadByUid);
+    if (count >= 0 && recurringUids.count() > 0) {
+        // Additionally load any exception or parent to ensure calendar
+        // consistency, for all series at once.
+        const SqliteLoader::Query query = SqliteLoader::seriesQuery(recurringUids.values());
+        sqlite3_stmt *loadByUids = mFormat->acquireStatement(query.query, query.qsize);
+        if (!loadByUids || !SqliteLoader::bind(loadByUids, query.values)) {
+            count = -1;
+        } else {
+            do {
+                Incidence::List list;
+                nRows = mFormat->selectComponents(loadByUids, &list, gLoadBatchSize, deferred);
+                if (nRows < 0) {
+                    count = -1;
+                    break;
+                }
+                for (const Incidence::Ptr &member : const_cast<const Incidence::List&>(list)) {
+                    addIncidence(member, deferred);
+                }
+            } while (nRows == gLoadBatchSize);
+        }
+        mFormat->releaseStatement(loadByUids);
     }
 
-    if (!mSem.release()) {
-        qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+    endRead();
+    if (count < 0) {
+        mStorage->emitStorageFinished(true, "errors loading incidences");
+    } else {
+        mStorage->emitStorageFinished(false, "load completed");
     }
-    mStorage->emitStorageFinished(false, "load completed");
 
     return count;
 }
@@ -636,40 +1764,75 @@ int SqliteStorage::Private::loadIncidencesBySeries(sqlite3_stmt *stmt1, QStringL
 
 bool SqliteStorage::purgeDeletedIncidences(const KCalendarCore::Incidence::List &list)
 {
-    if (!d->mDatabase) {
-        return false;
+    return d->purgeDeleted(&list, QDateTime(), false) >= 0;
+}
+
+int SqliteStorage::purgeDeletedBefore(const QDateTime &before, bool vacuum)
+{
+    if (!before.isValid()) {
+        return -1;
     }
+    return d->purgeDeleted(nullptr, before, vacuum);
+}
 
-    if (!d->mSem.acquire()) {
-        qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-        return false;
+//@cond PRIVATE
+int SqliteStorage::Private::purgeDeleted(const Incidence::List *list,
+                                         const QDateTime &before, bool vacuum)
+{
+    if (!mDatabase) {
+        return -1;
+    }
+    if (mOptions.readOnly) {
+        qCWarning(lcMkcal) << "cannot purge from read-only database" << mDatabaseName;
+        return -1;
+    }
+
+    if (!mSem.acquire()) {
+        qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
+        return -1;
     }
 
     int rv = 0;
-    unsigned int error = 1;
+    int count = -1;
+    bool inTransaction = false;
 
     char *errmsg = NULL;
     const char *query = NULL;
 
     query = BEGIN_TRANSACTION;
-    SL3_exec(d->mDatabase);
+    SL3_exec(mDatabase);
+    inTransaction = true;
 
-    error = 0;
-    for (const KCalendarCore::Incidence::Ptr &incidence: list) {
-        if (!d->mFormat->purgeDeletedComponents(*incidence)) {
-            error += 1;
-        }
+    count = list ? mFormat->purgeDeletedComponents(*list)
+        : mFormat->purgeDeletedComponents(before);
+    if (count < 0) {
+        goto error;
     }
 
     query = COMMIT_TRANSACTION;
-    SL3_exec(d->mDatabase);
+    SL3_exec(mDatabase);
+    inTransaction = false;
+
+    // Give the freed pages back to the file system. This is a no-op
+    // unless the database was created with incremental auto-vacuum.
+    if (vacuum && count > 0) {
+        query = INCREMENTAL_VACUUM;
+        SL3_try_exec(mDatabase);
+    }
 
  error:
-    if (!d->mSem.release()) {
-        qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
+    if (inTransaction) {
+        count = -1;
+        query = ROLLBACK_TRANSACTION;
+        SL3_try_exec(mDatabase);
     }
-    return error == 0;
+    if (!mSem.release()) {
+        qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+    }
+    qCDebug(lcMkcal) << "purged" << count << "deleted incidences";
+    return count;
 }
+//@endcond
 
 bool SqliteStorage::save()
 {
@@ -683,40 +1846,107 @@ bool SqliteStorage::save(ExtendedStorage::DeleteAction deleteAction)
     if (!d->mDatabase) {
         return false;
     }
+    if (d->mOptions.readOnly) {
+        qCWarning(lcMkcal) << "cannot save to read-only database" << d->mDatabaseName;
+        return false;
+    }
 
     if (!d->mSem.acquire()) {
         qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
         return false;
     }
 
-    int errors = 0;
-
-    // Incidences to insert
+    int rv = 0;
+    int errors = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    bool rollback = true;
+
+    // Incidences to update, their deferred parts are needed
+    // when modified, since all the attendees or attachments
+    // are then rewritten. They are read before the write
+    // transaction is opened.
+    QHash<QString, Incidence::Ptr> toUpdate;
+    QHash<QString, Incidence::Ptr> notHydrated;
+    for (QHash<QString, Incidence::Ptr>::ConstIterator it = d->mIncidencesToUpdate.constBegin();
+         it != d->mIncidencesToUpdate.constEnd(); ++it) {
+        ExtendedStorage::DeferredParts deferred = d->mDeferredIncidences.value(it.key(), NoPart);
+        const SqliteFormat::IncidenceParts changed =
+            d->modifiedParts(it.key(), *it.value(),
+                             SqliteFormat::AttendeesPart | SqliteFormat::AttachmentsPart);
+        if (!(changed & SqliteFormat::AttendeesPart)) {
+            deferred.setFlag(ExtendedStorage::AttendeesPart, false);
+        }
+        if (!(changed & SqliteFormat::AttachmentsPart)) {
+            deferred.setFlag(ExtendedStorage::AttachmentsPart, false);
+        }
+        if (deferred != NoPart && !d->hydrate(it.value(), deferred)) {
+            qCWarning(lcMkcal) << "cannot hydrate incidence" << it.key() << "for update";
+            notHydrated.insert(it.key(), it.value());
+            errors++;
+        } else {
+            toUpdate.insert(it.key(), it.value());
+        }
+    }
+
+    // All changes are written in a single transaction.
     Incidence::List added;
-    if (!d->mIncidencesToInsert.isEmpty()
-        && !d->saveIncidences(d->mIncidencesToInsert, DBInsert, &added)) {
-        errors++;
+    Incidence::List modified;
+    Incidence::List deleted;
+    QHash<QString, Incidence::Ptr> failedInserts;
+    QHash<QString, Incidence::Ptr> failedUpdates;
+    QHash<QString, Incidence::Ptr> failedDeletes;
+    const DBOperation deleteOperation =
+        deleteAction == ExtendedStorage::PurgeDeleted ? DBDelete : DBMarkDeleted;
+    const int transactionId = d->mSavedTransactionId;
+
+    query = BEGIN_TRANSACTION;
+    SL3_exec(d->mDatabase);
+
+    if (!d->saveIncidences(d->mIncidencesToInsert, DBInsert, &added, &failedInserts)
+        || !d->saveIncidences(toUpdate, DBUpdate, &modified, &failedUpdates)
+        || !d->saveIncidences(d->mIncidencesToDelete, deleteOperation, &deleted, &failedDeletes)) {
+        goto error;
+    }
+    if (!(added.isEmpty() && modified.isEmpty() && deleted.isEmpty())
+        && !d->mFormat->incrementTransactionId(&d->mSavedTransactionId)) {
+        goto error;
     }
 
-    // Incidences to update
-    Incidence::List modified;
-    if (!d->mIncidencesToUpdate.isEmpty()
-        && !d->saveIncidences(d->mIncidencesToUpdate, DBUpdate, &modified)) {
-        errors++;
+    query = COMMIT_TRANSACTION;
+    SL3_exec(d->mDatabase);
+    rollback = false;
+
+    errors += failedInserts.count() + failedUpdates.count() + failedDeletes.count();
+    // Failed changes are kept for a later save.
+    d->mIncidencesToInsert = failedInserts;
+    d->mIncidencesToUpdate = failedUpdates;
+    d->mIncidencesToUpdate.insert(notHydrated);
+    d->mIncidencesToDelete = failedDeletes;
+    for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(added)) {
+        d->mSnapshots.insert(incidence->instanceIdentifier(), d->mFormat->snapshot(*incidence));
     }
+    for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(modified)) {
+        d->mSnapshots.insert(incidence->instanceIdentifier(), d->mFormat->snapshot(*incidence));
+    }
+    for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(deleted)) {
+        d->mDeferredIncidences.remove(incidence->instanceIdentifier());
+        d->mSnapshots.remove(incidence->instanceIdentifier());
+    }
+    d->mIsSaved = !(added.isEmpty() && modified.isEmpty() && deleted.isEmpty());
 
-    // Incidences to delete
-    Incidence::List deleted;
-    if (!d->mIncidencesToDelete.isEmpty()) {
-        DBOperation dbop = deleteAction == ExtendedStorage::PurgeDeleted ? DBDelete : DBMarkDeleted;
-        if (!d->saveIncidences(d->mIncidencesToDelete, dbop, &deleted)) {
-            errors++;
+error:
+    if (rollback) {
+        qCWarning(lcMkcal) << "cannot save incidences, rolling back" << d->mDatabaseName;
+        if (!sqlite3_get_autocommit(d->mDatabase)) {
+            query = ROLLBACK_TRANSACTION;
+            SL3_try_exec(d->mDatabase);
         }
+        d->mFormat->resetTimeZones();
+        d->mSavedTransactionId = transactionId;
+        errors++;
     }
 
-    if (d->mIsSaved)
-        d->mFormat->incrementTransactionId(&d->mSavedTransactionId);
-
     if (!d->mSem.release()) {
         qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
     }
@@ -736,39 +1966,52 @@ bool SqliteStorage::save(ExtendedStorage::DeleteAction deleteAction)
 }
 
 //@cond PRIVATE
-bool SqliteStorage::Private::saveIncidences(QHash<QString, Incidence::Ptr> &list, DBOperation dbop, Incidence::List *savedIncidences)
+/*
+  Write the incidences of list within the current transaction, each one
+  in its own savepoint. An incidence that cannot be written is rolled
+  back and added to failedIncidences. It returns false when the whole
+  transaction should be rolled back, because of the save failure policy
+  or because SQLite already aborted it.
+*/
+bool SqliteStorage::Private::saveIncidences(const QHash<QString, Incidence::Ptr> &list, DBOperation dbop,
+                                            Incidence::List *savedIncidences,
+                                            QHash<QString, Incidence::Ptr> *failedIncidences)
 {
     int rv = 0;
-    int errors = 0;
     const char *operation = (dbop == DBInsert) ? "inserting" :
                             (dbop == DBUpdate) ? "updating" : "deleting";
     QHash<QString, Incidence::Ptr>::const_iterator it;
     char *errmsg = NULL;
     const char *query = NULL;
 
-    query = BEGIN_TRANSACTION;
-    SL3_exec(mDatabase);
-
     for (it = list.constBegin(); it != list.constEnd(); ++it) {
-         (*savedIncidences) << *it;
-
+        const SqliteFormat::IncidenceParts parts = dbop == DBUpdate
+            ? modifiedParts(it.key(), **it) : SqliteFormat::AllParts;
         qCDebug(lcMkcal) << operation << "incidence" << (*it)->uid();
-        if (!mFormat->modifyComponents(**it, dbop)) {
-            qCWarning(lcMkcal) << sqlite3_errmsg(mDatabase) << "for incidence" << (*it)->uid();
-            errors++;
+        query = SAVEPOINT_INCIDENCE;
+        SL3_exec(mDatabase);
+        if (mFormat->modifyComponents(**it, dbop, parts)) {
+            query = RELEASE_INCIDENCE;
+            SL3_exec(mDatabase);
+            (*savedIncidences) << *it;
+            continue;
         }
-    }
-
-    list.clear();
-    // TODO What if there were errors? Options: 1) rollback 2) best effort.
-
-    query = COMMIT_TRANSACTION;
-    SL3_exec(mDatabase);
 
-    if (!savedIncidences->isEmpty())
-        mIsSaved = true;
+        qCWarning(lcMkcal) << sqlite3_errmsg(mDatabase) << "for incidence" << (*it)->uid();
+        failedIncidences->insert(it.key(), *it);
+        if (sqlite3_get_autocommit(mDatabase)
+            || mOptions.saveFailure == SqliteStorage::Options::RollbackAll) {
+            return false;
+        }
+        query = ROLLBACK_INCIDENCE;
+        SL3_exec(mDatabase);
+        query = RELEASE_INCIDENCE;
+        SL3_exec(mDatabase);
+        // Time zones added by this incidence are rolled back too.
+        mFormat->resetTimeZones();
+    }
 
-    return errors == 0;
+    return true;
 
 error:
     return false;
@@ -777,6 +2020,7 @@ error:
 
 bool SqliteStorage::close()
 {
+    d->stopLoader();
     if (d->mDatabase) {
         if (d->mWatcher) {
             d->mWatcher->removePaths(d->mWatcher->files());
@@ -786,10 +2030,14 @@ bool SqliteStorage::close()
             d->mWatcher = NULL;
         }
         d->mChanged.close();
+        d->mDeferredIncidences.clear();
+        d->mSnapshots.clear();
         delete d->mFormat;
         d->mFormat = 0;
         sqlite3_close(d->mDatabase);
         d->mDatabase = 0;
+        d->mWal = false;
+        d->mReadTransactions = 0;
     }
     return ExtendedStorage::close();
 }
@@ -852,177 +2100,158 @@ void SqliteStorage::calendarIncidenceAdditionCanceled(const Incidence::Ptr &inci
     }
 }
 
-bool SqliteStorage::insertedIncidences(Incidence::List *list, const QDateTime &after)
+bool SqliteStorage::forEachIncidence(IncidenceFilter filter, const QDateTime &after,
+                                     const IncidenceVisitor &visitor)
 {
-    if (d->mDatabase && list && after.isValid()) {
-        const char *query1 = NULL;
-        int qsize1 = 0;
-        int rv = 0;
-        sqlite3_stmt *stmt1 = NULL;
-        int index = 1;
-        QByteArray n;
-        sqlite3_int64 secs;
-        Incidence::Ptr incidence;
-        bool success = false;
-
-
-        query1 = SELECT_COMPONENTS_BY_CREATED;
-        qsize1 = sizeof(SELECT_COMPONENTS_BY_CREATED);
-
-        qCDebug(lcMkcal) << "incidences inserted since" << after;
-        if (!d->mSem.acquire()) {
-            qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-            return false;
-        }
-
-        SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, nullptr);
-        secs = d->mFormat->toOriginTime(after);
-        SL3_bind_int64(stmt1, index, secs);
-
-        while ((incidence = d->mFormat->selectComponents(stmt1))) {
-            list->append(incidence);
-        }
-        success = true;
-
-    error:
-        sqlite3_finalize(stmt1);
-        if (!d->mSem.release()) {
-            qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-        }
-        return success;
+    if (!d->mDatabase || !visitor) {
+        return false;
     }
-    return false;
-}
 
-bool SqliteStorage::modifiedIncidences(Incidence::List *list, const QDateTime &after)
-{
-    if (d->mDatabase && list && after.isValid()) {
-        const char *query1 = NULL;
-        int qsize1 = 0;
-        int rv = 0;
-        sqlite3_stmt *stmt1 = NULL;
-        int index = 1;
-        QByteArray n;
-        sqlite3_int64 secs;
-        Incidence::Ptr incidence;
-        QString nbook;
-        bool success = false;
-
-        query1 = SELECT_COMPONENTS_BY_LAST_MODIFIED;
-        qsize1 = sizeof(SELECT_COMPONENTS_BY_LAST_MODIFIED);
-
-        qCDebug(lcMkcal) << "incidences updated since" << after;
-        if (!d->mSem.acquire()) {
-            qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-            return false;
+    const char *query1 = NULL;
+    int qsize1 = 0;
+    int rv = 0;
+    sqlite3_stmt *stmt1 = NULL;
+    sqlite3_int64 secs = 0;
+    int lastRowId = 0;
+    int nRows = gLoadBatchSize;
+    bool locked = false;
+    bool success = false;
+
+    switch (filter) {
+    case InsertedIncidences:
+        query1 = SELECT_COMPONENTS_BY_CREATED_BY_CHUNK;
+        qsize1 = sizeof(SELECT_COMPONENTS_BY_CREATED_BY_CHUNK);
+        break;
+    case ModifiedIncidences:
+        query1 = SELECT_COMPONENTS_BY_LAST_MODIFIED_BY_CHUNK;
+        qsize1 = sizeof(SELECT_COMPONENTS_BY_LAST_MODIFIED_BY_CHUNK);
+        break;
+    case DeletedIncidences:
+        if (after.isValid()) {
+            query1 = SELECT_COMPONENTS_BY_DELETED_BY_CHUNK;
+            qsize1 = sizeof(SELECT_COMPONENTS_BY_DELETED_BY_CHUNK);
+        } else {
+            query1 = SELECT_COMPONENTS_ALL_DELETED_BY_CHUNK;
+            qsize1 = sizeof(SELECT_COMPONENTS_ALL_DELETED_BY_CHUNK);
         }
-
-        SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, nullptr);
+        break;
+    default:
+        query1 = SELECT_COMPONENTS_ALL_BY_CHUNK;
+        qsize1 = sizeof(SELECT_COMPONENTS_ALL_BY_CHUNK);
+        break;
+    }
+    if ((filter == InsertedIncidences || filter == ModifiedIncidences)
+        && !after.isValid()) {
+        return false;
+    }
+    if (after.isValid()) {
         secs = d->mFormat->toOriginTime(after);
-        SL3_bind_int64(stmt1, index, secs);
-        SL3_bind_int64(stmt1, index, secs);
-
-        while ((incidence = d->mFormat->selectComponents(stmt1))) {
-            list->append(incidence);
-        }
-        success = true;
-
-    error:
-        sqlite3_finalize(stmt1);
-        if (!d->mSem.release()) {
-            qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-        }
-        return success;
     }
-    return false;
-}
 
-bool SqliteStorage::deletedIncidences(Incidence::List *list, const QDateTime &after)
-{
-    if (d->mDatabase && list) {
-        const char *query1 = NULL;
-        int qsize1 = 0;
-        int rv = 0;
-        sqlite3_stmt *stmt1 = NULL;
+    // The lock, or the read transaction, is only held while reading
+    // a chunk, not while the visitor is processing it.
+    while (nRows == gLoadBatchSize) {
         int index = 1;
-        QByteArray n;
-        sqlite3_int64 secs;
-        Incidence::Ptr incidence;
-        QString nbook;
-        bool success = false;
+        Incidence::List list;
 
-        if (after.isValid()) {
-            query1 = SELECT_COMPONENTS_BY_DELETED;
-            qsize1 = sizeof(SELECT_COMPONENTS_BY_DELETED);
-        } else {
-            query1 = SELECT_COMPONENTS_ALL_DELETED;
-            qsize1 = sizeof(SELECT_COMPONENTS_ALL_DELETED);
+        if (!d->beginRead()) {
+            goto error;
         }
+        locked = true;
 
-        qCDebug(lcMkcal) << "incidences deleted since" << after;
-        if (!d->mSem.acquire()) {
-            qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-            return false;
+        if (!stmt1) {
+            SL3_acquire(d->mFormat, query1, qsize1, stmt1);
         }
-
-        SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, nullptr);
-        if (after.isValid()) {
-            secs = d->mFormat->toOriginTime(after);
+        SL3_reset(stmt1);
+        if (filter == InsertedIncidences) {
+            SL3_bind_int64(stmt1, index, secs);
+        } else if (filter == ModifiedIncidences
+                   || (filter == DeletedIncidences && after.isValid())) {
             SL3_bind_int64(stmt1, index, secs);
             SL3_bind_int64(stmt1, index, secs);
         }
+        SL3_bind_int(stmt1, index, lastRowId);
+        SL3_bind_int(stmt1, index, gLoadBatchSize);
 
-        while ((incidence = d->mFormat->selectComponents(stmt1))) {
-            list->append(incidence);
-        }
-        success = true;
+        nRows = d->mFormat->selectComponents(stmt1, &list, 0, NoPart, &lastRowId);
 
-    error:
-        sqlite3_finalize(stmt1);
-        if (!d->mSem.release()) {
-            qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
+        d->endRead();
+        locked = false;
+
+        if (nRows < 0) {
+            goto error;
+        }
+        for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(list)) {
+            if (!visitor(incidence)) {
+                nRows = 0;
+                break;
+            }
         }
-        return success;
     }
-    return false;
+    success = true;
+
+error:
+    if (locked) {
+        d->endRead();
+    }
+    d->mFormat->releaseStatement(stmt1);
+    return success;
 }
 
-bool SqliteStorage::allIncidences(Incidence::List *list)
+bool SqliteStorage::insertedIncidences(Incidence::List *list, const QDateTime &after)
 {
-    if (d->mDatabase && list) {
-        const char *query1 = NULL;
-        int qsize1 = 0;
-        int rv = 0;
-        sqlite3_stmt *stmt1 = NULL;
-        int index = 1;
-        QByteArray n;
-        Incidence::Ptr incidence;
-        QString nbook;
-        bool success = false;
+    if (!list) {
+        return false;
+    }
 
-        query1 = SELECT_COMPONENTS_ALL;
-        qsize1 = sizeof(SELECT_COMPONENTS_ALL);
+    qCDebug(lcMkcal) << "incidences inserted since" << after;
+    return forEachIncidence(InsertedIncidences, after,
+                            [list] (const Incidence::Ptr &incidence) {
+                                list->append(incidence);
+                                return true;
+                            });
+}
 
-        qCDebug(lcMkcal) << "all incidences";
-        if (!d->mSem.acquire()) {
-            qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-            return false;
-        }
+bool SqliteStorage::modifiedIncidences(Incidence::List *list, const QDateTime &after)
+{
+    if (!list) {
+        return false;
+    }
 
-        SL3_prepare_v2(d->mDatabase, query1, qsize1, &stmt1, nullptr);
-        while ((incidence = d->mFormat->selectComponents(stmt1))) {
-            list->append(incidence);
-        }
-        success = true;
+    qCDebug(lcMkcal) << "incidences updated since" << after;
+    return forEachIncidence(ModifiedIncidences, after,
+                            [list] (const Incidence::Ptr &incidence) {
+                                list->append(incidence);
+                                return true;
+                            });
+}
 
-    error:
-        sqlite3_finalize(stmt1);
-        if (!d->mSem.release()) {
-            qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-        }
-        return success;
+bool SqliteStorage::deletedIncidences(Incidence::List *list, const QDateTime &after)
+{
+    if (!list) {
+        return false;
     }
-    return false;
+
+    qCDebug(lcMkcal) << "incidences deleted since" << after;
+    return forEachIncidence(DeletedIncidences, after,
+                            [list] (const Incidence::Ptr &incidence) {
+                                list->append(incidence);
+                                return true;
+                            });
+}
+
+bool SqliteStorage::allIncidences(Incidence::List *list)
+{
+    if (!list) {
+        return false;
+    }
+
+    qCDebug(lcMkcal) << "all incidences";
+    return forEachIncidence(AllIncidences, QDateTime(),
+                            [list] (const Incidence::Ptr &incidence) {
+                                list->append(incidence);
+                                return true;
+                            });
 }
 
 QDateTime SqliteStorage::incidenceDeletedDate(const Incidence::Ptr &incidence)
@@ -1040,9 +2269,8 @@ QDateTime SqliteStorage::incidenceDeletedDate(const Incidence::Ptr &incidence)
     const char *query = SELECT_COMPONENTS_BY_UID_RECID_AND_DELETED;
     int qsize = sizeof(SELECT_COMPONENTS_BY_UID_RECID_AND_DELETED);
     sqlite3_stmt *stmt = NULL;
-    const char *tail = NULL;
 
-    SL3_prepare_v2(d->mDatabase, query, qsize, &stmt, &tail);
+    SL3_acquire(d->mFormat, query, qsize, stmt);
     index = 1;
     u = incidence->uid().toUtf8();
     SL3_bind_text(stmt, index, u.constData(), u.length(), SQLITE_STATIC);
@@ -1058,8 +2286,8 @@ QDateTime SqliteStorage::incidenceDeletedDate(const Incidence::Ptr &incidence)
         SL3_bind_int64(stmt, index, 0);
     }
 
-    if (!d->mSem.acquire()) {
-        qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
+    if (!d->beginRead()) {
+        d->mFormat->releaseStatement(stmt);
         return deletionDate;
     }
 
@@ -1070,27 +2298,359 @@ QDateTime SqliteStorage::incidenceDeletedDate(const Incidence::Ptr &incidence)
     }
 
 error:
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    d->mFormat->releaseStatement(stmt);
 
-    if (!d->mSem.release()) {
-        qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-    }
+    d->endRead();
     return deletionDate;
 }
 
+static bool isDelimiter(const QByteArray &line, const char *delimiter, int length)
+{
+    return line.length() > length && qstrnicmp(line.constData(), delimiter, length) == 0;
+}
+
+bool SqliteStorage::importIncidences(QIODevice *device, int *count)
+{
+    if (count) {
+        *count = 0;
+    }
+    if (!d->mDatabase) {
+        return false;
+    }
+    if (d->mOptions.readOnly) {
+        qCWarning(lcMkcal) << "cannot import into read-only database" << d->mDatabaseName;
+        return false;
+    }
+    if (!device || !device->isReadable()) {
+        qCWarning(lcMkcal) << "cannot read the iCalendar stream to import";
+        return false;
+    }
+
+    // Properties of the calendar and its time zones are
+    // repeated for each batch of components.
+    QByteArray header;
+    QByteArray timeZones;
+    QByteArray components;
+    QByteArray component;
+    QByteArray name;
+    int depth = 0;
+    int pending = 0;
+    int imported = 0;
+    int failures = 0;
+    bool inCalendar = false;
+    bool headerDone = false;
+    bool success = true;
+
+    while (success && !device->atEnd()) {
+        const QByteArray line = device->readLine();
+        const bool begin = isDelimiter(line, "BEGIN:", 6);
+        const bool end = !begin && isDelimiter(line, "END:", 4);
+
+        if (depth > 0) {
+            // Within a top level component, alarms included.
+            component += line;
+            depth += begin ? 1 : end ? -1 : 0;
+            if (depth > 0) {
+                continue;
+            }
+            if (name == "VTIMEZONE") {
+                timeZones += component;
+            } else if (name == "VEVENT" || name == "VTODO" || name == "VJOURNAL") {
+                components += component;
+                pending += 1;
+            }
+            component.clear();
+        } else if (begin) {
+            name = line.mid(6).trimmed().toUpper();
+            if (name == "VCALENDAR") {
+                inCalendar = true;
+            } else {
+                headerDone = true;
+                component = line;
+                depth = 1;
+            }
+        } else if (end) {
+            inCalendar = false;
+            headerDone = true;
+        } else if (inCalendar && !headerDone) {
+            header += line;
+        }
+
+        if (pending == gImportBatchSize) {
+            success = d->importBatch(header, timeZones, components, &imported, &failures);
+            components.clear();
+            pending = 0;
+        }
+    }
+    if (success && pending > 0) {
+        success = d->importBatch(header, timeZones, components, &imported, &failures);
+    }
+    if (depth > 0) {
+        qCWarning(lcMkcal) << "truncated iCalendar stream, last component ignored";
+        success = false;
+    }
+
+    if (count) {
+        *count = imported;
+    }
+    qCDebug(lcMkcal) << "imported" << imported << "incidences," << failures << "failed";
+
+    return success && failures == 0;
+}
+
+//@cond PRIVATE
+/*
+  Parse a batch of components, wrapped in a calendar with the given
+  header and time zones, and write them in a single transaction.
+  It returns false when nothing of the batch was written.
+*/
+bool SqliteStorage::Private::importBatch(const QByteArray &header, const QByteArray &timeZones,
+                                         const QByteArray &components, int *count, int *failures)
+{
+    int rv = 0;
+    char *errmsg = NULL;
+    const char *query = NULL;
+    int transactionId;
+    bool rollback = true;
+    QHash<QString, Incidence::Ptr> inserts;
+    QHash<QString, Incidence::Ptr> updates;
+    QHash<QString, Incidence::Ptr> failed;
+    Incidence::List saved;
+
+    MemoryCalendar::Ptr calendar(new MemoryCalendar(mCalendar->timeZone()));
+    ICalFormat format;
+    if (!format.fromRawString(calendar, "BEGIN:VCALENDAR\r\n" + header + timeZones
+                              + components + "END:VCALENDAR\r\n")) {
+        qCWarning(lcMkcal) << "cannot parse the iCalendar data to import";
+        return false;
+    }
+
+    if (!mSem.acquire()) {
+        qCWarning(lcMkcal) << "cannot lock" << mDatabaseName << "error" << mSem.errorString();
+        return false;
+    }
+
+    query = BEGIN_TRANSACTION;
+    SL3_exec(mDatabase);
+
+    for (const Incidence::Ptr &incidence : calendar->rawIncidences()) {
+        const QString key = incidence->instanceIdentifier();
+        if (mFormat->hasComponent(*incidence)) {
+            // A loaded copy does not match the database anymore.
+            mSnapshots.remove(key);
+            updates.insert(key, incidence);
+        } else {
+            inserts.insert(key, incidence);
+        }
+    }
+    if (!saveIncidences(inserts, DBInsert, &saved, &failed)
+        || !saveIncidences(updates, DBUpdate, &saved, &failed)) {
+        goto error;
+    }
+    // Not the saved transaction id, the import is
+    // seen as a modification from another process.
+    if (!saved.isEmpty() && !mFormat->incrementTransactionId(&transactionId)) {
+        goto error;
+    }
+
+    query = COMMIT_TRANSACTION;
+    SL3_exec(mDatabase);
+    rollback = false;
+    *count += saved.count();
+    *failures += failed.count();
+
+error:
+    if (rollback) {
+        qCWarning(lcMkcal) << "cannot import incidences, rolling back" << mDatabaseName;
+        if (!sqlite3_get_autocommit(mDatabase)) {
+            query = ROLLBACK_TRANSACTION;
+            SL3_try_exec(mDatabase);
+        }
+        mFormat->resetTimeZones();
+    }
+
+    if (!mSem.release()) {
+        qCWarning(lcMkcal) << "cannot release lock" << mDatabaseName << "error" << mSem.errorString();
+    }
+
+    if (!rollback && !saved.isEmpty()) {
+        mChanged.resize(0);   // make a change to create signal
+    }
+
+    return !rollback;
+}
+//@endcond
+
+/*
+  Write the components of the iCalendar text of a calendar to device,
+  as part of a single VCALENDAR: the properties of the calendar are
+  skipped, and each time zone is written only once.
+*/
+static bool writeComponents(QIODevice *device, const QByteArray &text,
+                            QSet<QByteArray> *timeZones)
+{
+    QByteArray component;
+    QByteArray name;
+    QByteArray tzid;
+    int depth = 0;
+    int from = 0;
+
+    while (from < text.length()) {
+        int to = text.indexOf('\n', from);
+        to = to < 0 ? text.length() : to + 1;
+        const QByteArray line = text.mid(from, to - from);
+        from = to;
+
+        const bool begin = isDelimiter(line, "BEGIN:", 6);
+        const bool end = !begin && isDelimiter(line, "END:", 4);
+        if (depth == 0) {
+            if (begin) {
+                name = line.mid(6).trimmed().toUpper();
+                if (name != "VCALENDAR") {
+                    component = line;
+                    tzid.clear();
+                    depth = 1;
+                }
+            }
+            continue;
+        }
+
+        component += line;
+        if (depth == 1 && isDelimiter(line, "TZID:", 5)) {
+            tzid = line.mid(5).trimmed();
+        }
+        depth += begin ? 1 : end ? -1 : 0;
+        if (depth == 0) {
+            if (name == "VTIMEZONE") {
+                if (timeZones->contains(tzid)) {
+                    continue;
+                }
+                timeZones->insert(tzid);
+            }
+            if (device->write(component) != component.length()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool SqliteStorage::exportIncidences(QIODevice *device, ExportFilter filter,
+                                     const QDateTime &start, const QDateTime &end,
+                                     int *count)
+{
+    if (count) {
+        *count = 0;
+    }
+    if (!d->mDatabase) {
+        return false;
+    }
+    if (!device || !device->isWritable()) {
+        qCWarning(lcMkcal) << "cannot write the iCalendar stream to export";
+        return false;
+    }
+
+    int rv = 0;
+    sqlite3_stmt *stmt1 = NULL;
+    int lastRowId = 0;
+    int nRows = gLoadBatchSize;
+    int exported = 0;
+    bool locked = false;
+    bool success = false;
+    QSet<QByteArray> timeZones;
+    ICalFormat format;
+    // Unbounded dates are given as the extreme values of the columns.
+    const sqlite3_int64 secsStart = start.isValid()
+        ? SqliteFormat::toOriginTime(start) : std::numeric_limits<sqlite3_int64>::min();
+    const sqlite3_int64 secsEnd = end.isValid()
+        ? SqliteFormat::toOriginTime(end) : std::numeric_limits<sqlite3_int64>::max();
+    const sqlite3_int64 deletedMin = filter == ExportUndeleted ? 0
+        : filter == ExportDeleted ? 1 : std::numeric_limits<sqlite3_int64>::min();
+    const sqlite3_int64 deletedMax = filter == ExportUndeleted ? 0
+        : std::numeric_limits<sqlite3_int64>::max();
+
+    if (device->write("BEGIN:VCALENDAR\r\nPRODID:" + CalFormat::productId().toUtf8()
+                      + "\r\nVERSION:2.0\r\n") < 0) {
+        goto error;
+    }
+
+    // The lock, or the read transaction, is only held while reading
+    // a chunk, not while it is serialized.
+    while (nRows == gLoadBatchSize) {
+        int index = 1;
+        Incidence::List list;
+
+        if (!d->beginRead()) {
+            goto error;
+        }
+        locked = true;
+
+        if (!stmt1) {
+            SL3_acquire(d->mFormat, SELECT_COMPONENTS_FOR_EXPORT_BY_CHUNK,
+                        sizeof(SELECT_COMPONENTS_FOR_EXPORT_BY_CHUNK), stmt1);
+        }
+        SL3_reset(stmt1);
+        SL3_bind_int64(stmt1, index, deletedMin);
+        SL3_bind_int64(stmt1, index, deletedMax);
+        SL3_bind_int64(stmt1, index, secsEnd);
+        SL3_bind_int64(stmt1, index, secsStart);
+        SL3_bind_int64(stmt1, index, secsStart);
+        SL3_bind_int64(stmt1, index, secsStart);
+        SL3_bind_int(stmt1, index, lastRowId);
+        SL3_bind_int(stmt1, index, gLoadBatchSize);
+
+        nRows = d->mFormat->selectComponents(stmt1, &list, 0, NoPart, &lastRowId);
+
+        d->endRead();
+        locked = false;
+
+        if (nRows < 0) {
+            goto error;
+        }
+        if (list.isEmpty()) {
+            continue;
+        }
+        MemoryCalendar::Ptr calendar(new MemoryCalendar(d->mCalendar->timeZone()));
+        for (const Incidence::Ptr &incidence : const_cast<const Incidence::List&>(list)) {
+            calendar->addIncidence(incidence);
+        }
+        if (!writeComponents(device, format.toString(calendar).toUtf8(), &timeZones)) {
+            goto error;
+        }
+        exported += list.count();
+    }
+
+    if (device->write("END:VCALENDAR\r\n") < 0) {
+        goto error;
+    }
+    success = true;
+
+error:
+    if (locked) {
+        d->endRead();
+    }
+    d->mFormat->releaseStatement(stmt1);
+    if (!success) {
+        qCWarning(lcMkcal) << "cannot export incidences" << device->errorString();
+    }
+    if (count) {
+        *count = exported;
+    }
+    qCDebug(lcMkcal) << "exported" << exported << "incidences";
+
+    return success;
+}
+
 void SqliteStorage::fileChanged(const QString &path)
 {
-    if (!d->mSem.acquire()) {
-        qCWarning(lcMkcal) << "cannot lock" << d->mDatabaseName << "error" << d->mSem.errorString();
+    if (!d->beginRead()) {
         return;
     }
     int transactionId;
     if (!d->mFormat->selectMetadata(&transactionId))
         transactionId = d->mSavedTransactionId - 1; // Ensure reload on error
-    if (!d->mSem.release()) {
-        qCWarning(lcMkcal) << "cannot release lock" << d->mDatabaseName << "error" << d->mSem.errorString();
-    }
+    d->endRead();
 
     if (transactionId != d->mSavedTransactionId) {
         d->mSavedTransactionId = transactionId;
@@ -36,6 +36,9 @@
 
 #include "mkcal_export.h"
 #include "extendedstorage.h"
+#include "sqlitestorageoptions.h"
+
+class QIODevice;
 
 namespace mKCal {
 
@@ -56,15 +59,22 @@ public:
     */
     typedef QSharedPointer<SqliteStorage> Ptr;
 
+    /**
+      Tuning of the database connection.
+    */
+    typedef SqliteStorageOptions Options;
+
     /**
       Constructs a new SqliteStorage object for Calendar @p calendar with
       storage to file @p databaseName.
 
       @param calendar is a pointer to a valid Calendar object.
       @param databaseName is the name of the database containing the Calendar data.
+      @param options is the tuning of the database connection.
     */
     explicit SqliteStorage(const ExtendedCalendar::Ptr &cal,
-                           const QString &databaseName);
+                           const QString &databaseName,
+                           const Options &options = Options());
 
     /**
       Constructs a new SqliteStorage object for Calendar @p calendar. Location
@@ -72,8 +82,10 @@ public:
       enivronment variable.
 
       @param calendar is a pointer to a valid Calendar object.
+      @param options is the tuning of the database connection.
     */
-    explicit SqliteStorage(const ExtendedCalendar::Ptr &cal);
+    explicit SqliteStorage(const ExtendedCalendar::Ptr &cal,
+                           const Options &options = Options());
 
     /**
       Destructor.
@@ -85,6 +97,53 @@ public:
     */
     QString databaseName() const;
 
+    /**
+      Usage counters of the prepared statement cache.
+    */
+    struct StatementStatistics {
+        /** Number of queries served by an already prepared statement. */
+        quint64 hits = 0;
+        /** Number of queries that required to prepare a statement. */
+        quint64 misses = 0;
+        /** Time spent in preparing statements, in nanoseconds. */
+        qint64 prepareNSecs = 0;
+    };
+
+    /**
+      Returns the usage counters of the prepared statement cache
+      since the database has been opened. All counters are zero
+      when the database is not opened.
+    */
+    StatementStatistics statementStatistics() const;
+
+    /**
+      Returns the tuning of the database connection. When the database
+      is opened, these are the values in effect, as reported by SQLite.
+      Otherwise, these are the requested values.
+    */
+    Options options() const;
+
+    /**
+      Request the write-ahead log journal mode for the database,
+      to be called before open(). The mode is stored in the database
+      file, so every process opening it afterwards uses it too.
+      This is a shorthand for the journalMode field of Options.
+
+      With a write-ahead log, reading does not wait for the saving
+      of other processes: reads are done in deferred transactions,
+      and the inter-process lock is only taken to write.
+
+      @param enable true to switch the database to write-ahead logging.
+      The journal mode of the database is left unchanged otherwise.
+    */
+    void setWriteAheadLogging(bool enable);
+
+    /**
+      Returns true if the opened database uses a write-ahead log,
+      either on request or because another process switched it.
+    */
+    bool isWriteAheadLogging() const;
+
     /**
       @copydoc
       CalStorage::open()
@@ -103,18 +162,73 @@ public:
     */
     bool load(const QString &uid);
 
+    /**
+      @copydoc
+      ExtendedStorage::load(const QStringList &)
+    */
+    bool load(const QStringList &uids);
+
     /**
       @copydoc
       ExtendedStorage::load(const QDate &, const QDate &)
     */
     bool load(const QDate &start, const QDate &end);
 
+    /**
+      @copydoc
+      ExtendedStorage::loadAsync(const QDate &, const QDate &)
+    */
+    bool loadAsync(const QDate &start, const QDate &end);
+
+    /**
+      @copydoc
+      ExtendedStorage::loadAsync(const QString &)
+    */
+    bool loadAsync(const QString &uid);
+
+    /**
+      @copydoc
+      ExtendedStorage::loadHeaders(const QDate &, const QDate &, IncidenceHeader::List *)
+    */
+    bool loadHeaders(const QDate &start, const QDate &end, IncidenceHeader::List *list);
+
+    /**
+      @copydoc
+      ExtendedStorage::hydrate(const KCalendarCore::Incidence::Ptr &, DeferredParts)
+    */
+    bool hydrate(const KCalendarCore::Incidence::Ptr &incidence, DeferredParts parts = AllParts);
+
+    /**
+      @copydoc
+      ExtendedStorage::pendingParts(const KCalendarCore::Incidence::Ptr &)
+    */
+    DeferredParts pendingParts(const KCalendarCore::Incidence::Ptr &incidence) const;
+
     /**
       @copydoc
       ExtendedStorage::purgeDeletedIncidences(const KCalCore::Incidence::List &, const QString &)
     */
     bool purgeDeletedIncidences(const KCalendarCore::Incidence::List &list);
 
+    /**
+      Remove from the database the incidences marked as deleted before
+      a given date, together with their attendees, alarms, attachments
+      and custom properties. Like purgeDeletedIncidences(), the purge is
+      done with one statement per table, whatever the number of purged
+      incidences.
+
+      The file does not shrink by itself, the freed pages are reused by
+      later insertions. With @p vacuum, they are given back to the file
+      system instead, for databases created with incremental
+      auto-vacuum, as new databases are. An older database file keeps
+      its size until it is fully vacuumed.
+
+      @param before incidences deleted strictly before this date are purged
+      @param vacuum run an incremental vacuum after the purge
+      @return the number of purged incidences, or -1 on error.
+    */
+    int purgeDeletedBefore(const QDateTime &before, bool vacuum = false);
+
     /**
       @copydoc
       CalStorage::save()
@@ -194,18 +308,85 @@ public:
     */
     bool allIncidences(KCalendarCore::Incidence::List *list);
 
+    /**
+      @copydoc
+      ExtendedStorage::forEachIncidence()
+    */
+    bool forEachIncidence(IncidenceFilter filter, const QDateTime &after,
+                          const IncidenceVisitor &visitor);
+
     /**
       @copydoc
       ExtendedStorage::search()
     */
     bool search(const QString &key, QStringList *identifiers, int limit = 0);
 
+    /**
+      @copydoc
+      ExtendedStorage::searchAsync()
+    */
+    bool searchAsync(const QString &key, int limit = 0,
+                     const SearchResultHandler &handler = SearchResultHandler());
+
     /**
       @copydoc
       ExtendedStorage::incidenceDeletedDate()
     */
     QDateTime incidenceDeletedDate(const KCalendarCore::Incidence::Ptr &incidence);
 
+    /**
+      Import the events, todos and journals of an iCalendar stream
+      straight into the database, without adding them to the calendar.
+      The stream is parsed component by component and the incidences
+      are written by batches of fixed size, each one in its own
+      transaction, so the imported calendar is never fully in memory.
+
+      An imported incidence replaces a stored one with the same UID
+      and recurrence id. Failures are handled according to
+      Options::saveFailure, as for save(), the batches written before
+      a rolled back one being kept.
+
+      Observers of this storage, and of the others on the same database,
+      are notified of the import as of a modification by another
+      process, see ExtendedStorageObserver::storageModified().
+
+      @param device the iCalendar stream, opened for reading
+      @param count if not null, set to the number of written incidences
+      @return true if the stream was read and all its incidences written.
+    */
+    bool importIncidences(QIODevice *device, int *count = nullptr);
+
+    /**
+      Incidences written by exportIncidences(), according
+      to their deletion mark.
+    */
+    enum ExportFilter {
+        ExportUndeleted,
+        ExportDeleted,
+        ExportAll
+    };
+
+    /**
+      Export the incidences of the database as a single iCalendar
+      stream. The stored components are read by chunks, in the order
+      they were inserted, and each chunk is serialized and written to
+      the device before the next one is read, so the exported calendar
+      is never fully in memory. The calendar associated to this storage
+      is not modified.
+
+      @param device the stream, opened for writing
+      @param filter tells if the incidences marked as deleted are written
+      @param start if valid, only incidences ending after it are written,
+             a series being considered from its start to the end of its
+             recurrence, and incidences without any date are skipped
+      @param end if valid, only incidences starting before it are written
+      @param count if not null, set to the number of written incidences
+      @return true if the whole export was written.
+    */
+    bool exportIncidences(QIODevice *device, ExportFilter filter = ExportUndeleted,
+                          const QDateTime &start = QDateTime(), const QDateTime &end = QDateTime(),
+                          int *count = nullptr);
+
     /**
       @copydoc
       ExtendedStorage::virtual_hook()
@@ -0,0 +1,42 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "sqlitestorageoptions.h"
+
+using namespace mKCal;
+
+SqliteStorageOptions SqliteStorageOptions::lowMemory()
+{
+    SqliteStorageOptions options;
+    options.cacheSize = -512;
+    options.mmapSize = 0;
+    options.tempStore = TempStoreFile;
+    return options;
+}
+
+SqliteStorageOptions SqliteStorageOptions::highThroughput()
+{
+    SqliteStorageOptions options;
+    options.cacheSize = -8192;
+    options.mmapSize = 64 * 1024 * 1024;
+    options.synchronous = SynchronousNormal;
+    options.tempStore = TempStoreMemory;
+    options.journalMode = JournalWal;
+    return options;
+}
@@ -0,0 +1,123 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the SqliteStorageOptions structure.
+*/
+
+#ifndef MKCAL_SQLITESTORAGEOPTIONS_H
+#define MKCAL_SQLITESTORAGEOPTIONS_H
+
+#include "mkcal_export.h"
+
+#include <QtGlobal>
+
+namespace mKCal {
+
+/**
+  @brief
+  Tuning of the SQLite connection of a SqliteStorage.
+
+  The options are applied when the storage is opened. Default values
+  keep the SQLite defaults, except for the busy timeout. See
+  SqliteStorage::options() for the values in effect.
+*/
+struct MKCAL_EXPORT SqliteStorageOptions
+{
+    /**
+      Levels of the synchronous pragma.
+    */
+    enum Synchronous {
+        SynchronousDefault = -1,
+        SynchronousOff = 0,
+        SynchronousNormal = 1,
+        SynchronousFull = 2,
+        SynchronousExtra = 3
+    };
+
+    /**
+      Values of the temp_store pragma.
+    */
+    enum TempStore {
+        TempStoreDefault = 0,
+        TempStoreFile = 1,
+        TempStoreMemory = 2
+    };
+
+    /**
+      Journal modes, JournalDefault keeps the one stored in the database.
+    */
+    enum JournalMode {
+        JournalDefault,
+        JournalRollback,
+        JournalWal
+    };
+
+    /**
+      What SqliteStorage::save() does when an incidence cannot be written.
+    */
+    enum SaveFailure {
+        RollbackAll, /**< nothing is written, all changes are kept for a later save */
+        SkipFailed   /**< the other changes are written, the failed ones are kept */
+    };
+
+    /** Page cache size, in pages when positive, in KiB when negative, 0 for the default. */
+    int cacheSize = 0;
+    /** Maximum size of memory mapped I/O in bytes, negative for the default. */
+    qint64 mmapSize = -1;
+    Synchronous synchronous = SynchronousDefault;
+    TempStore tempStore = TempStoreDefault;
+    /** Time to wait for locks held by other connections, in milliseconds. */
+    int busyTimeout = 1500;
+    /** See SqliteStorage::setWriteAheadLogging(). */
+    JournalMode journalMode = JournalDefault;
+    /**
+      Open the database for reading only, for processes that never save.
+      Opening is then faster: the inter-process lock is not taken, and
+      the schema is neither created nor migrated. Opening fails if the
+      database does not exist or requires a migration. Saving and
+      purging fail, and the occurrences of recurring incidences are not
+      indexed.
+    */
+    bool readOnly = false;
+    /**
+      Each save() is a single transaction, in which every incidence
+      is written within its own savepoint. This option tells if a
+      failure rolls back the whole transaction or this incidence only.
+    */
+    SaveFailure saveFailure = RollbackAll;
+
+    /**
+      Options for devices short of memory: a small page cache,
+      no memory mapping and temporary data in files.
+    */
+    static SqliteStorageOptions lowMemory();
+
+    /**
+      Options for devices with memory to spare: a large page cache,
+      memory mapped reads, temporary data in memory and a write-ahead
+      log, synchronised at checkpoints only.
+    */
+    static SqliteStorageOptions highThroughput();
+};
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+
+#include "statementcache_p.h"
+#include "logging_p.h"
+
+#include <QElapsedTimer>
+
+using namespace mKCal;
+
+StatementCache::StatementCache(sqlite3 *database, int capacity)
+    : mDatabase(database)
+    , mCapacity(capacity)
+{
+}
+
+StatementCache::~StatementCache()
+{
+    for (QHash<QByteArray, Entry>::ConstIterator it = mEntries.constBegin();
+         it != mEntries.constEnd(); ++it) {
+        if (it->inUse) {
+            qCWarning(lcMkcal) << "finalizing a statement in use" << it.key();
+        }
+        sqlite3_finalize(it->stmt);
+    }
+}
+
+sqlite3_stmt *StatementCache::acquire(const char *query, int qsize)
+{
+    const QByteArray key = qsize < 0 ? QByteArray(query)
+        : QByteArray(query, qstrnlen(query, qsize));
+
+    QHash<QByteArray, Entry>::Iterator it = mEntries.find(key);
+    if (it != mEntries.end() && !it->inUse) {
+        mStatistics.hits += 1;
+        it->inUse = true;
+        it->tick = ++mTick;
+        return it->stmt;
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    QElapsedTimer clock;
+    clock.start();
+    int rv = sqlite3_prepare_v2(mDatabase, query, qsize, &stmt, nullptr);
+    mStatistics.prepareNSecs += clock.nsecsElapsed();
+    mStatistics.misses += 1;
+    if (rv) {
+        qCWarning(lcMkcal) << "sqlite3_prepare error code:" << rv;
+        qCWarning(lcMkcal) << sqlite3_errmsg(mDatabase);
+        sqlite3_finalize(stmt);
+        return nullptr;
+    }
+
+    if (it == mEntries.end()) {
+        evict();
+        Entry entry;
+        entry.stmt = stmt;
+        entry.tick = ++mTick;
+        entry.inUse = true;
+        mEntries.insert(key, entry);
+    }
+    // Otherwise, the cached one is in use, this one is transient.
+    return stmt;
+}
+
+void StatementCache::release(sqlite3_stmt *stmt)
+{
+    if (!stmt) {
+        return;
+    }
+
+    QHash<QByteArray, Entry>::Iterator it = mEntries.find(QByteArray(sqlite3_sql(stmt)));
+    if (it != mEntries.end() && it->stmt == stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        it->inUse = false;
+    } else {
+        sqlite3_finalize(stmt);
+    }
+}
+
+void StatementCache::clear()
+{
+    QHash<QByteArray, Entry>::Iterator it = mEntries.begin();
+    while (it != mEntries.end()) {
+        if (!it->inUse) {
+            sqlite3_finalize(it->stmt);
+            it = mEntries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+StatementCache::Statistics StatementCache::statistics() const
+{
+    return mStatistics;
+}
+
+void StatementCache::evict()
+{
+    while (mEntries.count() >= mCapacity) {
+        QHash<QByteArray, Entry>::Iterator oldest = mEntries.end();
+        for (QHash<QByteArray, Entry>::Iterator it = mEntries.begin();
+             it != mEntries.end(); ++it) {
+            if (!it->inUse && (oldest == mEntries.end() || it->tick < oldest->tick)) {
+                oldest = it;
+            }
+        }
+        if (oldest == mEntries.end()) {
+            // All statements are in use.
+            return;
+        }
+        sqlite3_finalize(oldest->stmt);
+        mEntries.erase(oldest);
+    }
+}
@@ -0,0 +1,101 @@
+/*
+  This file is part of the mkcal library.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public License
+  along with this library; see the file COPYING.LIB.  If not, write to
+  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+  Boston, MA 02110-1301, USA.
+*/
+/**
+  @file
+  This file is part of the API for handling calendar data and
+  defines the StatementCache class.
+*/
+
+#ifndef MKCAL_STATEMENTCACHE_H
+#define MKCAL_STATEMENTCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+
+#include <sqlite3.h>
+
+namespace mKCal {
+
+/**
+  @brief
+  A cache of prepared statements for one database connection.
+
+  Statements are indexed by their SQL text. A statement is acquired
+  for the duration of a query and released afterwards, to be reset
+  and kept for a later use. When the same SQL is acquired while the
+  cached statement is still in use, a transient statement is prepared
+  and finalized on release. The least recently used statements are
+  finalized when the cache exceeds its capacity.
+*/
+class StatementCache
+{
+public:
+    /**
+      Usage counters of a cache.
+    */
+    struct Statistics {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        qint64 prepareNSecs = 0;
+    };
+
+    StatementCache(sqlite3 *database, int capacity = 32);
+    ~StatementCache();
+
+    /**
+      Get a prepared statement for @param query, see sqlite3_prepare_v2()
+      for the meaning of @param qsize.
+
+      @return a statement ready to be bound, or a null pointer on error.
+    */
+    sqlite3_stmt *acquire(const char *query, int qsize);
+
+    /**
+      Give back a statement obtained from acquire(). Null pointers
+      are ignored.
+    */
+    void release(sqlite3_stmt *stmt);
+
+    /**
+      Finalize all statements not in use.
+    */
+    void clear();
+
+    Statistics statistics() const;
+
+private:
+    Q_DISABLE_COPY(StatementCache)
+
+    struct Entry {
+        sqlite3_stmt *stmt = nullptr;
+        quint64 tick = 0;
+        bool inUse = false;
+    };
+    void evict();
+
+    sqlite3 *mDatabase;
+    int mCapacity;
+    quint64 mTick = 0;
+    QHash<QByteArray, Entry> mEntries;
+    Statistics mStatistics;
+};
+
+}
+
+#endif
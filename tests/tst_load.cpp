@@ -36,9 +36,11 @@ private slots:
 
     void testAll();
     void testById();
+    void testByIds();
     void testSeries();
     void testByInstanceIdentifier();
     void testByDate();
+    void testOldSeries();
     void testRange();
     void testRange_data();
     void testSearch();
@@ -151,6 +153,55 @@ void tst_load::testById()
     QVERIFY(storage->save(ExtendedStorage::PurgeDeleted));
 }
 
+void tst_load::testByIds()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(QDate(2023, 3, 6), QTime(10, 0), Qt::UTC));
+    event->setSummary("Weekly event");
+    event->recurrence()->setWeekly(1);
+    KCalendarCore::Incidence::Ptr exception =
+        KCalendarCore::Calendar::createException(event, event->dtStart().addDays(7));
+    exception->setSummary("Weekly exception");
+    KCalendarCore::Event::Ptr event2(new KCalendarCore::Event);
+    event2->setDtStart(QDateTime(QDate(2023, 3, 7), QTime(10, 0), Qt::UTC));
+    event2->setSummary("Daily event");
+    event2->recurrence()->setDaily(1);
+    KCalendarCore::Event::Ptr event3(new KCalendarCore::Event);
+    event3->setDtStart(QDateTime(QDate(2023, 3, 8), QTime(10, 0), Qt::UTC));
+    event3->setSummary("Not loaded event");
+
+    QVERIFY(mStorage->calendar()->addEvent(event));
+    QVERIFY(mStorage->calendar()->addIncidence(exception));
+    QVERIFY(mStorage->calendar()->addEvent(event2));
+    QVERIFY(mStorage->calendar()->addEvent(event3));
+    QVERIFY(mStorage->save());
+
+    ExtendedCalendar::Ptr calendar(new ExtendedCalendar(QTimeZone::utc()));
+    ExtendedStorage::Ptr storage = ExtendedCalendar::defaultStorage(calendar);
+    QVERIFY(storage->open());
+
+    QVERIFY(calendar->events().isEmpty());
+
+    // Whole series, parents and exceptions, are loaded at once.
+    QVERIFY(storage->load(QStringList() << event->uid() << event2->uid()));
+    QCOMPARE(calendar->events().length(), 3);
+    QVERIFY(calendar->incidence(event->uid()));
+    QVERIFY(calendar->incidence(exception->uid(), exception->recurrenceId()));
+    QVERIFY(calendar->incidence(event2->uid()));
+    QVERIFY(!calendar->incidence(event3->uid()));
+
+    // Loaded series are not loaded again.
+    QVERIFY(storage->load(QStringList() << event->uid() << event3->uid()));
+    QCOMPARE(calendar->events().length(), 4);
+    QVERIFY(calendar->incidence(event3->uid()));
+
+    QVERIFY(mStorage->calendar()->deleteIncidence(exception));
+    QVERIFY(mStorage->calendar()->deleteIncidence(event));
+    QVERIFY(mStorage->calendar()->deleteIncidence(event2));
+    QVERIFY(mStorage->calendar()->deleteIncidence(event3));
+    QVERIFY(mStorage->save(ExtendedStorage::PurgeDeleted));
+}
+
 void tst_load::testSeries()
 {
     KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
@@ -278,6 +329,11 @@ void tst_load::testByDate()
     event7->setDtStart(QDateTime(date.addDays(-3), QTime(12, 0), Qt::UTC));
     event7->recurrence()->addRDateTime(QDateTime(date, QTime(9, 0), Qt::UTC));
     QVERIFY(mStorage->calendar()->addEvent(event7));
+    // Recurring weekly event, not intersecting date.
+    KCalendarCore::Event::Ptr event8(new KCalendarCore::Event);
+    event8->setDtStart(QDateTime(date.addDays(1), QTime(12, 0), Qt::UTC));
+    event8->recurrence()->setWeekly(1);
+    QVERIFY(mStorage->calendar()->addEvent(event8));
 
     QVERIFY(mStorage->save());
     
@@ -294,11 +350,17 @@ void tst_load::testByDate()
     QVERIFY(calendar->incidence(event5->uid()));
     QVERIFY(calendar->incidence(event6->uid()));
     QVERIFY(calendar->incidence(event7->uid()));
+    QVERIFY(!calendar->incidence(event8->uid()));
     QCOMPARE(calendar->events().length() - length0, 6);
-    QVERIFY(storage->isRecurrenceLoaded());
+    // Only the series occurring at date are loaded.
+    QVERIFY(!storage->isRecurrenceLoaded());
     QDateTime start, end;
     QVERIFY(!storage->getLoadDates(date, date.addDays(1), &start, &end));
 
+    QVERIFY(storage->load(date.addDays(7)));
+    QVERIFY(calendar->incidence(event8->uid()));
+
+    QVERIFY(mStorage->calendar()->deleteIncidence(event8));
     QVERIFY(mStorage->calendar()->deleteIncidence(event7));
     QVERIFY(mStorage->calendar()->deleteIncidence(event6));
     QVERIFY(mStorage->calendar()->deleteIncidence(event5));
@@ -309,6 +371,44 @@ void tst_load::testByDate()
     QVERIFY(mStorage->save(ExtendedStorage::PurgeDeleted));
 }
 
+void tst_load::testOldSeries()
+{
+    // An infinite series started long ago, with more occurrences
+    // before today than the occurrence index holds.
+    const QDate today = QDate::currentDate();
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(today.addYears(-20), QTime(10, 0), Qt::UTC));
+    event->setSummary("Old daily event");
+    event->recurrence()->setDaily(1);
+    // A series finished before the loaded dates.
+    KCalendarCore::Event::Ptr finished(new KCalendarCore::Event);
+    finished->setDtStart(QDateTime(today.addYears(-20), QTime(10, 0), Qt::UTC));
+    finished->setSummary("Finished daily event");
+    finished->recurrence()->setDaily(1);
+    finished->recurrence()->setEndDate(today.addYears(-19));
+    QVERIFY(mStorage->calendar()->addEvent(event));
+    QVERIFY(mStorage->calendar()->addEvent(finished));
+    QVERIFY(mStorage->save());
+
+    // Dates around today, before the expansion done at save time,
+    // and after its horizon, twice for the index to be extended.
+    const QList<QDate> dates = QList<QDate>() << today << today.addYears(-15)
+                                              << today.addYears(5) << today.addYears(-15)
+                                              << today.addYears(5);
+    for (const QDate &date : dates) {
+        ExtendedCalendar::Ptr calendar(new ExtendedCalendar(QTimeZone::utc()));
+        ExtendedStorage::Ptr storage = ExtendedCalendar::defaultStorage(calendar);
+        QVERIFY(storage->open());
+        QVERIFY(storage->load(date));
+        QVERIFY(calendar->incidence(event->uid()));
+        QVERIFY(!calendar->incidence(finished->uid()));
+    }
+
+    QVERIFY(mStorage->calendar()->deleteIncidence(event));
+    QVERIFY(mStorage->calendar()->deleteIncidence(finished));
+    QVERIFY(mStorage->save(ExtendedStorage::PurgeDeleted));
+}
+
 void tst_load::testRange_data()
 {
     QTest::addColumn<QDate>("start");
@@ -316,47 +416,63 @@ void tst_load::testRange_data()
     QTest::addColumn<bool>("shouldLoad");
     QTest::addColumn<QDateTime>("loadStart");
     QTest::addColumn<QDateTime>("loadEnd");
+    QTest::addColumn<int>("nRanges");
 
     QTest::newRow("non overlapping") << QDate(2022, 2, 16) << QDate(2022, 5, 8)
                                      << true
                                      << QDateTime(QDate(2022, 2, 16), {})
-                                     << QDateTime(QDate(2022, 5, 8), {});
+                                     << QDateTime(QDate(2022, 5, 8), {})
+                                     << 1;
     QTest::newRow("overlapping before") << QDate(2022, 1, 1) << QDate(2022, 3, 16)
                                         << true
                                         << QDateTime(QDate(2022, 1, 11), {})
-                                        << QDateTime(QDate(2022, 3, 16), {});
+                                        << QDateTime(QDate(2022, 3, 16), {})
+                                        << 2;
     QTest::newRow("overlapping after") << QDate(2022, 3, 14) << QDate(2022, 8, 22)
                                         << true
                                         << QDateTime(QDate(2022, 3, 14), {})
-                                        << QDateTime(QDate(2022, 8, 20), {});
+                                        << QDateTime(QDate(2022, 8, 20), {})
+                                        << 2;
     QTest::newRow("including") << QDate(2022, 4, 14) << QDate(2022, 5, 22)
                                << true
                                << QDateTime(QDate(2022, 4, 14), {})
-                               << QDateTime(QDate(2022, 5, 22), {});
+                               << QDateTime(QDate(2022, 5, 22), {})
+                               << 2;
     QTest::newRow("contained") << QDate(2022, 5, 8) << QDate(2022, 5, 11)
                                << false
                                << QDateTime()
-                               << QDateTime();
+                               << QDateTime()
+                               << 0;
     QTest::newRow("contained contiguous") << QDate(2022, 5, 8) << QDate(2022, 5, 18)
                                           << false
                                           << QDateTime()
-                                          << QDateTime();
+                                          << QDateTime()
+                                          << 0;
     QTest::newRow("open bounded") << QDate(2023, 5, 8) << QDate()
                                   << true
                                   << QDateTime(QDate(2023, 5, 8), {})
-                                  << QDateTime();
+                                  << QDateTime()
+                                  << 1;
     QTest::newRow("open bounded with overlap") << QDate(2022, 5, 8) << QDate()
                                                << true
                                                << QDateTime(QDate(2022, 5, 18), {})
-                                               << QDateTime();
+                                               << QDateTime()
+                                               << 2;
     QTest::newRow("open bounded loaded") << QDate() << QDate(2022, 1, 1)
                                          << false
                                          << QDateTime()
-                                         << QDateTime();
+                                         << QDateTime()
+                                         << 0;
     QTest::newRow("open bounded loaded with overlap") << QDate() << QDate(2022, 1, 13)
                                                       << true
                                                       << QDateTime(QDate(2022, 1, 11), {})
-                                                      << QDateTime(QDate(2022, 1, 13), {});
+                                                      << QDateTime(QDate(2022, 1, 13), {})
+                                                      << 1;
+    QTest::newRow("straddling a loaded range") << QDate(2022, 5, 1) << QDate(2022, 5, 20)
+                                               << true
+                                               << QDateTime(QDate(2022, 5, 1), {})
+                                               << QDateTime(QDate(2022, 5, 20), {})
+                                               << 2;
 }
 
 void tst_load::testRange()
@@ -366,6 +482,7 @@ void tst_load::testRange()
     QFETCH(bool, shouldLoad);
     QFETCH(QDateTime, loadStart);
     QFETCH(QDateTime, loadEnd);
+    QFETCH(int, nRanges);
 
     mStorage->close();
     mStorage->open();
@@ -384,6 +501,8 @@ void tst_load::testRange()
         QCOMPARE(lStart, loadStart);
         QCOMPARE(lEnd, loadEnd);
     }
+    // Only the days not loaded yet, one range per gap.
+    QCOMPARE(mStorage->getLoadRanges(start, end).count(), nRanges);
 }
 
 void tst_load::testSearch()
@@ -429,11 +548,34 @@ void tst_load::testSearch()
     QVERIFY(calendar->incidence(event3->uid()));
     QVERIFY(calendar->incidence(event4->uid()));
 
+    identifiers.clear();
+    QVERIFY(storage->search(QString::fromLatin1("Summary with STR"), &identifiers));
+    QVERIFY(identifiers.contains(event->instanceIdentifier()));
+    QVERIFY(identifiers.contains(event2->instanceIdentifier()));
+    QVERIFY(!identifiers.contains(exception->instanceIdentifier()));
+    QVERIFY(!identifiers.contains(event3->instanceIdentifier()));
+
+    // The limit applies to non recurring matches only.
+    identifiers.clear();
+    QVERIFY(storage->search(QString::fromLatin1("azerty"), &identifiers, 2));
+    int nSingles = 0;
+    for (const KCalendarCore::Event::Ptr &single : {event, event3, event4}) {
+        nSingles += identifiers.contains(single->instanceIdentifier()) ? 1 : 0;
+    }
+    QCOMPARE(nSingles, 2);
+
     QVERIFY(mStorage->calendar()->deleteIncidence(event));
     QVERIFY(mStorage->calendar()->deleteIncidence(event2));
     QVERIFY(mStorage->calendar()->deleteIncidence(event3));
     QVERIFY(mStorage->calendar()->deleteIncidence(event4));
     QVERIFY(mStorage->save(ExtendedStorage::PurgeDeleted));
+
+    // Deleted incidences are not found anymore.
+    identifiers.clear();
+    QVERIFY(storage->search(QString::fromLatin1("azerty"), &identifiers));
+    QVERIFY(!identifiers.contains(event->instanceIdentifier()));
+    QVERIFY(!identifiers.contains(event3->instanceIdentifier()));
+    QVERIFY(!identifiers.contains(event4->instanceIdentifier()));
 }
 
 #include "tst_load.moc"
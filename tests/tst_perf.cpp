@@ -21,9 +21,17 @@
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QTemporaryFile>
+#include <QProcess>
+#include <QFileInfo>
+#include <QBitArray>
+
+#include <KCalendarCore/ICalFormat>
+
+#include <sqlite3.h>
 
 #include "tst_perf.h"
 #include "sqlitestorage.h"
+#include "sqliteformat.h"
 
 tst_perf::tst_perf(QObject *parent)
     : QObject(parent)
@@ -33,6 +41,52 @@ tst_perf::tst_perf(QObject *parent)
 
 static const int N_EVENTS = 200;
 
+// A storage on its own temporary database, to be opened by the test.
+struct StorageFixture
+{
+    explicit StorageFixture(const SqliteStorage::Options &options = SqliteStorage::Options())
+        : calendar(new ExtendedCalendar(QTimeZone::systemTimeZone()))
+    {
+        if (file.open()) {
+            storage = SqliteStorage::Ptr(new SqliteStorage(calendar, file.fileName(), options));
+        }
+    }
+    ~StorageFixture()
+    {
+        QFile::remove(file.fileName() + ".changed");
+    }
+
+    // Close the storage and unload the calendar.
+    bool close()
+    {
+        const bool closed = storage->close();
+        calendar->close();
+        return closed;
+    }
+
+    QTemporaryFile file;
+    ExtendedCalendar::Ptr calendar;
+    SqliteStorage::Ptr storage;
+};
+
+// The integer value returned by a query, -1 on error.
+static qint64 queryInt64(const QString &databaseName, const QByteArray &query)
+{
+    sqlite3 *database;
+    sqlite3_stmt *stmt = nullptr;
+    qint64 value = -1;
+    if (sqlite3_open(databaseName.toUtf8(), &database) != SQLITE_OK) {
+        return value;
+    }
+    if (sqlite3_prepare_v2(database, query.constData(), -1, &stmt, nullptr) == SQLITE_OK
+        && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+    return value;
+}
+
 void tst_perf::initTestCase()
 {
     QString dbFile = QString::fromLatin1(qgetenv("SQLITESTORAGEDB"));
@@ -42,7 +96,7 @@ void tst_perf::initTestCase()
         dbFile = db->fileName();
     }
     ExtendedCalendar::Ptr cal(new ExtendedCalendar(QTimeZone::systemTimeZone()));
-    m_storage = ExtendedStorage::Ptr(new SqliteStorage(cal, dbFile, true));
+    m_storage = ExtendedStorage::Ptr(new SqliteStorage(cal, dbFile));
 }
 
 void tst_perf::cleanupTestCase()
@@ -123,4 +177,744 @@ void tst_perf::tst_loadRange()
     qDebug() << "SqliteStorage::load(range) rate " << float(clock.elapsed()) / m_storage->calendar()->rawEvents().count() << "ms per event";
 }
 
+static int countSelects(unsigned int type, void *context, void *p, void *x)
+{
+    Q_UNUSED(type);
+    Q_UNUSED(x);
+
+    const char *sql = sqlite3_sql(static_cast<sqlite3_stmt*>(p));
+    if (sql && !qstrnicmp(sql, "select", 6)) {
+        *static_cast<int*>(context) += 1;
+    }
+    return 0;
+}
+
+void tst_perf::tst_selectComponents()
+{
+    QElapsedTimer clock;
+    sqlite3 *database;
+    sqlite3_stmt *stmt = nullptr;
+    int nQueries = 0;
+
+    QCOMPARE(sqlite3_open(m_storage.staticCast<SqliteStorage>()->databaseName().toUtf8(), &database), SQLITE_OK);
+    sqlite3_trace_v2(database, SQLITE_TRACE_STMT, countSelects, &nQueries);
+    QCOMPARE(sqlite3_prepare_v2(database, SELECT_COMPONENTS_ALL, sizeof(SELECT_COMPONENTS_ALL), &stmt, nullptr), SQLITE_OK);
+
+    KCalendarCore::Incidence::List rowList;
+    KCalendarCore::Incidence::List batchList;
+    int rowQueries, batchQueries;
+    qint64 rowTime, batchTime;
+    {
+        SqliteFormat format(database);
+        KCalendarCore::Incidence::Ptr incidence;
+
+        clock.start();
+        while ((incidence = format.selectComponents(stmt))) {
+            rowList.append(incidence);
+        }
+        rowTime = clock.elapsed();
+        rowQueries = nQueries;
+
+        QCOMPARE(sqlite3_reset(stmt), SQLITE_OK);
+        nQueries = 0;
+        clock.restart();
+        int n;
+        do {
+            n = format.selectComponents(stmt, &batchList, 100);
+            QVERIFY(n >= 0);
+        } while (n == 100);
+        batchTime = clock.elapsed();
+        batchQueries = nQueries;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+
+    QVERIFY(!rowList.isEmpty());
+    QCOMPARE(batchList.count(), rowList.count());
+    for (int i = 0; i < rowList.count(); i++) {
+        QVERIFY(*batchList[i] == *rowList[i]);
+    }
+    qDebug() << "SqliteFormat::selectComponents() per row:" << rowQueries << "queries in" << rowTime << "ms";
+    qDebug() << "SqliteFormat::selectComponents() per batch:" << batchQueries << "queries in" << batchTime << "ms";
+    QVERIFY(batchQueries < rowQueries);
+}
+
+void tst_perf::tst_fromOriginTime_data()
+{
+    QTest::addColumn<bool>("cached");
+
+    QTest::newRow("time zone from id") << false;
+    QTest::newRow("cached time zone") << true;
+}
+
+void tst_perf::tst_fromOriginTime()
+{
+    QFETCH(bool, cached);
+
+    const QByteArray zonename("Europe/Paris");
+    const sqlite3_int64 seconds = SqliteFormat::toOriginTime(QDateTime::currentDateTimeUtc());
+    QDateTime dt;
+
+    if (cached) {
+        QBENCHMARK {
+            dt = SqliteFormat::fromOriginTime(seconds, zonename);
+        }
+    } else {
+        // What fromOriginTime() was doing for each column of each row.
+        QBENCHMARK {
+            dt = SqliteFormat::fromOriginTime(seconds).toTimeZone(QTimeZone(zonename));
+        }
+    }
+    QCOMPARE(dt.timeZone(), QTimeZone(zonename));
+}
+
+void tst_perf::tst_statementCache()
+{
+    SqliteStorage::Ptr storage = m_storage.staticCast<SqliteStorage>();
+    const QDate cur = QDateTime::currentDateTimeUtc().date();
+    const int N_QUERIES = 50;
+    IncidenceHeader::List headers;
+
+    QVERIFY(storage->loadHeaders(cur, cur.addDays(1), &headers));
+    const SqliteStorage::StatementStatistics first = storage->statementStatistics();
+    QVERIFY(first.misses > 0);
+
+    QElapsedTimer clock;
+    clock.start();
+    for (int i = 0; i < N_QUERIES; i++) {
+        QVERIFY(storage->loadHeaders(cur.addDays(i), cur.addDays(i + 1), &headers));
+    }
+    const qint64 elapsed = clock.nsecsElapsed();
+    const SqliteStorage::StatementStatistics stats = storage->statementStatistics();
+
+    // The statement is prepared once and reused for every query.
+    QCOMPARE(stats.misses, first.misses);
+    QCOMPARE(stats.hits, first.hits + N_QUERIES);
+    QCOMPARE(stats.prepareNSecs, first.prepareNSecs);
+    qDebug() << "SqliteStorage::loadHeaders()" << float(elapsed) / N_QUERIES / 1000 << "us per query,"
+             << stats.hits << "hits," << stats.misses << "misses,"
+             << float(stats.prepareNSecs) / 1000 << "us preparing statements";
+}
+
+void tst_perf::tst_search()
+{
+    const int N_QUERIES = 20;
+    const QString key = QString::fromLatin1("summ");
+    QStringList identifiers;
+    QElapsedTimer clock;
+
+    clock.start();
+    for (int i = 0; i < N_QUERIES; i++) {
+        identifiers.clear();
+        QVERIFY(m_storage->search(key, &identifiers));
+    }
+    const qint64 searchTime = clock.nsecsElapsed();
+    if (db)
+        // Expected not to be N_EVENTS in case of reading from a database with arbitrary content.
+        QCOMPARE(identifiers.count(), N_EVENTS);
+
+    // The LIKE scan used by search() without full-text index.
+    sqlite3 *database;
+    sqlite3_stmt *stmt = nullptr;
+    const QByteArray pattern("%summ%");
+    int nRows = 0;
+    QCOMPARE(sqlite3_open(m_storage.staticCast<SqliteStorage>()->databaseName().toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_prepare_v2(database, SEARCH_COMPONENTS, sizeof(SEARCH_COMPONENTS), &stmt, nullptr), SQLITE_OK);
+    clock.restart();
+    for (int i = 0; i < N_QUERIES; i++) {
+        QCOMPARE(sqlite3_reset(stmt), SQLITE_OK);
+        for (int j = 1; j <= 3; j++) {
+            QCOMPARE(sqlite3_bind_text(stmt, j, pattern.constData(), pattern.length(), SQLITE_STATIC), SQLITE_OK);
+        }
+        nRows = 0;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            nRows += 1;
+        }
+    }
+    const qint64 likeTime = clock.nsecsElapsed();
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+
+    QVERIFY(nRows > 0);
+    qDebug() << "SqliteStorage::search()" << float(searchTime) / N_QUERIES / 1000 << "us per query,"
+             << identifiers.count() << "matches";
+    qDebug() << "LIKE scan without loading" << float(likeTime) / N_QUERIES / 1000 << "us per query,"
+             << nRows << "matches";
+}
+
+void tst_perf::tst_concurrentRead_data()
+{
+    QTest::addColumn<bool>("wal");
+
+    // The journal mode is kept in the database, rollback first.
+    QTest::newRow("rollback journal") << false;
+    QTest::newRow("write-ahead log") << true;
+}
+
+void tst_perf::tst_concurrentRead()
+{
+    QFETCH(bool, wal);
+
+    SqliteStorage::Ptr storage = m_storage.staticCast<SqliteStorage>();
+    QVERIFY(storage->close());
+    storage->setWriteAheadLogging(wal);
+    QVERIFY(storage->open());
+    QCOMPARE(storage->isWriteAheadLogging(), wal);
+
+    // Another process saving continuously in the same database.
+    QProcess writer;
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert(QString::fromLatin1("SQLITESTORAGEDB"), storage->databaseName());
+    env.insert(QString::fromLatin1("MKCAL_PERF_WRITER"), QString::fromLatin1("1"));
+    writer.setProcessEnvironment(env);
+    writer.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    writer.start(QCoreApplication::applicationFilePath(),
+                 QStringList() << QString::fromLatin1("tst_writer"));
+    QVERIFY(writer.waitForStarted());
+
+    const QDate cur = QDateTime::currentDateTimeUtc().date();
+    QElapsedTimer clock;
+    qint64 total = 0;
+    qint64 worst = 0;
+    int nReads = 0;
+    while (!writer.waitForFinished(0)) {
+        IncidenceHeader::List headers;
+        clock.start();
+        QVERIFY(storage->loadHeaders(cur.addDays(-2), cur.addDays(N_EVENTS * 2), &headers));
+        const qint64 elapsed = clock.nsecsElapsed();
+        total += elapsed;
+        worst = qMax(worst, elapsed);
+        nReads += 1;
+    }
+    QCOMPARE(writer.exitStatus(), QProcess::NormalExit);
+    QCOMPARE(writer.exitCode(), 0);
+
+    QVERIFY(nReads > 0);
+    qDebug() << "SqliteStorage::loadHeaders() while saving" << (wal ? "with" : "without")
+             << "write-ahead log:" << float(total) / nReads / 1000 << "us per query,"
+             << float(worst) / 1000 << "us at worst," << nReads << "queries";
+}
+
+void tst_perf::tst_writer()
+{
+    if (qEnvironmentVariableIsEmpty("MKCAL_PERF_WRITER")) {
+        QSKIP("writer process of tst_concurrentRead only");
+    }
+
+    const int N_SAVES = 20;
+    const QDateTime cur = QDateTime::currentDateTimeUtc();
+    for (int i = 0; i < N_SAVES; i++) {
+        KCalendarCore::Incidence::List events;
+        for (int j = 0; j < N_EVENTS; j++) {
+            KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+            event->setDtStart(cur.addDays(j));
+            event->setSummary(QString::fromLatin1("concurrent summary"));
+            QVERIFY(m_storage->calendar()->addIncidence(event));
+            events.append(event);
+        }
+        QVERIFY(m_storage->save());
+        for (const KCalendarCore::Incidence::Ptr &event : const_cast<const KCalendarCore::Incidence::List&>(events)) {
+            QVERIFY(m_storage->calendar()->deleteIncidence(event));
+        }
+        QVERIFY(m_storage->save(ExtendedStorage::PurgeDeleted));
+    }
+}
+
+void tst_perf::tst_options_data()
+{
+    QTest::addColumn<QString>("preset");
+
+    QTest::newRow("default") << QString::fromLatin1("default");
+    QTest::newRow("low memory") << QString::fromLatin1("lowMemory");
+    QTest::newRow("high throughput") << QString::fromLatin1("highThroughput");
+}
+
+void tst_perf::tst_options()
+{
+    QFETCH(QString, preset);
+
+    SqliteStorage::Options options;
+    if (preset == QString::fromLatin1("lowMemory")) {
+        options = SqliteStorage::Options::lowMemory();
+    } else if (preset == QString::fromLatin1("highThroughput")) {
+        options = SqliteStorage::Options::highThroughput();
+    }
+
+    StorageFixture fixture(options);
+    const ExtendedCalendar::Ptr &cal = fixture.calendar;
+    const SqliteStorage::Ptr &storage = fixture.storage;
+    QVERIFY(storage && storage->open());
+
+    // Memory mapping may be limited at build time, not compared.
+    const SqliteStorage::Options effective = storage->options();
+    if (options.cacheSize) {
+        QCOMPARE(effective.cacheSize, options.cacheSize);
+    }
+    if (options.synchronous != SqliteStorage::Options::SynchronousDefault) {
+        QCOMPARE(effective.synchronous, options.synchronous);
+    }
+    if (options.tempStore != SqliteStorage::Options::TempStoreDefault) {
+        QCOMPARE(effective.tempStore, options.tempStore);
+    }
+    if (options.journalMode != SqliteStorage::Options::JournalDefault) {
+        QCOMPARE(effective.journalMode, options.journalMode);
+    }
+    QCOMPARE(effective.busyTimeout, options.busyTimeout);
+
+    QElapsedTimer clock;
+    const QDateTime cur = QDateTime::currentDateTimeUtc();
+    for (int i = 0; i < N_EVENTS; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(cur.addDays(i));
+        event->setSummary(QString::fromLatin1("summary"));
+        QVERIFY(cal->addIncidence(event));
+    }
+    clock.start();
+    QVERIFY(storage->save());
+    const qint64 saveTime = clock.elapsed();
+
+    QVERIFY(fixture.close());
+    QVERIFY(storage->open());
+    clock.restart();
+    QVERIFY(storage->load());
+    const qint64 loadTime = clock.elapsed();
+    QCOMPARE(cal->rawEvents().count(), N_EVENTS);
+
+    const int N_QUERIES = 20;
+    QStringList identifiers;
+    clock.restart();
+    for (int i = 0; i < N_QUERIES; i++) {
+        identifiers.clear();
+        QVERIFY(storage->search(QString::fromLatin1("summ"), &identifiers));
+    }
+    const qint64 searchTime = clock.nsecsElapsed();
+    QCOMPARE(identifiers.count(), N_EVENTS);
+
+    QVERIFY(fixture.close());
+
+    qDebug() << preset << "options: save" << saveTime << "ms, load" << loadTime << "ms, search"
+             << float(searchTime) / N_QUERIES / 1000 << "us per query";
+}
+
+void tst_perf::tst_open()
+{
+    const int N_OPENS = 20;
+    QElapsedTimer clock;
+    qint64 elapsed = 0;
+
+    // The database is already at the current version, opening
+    // should not run the schema creation, nor any migration.
+    for (int i = 0; i < N_OPENS; i++) {
+        QVERIFY(m_storage->close());
+        clock.start();
+        QVERIFY(m_storage->open());
+        elapsed += clock.nsecsElapsed();
+    }
+
+    qDebug() << "SqliteStorage::open() on an existing database"
+             << float(elapsed) / N_OPENS / 1000 << "us per open";
+}
+
+static bool execute(sqlite3 *database, const QByteArray &query)
+{
+    char *errmsg = nullptr;
+    if (sqlite3_exec(database, query.constData(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        qWarning() << query << errmsg;
+        sqlite3_free(errmsg);
+        return false;
+    }
+    return true;
+}
+
+// Size of the database file, once compacted.
+static qint64 vacuumedSize(const QString &fileName)
+{
+    sqlite3 *database;
+    if (sqlite3_open(fileName.toUtf8(), &database) != SQLITE_OK) {
+        return -1;
+    }
+    const bool success = execute(database, "VACUUM");
+    sqlite3_close(database);
+    return success ? QFileInfo(fileName).size() : -1;
+}
+
+// Write back the type and the time zones as text, and the recurrence
+// rules in the Recursive table, like in the schema version 5.
+static bool downgradeToVersion5(const QString &fileName)
+{
+    static const char *zoneColumns[][2] = {
+        {"Components", "StartTimeZone"},
+        {"Components", "EndDueTimeZone"},
+        {"Components", "RecurIdTimeZone"},
+        {"Components", "CompletedTimeZone"},
+        {"Rdates", "TimeZone"},
+        {"Recursive", "untilTimeZone"},
+        {"Alarm", "triggerTimeZone"}
+    };
+    sqlite3 *database;
+    if (sqlite3_open(fileName.toUtf8(), &database) != SQLITE_OK) {
+        return false;
+    }
+    bool success = execute(database, "UPDATE Components SET Type=CASE Type WHEN 0 THEN 'Event' "
+                           "WHEN 1 THEN 'Todo' WHEN 2 THEN 'Journal' ELSE 'FreeBusy' END");
+    for (const auto &zone : zoneColumns) {
+        const QByteArray column = QByteArray(zone[0]) + "." + zone[1];
+        success = success && execute(database, QByteArray("UPDATE ") + zone[0] + " SET " + zone[1]
+                                     + "=CASE " + column + " WHEN 0 THEN '' WHEN -1 THEN 'FloatingDate' "
+                                     + "ELSE (SELECT Name FROM TimeZones WHERE TimeZoneId=" + column + ") END");
+    }
+    // The series of tst_compactSchema() are weekly, with 11 occurrences.
+    success = success && execute(database, "INSERT INTO Recursive(ComponentId, RuleType, Frequency, "
+                                 "Count, Interval, WeekStart) SELECT ComponentId, 1, 5, 11, 1, 1 "
+                                 "FROM Components WHERE Recurrence IS NOT NULL")
+        && execute(database, "ALTER TABLE Components DROP COLUMN Recurrence")
+        && execute(database, "ALTER TABLE OccurrenceHorizons DROP COLUMN Origin");
+    success = success && execute(database, "DROP TABLE TimeZones")
+        && execute(database, "DELETE FROM Migrations WHERE Version>5")
+        && execute(database, "PRAGMA user_version = 5");
+    sqlite3_close(database);
+    return success;
+}
+
+void tst_perf::tst_compactSchema()
+{
+    // Use MKCAL_PERF_FIXTURE_SIZE=100000 for a large fixture.
+    int nIncidences = qEnvironmentVariableIntValue("MKCAL_PERF_FIXTURE_SIZE");
+    if (nIncidences <= 0) {
+        nIncidences = 10 * N_EVENTS;
+    }
+    const QByteArray zones[] = {"Europe/Paris", "America/New_York", "Asia/Tokyo", "UTC"};
+
+    StorageFixture fixture;
+    const ExtendedCalendar::Ptr &cal = fixture.calendar;
+    const SqliteStorage::Ptr &storage = fixture.storage;
+    QVERIFY(storage && storage->open());
+    const QDateTime cur(QDate(2024, 1, 1), QTime(9, 0), QTimeZone("Europe/Paris"));
+    for (int i = 0; i < nIncidences; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        switch (i % 4) {
+        case 0:
+            event->setDtStart(QDateTime(cur.date().addDays(i / 4), QTime(0, 0), Qt::LocalTime));
+            event->setAllDay(true);
+            break;
+        case 1:
+            event->setDtStart(QDateTime(cur.date().addDays(i / 4), cur.time(), Qt::LocalTime));
+            break;
+        default:
+            event->setDtStart(cur.addDays(i / 4).toTimeZone(QTimeZone(zones[i % 4])));
+            break;
+        }
+        if (!event->allDay()) {
+            event->setDtEnd(event->dtStart().addSecs(3600));
+        }
+        event->setSummary(QString::fromLatin1("summary %1").arg(i));
+        if (i % 3 == 0) {
+            KCalendarCore::Alarm::Ptr alarm = event->newAlarm();
+            alarm->setDisplayAlarm(QString::fromLatin1("Driiiiing"));
+            alarm->setTime(event->dtStart().addSecs(-600));
+        }
+        if (i % 5 == 0) {
+            event->recurrence()->setWeekly(1, event->dtStart().date().dayOfWeek());
+            event->recurrence()->setEndDateTime(event->dtStart().addDays(70));
+        }
+        QVERIFY(cal->addIncidence(event));
+    }
+    QVERIFY(storage->save());
+    QVERIFY(fixture.close());
+
+    const qint64 compactSize = vacuumedSize(fixture.file.fileName());
+    QVERIFY(compactSize > 0);
+    QVERIFY(storage->open());
+    QElapsedTimer clock;
+    clock.start();
+    QVERIFY(storage->load());
+    const qint64 compactLoadTime = clock.elapsed();
+    const KCalendarCore::Event::List expected = cal->rawEvents();
+    QCOMPARE(expected.count(), nIncidences);
+    QVERIFY(fixture.close());
+
+    QVERIFY(downgradeToVersion5(fixture.file.fileName()));
+    const qint64 textSize = vacuumedSize(fixture.file.fileName());
+    QVERIFY(textSize > 0);
+
+    // Opening runs the migration to the compact schema.
+    clock.restart();
+    QVERIFY(storage->open());
+    const qint64 migrationTime = clock.elapsed();
+    QVERIFY(storage->load());
+    QCOMPARE(cal->rawEvents().count(), nIncidences);
+    for (const KCalendarCore::Event::Ptr &reference : expected) {
+        const KCalendarCore::Event::Ptr event = cal->event(reference->uid());
+        QVERIFY(event);
+        QCOMPARE(event->allDay(), reference->allDay());
+        QCOMPARE(event->dtStart(), reference->dtStart());
+        QCOMPARE(event->dtStart().timeSpec(), reference->dtStart().timeSpec());
+        QCOMPARE(event->dtStart().timeZone(), reference->dtStart().timeZone());
+        QCOMPARE(event->alarms().count(), reference->alarms().count());
+        QCOMPARE(event->recurs(), reference->recurs());
+    }
+    QVERIFY(fixture.close());
+
+    qDebug() << nIncidences << "incidences, text types and zone names:" << textSize / 1024 << "KiB";
+    qDebug() << nIncidences << "incidences, type codes and zone identifiers:" << compactSize / 1024
+             << "KiB, load" << compactLoadTime << "ms, migration" << migrationTime << "ms";
+    QVERIFY(compactSize < textSize);
+}
+
+void tst_perf::tst_loadRecurrences()
+{
+    const int N_EXCEPTIONS = 20;
+    StorageFixture fixture;
+    const ExtendedCalendar::Ptr &cal = fixture.calendar;
+    const SqliteStorage::Ptr &storage = fixture.storage;
+    QVERIFY(storage && storage->open());
+    const QDateTime cur(QDate(2024, 1, 1), QTime(9, 0), QTimeZone("Europe/Paris"));
+    for (int i = 0; i < N_EVENTS; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(cur.addDays(i));
+        event->setDtEnd(event->dtStart().addSecs(3600));
+        event->setSummary(QString::fromLatin1("series %1").arg(i));
+        event->recurrence()->setWeekly(1, QBitArray(7, true));
+        event->recurrence()->addRRule(new KCalendarCore::RecurrenceRule(*event->recurrence()->defaultRRule()));
+        event->recurrence()->rRules().last()->setRecurrenceType(KCalendarCore::RecurrenceRule::rMonthly);
+        for (int j = 0; j < N_EXCEPTIONS; j++) {
+            event->recurrence()->addExDateTime(event->dtStart().addDays(7 * j + 1));
+        }
+        QVERIFY(cal->addIncidence(event));
+    }
+    QVERIFY(storage->save());
+    QVERIFY(fixture.close());
+
+    const qint64 recurrenceSize = queryInt64(fixture.file.fileName(),
+                                            "select sum(length(Recurrence)) from Components");
+    QVERIFY(recurrenceSize > 0);
+
+    QVERIFY(storage->open());
+    QElapsedTimer clock;
+    clock.start();
+    QVERIFY(storage->load());
+    const qint64 loadTime = clock.nsecsElapsed();
+    const KCalendarCore::Event::List series = cal->rawEvents();
+    QCOMPARE(series.count(), N_EVENTS);
+    for (const KCalendarCore::Event::Ptr &event : series) {
+        QCOMPARE(event->recurrence()->rRules().count(), 2);
+        QCOMPARE(event->recurrence()->exDateTimes().count(), N_EXCEPTIONS);
+    }
+    QVERIFY(fixture.close());
+
+    qDebug() << "SqliteStorage::load() of series" << float(loadTime) / N_EVENTS / 1000 << "us per series,"
+             << float(recurrenceSize) / N_EVENTS << "bytes of recurrence per series";
+}
+
+void tst_perf::tst_partialUpdate()
+{
+    const int N_MEETINGS = 50;
+    const int N_ATTENDEES = 300;
+    StorageFixture fixture;
+    const ExtendedCalendar::Ptr &cal = fixture.calendar;
+    const SqliteStorage::Ptr &storage = fixture.storage;
+    QVERIFY(storage && storage->open());
+    const QDateTime cur = QDateTime::currentDateTimeUtc();
+    const QByteArray data = QByteArray(16 * 1024, 'x').toBase64();
+    for (int i = 0; i < N_MEETINGS; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(cur.addDays(i));
+        event->setDtEnd(event->dtStart().addSecs(3600));
+        event->setSummary(QString::fromLatin1("meeting %1").arg(i));
+        event->setOrganizer(KCalendarCore::Person(QString::fromLatin1("Organizer"),
+                                                  QString::fromLatin1("organizer@example.org")));
+        for (int j = 0; j < N_ATTENDEES; j++) {
+            event->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Attendee %1").arg(j),
+                                                       QString::fromLatin1("attendee%1@example.org").arg(j)));
+        }
+        event->addAttachment(KCalendarCore::Attachment(data, QString::fromLatin1("application/octet-stream")));
+        QVERIFY(cal->addIncidence(event));
+    }
+    QVERIFY(storage->save());
+    QVERIFY(fixture.close());
+
+    QElapsedTimer clock;
+    QVERIFY(storage->open());
+    QVERIFY(storage->load());
+    const qint64 attendeeRowId = queryInt64(fixture.file.fileName(), "select min(rowid) from Attendee");
+    const qint64 attachmentRowId = queryInt64(fixture.file.fileName(), "select min(rowid) from Attachments");
+    KCalendarCore::Event::List meetings = cal->rawEvents();
+    QCOMPARE(meetings.count(), N_MEETINGS);
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        event->setSummary(event->summary() + QString::fromLatin1("."));
+    }
+    clock.start();
+    QVERIFY(storage->save());
+    const qint64 summaryTime = clock.nsecsElapsed();
+    // The attendees and the attachments were not rewritten.
+    QCOMPARE(queryInt64(fixture.file.fileName(), "select min(rowid) from Attendee"), attendeeRowId);
+    QCOMPARE(queryInt64(fixture.file.fileName(), "select min(rowid) from Attachments"), attachmentRowId);
+
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        KCalendarCore::Attendee::List attendees = event->attendees();
+        attendees.first().setStatus(KCalendarCore::Attendee::Accepted);
+        event->setAttendees(attendees);
+    }
+    clock.start();
+    QVERIFY(storage->save());
+    const qint64 attendeesTime = clock.nsecsElapsed();
+    QVERIFY(queryInt64(fixture.file.fileName(), "select min(rowid) from Attendee") > attendeeRowId);
+    QCOMPARE(queryInt64(fixture.file.fileName(), "select min(rowid) from Attachments"), attachmentRowId);
+
+    QVERIFY(fixture.close());
+    QVERIFY(storage->open());
+    QVERIFY(storage->load());
+    meetings = cal->rawEvents();
+    QCOMPARE(meetings.count(), N_MEETINGS);
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        QVERIFY(event->summary().endsWith(QString::fromLatin1(".")));
+        QCOMPARE(event->attendees().count(), N_ATTENDEES);
+        QCOMPARE(event->attendees().first().status(), KCalendarCore::Attendee::Accepted);
+        QCOMPARE(event->attachments().count(), 1);
+    }
+
+    // Alarms and recurrences modified in place, not part
+    // of the snapshots, are compared with the stored ones.
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        KCalendarCore::Alarm::Ptr alarm = event->newAlarm();
+        alarm->setDisplayAlarm(QString::fromLatin1("reminder"));
+        alarm->setStartOffset(KCalendarCore::Duration(-900));
+        alarm->setEnabled(true);
+        event->recurrence()->setWeekly(1);
+    }
+    QVERIFY(storage->save());
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        event->alarms().first()->setStartOffset(KCalendarCore::Duration(-1800));
+        event->recurrence()->setDuration(10);
+    }
+    QVERIFY(storage->save());
+    QVERIFY(fixture.close());
+    QVERIFY(storage->open());
+    QVERIFY(storage->load());
+    meetings = cal->rawEvents();
+    QCOMPARE(meetings.count(), N_MEETINGS);
+    for (const KCalendarCore::Event::Ptr &event : meetings) {
+        QCOMPARE(event->alarms().count(), 1);
+        QCOMPARE(event->alarms().first()->startOffset(), KCalendarCore::Duration(-1800));
+        QCOMPARE(event->recurrence()->duration(), 10);
+    }
+    QVERIFY(fixture.close());
+
+    qDebug() << "SqliteStorage::save() of a summary change" << float(summaryTime) / N_MEETINGS / 1000
+             << "us per meeting, of an attendee change" << float(attendeesTime) / N_MEETINGS / 1000
+             << "us per meeting of" << N_ATTENDEES << "attendees";
+}
+
+void tst_perf::tst_import()
+{
+    // Use MKCAL_PERF_FIXTURE_SIZE=100000 for a large fixture.
+    int nIncidences = qEnvironmentVariableIntValue("MKCAL_PERF_FIXTURE_SIZE");
+    if (nIncidences <= 0) {
+        nIncidences = 10 * N_EVENTS;
+    }
+
+    QTemporaryFile ics;
+    QVERIFY(ics.open());
+    ics.write("BEGIN:VCALENDAR\r\nPRODID:-//mkcal//perf//EN\r\nVERSION:2.0\r\n");
+    const QDateTime cur(QDate(2024, 1, 1), QTime(9, 0), Qt::UTC);
+    for (int i = 0; i < nIncidences; i++) {
+        const QByteArray dtStart = cur.addSecs(3600 * i).toString(QString::fromLatin1("yyyyMMdd'T'hhmmss'Z'")).toLatin1();
+        const QByteArray n = QByteArray::number(i);
+        ics.write("BEGIN:VEVENT\r\nUID:import-" + n + "\r\nDTSTART:" + dtStart
+                  + "\r\nDURATION:PT1H\r\nSUMMARY:imported event " + n
+                  + "\r\nDESCRIPTION:" + QByteArray(200, 'd')
+                  + "\r\nATTENDEE;CN=Attendee " + n + ":mailto:attendee" + n + "@example.org"
+                  + "\r\nBEGIN:VALARM\r\nACTION:DISPLAY\r\nTRIGGER:-PT15M\r\nDESCRIPTION:reminder"
+                  + "\r\nEND:VALARM\r\nEND:VEVENT\r\n");
+    }
+    ics.write("END:VCALENDAR\r\n");
+    QVERIFY(ics.flush());
+    const float size = float(ics.size()) / 1024 / 1024;
+
+    // Parsing into a calendar and saving it.
+    StorageFixture parsed;
+    QVERIFY(parsed.storage && parsed.storage->open());
+    QElapsedTimer clock;
+    clock.start();
+    KCalendarCore::ICalFormat format;
+    QVERIFY(format.load(parsed.calendar, ics.fileName()));
+    QVERIFY(parsed.storage->save());
+    const qint64 saveTime = clock.nsecsElapsed();
+    QVERIFY(parsed.close());
+
+    // Streaming into the database.
+    StorageFixture streamed;
+    const ExtendedCalendar::Ptr &cal = streamed.calendar;
+    const SqliteStorage::Ptr &storage = streamed.storage;
+    QVERIFY(storage && storage->open());
+    QVERIFY(ics.seek(0));
+    int count = 0;
+    clock.start();
+    QVERIFY(storage->importIncidences(&ics, &count));
+    const qint64 importTime = clock.nsecsElapsed();
+    QCOMPARE(count, nIncidences);
+    QVERIFY(cal->rawEvents().isEmpty());
+    QVERIFY(storage->load());
+    QCOMPARE(cal->rawEvents().count(), nIncidences);
+    QVERIFY(streamed.close());
+
+    qDebug() << "Import of" << nIncidences << "events," << size << "MiB:"
+             << nIncidences / (float(saveTime) / 1e9) << "events/s with load() and save(),"
+             << nIncidences / (float(importTime) / 1e9) << "events/s with importIncidences()";
+}
+
+void tst_perf::tst_purgeDeleted()
+{
+    const int nIncidences = 10 * N_EVENTS;
+    StorageFixture fixture;
+    const ExtendedCalendar::Ptr &cal = fixture.calendar;
+    const SqliteStorage::Ptr &storage = fixture.storage;
+    QVERIFY(storage && storage->open());
+
+    const QDateTime cur(QDate(2024, 1, 1), QTime(9, 0), Qt::UTC);
+    KCalendarCore::Incidence::List tombstones;
+    for (int i = 0; i < nIncidences; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(cur.addSecs(3600 * i));
+        event->setDtEnd(cur.addSecs(3600 * i + 1800));
+        event->setSummary(QString::fromLatin1("tombstone %1").arg(i));
+        event->setDescription(QString(200, QChar('d')));
+        event->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Attendee %1").arg(i),
+                                                   QString::fromLatin1("attendee%1@example.org").arg(i)));
+        event->setNonKDECustomProperty("X-SYNC-ID", QString::number(i));
+        QVERIFY(cal->addEvent(event, cal->defaultNotebook()));
+        tombstones << event;
+    }
+    QVERIFY(storage->save());
+    for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(tombstones)) {
+        QVERIFY(cal->deleteIncidence(incidence));
+    }
+    QVERIFY(storage->save());
+    const qint64 fullSize = QFileInfo(fixture.file.fileName()).size();
+
+    // Purging half of the tombstones by identifier, the other half by age.
+    const KCalendarCore::Incidence::List half = tombstones.mid(0, nIncidences / 2);
+    QElapsedTimer clock;
+    clock.start();
+    QVERIFY(storage->purgeDeletedIncidences(half));
+    const qint64 listTime = clock.nsecsElapsed();
+    QCOMPARE(queryInt64(fixture.file.fileName(), "select count(*) from Components"),
+             qint64(nIncidences - half.count()));
+
+    clock.start();
+    QCOMPARE(storage->purgeDeletedBefore(QDateTime::currentDateTimeUtc().addSecs(60), true),
+             nIncidences - half.count());
+    const qint64 ageTime = clock.nsecsElapsed();
+    QCOMPARE(queryInt64(fixture.file.fileName(), "select count(*) from Components"), qint64(0));
+    const qint64 purgedSize = QFileInfo(fixture.file.fileName()).size();
+    QVERIFY(purgedSize < fullSize);
+
+    QVERIFY(fixture.close());
+
+    qDebug() << "Purge of" << nIncidences << "deleted events:"
+             << float(listTime) / half.count() / 1000 << "us per event by identifier,"
+             << float(ageTime) / (nIncidences - half.count()) / 1000 << "us per event by age,"
+             << fullSize / 1024 << "KiB before," << purgedSize / 1024 << "KiB after vacuum";
+}
+
 QTEST_GUILESS_MAIN(tst_perf)
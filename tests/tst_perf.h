@@ -43,6 +43,22 @@ private slots:
     void tst_save();
     void tst_load();
     void tst_loadRange();
+    void tst_selectComponents();
+    void tst_fromOriginTime_data();
+    void tst_fromOriginTime();
+    void tst_statementCache();
+    void tst_search();
+    void tst_concurrentRead_data();
+    void tst_concurrentRead();
+    void tst_writer();
+    void tst_options_data();
+    void tst_options();
+    void tst_open();
+    void tst_compactSchema();
+    void tst_loadRecurrences();
+    void tst_partialUpdate();
+    void tst_import();
+    void tst_purgeDeleted();
 
 private:
     ExtendedStorage::Ptr m_storage;
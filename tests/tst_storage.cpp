@@ -22,12 +22,16 @@
 #include <QDebug>
 #include <QTimeZone>
 #include <QSignalSpy>
+#include <QBuffer>
 
+#include <KCalendarCore/MemoryCalendar>
 #include <KCalendarCore/ICalFormat>
 #include <KCalendarCore/OccurrenceIterator>
 
 #include <sqlite3.h>
 
+#include <limits>
+
 #include "dummystorage.h" // Not used, but tests API compilation
 
 #include "tst_storage.h"
@@ -278,6 +282,98 @@ void tst_storage::tst_recurrence()
     QCOMPARE(match, event->dtStart().addDays(1));
 }
 
+void tst_storage::tst_recurrenceEncoding()
+{
+    const QTimeZone paris("Europe/Paris");
+    auto event = KCalendarCore::Event::Ptr(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(QDate(2024, 3, 4), QTime(10, 0), paris));
+    event->setDtEnd(event->dtStart().addSecs(3600));
+
+    KCalendarCore::Recurrence *recurrence = event->recurrence();
+    KCalendarCore::RecurrenceRule *rrule = new KCalendarCore::RecurrenceRule;
+    rrule->setRecurrenceType(KCalendarCore::RecurrenceRule::rMonthly);
+    rrule->setStartDt(event->dtStart());
+    rrule->setByDays(QList<KCalendarCore::RecurrenceRule::WDayPos>()
+                     << KCalendarCore::RecurrenceRule::WDayPos(-1, 5));
+    rrule->setByMonths(QList<int>() << 1 << 3 << 5);
+    rrule->setEndDt(QDateTime(QDate(2026, 12, 31), QTime(10, 0), paris));
+    recurrence->addRRule(rrule);
+    KCalendarCore::RecurrenceRule *exrule = new KCalendarCore::RecurrenceRule;
+    exrule->setRecurrenceType(KCalendarCore::RecurrenceRule::rWeekly);
+    exrule->setStartDt(event->dtStart());
+    exrule->setDuration(3);
+    recurrence->addExRule(exrule);
+    recurrence->addRDate(QDate(2024, 4, 2));
+    recurrence->addExDate(QDate(2025, 1, 31));
+    recurrence->addRDateTime(QDateTime(QDate(2024, 6, 1), QTime(9, 30), QTimeZone("America/New_York")));
+    recurrence->addExDateTime(QDateTime(QDate(2024, 5, 31), QTime(10, 0), paris));
+
+    QVERIFY(m_calendar->addEvent(event, NotebookId));
+    QVERIFY(m_storage->save());
+    const QString uid = event->uid();
+    reloadDb();
+
+    KCalendarCore::Event::Ptr fetched = m_calendar->event(uid);
+    QVERIFY(fetched);
+    QCOMPARE(*fetched->recurrence(), *recurrence);
+
+    // Legacy rows of the Recursive and Rdates tables are converted
+    // on migration.
+    auto single = KCalendarCore::Event::Ptr(new KCalendarCore::Event);
+    single->setDtStart(QDateTime(QDate(2024, 3, 4), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_calendar->addEvent(single, NotebookId));
+    QVERIFY(m_storage->save());
+    const QByteArray singleUid = single->uid().toUtf8();
+    const QString databaseName = m_storage.staticCast<SqliteStorage>()->databaseName();
+    m_storage.clear();
+    m_calendar.clear();
+
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    const QByteArray componentId = "(select ComponentId from Components where UID='" + singleUid + "')";
+    const QByteArray exDate = QByteArray::number(SqliteFormat::toLocalOriginTime(QDate(2024, 3, 11).startOfDay()));
+    const QByteArray statements[] = {
+        "update Components set Recurrence=null, RecurrenceEnd=null where UID='" + singleUid + "'",
+        "insert into Recursive values (" + componentId + ", 1, 5, 0, 0, 0, 4, 2, '', '', '', '1 3', '0 0', '', '', '', '', '', 1)",
+        "insert into Rdates values (" + componentId + ", 2, " + exDate + ", " + exDate + ", -1)",
+        "delete from Migrations where Version>6",
+        "PRAGMA user_version = 6"
+    };
+    for (const QByteArray &statement : statements) {
+        QCOMPARE(sqlite3_exec(database, statement.constData(), nullptr, nullptr, nullptr), SQLITE_OK);
+    }
+    sqlite3_close(database);
+
+    openDb();
+    fetched = m_calendar->event(QString::fromUtf8(singleUid));
+    QVERIFY(fetched);
+    QVERIFY(fetched->recurs());
+    QCOMPARE(fetched->recurrence()->rRules().count(), 1);
+    const KCalendarCore::RecurrenceRule *converted = fetched->recurrence()->rRules().first();
+    QCOMPARE(converted->recurrenceType(), KCalendarCore::RecurrenceRule::rWeekly);
+    QCOMPARE(converted->frequency(), 2);
+    QCOMPARE(converted->duration(), 4);
+    QCOMPARE(converted->byDays().count(), 2);
+    QCOMPARE(fetched->recurrence()->exDates(), QList<QDate>() << QDate(2024, 3, 11));
+    QCOMPARE(*m_calendar->event(uid)->recurrence(), *recurrence);
+
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    sqlite3_stmt *stmt = nullptr;
+    QCOMPARE(sqlite3_prepare_v2(database, "select (select count(*) from Recursive) + (select count(*) from Rdates), "
+                                "(select RecurrenceEnd from Components where Recurrence is not null and UID=?)",
+                                -1, &stmt, nullptr), SQLITE_OK);
+    QCOMPARE(sqlite3_bind_text(stmt, 1, singleUid.constData(), singleUid.length(), SQLITE_STATIC), SQLITE_OK);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    QCOMPARE(sqlite3_column_int(stmt, 0), 0);
+    QVERIFY(sqlite3_column_int64(stmt, 1) > 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->event(uid)));
+    QVERIFY(m_calendar->deleteIncidence(fetched));
+    QVERIFY(m_storage->save());
+}
+
 typedef struct ExpandedIncidenceValidity {
         QDateTime dtStart;
         QDateTime dtEnd;
@@ -2114,6 +2210,836 @@ void tst_storage::tst_attendees()
     QCOMPARE(refetched->attendees(), fetched->attendees());
 }
 
+void tst_storage::tst_loadHeaders()
+{
+    KCalendarCore::Event::Ptr allDay(new KCalendarCore::Event);
+    allDay->setDtStart(QDateTime(QDate(2021, 6, 10).startOfDay()));
+    allDay->setAllDay(true);
+    allDay->setSummary(QString::fromLatin1("All day event"));
+    allDay->setColor(QString::fromLatin1("red"));
+    allDay->newAlarm()->setDisplayAlarm(QString::fromLatin1("Driiiiing"));
+    QVERIFY(m_calendar->addEvent(allDay, NotebookId));
+
+    KCalendarCore::Event::Ptr outside(new KCalendarCore::Event);
+    outside->setDtStart(QDateTime(QDate(2021, 7, 1), QTime(10, 0), Qt::UTC));
+    outside->setDtEnd(QDateTime(QDate(2021, 7, 1), QTime(11, 0), Qt::UTC));
+    outside->setSummary(QString::fromLatin1("Out of range event"));
+    QVERIFY(m_calendar->addEvent(outside, NotebookId));
+
+    KCalendarCore::Event::Ptr recurring(new KCalendarCore::Event);
+    recurring->setDtStart(QDateTime(QDate(2020, 1, 6), QTime(9, 0), Qt::UTC));
+    recurring->setDtEnd(QDateTime(QDate(2020, 1, 6), QTime(9, 30), Qt::UTC));
+    recurring->setSummary(QString::fromLatin1("Weekly event"));
+    recurring->recurrence()->setWeekly(1);
+    QVERIFY(m_calendar->addEvent(recurring, NotebookId));
+
+    QVERIFY(m_storage->save());
+    reloadDb(QDate(2000, 1, 1), QDate(2000, 1, 2));
+
+    IncidenceHeader::List headers;
+    QVERIFY(m_storage->loadHeaders(QDate(2021, 6, 1), QDate(2021, 7, 1), &headers));
+    QCOMPARE(headers.count(), 2);
+    // Reading headers does not load anything in memory.
+    QVERIFY(!m_calendar->incidence(allDay->uid()));
+
+    IncidenceHeader allDayHeader, recurringHeader;
+    for (const IncidenceHeader &header : headers) {
+        if (header.uid == allDay->uid()) {
+            allDayHeader = header;
+        } else if (header.uid == recurring->uid()) {
+            recurringHeader = header;
+        }
+    }
+    QCOMPARE(allDayHeader.type, KCalendarCore::IncidenceBase::TypeEvent);
+    QCOMPARE(allDayHeader.summary, allDay->summary());
+    QCOMPARE(allDayHeader.dtStart, allDay->dtStart());
+    QVERIFY(!allDayHeader.dtEnd.isValid());
+    QVERIFY(allDayHeader.allDay);
+    QCOMPARE(allDayHeader.color, allDay->color());
+    QVERIFY(allDayHeader.hasAlarms);
+    QVERIFY(!allDayHeader.recurs);
+    QVERIFY(!allDayHeader.recurrenceId.isValid());
+
+    QCOMPARE(recurringHeader.summary, recurring->summary());
+    QCOMPARE(recurringHeader.dtStart, recurring->dtStart());
+    QCOMPARE(recurringHeader.dtEnd, recurring->dtEnd());
+    QVERIFY(!recurringHeader.allDay);
+    QVERIFY(!recurringHeader.hasAlarms);
+    QVERIFY(recurringHeader.recurs);
+
+    headers.clear();
+    QVERIFY(m_storage->loadHeaders(QDate(), QDate(), &headers));
+    QCOMPARE(headers.count(), 3);
+
+    KCalendarCore::Incidence::Ptr fetched = m_storage->loadIncidence(allDayHeader);
+    QVERIFY(fetched);
+    QCOMPARE(fetched->summary(), allDay->summary());
+    QCOMPARE(fetched->alarms().count(), 1);
+    QCOMPARE(m_calendar->incidence(allDay->uid()), fetched);
+}
+
+class TestStorageObserver: public QObject, public ExtendedStorageObserver
+{
+    Q_OBJECT
+public:
+    TestStorageObserver(ExtendedStorage::Ptr storage): mStorage(storage)
+    {
+        mStorage->registerObserver(this);
+    }
+    ~TestStorageObserver()
+    {
+        mStorage->unregisterObserver(this);
+    }
+
+    void storageModified(ExtendedStorage *storage, const QString &info)
+    {
+        emit modified();
+    }
+
+    void storageFinished(ExtendedStorage *storage, bool error, const QString &info)
+    {
+        emit finished(error, info);
+    }
+
+    void storageUpdated(ExtendedStorage *storage,
+                        const KCalendarCore::Incidence::List &added,
+                        const KCalendarCore::Incidence::List &modified,
+                        const KCalendarCore::Incidence::List &deleted)
+    {
+        emit updated(added, modified, deleted);
+    }
+
+signals:
+    void modified();
+    void finished(bool error, const QString &info);
+    void updated(const KCalendarCore::Incidence::List &added,
+                 const KCalendarCore::Incidence::List &modified,
+                 const KCalendarCore::Incidence::List &deleted);
+
+private:
+    ExtendedStorage::Ptr mStorage;
+};
+
+void tst_storage::tst_deferredParts()
+{
+    auto event = KCalendarCore::Event::Ptr(new KCalendarCore::Event);
+    event->setSummary("testing deferred parts.");
+    event->setDtStart(QDateTime(QDate(2022, 3, 14), QTime(10, 12)));
+    event->setOrganizer(KCalendarCore::Person(QString::fromLatin1("Alice"),
+                                              QString::fromLatin1("alice@example.org")));
+    event->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Bob"),
+                                               QString::fromLatin1("bob@example.org"),
+                                               true,
+                                               KCalendarCore::Attendee::Tentative,
+                                               KCalendarCore::Attendee::OptParticipant));
+    event->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Carl"),
+                                               QString::fromLatin1("carl@example.org")));
+    event->addAttachment(KCalendarCore::Attachment(QByteArray("Hello world!"),
+                                                   QString::fromLatin1("text/plain")));
+    QVERIFY(m_calendar->addIncidence(event, NotebookId));
+    QVERIFY(m_storage->save());
+
+    m_storage.clear();
+    m_calendar.clear();
+    m_calendar = ExtendedCalendar::Ptr(new ExtendedCalendar(QTimeZone::systemTimeZone()));
+    m_storage = m_calendar->defaultStorage(m_calendar);
+    m_storage->setDeferredParts(ExtendedStorage::AllParts);
+    QVERIFY(m_storage->open());
+    QVERIFY(m_storage->load(event->uid()));
+
+    KCalendarCore::Incidence::Ptr fetched = m_calendar->incidence(event->uid());
+    QVERIFY(fetched);
+    QCOMPARE(fetched->organizer(), event->organizer());
+    QVERIFY(fetched->attendees().isEmpty());
+    QVERIFY(fetched->attachments().isEmpty());
+    QCOMPARE(m_storage->pendingParts(fetched), ExtendedStorage::AllParts);
+
+    const QDateTime lastModified = fetched->lastModified();
+    QVERIFY(m_storage->hydrate(fetched, ExtendedStorage::AttendeesPart));
+    QCOMPARE(fetched->attendees(), event->attendees());
+    QVERIFY(fetched->attachments().isEmpty());
+    QCOMPARE(m_storage->pendingParts(fetched),
+             ExtendedStorage::DeferredParts(ExtendedStorage::AttachmentsPart));
+    // Hydration is not a modification.
+    QCOMPARE(fetched->lastModified(), lastModified);
+    KCalendarCore::Incidence::List modified;
+    QVERIFY(m_storage->modifiedIncidences(&modified, lastModified.addSecs(1)));
+    QVERIFY(modified.isEmpty());
+
+    // Modifying without hydrating first doesn't lose stored attachments.
+    fetched->setSummary(QString::fromLatin1("modified summary"));
+    QVERIFY(m_storage->save());
+    QCOMPARE(m_storage->pendingParts(fetched), ExtendedStorage::NoPart);
+    QCOMPARE(fetched->attachments(), event->attachments());
+
+    reloadDb();
+    fetched = m_calendar->incidence(event->uid());
+    QVERIFY(fetched);
+    QCOMPARE(fetched->summary(), QString::fromLatin1("modified summary"));
+    QCOMPARE(fetched->attendees(), event->attendees());
+    QCOMPARE(fetched->attachments(), event->attachments());
+
+    // Asynchronous loads keep the parts deferred when requested,
+    // even if they are changed before the incidences are added.
+    reloadDb(QDate(2000, 1, 1), QDate(2000, 1, 2));
+    TestStorageObserver observer(m_storage);
+    QSignalSpy finished(&observer, &TestStorageObserver::finished);
+    m_storage->setDeferredParts(ExtendedStorage::AllParts);
+    QVERIFY(m_storage->loadAsync(event->uid()));
+    m_storage->setDeferredParts(ExtendedStorage::NoPart);
+    QVERIFY(finished.wait());
+    fetched = m_calendar->incidence(event->uid());
+    QVERIFY(fetched);
+    QVERIFY(fetched->attendees().isEmpty());
+    QCOMPARE(m_storage->pendingParts(fetched), ExtendedStorage::AllParts);
+    QVERIFY(m_storage->hydrate(fetched));
+    QCOMPARE(fetched->attendees(), event->attendees());
+    QCOMPARE(fetched->attachments(), event->attachments());
+}
+
+void tst_storage::tst_forEachIncidence()
+{
+    QSet<QString> uids;
+    for (int i = 0; i < 3; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(QDateTime(QDate(2022, 4, 1 + i), QTime(12, 0), Qt::UTC));
+        event->setSummary(QString::fromLatin1("enumerated event %1").arg(i));
+        QVERIFY(m_calendar->addEvent(event, NotebookId));
+        uids.insert(event->uid());
+    }
+    QVERIFY(m_storage->save());
+
+    QSet<QString> visited;
+    QVERIFY(m_storage->forEachIncidence(ExtendedStorage::AllIncidences, QDateTime(),
+                                        [&visited] (const KCalendarCore::Incidence::Ptr &incidence) {
+                                            visited.insert(incidence->uid());
+                                            return true;
+                                        }));
+    QCOMPARE(visited, uids);
+
+    // Enumeration can be stopped by the visitor.
+    int count = 0;
+    QVERIFY(m_storage->forEachIncidence(ExtendedStorage::AllIncidences, QDateTime(),
+                                        [&count] (const KCalendarCore::Incidence::Ptr &) {
+                                            count += 1;
+                                            return false;
+                                        }));
+    QCOMPARE(count, 1);
+
+    // Inserted incidences require a valid date.
+    QVERIFY(!m_storage->forEachIncidence(ExtendedStorage::InsertedIncidences, QDateTime(),
+                                         [] (const KCalendarCore::Incidence::Ptr &) {
+                                             return true;
+                                         }));
+    visited.clear();
+    QVERIFY(m_storage->forEachIncidence(ExtendedStorage::InsertedIncidences,
+                                        QDateTime::currentDateTimeUtc().addSecs(-60),
+                                        [&visited] (const KCalendarCore::Incidence::Ptr &incidence) {
+                                            visited.insert(incidence->uid());
+                                            return true;
+                                        }));
+    QCOMPARE(visited, uids);
+}
+
+void tst_storage::tst_componentsRange()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(QDate(2022, 5, 10), QTime(10, 0), Qt::UTC));
+    event->setDtEnd(QDateTime(QDate(2022, 5, 12), QTime(10, 0), Qt::UTC));
+    event->setSummary(QString::fromLatin1("indexed event"));
+    QVERIFY(m_calendar->addEvent(event, NotebookId));
+    QVERIFY(m_storage->save());
+    const QString uid = event->uid();
+
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(m_storage.staticCast<SqliteStorage>()->databaseName().toUtf8(), &database), SQLITE_OK);
+    // Any live component is in the interval index, with its date bounds.
+    const char *query = "select count(*) from Components where DateDeleted=0 and ComponentId not in "
+        "(select ComponentId from ComponentsRange)";
+    auto countMissing = [database, query] () {
+        sqlite3_stmt *stmt = nullptr;
+        int count = -1;
+        if (sqlite3_prepare_v2(database, query, -1, &stmt, nullptr) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+            count = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return count;
+    };
+    QCOMPARE(countMissing(), 0);
+
+    reloadDb(QDate(2022, 5, 11), QDate(2022, 5, 12));
+    QVERIFY(m_calendar->incidence(uid));
+    reloadDb(QDate(2022, 5, 13), QDate(2022, 5, 14));
+    QVERIFY(!m_calendar->incidence(uid));
+
+    // Moving the event updates the index.
+    reloadDb();
+    event = m_calendar->event(uid);
+    QVERIFY(event);
+    event->setDtStart(QDateTime(QDate(2022, 5, 13), QTime(10, 0), Qt::UTC));
+    event->setDtEnd(QDateTime(QDate(2022, 5, 13), QTime(11, 0), Qt::UTC));
+    QVERIFY(m_storage->save());
+    QCOMPARE(countMissing(), 0);
+    reloadDb(QDate(2022, 5, 11), QDate(2022, 5, 12));
+    QVERIFY(!m_calendar->incidence(uid));
+    reloadDb(QDate(2022, 5, 13), QDate(2022, 5, 14));
+    QVERIFY(m_calendar->incidence(uid));
+
+    // Deleted events are not indexed anymore.
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(uid)));
+    QVERIFY(m_storage->save());
+    sqlite3_stmt *stmt = nullptr;
+    QCOMPARE(sqlite3_prepare_v2(database, "select count(*) from ComponentsRange where ComponentId not in "
+                                "(select ComponentId from Components where DateDeleted=0)",
+                                -1, &stmt, nullptr), SQLITE_OK);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    QCOMPARE(sqlite3_column_int(stmt, 0), 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+}
+
+void tst_storage::tst_recurrenceEnd()
+{
+    KCalendarCore::Event::Ptr finished(new KCalendarCore::Event);
+    finished->setDtStart(QDateTime(QDate(2019, 3, 4), QTime(9, 0), Qt::UTC));
+    finished->setDtEnd(QDateTime(QDate(2019, 3, 4), QTime(10, 0), Qt::UTC));
+    finished->setSummary(QString::fromLatin1("finished series"));
+    finished->recurrence()->setWeekly(1);
+    finished->recurrence()->setDuration(3);
+    QVERIFY(m_calendar->addEvent(finished, NotebookId));
+
+    KCalendarCore::Event::Ptr infinite(new KCalendarCore::Event);
+    infinite->setDtStart(QDateTime(QDate(2019, 3, 5), QTime(9, 0), Qt::UTC));
+    infinite->setSummary(QString::fromLatin1("infinite series"));
+    infinite->recurrence()->setWeekly(1);
+    QVERIFY(m_calendar->addEvent(infinite, NotebookId));
+    QVERIFY(m_storage->save());
+
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(m_storage.staticCast<SqliteStorage>()->databaseName().toUtf8(), &database), SQLITE_OK);
+    sqlite3_stmt *stmt = nullptr;
+    QCOMPARE(sqlite3_prepare_v2(database, "select RecurrenceEnd from Components where UID=? and DateDeleted=0",
+                                -1, &stmt, nullptr), SQLITE_OK);
+    const QByteArray finishedUid(finished->uid().toUtf8());
+    QCOMPARE(sqlite3_bind_text(stmt, 1, finishedUid.constData(), finishedUid.length(), SQLITE_STATIC), SQLITE_OK);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    // End of the third occurrence.
+    QCOMPARE(sqlite3_column_int64(stmt, 0),
+             SqliteFormat::toOriginTime(QDateTime(QDate(2019, 3, 18), QTime(10, 0), Qt::UTC)));
+    QCOMPARE(sqlite3_reset(stmt), SQLITE_OK);
+    const QByteArray infiniteUid(infinite->uid().toUtf8());
+    QCOMPARE(sqlite3_bind_text(stmt, 1, infiniteUid.constData(), infiniteUid.length(), SQLITE_STATIC), SQLITE_OK);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    QCOMPARE(sqlite3_column_int64(stmt, 0), std::numeric_limits<sqlite3_int64>::max());
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+
+    // Finished series are not listed anymore.
+    IncidenceHeader::List headers;
+    QVERIFY(m_storage->loadHeaders(QDate(2019, 4, 1), QDate(2019, 5, 1), &headers));
+    bool hasFinished = false;
+    bool hasInfinite = false;
+    for (const IncidenceHeader &header : headers) {
+        hasFinished = hasFinished || header.uid == finished->uid();
+        hasInfinite = hasInfinite || header.uid == infinite->uid();
+    }
+    QVERIFY(!hasFinished);
+    QVERIFY(hasInfinite);
+
+    reloadDb(QDate(2019, 4, 1), QDate(2019, 5, 1));
+    QVERIFY(!m_calendar->incidence(finished->uid()));
+    QVERIFY(m_calendar->incidence(infinite->uid()));
+
+    reloadDb();
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(finished->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(infinite->uid())));
+    QVERIFY(m_storage->save());
+}
+
+void tst_storage::tst_memoryBudget()
+{
+    KCalendarCore::Event::Ptr january(new KCalendarCore::Event);
+    january->setDtStart(QDateTime(QDate(2021, 1, 10), QTime(10, 0), Qt::UTC));
+    january->setSummary(QString::fromLatin1("january"));
+    QVERIFY(m_calendar->addEvent(january, NotebookId));
+    KCalendarCore::Event::Ptr february(new KCalendarCore::Event);
+    february->setDtStart(QDateTime(QDate(2021, 2, 10), QTime(10, 0), Qt::UTC));
+    february->setSummary(QString::fromLatin1("february"));
+    QVERIFY(m_calendar->addEvent(february, NotebookId));
+    KCalendarCore::Event::Ptr march(new KCalendarCore::Event);
+    march->setDtStart(QDateTime(QDate(2021, 3, 10), QTime(10, 0), Qt::UTC));
+    march->setSummary(QString::fromLatin1("march"));
+    QVERIFY(m_calendar->addEvent(march, NotebookId));
+    KCalendarCore::Event::Ptr straddling(new KCalendarCore::Event);
+    straddling->setDtStart(QDateTime(QDate(2021, 1, 30), QTime(10, 0), Qt::UTC));
+    straddling->setDtEnd(QDateTime(QDate(2021, 2, 2), QTime(10, 0), Qt::UTC));
+    straddling->setSummary(QString::fromLatin1("january to february"));
+    QVERIFY(m_calendar->addEvent(straddling, NotebookId));
+    KCalendarCore::Event::Ptr recurring(new KCalendarCore::Event);
+    recurring->setDtStart(QDateTime(QDate(2021, 1, 4), QTime(10, 0), Qt::UTC));
+    recurring->setSummary(QString::fromLatin1("weekly"));
+    recurring->recurrence()->setWeekly(1);
+    QVERIFY(m_calendar->addEvent(recurring, NotebookId));
+    QVERIFY(m_storage->save());
+
+    reloadDb(QDate(2021, 1, 1), QDate(2021, 2, 1));
+    QVERIFY(m_calendar->incidence(january->uid()));
+    QVERIFY(m_calendar->incidence(straddling->uid()));
+    QVERIFY(m_calendar->incidence(recurring->uid()));
+    m_storage->setMemoryBudget(m_calendar->rawIncidences().count());
+
+    // The least recently used range is unloaded, but not the
+    // incidences also in a range still loaded.
+    QVERIFY(m_storage->load(QDate(2021, 2, 1), QDate(2021, 3, 1)));
+    QVERIFY(!m_calendar->incidence(january->uid()));
+    QVERIFY(m_calendar->incidence(february->uid()));
+    QVERIFY(m_calendar->incidence(straddling->uid()));
+    QVERIFY(m_calendar->incidence(recurring->uid()));
+    QVERIFY(m_calendar->deletedIncidences().isEmpty());
+
+    // Incidences with unsaved modifications are kept, incidences
+    // partly in the unloaded range and in no other one are not.
+    m_calendar->incidence(february->uid())->setSummary(QString::fromLatin1("modified february"));
+    QVERIFY(m_storage->load(QDate(2021, 3, 1), QDate(2021, 4, 1)));
+    QVERIFY(m_calendar->incidence(february->uid()));
+    QVERIFY(!m_calendar->incidence(straddling->uid()));
+    QVERIFY(m_calendar->incidence(march->uid()));
+    QVERIFY(m_storage->save());
+
+    // Unloaded ranges are loaded again on request.
+    QVERIFY(m_storage->load(QDate(2021, 1, 1), QDate(2021, 2, 1)));
+    QVERIFY(m_calendar->incidence(january->uid()));
+    QVERIFY(m_calendar->incidence(straddling->uid()));
+    QVERIFY(!m_calendar->incidence(march->uid()));
+
+    m_storage->setMemoryBudget(0);
+    reloadDb();
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(january->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(february->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(march->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(straddling->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(recurring->uid())));
+    QVERIFY(m_storage->save());
+}
+
+void tst_storage::tst_readOnly()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(QDate(2024, 6, 10), QTime(10, 0), Qt::UTC));
+    event->setSummary(QString::fromLatin1("read-only event"));
+    QVERIFY(m_calendar->addEvent(event, NotebookId));
+    QVERIFY(m_storage->save());
+
+    const QString databaseName = m_storage.staticCast<SqliteStorage>()->databaseName();
+    SqliteStorage::Options options;
+    options.readOnly = true;
+    ExtendedCalendar::Ptr calendar(new ExtendedCalendar(QTimeZone::utc()));
+    SqliteStorage::Ptr storage(new SqliteStorage(calendar, databaseName, options));
+    QVERIFY(storage->open());
+    QVERIFY(storage->options().readOnly);
+
+    QVERIFY(storage->load(QDate(2024, 6, 10), QDate(2024, 6, 11)));
+    KCalendarCore::Incidence::Ptr fetched = calendar->incidence(event->uid());
+    QVERIFY(fetched);
+    QCOMPARE(fetched->summary(), event->summary());
+
+    // Nothing can be written.
+    fetched->setSummary(QString::fromLatin1("modified event"));
+    QVERIFY(!storage->save());
+    QVERIFY(storage->close());
+
+    // The database is not created in read-only mode.
+    SqliteStorage::Ptr missing(new SqliteStorage(calendar, databaseName + QString::fromLatin1(".missing"), options));
+    QVERIFY(!missing->open());
+    QVERIFY(!QFile::exists(databaseName + QString::fromLatin1(".missing")));
+
+    QVERIFY(m_calendar->deleteIncidence(event));
+    QVERIFY(m_storage->save());
+}
+
+void tst_storage::tst_newerVersion()
+{
+    const QString databaseName = m_storage.staticCast<SqliteStorage>()->databaseName()
+        + QString::fromLatin1(".newer");
+    ExtendedCalendar::Ptr calendar(new ExtendedCalendar(QTimeZone::utc()));
+    SqliteStorage::Ptr storage(new SqliteStorage(calendar, databaseName));
+    QVERIFY(storage->open());
+    QVERIFY(storage->close());
+
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_exec(database, "PRAGMA user_version = 1000", nullptr, nullptr, nullptr), SQLITE_OK);
+    sqlite3_close(database);
+
+    // This version does not know how to write such a database.
+    QVERIFY(!storage->open());
+    SqliteStorage::Options options;
+    options.readOnly = true;
+    storage = SqliteStorage::Ptr(new SqliteStorage(calendar, databaseName, options));
+    QVERIFY(!storage->open());
+
+    storage.clear();
+    QFile::remove(databaseName);
+    QFile::remove(databaseName + QString::fromLatin1(".changed"));
+}
+
+// The integer value returned by a query, with an optional
+// text parameter, -1 on error.
+static qint64 queryInt64(const QString &databaseName, const QByteArray &query,
+                         const QString &parameter = QString())
+{
+    sqlite3 *database;
+    sqlite3_stmt *stmt;
+    qint64 value = -1;
+    if (sqlite3_open(databaseName.toUtf8(), &database) != SQLITE_OK) {
+        return value;
+    }
+    if (sqlite3_prepare_v2(database, query.constData(), -1, &stmt, nullptr) == SQLITE_OK) {
+        const QByteArray text = parameter.toUtf8();
+        if (!parameter.isNull()) {
+            sqlite3_bind_text(stmt, 1, text.constData(), text.length(), SQLITE_STATIC);
+        }
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(database);
+    return value;
+}
+
+static int countComponents(const QString &databaseName, const QString &uid)
+{
+    return queryInt64(databaseName, "select count(*) from Components where UID=?", uid);
+}
+
+void tst_storage::tst_saveFailure()
+{
+    const QString databaseName = m_storage.staticCast<SqliteStorage>()->databaseName();
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_exec(database,
+                          "create trigger RejectSummary before insert on Components"
+                          " when new.Summary='rejected' begin select raise(abort, 'rejected'); end",
+                          nullptr, nullptr, nullptr), SQLITE_OK);
+
+    KCalendarCore::Event::Ptr accepted(new KCalendarCore::Event);
+    accepted->setDtStart(QDateTime(QDate(2024, 7, 1), QTime(10, 0), Qt::UTC));
+    accepted->setSummary(QString::fromLatin1("accepted"));
+    QVERIFY(m_calendar->addEvent(accepted, NotebookId));
+    KCalendarCore::Event::Ptr rejected(new KCalendarCore::Event);
+    rejected->setDtStart(QDateTime(QDate(2024, 7, 2), QTime(10, 0), Qt::UTC));
+    rejected->setSummary(QString::fromLatin1("rejected"));
+    QVERIFY(m_calendar->addEvent(rejected, NotebookId));
+
+    // By default, nothing is written when an incidence fails.
+    QVERIFY(!m_storage->save());
+    QCOMPARE(countComponents(databaseName, accepted->uid()), 0);
+    QCOMPARE(countComponents(databaseName, rejected->uid()), 0);
+
+    // Only the failed incidence is skipped otherwise.
+    SqliteStorage::Options options;
+    options.saveFailure = SqliteStorage::Options::SkipFailed;
+    ExtendedCalendar::Ptr calendar(new ExtendedCalendar(QTimeZone::utc()));
+    SqliteStorage::Ptr storage(new SqliteStorage(calendar, databaseName, options));
+    QVERIFY(storage->open());
+    KCalendarCore::Event::Ptr skipped(new KCalendarCore::Event);
+    skipped->setDtStart(QDateTime(QDate(2024, 7, 3), QTime(10, 0), Qt::UTC));
+    skipped->setSummary(QString::fromLatin1("rejected"));
+    QVERIFY(calendar->addEvent(skipped));
+    KCalendarCore::Event::Ptr written(new KCalendarCore::Event);
+    written->setDtStart(QDateTime(QDate(2024, 7, 4), QTime(10, 0), Qt::UTC));
+    written->setSummary(QString::fromLatin1("written"));
+    QVERIFY(calendar->addEvent(written));
+    QVERIFY(!storage->save());
+    QCOMPARE(countComponents(databaseName, skipped->uid()), 0);
+    QCOMPARE(countComponents(databaseName, written->uid()), 1);
+
+    // Failed changes are kept for a later save.
+    QCOMPARE(sqlite3_exec(database, "drop trigger RejectSummary", nullptr, nullptr, nullptr), SQLITE_OK);
+    sqlite3_close(database);
+    QVERIFY(storage->save());
+    QCOMPARE(countComponents(databaseName, skipped->uid()), 1);
+    QCOMPARE(countComponents(databaseName, written->uid()), 1);
+    QVERIFY(storage->close());
+    QVERIFY(m_storage->save());
+    QCOMPARE(countComponents(databaseName, accepted->uid()), 1);
+    QCOMPARE(countComponents(databaseName, rejected->uid()), 1);
+
+    // A failure in a child table rolls the whole incidence back.
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_exec(database,
+                          "create trigger RejectAttendee before insert on Attendee"
+                          " when new.Email='rejected@example.org' begin select raise(abort, 'rejected'); end",
+                          nullptr, nullptr, nullptr), SQLITE_OK);
+    KCalendarCore::Event::Ptr partial(new KCalendarCore::Event);
+    partial->setDtStart(QDateTime(QDate(2024, 7, 5), QTime(10, 0), Qt::UTC));
+    partial->setSummary(QString::fromLatin1("partial"));
+    partial->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Rejected"),
+                                                 QString::fromLatin1("rejected@example.org")));
+    QVERIFY(m_calendar->addEvent(partial, NotebookId));
+    QVERIFY(!m_storage->save());
+    QCOMPARE(countComponents(databaseName, partial->uid()), 0);
+    QCOMPARE(sqlite3_exec(database, "drop trigger RejectAttendee", nullptr, nullptr, nullptr), SQLITE_OK);
+    sqlite3_close(database);
+    QVERIFY(m_storage->save());
+    QCOMPARE(countComponents(databaseName, partial->uid()), 1);
+
+    reloadDb();
+    QCOMPARE(m_calendar->incidence(partial->uid())->attendees().count(), 1);
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(partial->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(accepted->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(rejected->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(skipped->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(written->uid())));
+    QVERIFY(m_storage->save(ExtendedStorage::PurgeDeleted));
+}
+
+void tst_storage::tst_importIncidences()
+{
+    KCalendarCore::Event::Ptr existing(new KCalendarCore::Event);
+    existing->setUid(QString::fromLatin1("import-event"));
+    existing->setDtStart(QDateTime(QDate(2024, 8, 1), QTime(10, 0), Qt::UTC));
+    existing->setSummary(QString::fromLatin1("before import"));
+    QVERIFY(m_calendar->addEvent(existing, NotebookId));
+    QVERIFY(m_storage->save());
+
+    QByteArray data(
+        "BEGIN:VCALENDAR\r\n"
+        "PRODID:-//mkcal//test//EN\r\n"
+        "VERSION:2.0\r\n"
+        "BEGIN:VTIMEZONE\r\n"
+        "TZID:Custom/Zone\r\n"
+        "BEGIN:STANDARD\r\n"
+        "DTSTART:19700101T000000\r\n"
+        "TZOFFSETFROM:+0300\r\n"
+        "TZOFFSETTO:+0300\r\n"
+        "END:STANDARD\r\n"
+        "END:VTIMEZONE\r\n"
+        "BEGIN:VEVENT\r\n"
+        "UID:import-event\r\n"
+        "DTSTART;TZID=Custom/Zone:20240801T130000\r\n"
+        "SUMMARY:after import\r\n"
+        "RRULE:FREQ=WEEKLY;COUNT=3\r\n"
+        "BEGIN:VALARM\r\n"
+        "ACTION:DISPLAY\r\n"
+        "TRIGGER:-PT15M\r\n"
+        "DESCRIPTION:reminder\r\n"
+        "END:VALARM\r\n"
+        "END:VEVENT\r\n"
+        "BEGIN:VEVENT\r\n"
+        "UID:import-event\r\n"
+        "RECURRENCE-ID;TZID=Custom/Zone:20240808T130000\r\n"
+        "DTSTART;TZID=Custom/Zone:20240808T140000\r\n"
+        "SUMMARY:exception\r\n"
+        "END:VEVENT\r\n"
+        "BEGIN:VTODO\r\n"
+        "UID:import-todo\r\n"
+        "SUMMARY:a long summary folded\r\n"
+        "  over two lines\r\n"
+        "END:VTODO\r\n"
+        "BEGIN:VFREEBUSY\r\n"
+        "UID:import-freebusy\r\n"
+        "END:VFREEBUSY\r\n"
+        "BEGIN:VJOURNAL\r\n"
+        "UID:import-journal\r\n"
+        "DTSTART;VALUE=DATE:20240802\r\n"
+        "END:VJOURNAL\r\n"
+        "END:VCALENDAR\r\n");
+    QBuffer buffer(&data);
+    QVERIFY(buffer.open(QIODevice::ReadOnly));
+    int count = 0;
+    QVERIFY(m_storage.staticCast<SqliteStorage>()->importIncidences(&buffer, &count));
+    QCOMPARE(count, 4);
+
+    reloadDb();
+    KCalendarCore::Event::Ptr event = m_calendar->event(existing->uid());
+    QVERIFY(event);
+    QCOMPARE(event->summary(), QString::fromLatin1("after import"));
+    QCOMPARE(event->dtStart().toUTC(), QDateTime(QDate(2024, 8, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(event->recurs());
+    QCOMPARE(event->alarms().count(), 1);
+    KCalendarCore::Event::Ptr exception = m_calendar->event(existing->uid(), event->dtStart().addDays(7));
+    QVERIFY(exception);
+    QCOMPARE(exception->summary(), QString::fromLatin1("exception"));
+    KCalendarCore::Todo::Ptr todo = m_calendar->todo(QString::fromLatin1("import-todo"));
+    QVERIFY(todo);
+    QCOMPARE(todo->summary(), QString::fromLatin1("a long summary folded over two lines"));
+    QVERIFY(m_calendar->journal(QString::fromLatin1("import-journal")));
+
+    // A truncated stream is reported.
+    QByteArray truncated("BEGIN:VCALENDAR\r\nVERSION:2.0\r\nBEGIN:VEVENT\r\nUID:import-truncated\r\n");
+    QBuffer truncatedBuffer(&truncated);
+    QVERIFY(truncatedBuffer.open(QIODevice::ReadOnly));
+    QVERIFY(!m_storage.staticCast<SqliteStorage>()->importIncidences(&truncatedBuffer, &count));
+    QCOMPARE(count, 0);
+
+    QVERIFY(m_calendar->deleteIncidence(exception));
+    QVERIFY(m_calendar->deleteIncidence(event));
+    QVERIFY(m_calendar->deleteIncidence(todo));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->journal(QString::fromLatin1("import-journal"))));
+    QVERIFY(m_storage->save(ExtendedStorage::PurgeDeleted));
+}
+
+static QStringList exportedUids(SqliteStorage *storage, SqliteStorage::ExportFilter filter,
+                                const QDateTime &start = QDateTime(),
+                                const QDateTime &end = QDateTime(),
+                                int *timeZones = nullptr)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    if (!buffer.open(QIODevice::WriteOnly)) {
+        return QStringList();
+    }
+    int count = 0;
+    if (!storage->exportIncidences(&buffer, filter, start, end, &count)) {
+        return QStringList();
+    }
+    if (timeZones) {
+        *timeZones = data.count("BEGIN:VTIMEZONE");
+    }
+
+    KCalendarCore::MemoryCalendar::Ptr calendar(new KCalendarCore::MemoryCalendar(QTimeZone::systemTimeZone()));
+    KCalendarCore::ICalFormat format;
+    if (!format.fromRawString(calendar, data)) {
+        return QStringList();
+    }
+    QStringList uids;
+    const KCalendarCore::Incidence::List list = calendar->incidences();
+    for (const KCalendarCore::Incidence::Ptr &incidence : list) {
+        uids << incidence->uid();
+    }
+    if (uids.count() != count) {
+        return QStringList();
+    }
+    uids.sort();
+    return uids;
+}
+
+void tst_storage::tst_exportIncidences()
+{
+    const QTimeZone tz("Europe/Helsinki");
+    KCalendarCore::Event::Ptr inRange(new KCalendarCore::Event);
+    inRange->setUid(QString::fromLatin1("export-in-range"));
+    inRange->setDtStart(QDateTime(QDate(2024, 9, 10), QTime(10, 0), tz));
+    inRange->setDtEnd(QDateTime(QDate(2024, 9, 10), QTime(11, 0), tz));
+    QVERIFY(m_calendar->addEvent(inRange, NotebookId));
+    KCalendarCore::Event::Ptr outOfRange(new KCalendarCore::Event);
+    outOfRange->setUid(QString::fromLatin1("export-out-of-range"));
+    outOfRange->setDtStart(QDateTime(QDate(2024, 1, 10), QTime(10, 0), Qt::UTC));
+    outOfRange->setDtEnd(QDateTime(QDate(2024, 1, 10), QTime(11, 0), Qt::UTC));
+    QVERIFY(m_calendar->addEvent(outOfRange, NotebookId));
+    KCalendarCore::Event::Ptr series(new KCalendarCore::Event);
+    series->setUid(QString::fromLatin1("export-series"));
+    series->setDtStart(QDateTime(QDate(2024, 1, 3), QTime(8, 0), tz));
+    series->setDtEnd(QDateTime(QDate(2024, 1, 3), QTime(9, 0), tz));
+    series->recurrence()->setWeekly(1);
+    series->recurrence()->setEndDate(QDate(2024, 12, 31));
+    QVERIFY(m_calendar->addEvent(series, NotebookId));
+    KCalendarCore::Event::Ptr deleted(new KCalendarCore::Event);
+    deleted->setUid(QString::fromLatin1("export-deleted"));
+    deleted->setDtStart(QDateTime(QDate(2024, 9, 12), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_calendar->addEvent(deleted, NotebookId));
+    QVERIFY(m_storage->save());
+    QVERIFY(m_calendar->deleteIncidence(deleted));
+    QVERIFY(m_storage->save());
+
+    SqliteStorage *storage = m_storage.staticCast<SqliteStorage>().data();
+    const QDateTime start(QDate(2024, 9, 1), QTime(0, 0), Qt::UTC);
+    const QDateTime end(QDate(2024, 10, 1), QTime(0, 0), Qt::UTC);
+    int timeZones = 0;
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportUndeleted, QDateTime(), QDateTime(), &timeZones),
+             QStringList() << inRange->uid() << outOfRange->uid() << series->uid());
+    // Both events in Europe/Helsinki share the same time zone definition.
+    QCOMPARE(timeZones, 1);
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportUndeleted, start, end),
+             QStringList() << inRange->uid() << series->uid());
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportDeleted),
+             QStringList() << deleted->uid());
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportAll, start, end),
+             QStringList() << deleted->uid() << inRange->uid() << series->uid());
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportAll, end, end.addDays(1)),
+             QStringList() << series->uid());
+
+    // Exporting does not load anything in the calendar.
+    reloadDb();
+    storage = m_storage.staticCast<SqliteStorage>().data();
+    QCOMPARE(exportedUids(storage, SqliteStorage::ExportAll).count(), 4);
+    QVERIFY(m_calendar->incidences().isEmpty());
+
+    QVERIFY(m_storage->load());
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->event(inRange->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->event(outOfRange->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->event(series->uid())));
+    QVERIFY(m_storage->save(ExtendedStorage::PurgeDeleted));
+    KCalendarCore::Incidence::List purged;
+    QVERIFY(m_storage->deletedIncidences(&purged));
+    QVERIFY(m_storage->purgeDeletedIncidences(purged));
+    QVERIFY(exportedUids(storage, SqliteStorage::ExportAll).isEmpty());
+}
+
+static int countOrphans(const QString &databaseName)
+{
+    return queryInt64(databaseName,
+                      "select (select count(*) from Alarm where ComponentId not in (select ComponentId from Components))"
+                      " + (select count(*) from Attendee where ComponentId not in (select ComponentId from Components))"
+                      " + (select count(*) from Customproperties where ComponentId not in (select ComponentId from Components))");
+}
+
+void tst_storage::tst_purgeDeletedBefore()
+{
+    const QString databaseName = m_storage.staticCast<SqliteStorage>()->databaseName();
+    const int orphans = countOrphans(databaseName);
+    QVERIFY(orphans >= 0);
+    KCalendarCore::Event::List events;
+    for (int i = 0; i < 3; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QString::fromLatin1("purge-%1").arg(i));
+        event->setDtStart(QDateTime(QDate(2024, 10, 1 + i), QTime(10, 0), Qt::UTC));
+        event->setNonKDECustomProperty("X-PURGE", QString::number(i));
+        KCalendarCore::Alarm::Ptr alarm = event->newAlarm();
+        alarm->setDisplayAlarm(QString::fromLatin1("reminder"));
+        alarm->setStartOffset(KCalendarCore::Duration(-900));
+        alarm->setEnabled(true);
+        event->addAttendee(KCalendarCore::Attendee(QString::fromLatin1("Alice"),
+                                                   QString::fromLatin1("alice@example.org")));
+        QVERIFY(m_calendar->addEvent(event, NotebookId));
+        events << event;
+    }
+    QVERIFY(m_storage->save());
+    QVERIFY(m_calendar->deleteIncidence(events[0]));
+    QVERIFY(m_calendar->deleteIncidence(events[1]));
+    QVERIFY(m_storage->save());
+
+    // Age the first deletion by a day.
+    sqlite3 *database;
+    QCOMPARE(sqlite3_open(databaseName.toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_exec(database,
+                          "update Components set DateDeleted=DateDeleted-86400 where UID='purge-0'",
+                          nullptr, nullptr, nullptr), SQLITE_OK);
+    sqlite3_close(database);
+
+    SqliteStorage::Ptr storage = m_storage.staticCast<SqliteStorage>();
+    QCOMPARE(storage->purgeDeletedBefore(QDateTime()), -1);
+    QCOMPARE(storage->purgeDeletedBefore(QDateTime::currentDateTimeUtc().addSecs(-3600)), 1);
+    QCOMPARE(countComponents(databaseName, events[0]->uid()), 0);
+    QCOMPARE(countComponents(databaseName, events[1]->uid()), 1);
+    QCOMPARE(countOrphans(databaseName), orphans);
+
+    QCOMPARE(storage->purgeDeletedBefore(QDateTime::currentDateTimeUtc().addSecs(60), true), 1);
+    QCOMPARE(countComponents(databaseName, events[1]->uid()), 0);
+    QCOMPARE(countComponents(databaseName, events[2]->uid()), 1);
+    QCOMPARE(countOrphans(databaseName), orphans);
+    QCOMPARE(storage->purgeDeletedBefore(QDateTime::currentDateTimeUtc().addSecs(60), true), 0);
+
+    QVERIFY(m_calendar->deleteIncidence(events[2]));
+    QVERIFY(m_storage->save());
+    QVERIFY(m_storage->purgeDeletedIncidences(KCalendarCore::Incidence::List() << events[2]));
+    QCOMPARE(countComponents(databaseName, events[2]->uid()), 0);
+    QCOMPARE(countOrphans(databaseName), orphans);
+}
+
 void tst_storage::openDb(bool clear)
 {
     m_calendar = ExtendedCalendar::Ptr(new ExtendedCalendar(QTimeZone::systemTimeZone()));
@@ -2166,42 +3092,6 @@ void tst_storage::reloadDb(const QDate &from, const QDate &to)
     m_storage->load(from, to);
 }
 
-class TestStorageObserver: public QObject, public ExtendedStorageObserver
-{
-    Q_OBJECT
-public:
-    TestStorageObserver(ExtendedStorage::Ptr storage): mStorage(storage)
-    {
-        mStorage->registerObserver(this);
-    }
-    ~TestStorageObserver()
-    {
-        mStorage->unregisterObserver(this);
-    }
-
-    void storageModified(ExtendedStorage *storage, const QString &info)
-    {
-        emit modified();
-    }
-
-    void storageUpdated(ExtendedStorage *storage,
-                        const KCalendarCore::Incidence::List &added,
-                        const KCalendarCore::Incidence::List &modified,
-                        const KCalendarCore::Incidence::List &deleted)
-    {
-        emit updated(added, modified, deleted);
-    }
-
-signals:
-    void modified();
-    void updated(const KCalendarCore::Incidence::List &added,
-                 const KCalendarCore::Incidence::List &modified,
-                 const KCalendarCore::Incidence::List &deleted);
-
-private:
-    ExtendedStorage::Ptr mStorage;
-};
-
 Q_DECLARE_METATYPE(KCalendarCore::Incidence::List);
 void tst_storage::tst_storageObserver()
 {
@@ -2280,6 +3170,103 @@ void tst_storage::tst_storageObserver()
     QVERIFY(updated.isEmpty());
 }
 
+void tst_storage::tst_loadAsync()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(QDateTime(QDate(2024, 3, 10), QTime(10, 0), Qt::UTC));
+    event->setSummary(QString::fromLatin1("asynchronous event"));
+    QVERIFY(m_calendar->addEvent(event, NotebookId));
+    KCalendarCore::Event::Ptr event2(new KCalendarCore::Event);
+    event2->setDtStart(QDateTime(QDate(2024, 5, 10), QTime(10, 0), Qt::UTC));
+    event2->setSummary(QString::fromLatin1("asynchronous event, later"));
+    QVERIFY(m_calendar->addEvent(event2, NotebookId));
+    KCalendarCore::Event::Ptr recurring(new KCalendarCore::Event);
+    recurring->setDtStart(QDateTime(QDate(2024, 2, 1), QTime(10, 0), Qt::UTC));
+    recurring->setSummary(QString::fromLatin1("asynchronous series"));
+    recurring->recurrence()->setWeekly(1);
+    QVERIFY(m_calendar->addEvent(recurring, NotebookId));
+    QVERIFY(m_storage->save());
+
+    reloadDb(QDate(2000, 1, 1), QDate(2000, 1, 2));
+    TestStorageObserver observer(m_storage);
+    QSignalSpy finished(&observer, &TestStorageObserver::finished);
+
+    QVERIFY(m_storage->loadAsync(QDate(2024, 3, 1), QDate(2024, 4, 1)));
+    // Incidences are added to the calendar by the event loop.
+    QVERIFY(!m_calendar->incidence(event->uid()));
+    QVERIFY(finished.wait());
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.takeFirst()[0].toBool(), false);
+    QVERIFY(m_calendar->incidence(event->uid()));
+    QVERIFY(m_calendar->incidence(recurring->uid()));
+    QVERIFY(!m_calendar->incidence(event2->uid()));
+
+    QVERIFY(m_storage->loadAsync(event2->uid()));
+    QVERIFY(finished.wait());
+    QCOMPARE(finished.takeFirst()[0].toBool(), false);
+    QVERIFY(m_calendar->incidence(event2->uid()));
+
+    // The occurrences are indexed by the loader, up to the loaded
+    // range, keeping the ones indexed at save time.
+    sqlite3 *database;
+    sqlite3_stmt *stmt;
+    const char *query = "select min(DateMin), Horizon from OccurrencesRange"
+        " cross join Occurrences on Occurrences.OccurrenceId=OccurrencesRange.OccurrenceId"
+        " cross join OccurrenceHorizons on OccurrenceHorizons.ComponentId=Occurrences.ComponentId"
+        " where Occurrences.ComponentId=(select ComponentId from Components where UID=?)";
+    const QByteArray uid = recurring->uid().toUtf8();
+    QCOMPARE(sqlite3_open(m_storage.staticCast<SqliteStorage>()->databaseName().toUtf8(), &database), SQLITE_OK);
+    QCOMPARE(sqlite3_prepare_v2(database, query, -1, &stmt, nullptr), SQLITE_OK);
+    QCOMPARE(sqlite3_bind_text(stmt, 1, uid.constData(), uid.length(), SQLITE_STATIC), SQLITE_OK);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    const sqlite3_int64 first = sqlite3_column_int64(stmt, 0);
+    QVERIFY(sqlite3_column_int64(stmt, 1) < SqliteFormat::toOriginTime(QDateTime(QDate(2040, 4, 1), QTime(0, 0), Qt::UTC)));
+    // Not holding a read lock while the loader writes.
+    QCOMPARE(sqlite3_reset(stmt), SQLITE_OK);
+    QVERIFY(m_storage->loadAsync(QDate(2040, 3, 1), QDate(2040, 4, 1)));
+    QVERIFY(finished.wait());
+    QCOMPARE(finished.takeFirst()[0].toBool(), false);
+    QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+    QCOMPARE(sqlite3_column_int64(stmt, 0), first);
+    QVERIFY(sqlite3_column_int64(stmt, 1) >= SqliteFormat::toOriginTime(QDateTime(QDate(2040, 4, 1), QTime(0, 0), Qt::UTC)));
+    sqlite3_finalize(stmt);
+    sqlite3_close(database);
+
+    reloadDb(QDate(2000, 1, 1), QDate(2000, 1, 2));
+    TestStorageObserver observer2(m_storage);
+    QSignalSpy finished2(&observer2, &TestStorageObserver::finished);
+    QStringList identifiers;
+    QVERIFY(m_storage->searchAsync(QString::fromLatin1("asynchronous"), 0,
+                                   [&identifiers] (const QStringList &list) {identifiers = list;}));
+    QVERIFY(finished2.wait());
+    QCOMPARE(finished2.takeFirst()[0].toBool(), false);
+    QCOMPARE(identifiers.count(), 3);
+    QVERIFY(identifiers.contains(event->instanceIdentifier()));
+    QVERIFY(identifiers.contains(event2->instanceIdentifier()));
+    QVERIFY(identifiers.contains(recurring->instanceIdentifier()));
+    QVERIFY(m_calendar->incidence(event->uid()));
+    QVERIFY(m_calendar->incidence(event2->uid()));
+    QVERIFY(m_calendar->incidence(recurring->uid()));
+
+    // A synchronous load notifies once, for all its ranges and queries.
+    QVERIFY(m_storage->load(QDate(1999, 12, 1), QDate(2000, 2, 1)));
+    QCOMPARE(finished2.count(), 1);
+    QCOMPARE(finished2.takeFirst()[0].toBool(), false);
+
+    // Pending loads are canceled on close.
+    QVERIFY(m_storage->loadAsync(QDate(2024, 1, 1), QDate(2025, 1, 1)));
+    QVERIFY(m_storage->close());
+    QCOMPARE(finished2.count(), 1);
+    QCOMPARE(finished2.takeFirst()[0].toBool(), true);
+    QVERIFY(m_storage->open());
+
+    reloadDb();
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(event->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(event2->uid())));
+    QVERIFY(m_calendar->deleteIncidence(m_calendar->incidence(recurring->uid())));
+    QVERIFY(m_storage->save());
+}
+
 #include "tst_storage.moc"
 
 QTEST_GUILESS_MAIN(tst_storage)
@@ -50,6 +50,7 @@ private slots:
     void tst_alldayRecurrence();
     void tst_origintimes();
     void tst_recurrence();
+    void tst_recurrenceEncoding();
     void tst_recurrenceExpansion_data();
     void tst_recurrenceExpansion();
     void tst_rawEvents_data();
@@ -79,6 +80,19 @@ private slots:
     void tst_populateFromIcsData();
     void tst_attendees();
     void tst_storageObserver();
+    void tst_loadHeaders();
+    void tst_deferredParts();
+    void tst_forEachIncidence();
+    void tst_componentsRange();
+    void tst_recurrenceEnd();
+    void tst_loadAsync();
+    void tst_memoryBudget();
+    void tst_readOnly();
+    void tst_newerVersion();
+    void tst_saveFailure();
+    void tst_importIncidences();
+    void tst_exportIncidences();
+    void tst_purgeDeletedBefore();
 
 private:
     void openDb(bool clear = false);
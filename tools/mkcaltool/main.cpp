@@ -22,6 +22,7 @@
 */
 
 #include <QtCore/QCoreApplication>
+#include <QtCore/QDebug>
 
 #include "mkcaltool.h"
 
@@ -34,5 +35,22 @@ int main(int argc, char *argv[])
         MkcalTool mkcalTool;
         exit(mkcalTool.resetAlarms(eventUid));
     }
+    if (argc == 3 && 0 == ::strcmp(argv[1], "--import")) {
+        MkcalTool mkcalTool;
+        exit(mkcalTool.importIncidences(QString::fromLocal8Bit(argv[2])));
+    }
+    if ((argc == 3 || argc == 5) && 0 == ::strcmp(argv[1], "--export")) {
+        QDateTime start, end;
+        if (argc == 5) {
+            start = QDateTime::fromString(QString::fromLatin1(argv[3]), Qt::ISODate);
+            end = QDateTime::fromString(QString::fromLatin1(argv[4]), Qt::ISODate);
+            if (!start.isValid() || !end.isValid()) {
+                qWarning() << "Invalid date range, expecting ISO dates";
+                exit(1);
+            }
+        }
+        MkcalTool mkcalTool;
+        exit(mkcalTool.exportIncidences(QString::fromLocal8Bit(argv[2]), start, end));
+    }
     exit(0);
 }
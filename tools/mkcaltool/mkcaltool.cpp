@@ -23,10 +23,12 @@
 #include "mkcaltool.h"
 
 #include <QtCore/QDebug>
+#include <QtCore/QFile>
 
 // mkcal
 #include <extendedcalendar.h>
 #include <extendedstorage.h>
+#include <sqlitestorage.h>
 
 MkcalTool::MkcalTool()
 {
@@ -50,3 +52,52 @@ int MkcalTool::resetAlarms(const QString &eventUid)
     storage->emitStorageUpdated(KCalendarCore::Incidence::List(), KCalendarCore::Incidence::List() << event, KCalendarCore::Incidence::List());
     return 0;
 }
+
+int MkcalTool::importIncidences(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Unable to open" << fileName;
+        return 1;
+    }
+
+    mKCal::ExtendedCalendar::Ptr cal(new mKCal::ExtendedCalendar(QTimeZone::systemTimeZone()));
+    mKCal::SqliteStorage::Ptr storage(new mKCal::SqliteStorage(cal));
+    if (!storage->open()) {
+        qWarning() << "Unable to open the calendar database";
+        return 1;
+    }
+    int count = 0;
+    const bool success = storage->importIncidences(&file, &count);
+    qDebug() << "Imported" << count << "incidences from" << fileName;
+    storage->close();
+
+    return success ? 0 : 1;
+}
+
+int MkcalTool::exportIncidences(const QString &fileName,
+                                const QDateTime &start, const QDateTime &end)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Unable to open" << fileName;
+        return 1;
+    }
+
+    // Exporting never writes, the inter-process lock is not needed.
+    mKCal::SqliteStorage::Options options;
+    options.readOnly = true;
+    mKCal::ExtendedCalendar::Ptr cal(new mKCal::ExtendedCalendar(QTimeZone::systemTimeZone()));
+    mKCal::SqliteStorage::Ptr storage(new mKCal::SqliteStorage(cal, options));
+    if (!storage->open()) {
+        qWarning() << "Unable to open the calendar database";
+        return 1;
+    }
+    int count = 0;
+    const bool success = storage->exportIncidences(&file, mKCal::SqliteStorage::ExportUndeleted,
+                                                   start, end, &count);
+    qDebug() << "Exported" << count << "incidences to" << fileName;
+    storage->close();
+
+    return success ? 0 : 1;
+}
@@ -25,6 +25,7 @@
 #define MKCALTOOL_H
 
 #include <QtCore/QString>
+#include <QtCore/QDateTime>
 
 class MkcalTool
 {
@@ -33,6 +34,9 @@ public:
     explicit MkcalTool();
 
     int resetAlarms(const QString &eventUid);
+    int importIncidences(const QString &fileName);
+    int exportIncidences(const QString &fileName,
+                         const QDateTime &start = QDateTime(), const QDateTime &end = QDateTime());
 };
 
 #endif // MKCALTOOL_H